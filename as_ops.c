@@ -68,8 +68,6 @@ int reiser4_set_page_dirty(struct page *page)
 			   page->mapping->host &&
 			   reiser4_get_super_fake(page->mapping->host->i_sb) !=
 			   page->mapping->host &&
-			   reiser4_get_cc_fake(page->mapping->host->i_sb) !=
-			   page->mapping->host &&
 			   reiser4_get_bitmap_fake(page->mapping->host->i_sb) !=
 			   page->mapping->host));
 	return __set_page_dirty_nobuffers(page);
@@ -131,8 +129,6 @@ void reiser4_invalidatepage(struct page *page, unsigned int offset, unsigned int
 	 */
 	if (reiser4_get_super_fake(inode->i_sb) == inode)
 		return;
-	if (reiser4_get_cc_fake(inode->i_sb) == inode)
-		return;
 	if (reiser4_get_bitmap_fake(inode->i_sb) == inode)
 		return;
 	assert("vs-1426", PagePrivate(page));
@@ -10,6 +10,7 @@ reiser4/README */
 #include "tree.h"
 #include "super.h"
 #include "discard.h"
+#include "wander.h"
 
 #include <linux/types.h>	/* for __u??  */
 #include <linux/fs.h>		/* for struct super_block  */
@@ -105,6 +106,36 @@ reiser4/README */
    atom gets fully played (see wander.c for term description), the disk space
    occupied for it is returned to free blocks. */
 
+/* PER-CPU GRAB CACHES */
+
+/* Almost every file system operation grabs space at the beginning and
+   returns what is left at the end. To keep these two from bouncing
+   sbinfo->guard between cpus, each cpu keeps a small cache of free blocks
+   taken from sbinfo->blocks_free in batches (see struct reiser4_grab_cache).
+   reiser4_grab() and grabbed2free() move blocks between free and grabbed
+   parts of the cache of current cpu under the cache spin lock only.
+
+   Other transitions of grabbed blocks (to used, fake allocated, flush
+   reserved, etc.) take sbinfo->guard anyway. They are accounted in the
+   cache of current cpu too, changing its ->reserved and ->grabbed by the
+   same amount, so that free part of the cache is not affected. Lock
+   ordering is sbinfo->guard, then the cache lock.
+
+   Sum of ->reserved of all caches is kept in sbinfo->blocks_cached, which
+   is changed under sbinfo->guard only. So, reiser4_check_block_counters()
+   still checks exact invariant: blocks_free + blocks_grabbed + blocks_cached
+   plus the other counters is the number of blocks in the file system.
+
+   When free space gets low, reiser4_grab() stops refilling caches, returns
+   all caches to the super block counters and grabs from exact
+   sbinfo->blocks_free as before. Until caches are enabled again, neither
+   reiser4_grab() nor grabbed2free() use them, so that blocks released by
+   one thread are not grabbed by another one bypassing the check of
+   sbinfo->blocks_reserved. */
+
+/* number of free blocks cpu cache takes from sbinfo->blocks_free at once */
+#define GRAB_CACHE_BATCH (64)
+
 /* BLOCK NUMBERS */
 
 /* Any reiser4 node has a block number assigned to it.  We use these numbers for
@@ -159,10 +190,55 @@ static void add_to_ctx_grabbed(reiser4_context * ctx, __u64 count)
 	ctx->grabbed_blocks += count;
 }
 
+/* Increase super block's grabbed blocks counter for @count blocks which
+   come from other than free blocks. Super block should be locked */
+static void add_to_sb_grabbed(reiser4_super_info_data * sbinfo, __s64 count)
+{
+	struct reiser4_grab_cache *cache;
+
+	assert_spin_locked(&sbinfo->guard);
+
+	cache = raw_cpu_ptr(sbinfo->grab_cache);
+	spin_lock(&cache->lock);
+	cache->reserved += count;
+	cache->grabbed += count;
+	spin_unlock(&cache->lock);
+	sbinfo->blocks_cached += count;
+}
+
+/* Decrease super block's grabbed blocks counter for @count blocks which do
+   not become free. Per-cpu counters do not allow to check whether fs-wide
+   counter is big enough, it is a sum of contexts' ones checked by
+   sub_from_ctx_grabbed() */
 static void sub_from_sb_grabbed(reiser4_super_info_data * sbinfo, __u64 count)
 {
-	assert("zam-525", sbinfo->blocks_grabbed >= count);
-	sbinfo->blocks_grabbed -= count;
+	add_to_sb_grabbed(sbinfo, -(__s64)count);
+}
+
+/* Return all per-cpu grab caches to super block counters. After this
+   sbinfo->blocks_free and sbinfo->blocks_grabbed are exact. Super block
+   should be locked */
+static void drain_grab_caches(reiser4_super_info_data * sbinfo)
+{
+	int cpu;
+
+	assert_spin_locked(&sbinfo->guard);
+
+	WRITE_ONCE(sbinfo->grab_cache_enabled, 0);
+	for_each_possible_cpu(cpu) {
+		struct reiser4_grab_cache *cache;
+
+		cache = per_cpu_ptr(sbinfo->grab_cache, cpu);
+		spin_lock(&cache->lock);
+		assert("edward-2384", cache->reserved >= cache->grabbed);
+		sbinfo->blocks_free += cache->reserved - cache->grabbed;
+		sbinfo->blocks_grabbed += cache->grabbed;
+		sbinfo->blocks_cached -= cache->reserved;
+		cache->reserved = 0;
+		cache->grabbed = 0;
+		spin_unlock(&cache->lock);
+	}
+	assert("edward-2385", sbinfo->blocks_cached == 0);
 }
 
 /* Decrease the counter of block reserved for flush in super block. */
@@ -220,20 +296,22 @@ static void sub_from_atom_flush_reserved_nolock(txn_atom * atom, __u32 count)
 
 /* super block has 6 counters: free, used, grabbed, fake allocated
    (formatted and unformatted) and flush reserved. Their sum must be
-   number of blocks on a device. This function checks this */
+   number of blocks on a device. Free and grabbed blocks of per-cpu caches
+   are counted by sbinfo->blocks_cached. This function checks this */
 int reiser4_check_block_counters(const struct super_block *super)
 {
+	reiser4_super_info_data *sbinfo = get_super_private(super);
 	__u64 sum;
 
-	sum = reiser4_grabbed_blocks(super) + reiser4_free_blocks(super) +
-	    reiser4_data_blocks(super) + reiser4_fake_allocated(super) +
+	sum = sbinfo->blocks_grabbed + sbinfo->blocks_free +
+	    sbinfo->blocks_cached + reiser4_data_blocks(super) + reiser4_fake_allocated(super) +
 	    reiser4_fake_allocated_unformatted(super) + reiser4_flush_reserved(super) +
 	    reiser4_clustered_blocks(super);
 	if (reiser4_block_count(super) != sum) {
 		printk("super block counters: "
 		       "used %llu, free %llu, "
 		       "grabbed %llu, fake allocated (formatetd %llu, unformatted %llu), "
-		       "reserved %llu, clustered %llu, sum %llu, must be (block count) %llu\n",
+		       "reserved %llu, clustered %llu, cached %lld, sum %llu, must be (block count) %llu\n",
 		       (unsigned long long)reiser4_data_blocks(super),
 		       (unsigned long long)reiser4_free_blocks(super),
 		       (unsigned long long)reiser4_grabbed_blocks(super),
@@ -242,6 +320,7 @@ int reiser4_check_block_counters(const struct super_block *super)
 		       reiser4_fake_allocated_unformatted(super),
 		       (unsigned long long)reiser4_flush_reserved(super),
 		       (unsigned long long)reiser4_clustered_blocks(super),
+		       (long long)sbinfo->blocks_cached,
 		       (unsigned long long)sum,
 		       (unsigned long long)reiser4_block_count(super));
 		return 0;
@@ -261,12 +340,39 @@ int reiser4_check_block_counters(const struct super_block *super)
 			free blocks are preserved or already allocated.
 */
 
+/* grab @count blocks from cache of current cpu without locking super block */
+static int grab_from_cache(reiser4_super_info_data * sbinfo, __u64 count)
+{
+	struct reiser4_grab_cache *cache;
+	int ret = 0;
+
+	cache = raw_cpu_ptr(sbinfo->grab_cache);
+	spin_lock(&cache->lock);
+	if (READ_ONCE(sbinfo->grab_cache_enabled) &&
+	    cache->reserved - cache->grabbed >= (__s64)count)
+		cache->grabbed += count;
+	else
+		ret = -ENOSPC;
+	spin_unlock(&cache->lock);
+	return ret;
+}
+
+/* true if there are so many free blocks that caches of all cpus together can
+   not take reserved ones. Free part of a cache grows up to
+   2 * GRAB_CACHE_BATCH blocks, see grabbed2free() */
+static int far_from_enospc(reiser4_super_info_data * sbinfo, __u64 count)
+{
+	return sbinfo->blocks_free >= count + sbinfo->blocks_reserved +
+		(__u64)2 * GRAB_CACHE_BATCH * num_possible_cpus();
+}
+
 static int
 reiser4_grab(reiser4_context * ctx, __u64 count, reiser4_ba_flags_t flags)
 {
 	__u64 free_blocks;
 	int ret = 0, use_reserved = flags & BA_RESERVED;
 	reiser4_super_info_data *sbinfo;
+	struct reiser4_grab_cache *cache;
 
 	assert("vs-1276", ctx == get_current_context());
 
@@ -279,30 +385,50 @@ reiser4_grab(reiser4_context * ctx, __u64 count, reiser4_ba_flags_t flags)
 
 	sbinfo = get_super_private(ctx->super);
 
+	if (grab_from_cache(sbinfo, count) == 0)
+		goto grabbed;
+
 	spin_lock_reiser4_super(sbinfo);
 
-	free_blocks = sbinfo->blocks_free;
+	if (far_from_enospc(sbinfo, count)) {
+		/* refill cache of current cpu and grab from it */
+		cache = raw_cpu_ptr(sbinfo->grab_cache);
+		spin_lock(&cache->lock);
+		cache->reserved += count + GRAB_CACHE_BATCH;
+		cache->grabbed += count;
+		spin_unlock(&cache->lock);
+		sbinfo->blocks_cached += count + GRAB_CACHE_BATCH;
+		sbinfo->blocks_free -= count + GRAB_CACHE_BATCH;
+		WRITE_ONCE(sbinfo->grab_cache_enabled, 1);
+	} else {
+		/* free space is low, use exact counters */
+		drain_grab_caches(sbinfo);
 
-	if ((use_reserved && free_blocks < count) ||
-	    (!use_reserved && free_blocks < count + sbinfo->blocks_reserved)) {
-		ret = RETERR(-ENOSPC);
-		goto unlock_and_ret;
+		free_blocks = sbinfo->blocks_free;
+
+		if ((use_reserved && free_blocks < count) ||
+		    (!use_reserved &&
+		     free_blocks < count + sbinfo->blocks_reserved)) {
+			ret = RETERR(-ENOSPC);
+			goto unlock_and_ret;
+		}
+		sbinfo->blocks_grabbed += count;
+		sbinfo->blocks_free -= count;
 	}
+	assert("nikita-2986", reiser4_check_block_counters(ctx->super));
+	spin_unlock_reiser4_super(sbinfo);
 
+grabbed:
 	add_to_ctx_grabbed(ctx, count);
 
-	sbinfo->blocks_grabbed += count;
-	sbinfo->blocks_free -= count;
-
 #if REISER4_DEBUG
 	if (ctx->grabbed_initially == 0)
 		ctx->grabbed_initially = count;
 #endif
 
-	assert("nikita-2986", reiser4_check_block_counters(ctx->super));
-
 	/* disable grab space in current context */
 	ctx->grab_enabled = 0;
+	return 0;
 
 unlock_and_ret:
 	spin_unlock_reiser4_super(sbinfo);
@@ -329,6 +455,8 @@ int reiser4_grab_space(__u64 count, reiser4_ba_flags_t flags)
 		   present */
 		if (flags & BA_CAN_COMMIT) {
 			txnmgr_force_commit_all(ctx->super, 0);
+			/* free log blocks of committed atoms */
+			reiser4_checkpoint(ctx->super);
 			ctx->grab_enabled = 1;
 			ret = reiser4_grab(ctx, count, flags);
 		}
@@ -482,7 +610,7 @@ void cluster_reserved2grabbed(int count)
 	spin_lock_reiser4_super(sbinfo);
 
 	sub_from_cluster_reserved(sbinfo, count);
-	sbinfo->blocks_grabbed += count;
+	add_to_sb_grabbed(sbinfo, count);
 
 	assert("edward-505", reiser4_check_block_counters(ctx->super));
 
@@ -602,7 +730,8 @@ static void flush_reserved2used(txn_atom * atom, __u64 count)
 	spin_unlock_reiser4_super(sbinfo);
 }
 
-/* update the per fs  blocknr hint default value. */
+/* update the per fs blocknr hint default value. Where the value is kept
+   depends on block placement policy plugin */
 void
 update_blocknr_hint_default(const struct super_block *s,
 			    const reiser4_block_nr * block)
@@ -611,9 +740,9 @@ update_blocknr_hint_default(const struct super_block *s,
 
 	assert("nikita-3342", !reiser4_blocknr_is_fake(block));
 
-	spin_lock_reiser4_super(sbinfo);
 	if (*block < sbinfo->block_count) {
-		sbinfo->blocknr_hint_default = *block;
+		alloc_policy_plugin_by_id(sbinfo->alloc_policy)->
+			update_hint(s, block);
 	} else {
 		warning("zam-676",
 			"block number %llu is too large to be used in a blocknr hint\n",
@@ -621,18 +750,17 @@ update_blocknr_hint_default(const struct super_block *s,
 		dump_stack();
 		DEBUGON(1);
 	}
-	spin_unlock_reiser4_super(sbinfo);
 }
 
 /* get current value of the default blocknr hint. */
 void get_blocknr_hint_default(reiser4_block_nr * result)
 {
-	reiser4_super_info_data *sbinfo = get_current_super_private();
+	struct super_block *super = reiser4_get_current_sb();
+	reiser4_super_info_data *sbinfo = get_super_private(super);
 
-	spin_lock_reiser4_super(sbinfo);
-	*result = sbinfo->blocknr_hint_default;
+	alloc_policy_plugin_by_id(sbinfo->alloc_policy)->get_hint(super,
+								   result);
 	assert("zam-677", *result < sbinfo->block_count);
-	spin_unlock_reiser4_super(sbinfo);
 }
 
 /* Allocate "real" disk blocks by calling a proper space allocation plugin
@@ -714,6 +842,9 @@ reiser4_alloc_blocks(reiser4_blocknr_hint * hint, reiser4_block_nr * blk,
 		default:
 			impossible("zam-531", "wrong block stage");
 		}
+		if (!hint->backward)
+			alloc_policy_plugin_by_id(sbinfo->alloc_policy)->
+				allocated(ctx->super, blk, len);
 	} else {
 		assert("zam-821",
 		       ergo(hint->max_dist == 0
@@ -804,7 +935,7 @@ fake_allocated2grabbed(reiser4_context * ctx, reiser4_super_info_data * sbinfo,
 
 	assert("nikita-2682", reiser4_check_block_counters(ctx->super));
 
-	sbinfo->blocks_grabbed += count;
+	add_to_sb_grabbed(sbinfo, count);
 	sub_from_sb_fake_allocated(sbinfo, count, flags & BA_FORMATTED);
 
 	assert("nikita-2683", reiser4_check_block_counters(ctx->super));
@@ -844,19 +975,48 @@ void grabbed2free_mark(__u64 mark)
  * @count: number of blocks to adjust counters by
  *
  * Decreases context's and per filesystem's counters of grabbed
- * blocks. Increases per filesystem's counter of free blocks.
+ * blocks. Increases per filesystem's counter of free blocks. Blocks are
+ * returned to the cache of current cpu, its excess goes back to the super
+ * block. When free space is low and caches are not used, blocks go back to
+ * the super block right away.
  */
 void grabbed2free(reiser4_context *ctx, reiser4_super_info_data *sbinfo,
 		  __u64 count)
 {
+	struct reiser4_grab_cache *cache;
+	__s64 excess;
+
 	sub_from_ctx_grabbed(ctx, count);
 
-	spin_lock_reiser4_super(sbinfo);
+	cache = raw_cpu_ptr(sbinfo->grab_cache);
+	spin_lock(&cache->lock);
+	if (likely(READ_ONCE(sbinfo->grab_cache_enabled))) {
+		cache->grabbed -= count;
+		excess = cache->reserved - cache->grabbed -
+			2 * GRAB_CACHE_BATCH;
+		spin_unlock(&cache->lock);
+		if (excess <= 0)
+			return;
 
-	sub_from_sb_grabbed(sbinfo, count);
-	sbinfo->blocks_free += count;
+		spin_lock_reiser4_super(sbinfo);
+		spin_lock(&cache->lock);
+		/* caches could be drained meanwhile, then there is no
+		   excess */
+		excess = cache->reserved - cache->grabbed - GRAB_CACHE_BATCH;
+		if (excess > 0) {
+			cache->reserved -= excess;
+			sbinfo->blocks_cached -= excess;
+			sbinfo->blocks_free += excess;
+		}
+		spin_unlock(&cache->lock);
+	} else {
+		spin_unlock(&cache->lock);
+		/* make blocks visible to exact check of reiser4_grab() */
+		spin_lock_reiser4_super(sbinfo);
+		sub_from_sb_grabbed(sbinfo, count);
+		sbinfo->blocks_free += count;
+	}
 	assert("nikita-2684", reiser4_check_block_counters(ctx->super));
-
 	spin_unlock_reiser4_super(sbinfo);
 }
 
@@ -910,7 +1070,7 @@ void flush_reserved2grabbed(txn_atom * atom, __u64 count)
 
 	spin_lock_reiser4_super(sbinfo);
 
-	sbinfo->blocks_grabbed += count;
+	add_to_sb_grabbed(sbinfo, count);
 	sub_from_sb_flush_reserved(sbinfo, count);
 
 	assert("vpf-292", reiser4_check_block_counters(ctx->super));
@@ -942,7 +1102,7 @@ used2grabbed(reiser4_context * ctx, reiser4_super_info_data * sbinfo,
 
 	spin_lock_reiser4_super(sbinfo);
 
-	sbinfo->blocks_grabbed += count;
+	add_to_sb_grabbed(sbinfo, count);
 	sub_from_sb_used(sbinfo, count);
 
 	assert("nikita-2685", reiser4_check_block_counters(ctx->super));
@@ -1021,6 +1181,8 @@ reiser4_dealloc_blocks(const reiser4_block_nr * start,
 		do {
 			atom = get_current_atom_locked();
 			assert("zam-430", atom != NULL);
+			/* blocks are not freed twice */
+			assert("edward-2371", !atom_dset_contains(atom, start));
 
 			ret = atom_dset_deferred_add_extent(atom, &new_entry, start, len);
 
@@ -1137,16 +1299,17 @@ void reiser4_post_commit_hook(void)
 	sa_post_commit_hook();
 }
 
-void reiser4_post_write_back_hook(void)
+/* @atom is not necessary the current one: write-back of committed atoms can
+   be deferred, see reiser4_checkpoint() */
+void reiser4_post_write_back_hook(txn_atom *atom)
 {
-	struct list_head discarded_set;
-	txn_atom *atom;
+	struct rb_root discarded_set;
 	int ret;
 
 	/* process and issue discard requests */
-	blocknr_list_init (&discarded_set);
+	blocknr_tree_init(&discarded_set);
 	do {
-		atom = get_current_atom_locked();
+		spin_lock_atom(atom);
 		ret = discard_atom(atom, &discarded_set);
 	} while (ret == -E_REPEAT);
 
@@ -1154,7 +1317,7 @@ void reiser4_post_write_back_hook(void)
 		warning("intelfx-8", "discard atom failed (%d)", ret);
 	}
 
-	atom = get_current_atom_locked();
+	spin_lock_atom(atom);
 	discard_atom_post(atom, &discarded_set);
 
 	/* do the block deallocation which was deferred
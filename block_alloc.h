@@ -162,7 +162,7 @@ static inline int reiser4_check_block(const reiser4_block_nr *start,
 
 extern int reiser4_pre_commit_hook(void);
 extern void reiser4_post_commit_hook(void);
-extern void reiser4_post_write_back_hook(void);
+extern void reiser4_post_write_back_hook(txn_atom *);
 
 #endif				/* __FS_REISER4_BLOCK_ALLOC_H__ */
 
@@ -0,0 +1,301 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by
+ * reiser4/README */
+
+/* This is a block extent tree implementation, used for atom's delete set.
+
+   Extents are kept in rb-tree ordered by start block. Extents of the tree
+   never overlap and never touch each other: an extent inserted next to or
+   over existing ones is joined with them. So the tree of a huge deleted file
+   is a few extents rather than millions of block numbers, fusion of atoms is
+   a number of tree insertions proportional to the number of extents, and a
+   block can be looked up in O(log n).
+
+   Like blocknr_set, the tree is modified under atom spin lock. A new entry is
+   allocated with the lock released, see blocknr_tree_add_extent(). */
+
+#include "debug.h"
+#include "dformat.h"
+#include "txnmgr.h"
+#include "context.h"
+#include "super.h"
+
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+
+static struct kmem_cache *blocknr_tree_slab = NULL;
+
+/**
+ * Represents an extent range [@start; @start + @len).
+ */
+struct blocknr_tree_entry {
+	reiser4_block_nr start, len;
+	struct rb_node node;
+};
+
+#define blocknr_tree_entry(ptr) rb_entry(ptr, blocknr_tree_entry, node)
+
+static inline reiser4_block_nr bte_end(const blocknr_tree_entry *entry)
+{
+	return entry->start + entry->len;
+}
+
+static blocknr_tree_entry *blocknr_tree_entry_alloc(void)
+{
+	blocknr_tree_entry *entry;
+
+	entry = kmem_cache_alloc(blocknr_tree_slab, reiser4_ctx_gfp_mask_get());
+	if (entry != NULL) {
+		entry->start = 0;
+		entry->len = 0;
+		RB_CLEAR_NODE(&entry->node);
+	}
+	return entry;
+}
+
+static void blocknr_tree_entry_free(blocknr_tree_entry *entry)
+{
+	assert("edward-2355", entry != NULL);
+
+	kmem_cache_free(blocknr_tree_slab, entry);
+}
+
+/* find the last extent which starts at or before @blk */
+static blocknr_tree_entry *bt_find_prev(struct rb_root *tree,
+					reiser4_block_nr blk)
+{
+	struct rb_node *n = tree->rb_node;
+	blocknr_tree_entry *prev = NULL;
+
+	while (n != NULL) {
+		blocknr_tree_entry *entry = blocknr_tree_entry(n);
+
+		if (entry->start <= blk) {
+			prev = entry;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	return prev;
+}
+
+/* link @entry which does not overlap any extent of @tree into @tree */
+static void bt_link(struct rb_root *tree, blocknr_tree_entry *entry)
+{
+	struct rb_node **p = &tree->rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p != NULL) {
+		parent = *p;
+		if (entry->start < blocknr_tree_entry(parent)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&entry->node, parent, p);
+	rb_insert_color(&entry->node, tree);
+}
+
+/* join extents following @entry which overlap or touch it */
+static void bt_absorb_next(struct rb_root *tree, blocknr_tree_entry *entry)
+{
+	struct rb_node *next;
+
+	while ((next = rb_next(&entry->node)) != NULL) {
+		blocknr_tree_entry *n = blocknr_tree_entry(next);
+		reiser4_block_nr end = bte_end(entry);
+
+		if (n->start > end)
+			break;
+		if (bte_end(n) > end)
+			entry->len = bte_end(n) - entry->start;
+		rb_erase(next, tree);
+		blocknr_tree_entry_free(n);
+	}
+}
+
+/*
+ * Adds [@start; @start + @len) to @tree. Returns 1 if the extent is joined
+ * with an existing one, 0 if a new entry is needed.
+ */
+static int bt_join(struct rb_root *tree, reiser4_block_nr start,
+		   reiser4_block_nr len)
+{
+	blocknr_tree_entry *prev;
+
+	prev = bt_find_prev(tree, start);
+	if (prev == NULL || bte_end(prev) < start) {
+		/* maybe the extent touches the next one */
+		struct rb_node *next;
+
+		next = prev ? rb_next(&prev->node) : rb_first(tree);
+		if (next == NULL ||
+		    blocknr_tree_entry(next)->start > start + len)
+			return 0;
+		prev = blocknr_tree_entry(next);
+		prev->len = bte_end(prev) - start;
+		prev->start = start;
+	}
+	if (start + len > bte_end(prev))
+		prev->len = start + len - prev->start;
+	bt_absorb_next(tree, prev);
+	return 1;
+}
+
+int blocknr_tree_init_static(void)
+{
+	assert("edward-2356", blocknr_tree_slab == NULL);
+
+	blocknr_tree_slab = kmem_cache_create("blocknr_tree_entry",
+					      sizeof(blocknr_tree_entry),
+					      0,
+					      SLAB_HWCACHE_ALIGN |
+					      SLAB_RECLAIM_ACCOUNT,
+					      NULL);
+	if (blocknr_tree_slab == NULL)
+		return RETERR(-ENOMEM);
+	return 0;
+}
+
+void blocknr_tree_done_static(void)
+{
+	destroy_reiser4_cache(&blocknr_tree_slab);
+}
+
+void blocknr_tree_init(struct rb_root *tree)
+{
+	assert("edward-2357", tree != NULL);
+
+	*tree = RB_ROOT;
+}
+
+void blocknr_tree_destroy(struct rb_root *tree)
+{
+	blocknr_tree_entry *entry;
+	blocknr_tree_entry *tmp;
+
+	assert("edward-2358", tree != NULL);
+
+	rbtree_postorder_for_each_entry_safe(entry, tmp, tree, node)
+		blocknr_tree_entry_free(entry);
+	*tree = RB_ROOT;
+}
+
+/* move all extents of @from to @to. No allocations are needed */
+void blocknr_tree_merge(struct rb_root *from, struct rb_root *to)
+{
+	struct rb_node *n;
+
+	assert("edward-2359", from != NULL);
+	assert("edward-2360", to != NULL);
+
+	if (RB_EMPTY_ROOT(to)) {
+		*to = *from;
+		*from = RB_ROOT;
+		return;
+	}
+	while ((n = rb_first(from)) != NULL) {
+		blocknr_tree_entry *entry = blocknr_tree_entry(n);
+
+		rb_erase(n, from);
+		if (bt_join(to, entry->start, entry->len))
+			blocknr_tree_entry_free(entry);
+		else
+			bt_link(to, entry);
+	}
+}
+
+/**
+ * blocknr_tree_add_extent - add extent to the tree
+ * @atom: atom which owns @tree, locked
+ * @tree: extent tree
+ * @new_entry: preallocated entry, or pointer to NULL
+ * @start: first block of the extent
+ * @len: length of the extent
+ *
+ * Joins the extent with existing ones if possible. Otherwise, when
+ * *@new_entry is NULL, unlocks @atom, allocates a new entry and returns
+ * -E_REPEAT: the caller has to lock atom and call this again with the same
+ * @new_entry. The preallocated entry is freed if it is not needed anymore.
+ */
+int blocknr_tree_add_extent(txn_atom *atom,
+			    struct rb_root *tree,
+			    blocknr_tree_entry **new_entry,
+			    const reiser4_block_nr *start,
+			    const reiser4_block_nr *len)
+{
+	assert("edward-2361", atom != NULL);
+	assert("edward-2362", atom_is_protected(atom));
+	assert("edward-2363", tree != NULL);
+	assert("edward-2364", new_entry != NULL);
+	assert("edward-2365", start != NULL);
+	assert("edward-2366", len != NULL && *len > 0);
+
+	if (!bt_join(tree, *start, *len)) {
+		if (*new_entry == NULL) {
+			spin_unlock_atom(atom);
+			*new_entry = blocknr_tree_entry_alloc();
+			return (*new_entry != NULL) ? -E_REPEAT :
+				RETERR(-ENOMEM);
+		}
+		(*new_entry)->start = *start;
+		(*new_entry)->len = *len;
+		bt_link(tree, *new_entry);
+		*new_entry = NULL;
+	}
+	if (*new_entry != NULL) {
+		blocknr_tree_entry_free(*new_entry);
+		*new_entry = NULL;
+	}
+	return 0;
+}
+
+/* true if @blk belongs to one of extents of @tree */
+int blocknr_tree_contains(struct rb_root *tree, const reiser4_block_nr *blk)
+{
+	blocknr_tree_entry *prev;
+
+	prev = bt_find_prev(tree, *blk);
+	return prev != NULL && *blk < bte_end(prev);
+}
+
+/* call @actor for every extent of @tree in ascending order. If @delete is
+   set, all extents are removed from @tree, even if @actor fails */
+int blocknr_tree_iterator(txn_atom *atom,
+			  struct rb_root *tree,
+			  blocknr_set_actor_f actor,
+			  void *data,
+			  int delete)
+{
+	struct rb_node *n;
+	struct rb_node *next;
+	int ret = 0;
+
+	assert("edward-2367", tree != NULL);
+	assert("edward-2368", actor != NULL);
+
+	for (n = rb_first(tree); n != NULL; n = next) {
+		blocknr_tree_entry *entry = blocknr_tree_entry(n);
+
+		next = rb_next(n);
+		if (ret == 0)
+			ret = actor(atom, &entry->start, &entry->len, data);
+		if (delete) {
+			rb_erase(n, tree);
+			blocknr_tree_entry_free(entry);
+		} else if (ret != 0)
+			break;
+	}
+	assert("edward-2369", !delete || RB_EMPTY_ROOT(tree));
+	return ret;
+}
+
+/* Make Linus happy.
+   Local variables:
+   c-indentation-style: "K&R"
+   mode-name: "LC"
+   c-basic-offset: 8
+   tab-width: 8
+   fill-column: 120
+   scroll-step: 1
+   End:
+*/
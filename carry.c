@@ -351,6 +351,8 @@ static int carry_on_level(carry_level * doing	/* queue of carry operations to
 		assert("nikita-1042", op->op < COP_LAST_OP);
 		f = op_dispatch_table[op->op].handler;
 		result = f(op, doing, todo);
+		reiser4_stat_inc(reiser4_get_current_sb(),
+				 REISER4_STAT_CARRY_OPS);
 		/* locking can fail with -E_REPEAT. Any different error is fatal
 		   and will be handled by fatal_carry_error() sledgehammer.
 		 */
@@ -249,10 +249,11 @@ static unsigned int space_needed_for_op(znode * node	/* znode data are
 	default:
 		impossible("nikita-1701", "Wrong opcode");
 	case COP_INSERT:
-		return space_needed(node, NULL, op->u.insert.d->data, 1);
+		return space_needed(node, NULL, op->u.insert.d->data,
+				    op->u.insert.d->key, 1);
 	case COP_PASTE:
 		return space_needed(node, op->u.insert.d->coord,
-				    op->u.insert.d->data, 0);
+				    op->u.insert.d->data, NULL, 0);
 	}
 }
 
@@ -265,6 +266,8 @@ unsigned int space_needed(const znode * node	/* node data are inserted or
 						 * at */ ,
 			  const reiser4_item_data * data /* data to insert or
 							  * paste */ ,
+			  const reiser4_key * key /* key of new item, or
+						   * NULL */ ,
 			  int insertion/* non-0 is inserting, 0---paste */)
 {
 	int result;
@@ -288,9 +291,16 @@ unsigned int space_needed(const znode * node	/* node data are inserted or
 		node_plugin *nplug;
 
 		nplug = node->nplug;
-		/* and add node overhead */
-		if (nplug->item_overhead != NULL)
-			result += nplug->item_overhead(node, NULL);
+		/* and add node overhead. It may depend on the key of new
+		   item (see item_overhead_node42()) */
+		if (nplug->item_overhead != NULL) {
+			flow_t f;
+
+			if (key != NULL)
+				f.key = *key;
+			result += nplug->item_overhead(node,
+						       key != NULL ? &f : NULL);
+		}
 	}
 	return result;
 }
@@ -910,7 +920,7 @@ static size_t flow_insertion_overhead(carry_op * op)
 	    !can_paste(flow_insert_point(op), &flow_insert_flow(op)->key,
 		       flow_insert_data(op)))
 		insertion_overhead =
-		    node->nplug->item_overhead(node, NULL) +
+		    node->nplug->item_overhead(node, flow_insert_flow(op)) +
 			item_data_overhead(op);
 	return insertion_overhead;
 }
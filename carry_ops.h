@@ -24,7 +24,8 @@ typedef struct carry_op_handler {
 extern carry_op_handler op_dispatch_table[COP_LAST_OP];
 
 unsigned int space_needed(const znode * node, const coord_t *coord,
-			  const reiser4_item_data * data, int inserting);
+			  const reiser4_item_data * data,
+			  const reiser4_key * key, int inserting);
 extern carry_node *find_left_carry(carry_node * node, carry_level * level);
 extern carry_node *find_right_carry(carry_node * node, carry_level * level);
 
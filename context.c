@@ -91,6 +91,7 @@ reiser4_context * reiser4_init_context(struct super_block *super)
 		return ERR_PTR(RETERR(-ENOMEM));
 
 	_reiser4_init_context(context, super);
+	reiser4_stat_inc(super, REISER4_STAT_CONTEXTS);
 	return context;
 }
 
@@ -66,6 +66,8 @@ struct reiser4_context {
 	unsigned int ro:1;
 	/* replacement of PF_FLUSHER */
 	unsigned int flush_bd_task:1;
+	/* new atoms get ATOM_ISOLATED */
+	unsigned int isolated:1;
 
 	/* count non-trivial jnode_set_dirty() calls */
 	unsigned long nr_marked_dirty;
@@ -63,11 +63,10 @@
  * the partial erase units at head and tail of extents are truncated by kernel
  * (in blkdev_issue_discard()).
  *
- * So, at commit time the following actions take place:
- * - delete sets are merged to form the discard set;
- * - elements of the discard set are sorted;
- * - the discard set is iterated, joining any adjacent extents;
- * - for each extent, a single call to blkdev_issue_discard() is done.
+ * The delete set is kept sorted with adjacent extents joined (see
+ * blocknrtree.c), so at commit time it is taken from the atom as the discard
+ * set, and for each its extent a single call to blkdev_issue_discard() is
+ * done.
  */
 
 #include "discard.h"
@@ -112,10 +111,10 @@ static int discard_extent(txn_atom *atom UNUSED_ARG,
 	return __discard_extent(bdev, extent_start_sec, extent_len_sec);
 }
 
-int discard_atom(txn_atom *atom, struct list_head *processed_set)
+int discard_atom(txn_atom *atom, struct rb_root *processed_set)
 {
 	int ret;
-	struct list_head discard_set;
+	struct rb_root discard_set;
 
 	if (!reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
 		spin_unlock_atom(atom);
@@ -125,25 +124,22 @@ int discard_atom(txn_atom *atom, struct list_head *processed_set)
 	assert("intelfx-28", atom != NULL);
 	assert("intelfx-59", processed_set != NULL);
 
-	if (list_empty(&atom->discard.delete_set)) {
+	if (RB_EMPTY_ROOT(&atom->delete_set)) {
 		/* Nothing left to discard. */
 		spin_unlock_atom(atom);
 		return 0;
 	}
 
-	/* Take the delete sets from the atom in order to release atom spinlock. */
-	blocknr_list_init(&discard_set);
-	blocknr_list_merge(&atom->discard.delete_set, &discard_set);
+	/* Take the delete set from the atom in order to release atom spinlock. */
+	blocknr_tree_init(&discard_set);
+	blocknr_tree_merge(&atom->delete_set, &discard_set);
 	spin_unlock_atom(atom);
 
-	/* Sort the discard list, joining adjacent and overlapping extents. */
-	blocknr_list_sort_and_join(&discard_set);
-
 	/* Perform actual dirty work. */
-	ret = blocknr_list_iterator(NULL, &discard_set, &discard_extent, NULL, 0);
+	ret = blocknr_tree_iterator(NULL, &discard_set, &discard_extent, NULL, 0);
 
-	/* Add processed extents to the temporary list. */
-	blocknr_list_merge(&discard_set, processed_set);
+	/* Add processed extents to the temporary set. */
+	blocknr_tree_merge(&discard_set, processed_set);
 
 	if (ret != 0) {
 		return ret;
@@ -153,7 +149,7 @@ int discard_atom(txn_atom *atom, struct list_head *processed_set)
 	return -E_REPEAT;
 }
 
-void discard_atom_post(txn_atom *atom, struct list_head *processed_set)
+void discard_atom_post(txn_atom *atom, struct rb_root *processed_set)
 {
 	assert("intelfx-60", atom != NULL);
 	assert("intelfx-61", processed_set != NULL);
@@ -163,7 +159,7 @@ void discard_atom_post(txn_atom *atom, struct list_head *processed_set)
 		return;
 	}
 
-	blocknr_list_merge(processed_set, &atom->discard.delete_set);
+	blocknr_tree_merge(processed_set, &atom->delete_set);
 	spin_unlock_atom(atom);
 }
 
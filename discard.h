@@ -9,15 +9,17 @@
 #include "forward.h"
 #include "dformat.h"
 
+#include <linux/rbtree.h>
+
 /**
  * Issue discard requests for all block extents recorded in @atom's delete sets,
  * if discard is enabled. The extents processed are removed from the @atom's
  * delete sets and stored in @processed_set.
  *
  * @atom must be locked on entry and is unlocked on exit.
- * @processed_set must be initialized with blocknr_list_init().
+ * @processed_set must be initialized with blocknr_tree_init().
  */
-extern int discard_atom(txn_atom *atom, struct list_head *processed_set);
+extern int discard_atom(txn_atom *atom, struct rb_root *processed_set);
 
 /**
  * Splices @processed_set back to @atom's delete set.
@@ -26,7 +28,7 @@ extern int discard_atom(txn_atom *atom, struct list_head *processed_set);
  * @atom must be locked on entry and is unlocked on exit.
  * @processed_set must be the same as passed to discard_atom().
  */
-extern void discard_atom_post(txn_atom *atom, struct list_head *processed_set);
+extern void discard_atom_post(txn_atom *atom, struct rb_root *processed_set);
 
 /* __FS_REISER4_DISCARD_H__ */
 #endif
@@ -510,6 +510,7 @@ static void release_prepped_list(flush_queue_t *fq)
 int reiser4_write_fq(flush_queue_t *fq, long *nr_submitted, int flags)
 {
 	int ret;
+	long nr;
 	txn_atom *atom;
 
 	while (1) {
@@ -525,12 +526,51 @@ int reiser4_write_fq(flush_queue_t *fq, long *nr_submitted, int flags)
 	atom->nr_running_queues++;
 	spin_unlock_atom(atom);
 
-	ret = write_jnode_list(ATOM_FQ_LIST(fq), fq, nr_submitted, flags);
+	nr = 0;
+	ret = write_jnode_list(ATOM_FQ_LIST(fq), fq, &nr, flags);
 	release_prepped_list(fq);
+	if (nr_submitted)
+		*nr_submitted += nr;
+	reiser4_stat_add(reiser4_get_current_sb(), REISER4_STAT_FLUSH_WRITTEN,
+			 nr);
 
 	return ret;
 }
 
+/* wait all i/o for @atom which is not necessary the current one. @atom has to
+   be committed, so that it can not fuse */
+int reiser4_atom_finish_all_fq(txn_atom *atom)
+{
+	int nr_io_errors = 0;
+	int ret;
+
+	assert("edward-2349", atom->stage >= ASTAGE_POST_COMMIT);
+
+	do {
+		spin_lock_atom(atom);
+		while (1) {
+			ret = finish_all_fq(atom, &nr_io_errors);
+			if (ret != -EBUSY)
+				break;
+			reiser4_atom_wait_event(atom);
+			spin_lock_atom(atom);
+		}
+	} while (ret == -E_REPEAT);
+
+	if (!ret)
+		spin_unlock_atom(atom);
+
+	assert_spin_not_locked(&(atom->alock));
+
+	if (ret)
+		return ret;
+
+	if (nr_io_errors)
+		return RETERR(-EIO);
+
+	return 0;
+}
+
 /* Getting flush queue object for exclusive use by one thread. May require
    several iterations which is indicated by -E_REPEAT return code.
 
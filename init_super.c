@@ -16,12 +16,42 @@
 int reiser4_init_fs_info(struct super_block *super)
 {
 	reiser4_super_info_data *sbinfo;
+	int cpu;
 
 	sbinfo = kzalloc(sizeof(reiser4_super_info_data),
 			 reiser4_ctx_gfp_mask_get());
 	if (!sbinfo)
 		return RETERR(-ENOMEM);
 
+	sbinfo->stats = alloc_percpu(struct reiser4_stats);
+	if (!sbinfo->stats) {
+		kfree(sbinfo);
+		return RETERR(-ENOMEM);
+	}
+	sbinfo->lock_hist = alloc_percpu(struct reiser4_lock_hist);
+	if (!sbinfo->lock_hist) {
+		free_percpu(sbinfo->stats);
+		kfree(sbinfo);
+		return RETERR(-ENOMEM);
+	}
+	sbinfo->commit_hist = alloc_percpu(struct reiser4_commit_hist);
+	if (!sbinfo->commit_hist) {
+		free_percpu(sbinfo->lock_hist);
+		free_percpu(sbinfo->stats);
+		kfree(sbinfo);
+		return RETERR(-ENOMEM);
+	}
+	sbinfo->grab_cache = alloc_percpu(struct reiser4_grab_cache);
+	if (!sbinfo->grab_cache) {
+		free_percpu(sbinfo->commit_hist);
+		free_percpu(sbinfo->lock_hist);
+		free_percpu(sbinfo->stats);
+		kfree(sbinfo);
+		return RETERR(-ENOMEM);
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbinfo->grab_cache, cpu)->lock);
+
 	super->s_fs_info = sbinfo;
 	super->s_op = NULL;
 
@@ -48,6 +78,10 @@ void reiser4_done_fs_info(struct super_block *super)
 	assert("zam-990", super->s_fs_info != NULL);
 
 	reiser4_done_super_d_info(super);
+	free_percpu(get_super_private(super)->grab_cache);
+	free_percpu(get_super_private(super)->commit_hist);
+	free_percpu(get_super_private(super)->lock_hist);
+	free_percpu(get_super_private(super)->stats);
 	kfree(super->s_fs_info);
 	super->s_fs_info = NULL;
 }
@@ -78,9 +112,21 @@ typedef enum {
 
 	/*
 	 * option take one of txmod plugin labels.
-	 * Example is "txmod=journal" or "txmod=wa"
+	 * Example is "txmod=journal", "txmod=wa" or "txmod=log"
 	 */
 	OPT_TXMOD,
+
+	/*
+	 * option take one of block placement policy plugin labels.
+	 * Example is "alloc_policy=global" or "alloc_policy=percpu"
+	 */
+	OPT_ALLOC_POLICY,
+
+	/*
+	 * option take one of node plugin labels.
+	 * Example is "node=node41" or "node=node42"
+	 */
+	OPT_NODE,
 } opt_type_t;
 
 #if 0
@@ -126,6 +172,12 @@ struct opt_desc {
 		struct {
 			reiser4_txmod_id *result;
 		} txmod;
+		struct {
+			reiser4_alloc_policy_id *result;
+		} alloc_policy;
+		struct {
+			reiser4_node_id *result;
+		} node;
 		struct {
 			void *addr;
 			int nr_bits;
@@ -235,6 +287,52 @@ static int parse_option(char *opt_string, struct opt_desc *opt)
 			}
 			break;
 		}
+	case OPT_ALLOC_POLICY:
+		{
+			reiser4_alloc_policy_id i = 0;
+
+			if (val_start == NULL) {
+				err_msg = "Value is missing";
+				result = RETERR(-EINVAL);
+				break;
+			}
+			err_msg = "Wrong option value";
+			result = RETERR(-EINVAL);
+			while (i < LAST_ALLOC_POLICY_ID) {
+				if (!strcmp(alloc_policy_plugins[i].h.label,
+					    val_start)) {
+					result = 0;
+					err_msg = NULL;
+					*opt->u.alloc_policy.result = i;
+					break;
+				}
+				i++;
+			}
+			break;
+		}
+	case OPT_NODE:
+		{
+			reiser4_node_id i = 0;
+
+			if (val_start == NULL) {
+				err_msg = "Value is missing";
+				result = RETERR(-EINVAL);
+				break;
+			}
+			err_msg = "Wrong option value";
+			result = RETERR(-EINVAL);
+			while (i < LAST_NODE_ID) {
+				if (!strcmp(node_plugins[i].h.label,
+					    val_start)) {
+					result = 0;
+					err_msg = NULL;
+					*opt->u.node.result = i;
+					break;
+				}
+				i++;
+			}
+			break;
+		}
 	default:
 		wrong_return_value("nikita-2100", "opt -> type");
 		break;
@@ -318,7 +416,7 @@ static int parse_options(char *opt_string, struct opt_desc *opts, int nr_opts)
 		}						\
 	}
 
-#define MAX_NR_OPTIONS (30)
+#define MAX_NR_OPTIONS (40)
 
 #if REISER4_DEBUG
 #  define OPT_ARRAY_CHECK(opt, array)					\
@@ -364,6 +462,18 @@ static noinline void push_sb_field_opts(struct opt_desc **p,
 	 * limit of concurrent flushers for one atom. 0 means no limit.
 	 */
 	PUSH_SB_FIELD_OPT(tmgr.atom_max_flushers, "%u");
+	/*
+	 * tmgr.checkpoint_max_size=N
+	 * With deferred_checkpoint, committers write back atoms themselves
+	 * when not written back atoms keep more than N log blocks.
+	 */
+	PUSH_SB_FIELD_OPT(tmgr.checkpoint_max_size, "%u");
+	/*
+	 * tmgr.isolated_max_size=N
+	 * Atoms of fsync-ed files refuse fusion with other atoms until they
+	 * get more than N blocks.
+	 */
+	PUSH_SB_FIELD_OPT(tmgr.isolated_max_size, "%u");
 	/*
 	 * tree.cbk_cache_slots=N
 	 * Number of slots in the cbk cache.
@@ -435,6 +545,8 @@ int reiser4_init_super_data(struct super_block *super, char *opt_string)
 	sbinfo->tmgr.atom_max_age = REISER4_ATOM_MAX_AGE / HZ;
 	sbinfo->tmgr.atom_min_size = 256;
 	sbinfo->tmgr.atom_max_flushers = ATOM_MAX_FLUSHERS;
+	sbinfo->tmgr.checkpoint_max_size = totalram_pages() / 8;
+	sbinfo->tmgr.isolated_max_size = 4096;
 
 	/* initialize cbk cache parameter */
 	sbinfo->tree.cbk_cache.nr_slots = CBK_CACHE_SLOTS;
@@ -460,6 +572,9 @@ int reiser4_init_super_data(struct super_block *super, char *opt_string)
 	sbinfo->ra_params.max = totalram_pages() / 4;
 	sbinfo->ra_params.flags = 0;
 
+	/* new formatted nodes are of the plugin recorded by mkfs */
+	sbinfo->node_plugin = LAST_NODE_ID;
+
 	/* allocate memory for structure describing reiser4 mount options */
 	opts = kmalloc(sizeof(struct opt_desc) * MAX_NR_OPTIONS,
 		       reiser4_ctx_gfp_mask_get());
@@ -489,6 +604,17 @@ int reiser4_init_super_data(struct super_block *super, char *opt_string)
 	PUSH_BIT_OPT("discard", REISER4_DISCARD);
 	/* disable hole punching at flush time */
 	PUSH_BIT_OPT("dont_punch_holes", REISER4_DONT_PUNCH_HOLES);
+	/*
+	 * write overwrite set of committed atom in place by ktxnmgrd rather
+	 * than by committing thread
+	 */
+	PUSH_BIT_OPT("deferred_checkpoint", REISER4_DEFERRED_CHECKPOINT);
+	/*
+	 * let ktxnmgrd choose atom_max_size, atom_max_age and atom_min_size
+	 * from commit throughput and dirty memory. Values of tmgr.* options
+	 * are upper bounds then
+	 */
+	PUSH_BIT_OPT("adaptive_atom_limits", REISER4_ADAPTIVE_ATOM_LIMITS);
 
 	PUSH_OPT(p, opts,
 	{
@@ -547,6 +673,37 @@ int reiser4_init_super_data(struct super_block *super, char *opt_string)
 	}
 	);
 
+	/*
+	 * Where new nodes are placed when they have no preceder
+	 */
+	PUSH_OPT(p, opts,
+	{
+		.name = "alloc_policy",
+		.type = OPT_ALLOC_POLICY,
+		.u = {
+			.alloc_policy = {
+				 .result = &sbinfo->alloc_policy
+			 }
+		}
+	}
+	);
+
+	/*
+	 * Layout of formatted nodes created from now on. Existing nodes keep
+	 * their layout. Example is "node=node42" for prefix compressed keys
+	 */
+	PUSH_OPT(p, opts,
+	{
+		.name = "node",
+		.type = OPT_NODE,
+		.u = {
+			.node = {
+				 .result = &sbinfo->node_plugin
+			 }
+		}
+	}
+	);
+
 	/* modify default settings to values set by mount options */
 	result = parse_options(opt_string, opts, p - opts);
 	kfree(opts);
@@ -558,6 +715,10 @@ int reiser4_init_super_data(struct super_block *super, char *opt_string)
 	if (sbinfo->tmgr.atom_max_age <= 0)
 		/* overflow */
 		sbinfo->tmgr.atom_max_age = REISER4_ATOM_MAX_AGE;
+	sbinfo->tmgr.tune.max_size = sbinfo->tmgr.atom_max_size;
+	sbinfo->tmgr.tune.max_age = sbinfo->tmgr.atom_max_age;
+	sbinfo->tmgr.tune.min_size = sbinfo->tmgr.atom_min_size;
+	sbinfo->tmgr.tune.stamp = jiffies;
 
 	/* round optimal io size up to 512 bytes */
 	sbinfo->optimal_io_size >>= VFS_BLKSIZE_BITS;
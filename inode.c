@@ -60,6 +60,23 @@ int reiser4_inode_get_flag(const struct inode *inode,
 	return test_bit((int)f, inode_flags(inode));
 }
 
+/* true if modifications of @inode are to go to isolated atoms. File which
+   was not fsync-ed for REISER4_FSYNC_ISOLATED_TIME is not isolated any
+   longer */
+int reiser4_inode_isolated(struct inode *inode)
+{
+	unsigned long fsync_time;
+
+	if (!reiser4_inode_get_flag(inode, REISER4_FSYNC_ISOLATED))
+		return 0;
+	fsync_time = READ_ONCE(reiser4_inode_data(inode)->fsync_time);
+	if (time_after(jiffies, fsync_time + REISER4_FSYNC_ISOLATED_TIME)) {
+		reiser4_inode_clr_flag(inode, REISER4_FSYNC_ISOLATED);
+		return 0;
+	}
+	return 1;
+}
+
 /* convert oid to inode number */
 ino_t oid_to_ino(oid_t oid)
 {
@@ -244,6 +261,7 @@ static int init_inode(struct inode *inode /* inode to intialise */ ,
 */
 static int read_inode(struct inode *inode /* inode to read from disk */ ,
 		      const reiser4_key * key /* key of stat data */ ,
+		      sd_hint_t *hint /* stat-data found already, or NULL */ ,
 		      int silent)
 {
 	int result;
@@ -259,8 +277,21 @@ static int read_inode(struct inode *inode /* inode to read from disk */ ,
 
 	coord_init_zero(&coord);
 	init_lh(&lh);
+	result = -E_REPEAT;
+	/* first, try to use seal */
+	if (hint != NULL && reiser4_seal_is_set(&hint->seal)) {
+		coord = hint->coord;
+		coord_clear_iplug(&coord);
+		result = reiser4_seal_validate(&hint->seal, &coord, key, &lh,
+					       ZNODE_READ_LOCK,
+					       ZNODE_LOCK_LOPRI);
+		if (result != 0)
+			coord_init_zero(&coord);
+	}
 	/* locate stat-data in a tree and return znode locked */
-	result = lookup_sd(inode, ZNODE_READ_LOCK, &coord, &lh, key, silent);
+	if (result != 0)
+		result = lookup_sd(inode, ZNODE_READ_LOCK, &coord, &lh, key,
+				   silent);
 	assert("nikita-301", !is_inode_loaded(inode));
 	if (result == 0) {
 		/* use stat-data plugin to load sd into inode. */
@@ -380,18 +411,9 @@ static void loading_end(reiser4_inode * info)
 	mutex_unlock(&info->loading);
 }
 
-/**
- * reiser4_iget - obtain inode via iget5_locked, read from disk if necessary
- * @super: super block of filesystem
- * @key: key of inode's stat-data
- * @silent:
- *
- * This is our helper function a la iget(). This is be called by
- * lookup_common() and reiser4_read_super(). Return inode locked or error
- * encountered.
- */
-struct inode *reiser4_iget(struct super_block *super, const reiser4_key *key,
-			   int silent)
+static struct inode *do_iget(struct super_block *super,
+			     const reiser4_key *key, sd_hint_t *hint,
+			     int silent)
 {
 	struct inode *inode;
 	int result;
@@ -436,7 +458,7 @@ struct inode *reiser4_iget(struct super_block *super, const reiser4_key *key,
 			/* now, inode has objectid as ->i_ino and locality in
 			   reiser4-specific part. This is enough for
 			   read_inode() to read stat data from the disk */
-			result = read_inode(inode, key, silent);
+			result = read_inode(inode, key, hint, silent);
 		} else
 			loading_end(info);
 	}
@@ -467,6 +489,38 @@ struct inode *reiser4_iget(struct super_block *super, const reiser4_key *key,
 	return inode;
 }
 
+/**
+ * reiser4_iget - obtain inode via iget5_locked, read from disk if necessary
+ * @super: super block of filesystem
+ * @key: key of inode's stat-data
+ * @silent:
+ *
+ * This is our helper function a la iget(). This is be called by
+ * lookup_common() and reiser4_read_super(). Return inode locked or error
+ * encountered.
+ */
+struct inode *reiser4_iget(struct super_block *super, const reiser4_key *key,
+			   int silent)
+{
+	return do_iget(super, key, NULL, silent);
+}
+
+/**
+ * reiser4_iget_hint - obtain inode whose stat-data was found already
+ * @super: super block of filesystem
+ * @hint: stat-data found by reiser4_sd_lookup()
+ * @silent:
+ *
+ * Same as reiser4_iget(), but if inode is not in cache, its stat-data is
+ * accessed through the seal of @hint. Tree is only traversed if the seal is
+ * broken.
+ */
+struct inode *reiser4_iget_hint(struct super_block *super, sd_hint_t *hint,
+				int silent)
+{
+	return do_iget(super, &hint->key, hint, silent);
+}
+
 /* reiser4_iget() may return not fully initialized inode, this function should
  * be called after one completes reiser4 inode initializing. */
 void reiser4_iget_complete(struct inode *inode)
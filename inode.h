@@ -61,7 +61,17 @@ typedef enum {
 	REISER4_PART_MIXED = 9,
 	REISER4_PART_IN_CONV = 10,
 	/* This flag indicates that file plugin conversion is in progress */
-	REISER4_FILE_CONV_IN_PROGRESS = 11
+	REISER4_FILE_CONV_IN_PROGRESS = 11,
+	/* file is fsync-ed or written synchronously, its modifications go to
+	 * isolated atoms (see ATOM_ISOLATED). Expires when file is not fsync-ed
+	 * for a while, see reiser4_inode_isolated() */
+	REISER4_FSYNC_ISOLATED = 12,
+	/* directory was read from the beginning, and no name was looked up
+	 * in it since then */
+	REISER4_READDIR_PENDING = 13,
+	/* names returned by readdir of this directory were looked up after
+	 * it, read their stat-data ahead on next readdir */
+	REISER4_READDIR_SD_RA = 14
 } reiser4_file_plugin_flags;
 
 /* state associated with each inode.
@@ -145,6 +155,11 @@ struct reiser4_inode {
 	/* tree of jnodes. Phantom jnodes (ones not attched to any atom) are
 	   tagged in that tree by EFLUSH_TAG_ANONYMOUS */
 	struct radix_tree_root jnodes_tree;
+	/* spin lock protecting @jnodes_tree. It is taken in stead of tree
+	   lock when unformatted jnodes of this file are looked up, created
+	   and hashed. Lock ordering: tree lock, then this lock, then jnode
+	   hash table bucket lock. */
+	spinlock_t jnodes_guard;
 #if REISER4_DEBUG
 	/* number of unformatted node jnodes of this file in jnode hash table */
 	unsigned long nr_jnodes;
@@ -153,6 +168,8 @@ struct reiser4_inode {
 	/* block number of virtual root for this object. See comment above
 	 * fs/reiser4/search.c:handle_vroot() */
 	reiser4_block_nr vroot;
+	/* time of the last fsync, see REISER4_FSYNC_ISOLATED */
+	unsigned long fsync_time;
 	struct mutex loading;
 };
 
@@ -329,8 +346,18 @@ extern int max_hash_collisions(const struct inode *dir);
 extern void reiser4_unlock_inode(struct inode *inode);
 extern int is_reiser4_inode(const struct inode *inode);
 extern int setup_inode_ops(struct inode *inode, reiser4_object_create_data *);
+/* stat-data found by batched lookup (reiser4_sd_lookup()). Seal lets
+ * reiser4_iget_hint() get to the stat-data without tree traversal. */
+typedef struct sd_hint {
+	reiser4_key key;	/* key of stat-data */
+	seal_t seal;		/* not set if stat-data was not found */
+	coord_t coord;		/* stat-data coord seal is attached to */
+} sd_hint_t;
+
 extern struct inode *reiser4_iget(struct super_block *super,
 				  const reiser4_key * key, int silent);
+extern struct inode *reiser4_iget_hint(struct super_block *super,
+				       sd_hint_t *hint, int silent);
 extern void reiser4_iget_complete(struct inode *inode);
 extern void reiser4_inode_set_flag(struct inode *inode,
 				   reiser4_file_plugin_flags f);
@@ -338,6 +365,7 @@ extern void reiser4_inode_clr_flag(struct inode *inode,
 				   reiser4_file_plugin_flags f);
 extern int reiser4_inode_get_flag(const struct inode *inode,
 				  reiser4_file_plugin_flags f);
+extern int reiser4_inode_isolated(struct inode *inode);
 
 /*  has inode been initialized? */
 static inline int
@@ -89,15 +89,32 @@
  *    is just about to release last reference on jnode it sets JNODE_RIP bit
  *    on it, and then proceed with jnode destruction (removing jnode from hash
  *    table, cbk_cache, detaching page, etc.). All places that change jnode
- *    reference counter from 0 to 1 (jlookup(), zlook(), zget(), and
+ *    reference counter from 0 to 1 (jlookup(), jfind(), zlook(), zget(), and
  *    cbk_cache_scan_slots()) check for JNODE_RIP bit (this is done by
- *    jnode_rip_check() function), and pretend that nothing was found in hash
- *    table if bit is set.
+ *    jref_rcu() function), and pretend that nothing was found in hash
+ *    table if bit is set. As long as jnode is referenced by somebody else,
+ *    jref_rcu() takes no locks at all.
  *
  *    jput defers actual return of jnode into slab cache to some later time
  *    (by call_rcu()), this guarantees that other threads can safely continue
  *    working with JNODE_RIP-ped jnode.
  *
+ * Indices of unformatted jnodes.
+ *
+ *    Unformatted jnodes are indexed by jnode hash table and by per-inode
+ *    radix tree. Neither is protected by tree lock: per-inode radix tree is
+ *    protected by reiser4_inode->jnodes_guard, and chains of hash table are
+ *    protected by stripe locks internal to the hash table (see
+ *    type_safe_hash.h). Because of this,
+ *    creation and lookup of jnodes for file pages never touch tree lock.
+ *
+ *    jnode destruction still takes tree lock, but, for unformatted jnodes,
+ *    it also takes ->jnodes_guard of the inode before re-checking
+ *    ->x_count. As find_get_jnode() and locked path of jfind() acquire new
+ *    references under ->jnodes_guard, this is enough to serialize them
+ *    against destruction. Lockless path of jfind() relies on JNODE_RIP, as
+ *    jlookup() does.
+ *
  */
 
 #include "reiser4.h"
@@ -156,10 +173,9 @@ static inline __u32 jnode_key_hashfn(j_hash_table * table,
 				     const struct jnode_key *key)
 {
 	assert("nikita-2352", key != NULL);
-	assert("nikita-3346", IS_POW(table->_buckets));
 
 	/* yes, this is remarkable simply (where not stupid) hash function. */
-	return (key->objectid + key->index) & (table->_buckets - 1);
+	return (__u32)(key->objectid + key->index);
 }
 
 /* The hash table definition */
@@ -174,7 +190,9 @@ TYPE_SAFE_HASH_DEFINE(j, jnode, struct jnode_key, key.j, link.j,
 int jnodes_tree_init(reiser4_tree * tree/* tree to initialise jnodes for */)
 {
 	assert("nikita-2359", tree != NULL);
-	return j_hash_init(&tree->jhash_table, 16384);
+	return j_hash_init_resizable(&tree->jhash_table,
+				     REISER4_JNODE_HASH_TABLE_SIZE,
+				     REISER4_HASH_TABLE_MAX_SIZE);
 }
 
 /* call this to destroy jnode hash table. This is called during umount. */
@@ -190,7 +208,8 @@ int jnodes_tree_done(reiser4_tree * tree/* tree to destroy jnodes for */)
 	 * Scan hash table and free all jnodes.
 	 */
 	jtable = &tree->jhash_table;
-	if (jtable->_table) {
+	if (jtable->_cur != NULL) {
+		j_hash_freeze(jtable);
 		for_all_in_htable(jtable, j, node, next) {
 			assert("nikita-2361", !atomic_read(&node->x_count));
 			jdrop(node);
@@ -201,6 +220,12 @@ int jnodes_tree_done(reiser4_tree * tree/* tree to destroy jnodes for */)
 	return 0;
 }
 
+/* collect statistics of jnode hash table, see type_safe_hash.h */
+void jnodes_tree_stats(reiser4_tree * tree, struct tsh_stats *stats)
+{
+	j_hash_stats(&tree->jhash_table, stats);
+}
+
 /**
  * init_jnodes - create jnode cache
  *
@@ -379,35 +404,62 @@ jnode *jlookup(reiser4_tree * tree, oid_t objectid, unsigned long index)
 	node = j_hash_find(&tree->jhash_table, &jkey);
 	if (node != NULL) {
 		/* protect @node from recycling */
-		jref(node);
-		assert("nikita-2955", jnode_invariant(node, 0, 0));
-		node = jnode_rip_check(tree, node);
+		node = jref_rcu(tree, node);
+		assert("nikita-2955",
+		       ergo(node != NULL, jnode_invariant(node, 0, 0)));
 	}
 	rcu_read_unlock();
 	return node;
 }
 
-/* per inode radix tree of jnodes is protected by tree's read write spin lock */
+/* lock protecting per inode radix tree of jnodes */
+static inline spinlock_t *inode_jnodes_guard(struct inode *inode)
+{
+	return &reiser4_inode_data(inode)->jnodes_guard;
+}
+
+/* per inode radix tree of jnodes is protected by ->jnodes_guard */
 static jnode *jfind_nolock(struct address_space *mapping, unsigned long index)
 {
 	assert("vs-1694", mapping->host != NULL);
+	assert_spin_locked(inode_jnodes_guard(mapping->host));
 
 	return radix_tree_lookup(jnode_tree_by_inode(mapping->host), index);
 }
 
+/*
+ * look for jnode with given mapping and index in the per-inode radix tree.
+ *
+ * Radix tree is first searched without locks, under RCU: jnodes and radix
+ * tree nodes are both freed through RCU. Jnode found this way is pinned by
+ * jref_rcu() and then checked to be still indexed at @index. Only if lockless
+ * lookup races with removal of jnode from the index, lookup is repeated under
+ * ->jnodes_guard.
+ */
 jnode *jfind(struct address_space *mapping, unsigned long index)
 {
-	reiser4_tree *tree;
 	jnode *node;
 
 	assert("vs-1694", mapping->host != NULL);
-	tree = reiser4_tree_by_inode(mapping->host);
 
-	read_lock_tree(tree);
+	rcu_read_lock();
+	node = radix_tree_lookup(jnode_tree_by_inode(mapping->host), index);
+	if (node != NULL)
+		node = jref_rcu(reiser4_tree_by_inode(mapping->host), node);
+	rcu_read_unlock();
+	if (node == NULL)
+		return NULL;
+	if (likely(READ_ONCE(node->key.j.mapping) == mapping &&
+		   READ_ONCE(node->key.j.index) == index))
+		return node;
+	/* @node was removed from the index under us */
+	jput(node);
+
+	spin_lock(inode_jnodes_guard(mapping->host));
 	node = jfind_nolock(mapping, index);
 	if (node != NULL)
 		jref(node);
-	read_unlock_tree(tree);
+	spin_unlock(inode_jnodes_guard(mapping->host));
 	return node;
 }
 
@@ -417,9 +469,9 @@ static void inode_attach_jnode(jnode * node)
 	reiser4_inode *info;
 	struct radix_tree_root *rtree;
 
-	assert_rw_write_locked(&(jnode_get_tree(node)->tree_lock));
 	assert("zam-1043", node->key.j.mapping != NULL);
 	inode = node->key.j.mapping->host;
+	assert_spin_locked(inode_jnodes_guard(inode));
 	info = reiser4_inode_data(inode);
 	rtree = jnode_tree_by_reiser4_inode(info);
 	if (radix_tree_empty(rtree)) {
@@ -442,9 +494,9 @@ static void inode_detach_jnode(jnode * node)
 	reiser4_inode *info;
 	struct radix_tree_root *rtree;
 
-	assert_rw_write_locked(&(jnode_get_tree(node)->tree_lock));
 	assert("zam-1044", node->key.j.mapping != NULL);
 	inode = node->key.j.mapping->host;
+	assert_spin_locked(inode_jnodes_guard(inode));
 	info = reiser4_inode_data(inode);
 	rtree = jnode_tree_by_reiser4_inode(info);
 
@@ -477,7 +529,7 @@ hash_unformatted_jnode(jnode * node, struct address_space *mapping,
 	assert("vs-1442", node->key.j.mapping == 0);
 	assert("vs-1443", node->key.j.objectid == 0);
 	assert("vs-1444", node->key.j.index == (unsigned long)-1);
-	assert_rw_write_locked(&(jnode_get_tree(node)->tree_lock));
+	assert_spin_locked(inode_jnodes_guard(mapping->host));
 
 	node->key.j.mapping = mapping;
 	node->key.j.objectid = get_inode_oid(mapping->host);
@@ -498,13 +550,17 @@ hash_unformatted_jnode(jnode * node, struct address_space *mapping,
 
 static void unhash_unformatted_node_nolock(jnode * node)
 {
+	j_hash_table *jtable;
+
 	assert("vs-1683", node->key.j.mapping != NULL);
 	assert("vs-1684",
 	       node->key.j.objectid ==
 	       get_inode_oid(node->key.j.mapping->host));
+	assert_spin_locked(inode_jnodes_guard(node->key.j.mapping->host));
 
 	/* remove jnode from hash-table */
-	j_hash_remove_rcu(&node->tree->jhash_table, node);
+	jtable = &node->tree->jhash_table;
+	j_hash_remove_rcu(jtable, node);
 	inode_detach_jnode(node);
 	node->key.j.mapping = NULL;
 	node->key.j.index = (unsigned long)-1;
@@ -517,11 +573,14 @@ static void unhash_unformatted_node_nolock(jnode * node)
    reiser4_uncapture_jnode */
 void unhash_unformatted_jnode(jnode * node)
 {
+	spinlock_t *guard;
+
 	assert("vs-1445", jnode_is_unformatted(node));
 
-	write_lock_tree(node->tree);
+	guard = inode_jnodes_guard(node->key.j.mapping->host);
+	spin_lock(guard);
 	unhash_unformatted_node_nolock(node);
-	write_unlock_tree(node->tree);
+	spin_unlock(guard);
 }
 
 /*
@@ -546,7 +605,7 @@ static jnode *find_get_jnode(reiser4_tree * tree,
 	if (preload != 0)
 		return ERR_PTR(preload);
 
-	write_lock_tree(tree);
+	spin_lock(inode_jnodes_guard(mapping->host));
 	shadow = jfind_nolock(mapping, index);
 	if (likely(shadow == NULL)) {
 		/* add new jnode to hash table and inode's radix tree of
@@ -560,7 +619,7 @@ static jnode *find_get_jnode(reiser4_tree * tree,
 		assert("vs-1498", shadow->key.j.mapping == mapping);
 		result = shadow;
 	}
-	write_unlock_tree(tree);
+	spin_unlock(inode_jnodes_guard(mapping->host));
 
 	assert("nikita-2955",
 	       ergo(result != NULL, jnode_invariant(result, 0, 0)));
@@ -1548,6 +1607,28 @@ void jnode_list_remove(jnode * node)
 }
 #endif
 
+/*
+ * lock per-inode index of unformatted jnode @node, if @node is indexed. This
+ * is called by jnode destruction code under tree lock, before ->x_count is
+ * re-checked. Returns lock taken or NULL.
+ */
+static spinlock_t *jnode_lock_index(jnode * node, jnode_type jtype)
+{
+	spinlock_t *guard;
+
+	if (jtype != JNODE_UNFORMATTED_BLOCK || node->key.j.mapping == NULL)
+		return NULL;
+	guard = inode_jnodes_guard(node->key.j.mapping->host);
+	spin_lock(guard);
+	return guard;
+}
+
+static inline void jnode_unlock_index(spinlock_t * guard)
+{
+	if (guard != NULL)
+		spin_unlock(guard);
+}
+
 /*
  * this is called by jput_final() to remove jnode when last reference to it is
  * released.
@@ -1557,6 +1638,7 @@ static int jnode_try_drop(jnode * node)
 	int result;
 	reiser4_tree *tree;
 	jnode_type jtype;
+	spinlock_t *guard;
 
 	assert("nikita-2491", node != NULL);
 	assert("nikita-2583", JF_ISSET(node, JNODE_RIP));
@@ -1577,6 +1659,7 @@ static int jnode_try_drop(jnode * node)
 		return RETERR(-EBUSY);
 	}
 
+	guard = jnode_lock_index(node, jtype);
 	/* re-check ->x_count under tree lock. */
 	result = jnode_is_busy(node, jtype);
 	if (result == 0) {
@@ -1586,11 +1669,13 @@ static int jnode_try_drop(jnode * node)
 		spin_unlock_jnode(node);
 		/* no page and no references---despatch him. */
 		jnode_remove(node, jtype, tree);
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		jnode_free(node, jtype);
 	} else {
 		/* busy check failed: reference was acquired by concurrent
 		 * thread. */
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		spin_unlock_jnode(node);
 		JF_CLR(node, JNODE_RIP);
@@ -1605,6 +1690,7 @@ static int jdelete(jnode * node/* jnode to finish with */)
 	int result;
 	reiser4_tree *tree;
 	jnode_type jtype;
+	spinlock_t *guard;
 
 	assert("nikita-467", node != NULL);
 	assert("nikita-2531", JF_ISSET(node, JNODE_RIP));
@@ -1617,6 +1703,7 @@ static int jdelete(jnode * node/* jnode to finish with */)
 	tree = jnode_get_tree(node);
 
 	write_lock_tree(tree);
+	guard = jnode_lock_index(node, jtype);
 	/* re-check ->x_count under tree lock. */
 	result = jnode_is_busy(node, jtype);
 	if (likely(!result)) {
@@ -1633,6 +1720,7 @@ static int jdelete(jnode * node/* jnode to finish with */)
 		spin_unlock_jnode(node);
 		/* goodbye */
 		jnode_delete(node, jtype, tree);
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		jnode_free(node, jtype);
 		/* @node is no longer valid pointer */
@@ -1642,6 +1730,7 @@ static int jdelete(jnode * node/* jnode to finish with */)
 		/* busy check failed: reference was acquired by concurrent
 		 * thread. */
 		JF_CLR(node, JNODE_RIP);
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		spin_unlock_jnode(node);
 		if (page != NULL)
@@ -1664,6 +1753,7 @@ static int jdrop_in_tree(jnode * node, reiser4_tree * tree)
 	struct page *page;
 	jnode_type jtype;
 	int result;
+	spinlock_t *guard;
 
 	assert("zam-602", node != NULL);
 	assert_rw_not_read_locked(&(tree->tree_lock));
@@ -1676,6 +1766,7 @@ static int jdrop_in_tree(jnode * node, reiser4_tree * tree)
 	assert_spin_locked(&(node->guard));
 
 	write_lock_tree(tree);
+	guard = jnode_lock_index(node, jtype);
 
 	/* re-check ->x_count under tree lock. */
 	result = jnode_is_busy(node, jtype);
@@ -1690,6 +1781,7 @@ static int jdrop_in_tree(jnode * node, reiser4_tree * tree)
 		}
 		spin_unlock_jnode(node);
 		jnode_remove(node, jtype, tree);
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		jnode_free(node, jtype);
 		if (page != NULL)
@@ -1698,6 +1790,7 @@ static int jdrop_in_tree(jnode * node, reiser4_tree * tree)
 		/* busy check failed: reference was acquired by concurrent
 		 * thread. */
 		JF_CLR(node, JNODE_RIP);
+		jnode_unlock_index(guard);
 		write_unlock_tree(tree);
 		spin_unlock_jnode(node);
 		if (page != NULL)
@@ -127,6 +127,9 @@ struct jnode {
 		reiser4_block_nr z;
 		/* unformatted nodes are hashed by mapping plus offset */
 		struct jnode_key j;
+		/* io head made by copy_on_capture(): the node it is a copy
+		   of */
+		jnode *orig;
 	} key;
 
 	/* THIRD CACHE LINE */
@@ -260,6 +263,9 @@ typedef enum {
 	JNODE_REPACK = 23,
 	/* node should be converted by flush in squalloc phase */
 	JNODE_CONVERTIBLE = 24,
+	/* io head which replaces overwrite set node in its atom, see
+	   copy_on_capture(). ->key.orig points to that node */
+	JNODE_CAPTURE_COPY = 25,
 	/*
 	 * When jnode is dirtied for the first time in given transaction,
 	 * do_jnode_make_dirty() checks whether this jnode can possible became
@@ -424,6 +430,7 @@ extern flush_queue_t *reiser4_pos_fq(flush_pos_t *pos);
 
 extern int jnodes_tree_init(reiser4_tree * tree);
 extern int jnodes_tree_done(reiser4_tree * tree);
+extern void jnodes_tree_stats(reiser4_tree * tree, struct tsh_stats *stats);
 
 #if REISER4_DEBUG
 
@@ -682,6 +689,30 @@ static inline jnode *jnode_rip_check(reiser4_tree * tree, jnode * node)
 	return node;
 }
 
+/*
+ * acquire reference to @node found in one of lockless jnode indices (hash
+ * table, per-inode radix tree, cbk cache) under rcu_read_lock().
+ *
+ * If @node is already referenced by somebody else, it cannot be freed under
+ * us unless jput_final() has started to destroy it meanwhile, which is
+ * detected by JNODE_RIP. Thus the common case of a busy (cache-hot) jnode
+ * costs one atomic operation and a bit test. Unreferenced jnodes and races
+ * with destruction are handled by jnode_rip_sync(), which serializes with
+ * destruction under tree lock.
+ *
+ * Returns @node or NULL if @node is being destroyed.
+ */
+static inline jnode *jref_rcu(reiser4_tree * tree, jnode * node)
+{
+	if (likely(atomic_inc_not_zero(&node->x_count))) {
+		LOCK_CNT_INC(x_refs);
+		if (likely(!JF_ISSET(node, JNODE_RIP)))
+			return node;
+	} else
+		add_x_ref(node);
+	return jnode_rip_sync(tree, node);
+}
+
 extern reiser4_key *jnode_build_key(const jnode *node, reiser4_key * key);
 
 #if REISER4_DEBUG
@@ -28,6 +28,7 @@
 #include "ktxnmgrd.h"
 #include "super.h"
 #include "reiser4.h"
+#include "wander.h"
 
 #include <linux/sched.h>	/* for struct task_struct */
 #include <linux/wait.h>
@@ -36,9 +37,27 @@
 #include <linux/writeback.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/backing-dev.h>
+#include <linux/math64.h>
 
 static int scan_mgr(struct super_block *);
 
+/* how often adaptive atom limits are adjusted */
+#define ATOM_TUNE_PERIOD (HZ)
+
+/*
+ * with adaptive atom limits ktxnmgrd wakes up every ATOM_TUNE_PERIOD to
+ * adjust them. Atoms are scanned on each wake up as well, so that atoms
+ * exceeding the reduced maximal age do not wait for the full timeout.
+ */
+static signed long ktxnmgrd_timeout(struct super_block *super,
+				    ktxnmgrd_context *ctx)
+{
+	if (reiser4_is_set(super, REISER4_ADAPTIVE_ATOM_LIMITS))
+		return min_t(signed long, ctx->timeout, ATOM_TUNE_PERIOD);
+	return ctx->timeout;
+}
+
 /*
  * change current->comm so that ps, top, and friends will see changed
  * state. This serves no useful purpose whatsoever, but also costs nothing. May
@@ -83,7 +102,7 @@ static int ktxnmgrd(void *arg)
 			if (kthread_should_stop())
 				done = 1;
 			else
-				schedule_timeout(ctx->timeout);
+				schedule_timeout(ktxnmgrd_timeout(super, ctx));
 			finish_wait(&ctx->wait, &__wait);
 		}
 		if (done)
@@ -167,20 +186,119 @@ int is_current_ktxnmgrd(void)
 	return (get_current_super_private()->tmgr.daemon->tsk == current);
 }
 
+/*
+ * write-back of committed atoms is due when somebody waits for it or when
+ * the oldest of them waits for it longer than ktxnmgrd sleeps
+ */
+static int checkpoint_is_due(txn_mgr *mgr)
+{
+	int ret;
+
+	spin_lock_txnmgr(mgr);
+	ret = !list_empty(&mgr->checkpoint_list) &&
+		(mgr->checkpoint_wanted ||
+		 time_after_eq(jiffies,
+			       mgr->checkpoint_start + mgr->daemon->timeout));
+	spin_unlock_txnmgr(mgr);
+	return ret;
+}
+
+/**
+ * tune_atom_limits - adjust atom limits to device speed and dirty memory
+ * @super: super block mounted with adaptive_atom_limits option
+ *
+ * Maximal atom size is what the device writes in REISER4_ATOM_COMMIT_TARGET_MS
+ * milliseconds. Write speed is the larger of measured commit throughput and
+ * writeback bandwidth of the bdi: commits of small atoms are dominated by
+ * latency, and taking their throughput alone would shrink atoms further. An
+ * atom keeps its pages dirty until commit, so it is not allowed to take more
+ * than a half of the dirty limit. When dirty memory is above the background
+ * threshold, maximal atom age is reduced, down to REISER4_ATOM_MIN_AGE at the
+ * dirty limit. Values set by mount options are never exceeded. Called by
+ * ktxnmgrd on each wake up, limits are changed at most once in
+ * ATOM_TUNE_PERIOD.
+ */
+static void tune_atom_limits(struct super_block *super)
+{
+	txn_mgr *mgr = &get_super_private(super)->tmgr;
+	unsigned long background;
+	unsigned long dirty_limit;
+	unsigned long nr_dirty;
+	unsigned long bandwidth;
+	unsigned long size;
+	unsigned long age;
+	unsigned long min_size;
+
+	spin_lock_txnmgr(mgr);
+	if (time_before(jiffies, mgr->tune.stamp + ATOM_TUNE_PERIOD)) {
+		spin_unlock_txnmgr(mgr);
+		return;
+	}
+	mgr->tune.stamp = jiffies;
+	if (mgr->tune.commit_ns != 0) {
+		bandwidth = div64_u64(mgr->tune.nr_nodes * NSEC_PER_SEC,
+				      mgr->tune.commit_ns);
+		/* smooth over the last periods */
+		if (mgr->tune.bandwidth != 0)
+			bandwidth = (3 * mgr->tune.bandwidth + bandwidth) / 4;
+		mgr->tune.bandwidth = bandwidth;
+		mgr->tune.nr_nodes = 0;
+		mgr->tune.commit_ns = 0;
+	}
+	bandwidth = max_t(unsigned long, mgr->tune.bandwidth,
+			  super->s_bdi->wb.avg_write_bandwidth);
+	spin_unlock_txnmgr(mgr);
+
+	global_dirty_limits(&background, &dirty_limit);
+	nr_dirty = global_node_page_state(NR_FILE_DIRTY);
+
+	size = bandwidth * REISER4_ATOM_COMMIT_TARGET_MS / MSEC_PER_SEC;
+	size = min(size, dirty_limit / 2);
+	size = max_t(unsigned long, size, 2 * mgr->tune.min_size);
+	size = min_t(unsigned long, size, mgr->tune.max_size);
+	/* atoms smaller than that are fused when memory is short */
+	min_size = min_t(unsigned long, max(size >> 6, 16UL),
+			 mgr->tune.min_size);
+
+	age = mgr->tune.max_age;
+	if (nr_dirty > background && age > REISER4_ATOM_MIN_AGE) {
+		if (nr_dirty >= dirty_limit)
+			age = REISER4_ATOM_MIN_AGE;
+		else
+			age = REISER4_ATOM_MIN_AGE +
+				div64_u64((u64)(age - REISER4_ATOM_MIN_AGE) *
+					  (dirty_limit - nr_dirty),
+					  dirty_limit - background);
+	}
+
+	/* size moves half way to the target to damp oscillations, age
+	   follows dirty memory immediately */
+	WRITE_ONCE(mgr->atom_max_size, (mgr->atom_max_size + size) / 2);
+	WRITE_ONCE(mgr->atom_min_size, min_size);
+	WRITE_ONCE(mgr->atom_max_age, age);
+}
+
 /**
  * scan_mgr - commit atoms which are to be committed
  * @super: super block to commit atoms of
  *
- * Commits old atoms.
+ * Adjusts atom limits if they are adaptive, commits old atoms, writes back
+ * committed atoms when it is time to.
  */
 static int scan_mgr(struct super_block *super)
 {
 	int ret;
 	reiser4_context ctx;
+	txn_mgr *mgr;
 
 	init_stack_context(&ctx, super);
 
-	ret = commit_some_atoms(&get_super_private(super)->tmgr);
+	mgr = &get_super_private(super)->tmgr;
+	if (reiser4_is_set(super, REISER4_ADAPTIVE_ATOM_LIMITS))
+		tune_atom_limits(super);
+	ret = commit_some_atoms(mgr);
+	if (ret == 0 && checkpoint_is_due(mgr))
+		ret = reiser4_checkpoint(super);
 
 	reiser4_exit_context(&ctx);
 	return ret;
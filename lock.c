@@ -226,6 +226,10 @@
 #include "super.h"
 
 #include <linux/spinlock.h>
+#include <linux/sched/clock.h>
+
+#define CREATE_TRACE_POINTS
+#include "reiser4_trace.h"
 
 #if REISER4_DEBUG
 static int request_is_deadlock_safe(znode * , znode_lock_mode,
@@ -238,10 +242,37 @@ lock_stack *get_current_lock_stack(void)
 	return &get_current_context()->stack;
 }
 
+/* histogram bucket for the latency of @ns nanoseconds. See comment before
+   struct reiser4_lock_hist */
+static inline int lock_hist_bucket(u64 ns)
+{
+	/* buckets are in units of 1024 ns */
+	return min_t(int, fls64(ns >> 10), REISER4_LOCK_HIST_BUCKETS - 1);
+}
+
+/* account lock wait time (@hold == 0) or hold time (@hold == 1) of @node */
+static void lock_hist_add(znode * node, int hold, u64 ns)
+{
+	reiser4_super_info_data *sbinfo;
+	int level;
+	int bucket;
+
+	sbinfo = get_super_private(znode_get_tree(node)->super);
+	if (sbinfo == NULL || sbinfo->lock_hist == NULL)
+		return;
+	level = min_t(int, znode_get_level(node), REISER4_MAX_ZTREE_HEIGHT);
+	bucket = lock_hist_bucket(ns);
+	if (hold)
+		this_cpu_inc(sbinfo->lock_hist->hold[level][bucket]);
+	else
+		this_cpu_inc(sbinfo->lock_hist->wait[level][bucket]);
+}
+
 /* Wakes up all low priority owners informing them about possible deadlock */
 static void wake_up_all_lopri_owners(znode * node)
 {
 	lock_handle *handle;
+	int nr = 0;
 
 	assert_spin_locked(&(node->lock.guard));
 	list_for_each_entry(handle, &node->lock.owners, owners_link) {
@@ -252,8 +283,16 @@ static void wake_up_all_lopri_owners(znode * node)
 			atomic_inc(&handle->owner->nr_signaled);
 			/* Wake up a single process */
 			reiser4_wake_up(handle->owner);
+			nr++;
 		}
 	}
+	if (nr != 0) {
+		reiser4_stat_add(znode_get_tree(node)->super,
+				 REISER4_STAT_LOPRI_WAKEUPS, nr);
+		trace_reiser4_lopri_wakeup(znode_get_tree(node)->super,
+					   *znode_get_block(node),
+					   znode_get_level(node), nr);
+	}
 }
 
 /* Adds a lock to a lock owner, which means creating a link to the lock and
@@ -281,6 +320,7 @@ link_object(lock_handle * handle, lock_stack * owner, znode * node)
 	/* add lock handle to the head of znode's list of owners */
 	list_add(&handle->owners_link, &node->lock.owners);
 	handle->signaled = 0;
+	handle->locked_at = local_clock();
 }
 
 /* Breaks a relation between a lock and its owner */
@@ -324,6 +364,10 @@ static void lock_object(lock_stack * owner)
 	} else {
 		/* check that we don't switched from read to write lock */
 		assert("nikita-1840", node->lock.nr_readers <= 0);
+		/* first write lock: let optimistic readers know that node
+		   content is about to change */
+		if (node->lock.nr_readers == 0)
+			raw_write_seqcount_begin(&node->lock.seq);
 		/* We allow recursive locking; a node can be locked several
 		   times for write by same process */
 		node->lock.nr_readers--;
@@ -597,6 +641,7 @@ void longterm_unlock_znode(lock_handle * handle)
 	int readers;
 	int rdelta;
 	int youdie;
+	u64 held;
 
 	/*
 	 * this is time-critical and highly optimized code. Modify carefully.
@@ -610,6 +655,12 @@ void longterm_unlock_znode(lock_handle * handle)
 
 	LOCK_CNT_DEC(long_term_locked_znode);
 
+	held = local_clock() - handle->locked_at;
+	lock_hist_add(node, 1, held);
+	trace_reiser4_lock_hold(znode_get_tree(node)->super,
+				*znode_get_block(node), znode_get_level(node),
+				held);
+
 	/*
 	 * to minimize amount of operations performed under lock, pre-compute
 	 * all variables used within critical section. This makes code
@@ -652,6 +703,9 @@ void longterm_unlock_znode(lock_handle * handle)
 	/* This is enough to be sure whether an object is completely
 	   unlocked. */
 	node->lock.nr_readers += rdelta;
+	if (rdelta > 0 && node->lock.nr_readers == 0)
+		/* last write lock released */
+		raw_write_seqcount_end(&node->lock.seq);
 
 	/* If the node is locked it must have an owners list.  Likewise, if
 	   the node is unlocked it must have an empty owners list. */
@@ -767,6 +821,8 @@ int longterm_lock_znode(
 	zlock *lock;
 	txn_handle *txnh;
 	tree_level level;
+	/* when this request started to sleep, 0 if it didn't */
+	u64 wait_start = 0;
 
 	/* Get current process context */
 	lock_stack *owner = get_current_lock_stack();
@@ -965,6 +1021,11 @@ int longterm_lock_znode(
 		/* Ok, here we have prepared a lock request, so unlock
 		   a znode ... */
 		spin_unlock_zlock(lock);
+		if (wait_start == 0) {
+			reiser4_stat_inc(znode_get_tree(node)->super,
+					 REISER4_STAT_LOCK_WAITS);
+			wait_start = local_clock();
+		}
 		/* ... and sleep */
 		reiser4_go_to_sleep(owner);
 		if (owner->request.mode == ZNODE_NO_LOCK)
@@ -977,12 +1038,26 @@ request_is_done:
 				LOCK_CNT_INC(long_term_locked_znode);
 				zref(node);
 			}
-			return owner->request.ret_code;
+			ret = owner->request.ret_code;
+			goto out;
 		}
 		remove_lock_request(owner);
 	}
 
-	return lock_tail(owner, ret, mode);
+	ret = lock_tail(owner, ret, mode);
+out:
+	if (unlikely(ret == -E_DEADLOCK))
+		reiser4_stat_inc(znode_get_tree(node)->super,
+				 REISER4_STAT_LOCK_DEADLOCKS);
+	if (wait_start != 0) {
+		u64 waited = local_clock() - wait_start;
+
+		lock_hist_add(node, 0, waited);
+		trace_reiser4_lock_wait(znode_get_tree(node)->super,
+					*znode_get_block(node), level, mode,
+					hipri, ret, waited);
+	}
+	return ret;
 }
 
 /* lock object invalidation means changing of lock object state to `INVALID'
@@ -1008,6 +1083,8 @@ void reiser4_invalidate_lock(lock_handle * handle	/* path to lock
 
 	ZF_SET(node, JNODE_IS_DYING);
 	unlink_object(handle);
+	/* ->seq is left odd, so that optimistic readers never validate
+	   contents of dying node */
 	node->lock.nr_readers = 0;
 
 	invalidate_all_lock_requests(node);
@@ -1033,6 +1110,7 @@ void reiser4_init_lock(zlock * lock	/* pointer on allocated
 {
 	memset(lock, 0, sizeof(zlock));
 	spin_lock_init(&lock->guard);
+	seqcount_init(&lock->seq);
 	INIT_LIST_HEAD(&lock->requestors);
 	INIT_LIST_HEAD(&lock->owners);
 }
@@ -1045,6 +1123,7 @@ move_lh_internal(lock_handle * new, lock_handle * old, int unlink_old)
 	znode *node = old->node;
 	lock_stack *owner = old->owner;
 	int signaled;
+	u64 locked_at;
 
 	/* locks_list, modified by link_object() is not protected by
 	   anything. This is valid because only current thread ever modifies
@@ -1056,6 +1135,7 @@ move_lh_internal(lock_handle * new, lock_handle * old, int unlink_old)
 	spin_lock_zlock(&node->lock);
 
 	signaled = old->signaled;
+	locked_at = old->locked_at;
 	if (unlink_old) {
 		unlink_object(old);
 	} else {
@@ -1074,6 +1154,9 @@ move_lh_internal(lock_handle * new, lock_handle * old, int unlink_old)
 	}
 	link_object(new, owner, node);
 	new->signaled = signaled;
+	/* moved lock is still the same lock for hold time statistics */
+	if (unlink_old)
+		new->locked_at = locked_at;
 
 	spin_unlock_zlock(&node->lock);
 }
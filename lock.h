@@ -17,6 +17,7 @@
 
 #include <linux/types.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/pagemap.h>	/* for PAGE_CACHE_SIZE */
 #include <asm/atomic.h>
 #include <linux/wait.h>
@@ -38,6 +39,11 @@ struct zlock {
 	struct list_head owners;
 	/* A linked list of lock_stacks that wait for this lock */
 	struct list_head requestors;
+	/* Odd while the lock is held for write, incremented on each
+	   transition. Node content can only be modified under write lock,
+	   so this allows to read node without taking a lock and validate the
+	   result afterwards. Written under zlock spin lock. */
+	seqcount_t seq;
 };
 
 static inline void spin_lock_zlock(zlock *lock)
@@ -64,6 +70,21 @@ static inline void spin_unlock_zlock(zlock *lock)
 	spin_unlock(&lock->guard);
 }
 
+/* start optimistic (lockless) read of the node protected by @lock. Returns
+   odd value if node is write locked at the moment. */
+static inline unsigned zlock_read_begin(const zlock *lock)
+{
+	return raw_read_seqcount(&lock->seq);
+}
+
+/* true if node protected by @lock was write locked since
+   zlock_read_begin() returned @seq, that is, data read should be
+   discarded. */
+static inline int zlock_read_retry(const zlock *lock, unsigned seq)
+{
+	return (seq & 1) || read_seqcount_retry(&lock->seq, seq);
+}
+
 #define lock_is_locked(lock)          ((lock)->nr_readers != 0)
 #define lock_is_rlocked(lock)         ((lock)->nr_readers > 0)
 #define lock_is_wlocked(lock)         ((lock)->nr_readers < 0)
@@ -94,6 +115,9 @@ struct lock_handle {
 	struct list_head locks_link;
 	/* A list of all owners for a znode */
 	struct list_head owners_link;
+	/* local_clock() when the lock was acquired, for hold time
+	   statistics */
+	u64 locked_at;
 };
 
 struct lock_request {
@@ -0,0 +1,425 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by
+ * reiser4/README */
+
+/* Segments of log transaction model.
+
+   Log transaction model (txmod=log) relocates every dirty node, like
+   write-anywhere one does, but instead of looking for free blocks near the
+   node's neighbors it writes nodes at the head of a log. The log head moves
+   sequentially through segments of the disk, so that the device sees mostly
+   sequential writes. This is what SMR disks and cheap flash want.
+
+   Segment is the area covered by one bitmap block, so bitmap nodes count busy
+   blocks of segments at no additional cost (see nr_busy of struct bitmap_node
+   in plugin/space/bitmap.c). When the head leaves a segment it jumps to the
+   next segment which is empty enough. Free blocks behind the head are reused
+   only when the head comes to them again.
+
+   Partly free segments are compacted by the log cleaner, a kernel thread which
+   looks for the least busy segment among bitmaps in memory and walks twig level
+   of the tree: formatted nodes pointed from twigs which live in that segment
+   are made dirty, and flush relocates them to the head. There is no reverse
+   map, so unformatted nodes and nodes above twig level are not moved by the
+   cleaner, they leave the segment when they are modified. */
+
+#include "debug.h"
+#include "dformat.h"
+#include "key.h"
+#include "coord.h"
+#include "tree.h"
+#include "znode.h"
+#include "txnmgr.h"
+#include "block_alloc.h"
+#include "context.h"
+#include "super.h"
+#include "logseg.h"
+#include "plugin/item/item.h"
+#include "plugin/space/bitmap.h"
+
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+
+/* how often the cleaner looks for a segment to clean */
+#define LOG_CLEANER_PERIOD (30 * HZ)
+/* segments less than 1/LOG_VICTIM_RATIO busy are cleaned */
+#define LOG_VICTIM_RATIO (2)
+/* segments less than 1/LOG_HEAD_RATIO busy are written by the head */
+#define LOG_HEAD_RATIO (4)
+/* how many segments the head looks through for an empty enough one */
+#define LOG_LOOKAHEAD (16)
+
+static struct log_segments *get_log(struct super_block *super)
+{
+	struct log_segments *log = get_super_private(super)->logseg;
+
+	assert("edward-2374", log != NULL);
+	return log;
+}
+
+/* plugin/txmod.c uses this as a search start for relocated nodes */
+void reiser4_log_hint(reiser4_blocknr_hint *hint)
+{
+	struct log_segments *log = get_log(reiser4_get_current_sb());
+
+	spin_lock(&log->guard);
+	hint->blk = log->head;
+	spin_unlock(&log->guard);
+	hint->max_dist = 0;
+}
+
+/* find a segment starting from @seg, which is empty enough for the head */
+static __u64 log_next_segment(struct super_block *super,
+			      struct log_segments *log, __u64 seg)
+{
+	__u64 victim;
+	__u64 i;
+
+	spin_lock(&log->guard);
+	victim = log->victim;
+	spin_unlock(&log->guard);
+
+	for (i = 0; i < LOG_LOOKAHEAD && i < log->nr_segs; i++) {
+		reiser4_block_nr start;
+		reiser4_block_nr len;
+		__u64 busy;
+		__u64 s = seg + i;
+
+		if (s >= log->nr_segs)
+			s -= log->nr_segs;
+		if (s == victim)
+			continue;
+		reiser4_bitmap_segment(super, s, &start, &len);
+		if (reiser4_bitmap_segment_busy(super, s, 1, &busy) == 0 &&
+		    busy * LOG_HEAD_RATIO <= len)
+			return s;
+	}
+	/* all segments around are busy, do not jump over them */
+	return seg;
+}
+
+/**
+ * reiser4_log_advance - move log head
+ * @last: last block allocated at the head
+ *
+ * Called by log txmod after allocation from the search start given by
+ * reiser4_log_hint(). When the head leaves its segment, the next segment
+ * which is empty enough is chosen.
+ */
+void reiser4_log_advance(const reiser4_block_nr *last)
+{
+	struct super_block *super = reiser4_get_current_sb();
+	struct log_segments *log = get_log(super);
+	reiser4_block_nr head;
+	reiser4_block_nr len;
+	__u64 seg;
+	__u64 next;
+	int wrapped;
+
+	head = *last + 1;
+	if (head >= reiser4_block_count(super))
+		head = 0;
+	seg = reiser4_bitmap_segment_of(&head);
+
+	spin_lock(&log->guard);
+	if (seg == log->seg) {
+		log->head = head;
+		spin_unlock(&log->guard);
+		return;
+	}
+	spin_unlock(&log->guard);
+
+	next = log_next_segment(super, log, seg);
+	if (next != seg)
+		reiser4_bitmap_segment(super, next, &head, &len);
+
+	spin_lock(&log->guard);
+	wrapped = next < log->seg;
+	log->head = head;
+	log->seg = next;
+	spin_unlock(&log->guard);
+
+	if (wrapped) {
+		/* the head came back to segments written before, time to
+		   clean them */
+		reiser4_stat_inc(super, REISER4_STAT_LOG_WRAPS);
+		wake_up(&log->wait);
+	}
+}
+
+/* choose the least busy segment of ones which bitmaps are in memory */
+static __u64 log_choose_victim(struct super_block *super,
+			       struct log_segments *log)
+{
+	__u64 victim = log->nr_segs;
+	__u64 least = ~0ULL;
+	__u64 head;
+	__u64 s;
+
+	spin_lock(&log->guard);
+	head = log->seg;
+	spin_unlock(&log->guard);
+
+	for (s = 0; s < log->nr_segs; s++) {
+		reiser4_block_nr start;
+		reiser4_block_nr len;
+		__u64 busy;
+
+		if (s == head ||
+		    reiser4_bitmap_segment_busy(super, s, 0, &busy) != 0)
+			continue;
+		reiser4_bitmap_segment(super, s, &start, &len);
+		if (busy != 0 && busy * LOG_VICTIM_RATIO < len &&
+		    busy < least) {
+			least = busy;
+			victim = s;
+		}
+	}
+	return victim;
+}
+
+/* make @child pointed by @coord in @twig dirty, so that flush relocates it to
+   the log head */
+static int log_move_node(const coord_t *coord, znode *twig)
+{
+	lock_handle lh;
+	znode *child;
+	int ret;
+
+	child = child_znode(coord, twig, 0, 0);
+	if (IS_ERR(child))
+		return PTR_ERR(child);
+
+	init_lh(&lh);
+	ret = longterm_lock_znode(&lh, child, ZNODE_WRITE_LOCK,
+				  ZNODE_LOCK_LOPRI);
+	if (ret == 0) {
+		ret = zload(child);
+		if (ret == 0) {
+			if (!ZF_ISSET(child, JNODE_DIRTY) &&
+			    reiser4_grab_space_force(1, BA_RESERVED) == 0) {
+				znode_make_dirty(child);
+				reiser4_stat_inc(znode_get_tree(child)->super,
+						 REISER4_STAT_LOG_MOVED);
+			}
+			zrelse(child);
+		}
+	}
+	done_lh(&lh);
+	zput(child);
+	return ret;
+}
+
+/*
+ * Moves children of the twig at @key which live in [@start, @start + @len).
+ * Sets @key to the key of the next twig. Returns 1 when there are no more
+ * twigs.
+ */
+static int log_clean_twig(reiser4_tree *tree, reiser4_key *key,
+			  reiser4_block_nr start, reiser4_block_nr len)
+{
+	coord_t coord;
+	lock_handle lh;
+	reiser4_key next;
+	znode *twig;
+	int ret;
+
+	init_lh(&lh);
+	ret = coord_by_key(tree, key, &coord, &lh, ZNODE_READ_LOCK,
+			   FIND_MAX_NOT_MORE_THAN, TWIG_LEVEL, TWIG_LEVEL, 0,
+			   NULL);
+	if (IS_CBKERR(ret)) {
+		done_lh(&lh);
+		return ret;
+	}
+	twig = coord.node;
+	ret = zload(twig);
+	if (ret) {
+		done_lh(&lh);
+		return ret;
+	}
+	for_all_items(&coord, twig) {
+		reiser4_block_nr child;
+
+		if (!item_is_internal(&coord))
+			continue;
+		item_plugin_by_coord(&coord)->s.internal.down_link(&coord,
+								   NULL,
+								   &child);
+		if (child < start || child >= start + len)
+			continue;
+		ret = log_move_node(&coord, twig);
+		if (ret)
+			break;
+	}
+	read_lock_dk(tree);
+	next = *znode_get_rd_key(twig);
+	read_unlock_dk(tree);
+	zrelse(twig);
+	done_lh(&lh);
+
+	/* nodes which can not be locked now are left in the segment */
+	if (ret == -E_DEADLOCK || ret == -E_REPEAT || ret == -EINVAL)
+		ret = 0;
+	if (ret == 0) {
+		if (keyeq(&next, reiser4_max_key()) || !keygt(&next, key))
+			ret = 1;
+		else
+			*key = next;
+	}
+	return ret;
+}
+
+static int log_clean_segment(struct super_block *super, __u64 victim)
+{
+	reiser4_tree *tree = &get_super_private(super)->tree;
+	reiser4_block_nr start;
+	reiser4_block_nr len;
+	reiser4_key key;
+	int ret;
+
+	if (tree->height < TWIG_LEVEL)
+		return 0;
+	reiser4_bitmap_segment(super, victim, &start, &len);
+
+	key = *reiser4_min_key();
+	do {
+		ret = log_clean_twig(tree, &key, start, len);
+		all_grabbed2free();
+		/* do not let atom of the cleaner grow */
+		reiser4_txn_restart_current();
+	} while (ret == 0 && !kthread_should_stop());
+	return ret < 0 ? ret : 0;
+}
+
+static void log_clean(struct super_block *super, struct log_segments *log)
+{
+	reiser4_context *ctx;
+	__u64 victim;
+	int ret;
+
+	ctx = reiser4_init_context(super);
+	if (IS_ERR(ctx))
+		return;
+
+	victim = log_choose_victim(super, log);
+	if (victim != log->nr_segs) {
+		/* keep the head away from the victim until the cleaner
+		   chooses another one */
+		spin_lock(&log->guard);
+		log->victim = victim;
+		spin_unlock(&log->guard);
+
+		reiser4_stat_inc(super, REISER4_STAT_LOG_CLEANED);
+		ret = log_clean_segment(super, victim);
+		if (ret)
+			warning("edward-2375", "log cleaner failed (%d)", ret);
+	}
+	reiser4_exit_context(ctx);
+}
+
+#define set_comm(state) 						\
+	snprintf(current->comm, sizeof(current->comm),			\
+		  "logclean:%s:%s", (super)->s_id, (state))
+
+/* log cleaner thread function */
+static int log_cleaner(void *arg)
+{
+	struct super_block *super = arg;
+	struct log_segments *log = get_log(super);
+	int done = 0;
+
+	/* see comment in ktxnmgrd() */
+	current->journal_info = NULL;
+	while (1) {
+		try_to_freeze();
+		set_comm("wait");
+		{
+			DEFINE_WAIT(__wait);
+
+			prepare_to_wait(&log->wait, &__wait,
+					TASK_INTERRUPTIBLE);
+			if (kthread_should_stop())
+				done = 1;
+			else
+				schedule_timeout(LOG_CLEANER_PERIOD);
+			finish_wait(&log->wait, &__wait);
+		}
+		if (done)
+			break;
+		if (sb_rdonly(super))
+			continue;
+		set_comm("run");
+		log_clean(super, log);
+	}
+	return 0;
+}
+
+#undef set_comm
+
+/**
+ * reiser4_init_log_cleaner - initialize log segments and start the cleaner
+ * @super: super block to initialize log segments of
+ *
+ * Does nothing unless the file system is mounted with log transaction model.
+ * This is called on mount, after disk format plugin initialized the space
+ * allocator.
+ */
+int reiser4_init_log_cleaner(struct super_block *super)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+	struct log_segments *log;
+
+	if (sbinfo->txmod != LOG_TXMOD_ID)
+		return 0;
+
+	assert("edward-2376", sbinfo->logseg == NULL);
+
+	log = kzalloc(sizeof(*log), reiser4_ctx_gfp_mask_get());
+	if (log == NULL)
+		return RETERR(-ENOMEM);
+
+	spin_lock_init(&log->guard);
+	init_waitqueue_head(&log->wait);
+	log->nr_segs = reiser4_bitmap_nr_segments(super);
+	log->victim = log->nr_segs;
+	sbinfo->logseg = log;
+
+	log->tsk = kthread_run(log_cleaner, super, "logclean:%s",
+			       super->s_id);
+	if (IS_ERR(log->tsk)) {
+		int ret = PTR_ERR(log->tsk);
+
+		sbinfo->logseg = NULL;
+		kfree(log);
+		return RETERR(ret);
+	}
+	return 0;
+}
+
+/**
+ * reiser4_done_log_cleaner - stop the cleaner
+ * @super: super block to stop the cleaner of
+ *
+ * This is called on umount. Nodes made dirty by the cleaner are committed.
+ */
+void reiser4_done_log_cleaner(struct super_block *super)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	if (sbinfo->logseg == NULL)
+		return;
+	kthread_stop(sbinfo->logseg->tsk);
+	txnmgr_force_commit_all(super, 0);
+	kfree(sbinfo->logseg);
+	sbinfo->logseg = NULL;
+}
+
+/* Make Linus happy.
+   Local variables:
+   c-indentation-style: "K&R"
+   mode-name: "LC"
+   c-basic-offset: 8
+   tab-width: 8
+   fill-column: 120
+   End:
+*/
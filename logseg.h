@@ -0,0 +1,51 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by
+ * reiser4/README */
+
+/* Segments of log transaction model. See logseg.c for comments. */
+
+#ifndef __REISER4_LOGSEG_H__
+#define __REISER4_LOGSEG_H__
+
+#include "forward.h"
+#include "dformat.h"
+
+#include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>	/* for struct task_struct */
+
+struct log_segments {
+	/* spin lock protecting @head, @seg and @victim */
+	spinlock_t guard;
+	/* block to start search of free blocks for relocated nodes from */
+	reiser4_block_nr head;
+	/* segment @head is in */
+	__u64 seg;
+	/* number of segments */
+	__u64 nr_segs;
+	/* segment which nodes the cleaner moves, skipped by @head */
+	__u64 victim;
+	/* the cleaner sleeps here */
+	wait_queue_head_t wait;
+	/* cleaner kernel thread */
+	struct task_struct *tsk;
+};
+
+extern int reiser4_init_log_cleaner(struct super_block *);
+extern void reiser4_done_log_cleaner(struct super_block *);
+
+extern void reiser4_log_hint(reiser4_blocknr_hint *);
+extern void reiser4_log_advance(const reiser4_block_nr *last);
+
+/* __REISER4_LOGSEG_H__ */
+#endif
+
+/* Make Linus happy.
+   Local variables:
+   c-indentation-style: "K&R"
+   mode-name: "LC"
+   c-basic-offset: 8
+   tab-width: 8
+   fill-column: 120
+   End:
+*/
@@ -210,7 +210,6 @@ static struct address_space_operations formatted_fake_as_ops;
 
 static const oid_t fake_ino = 0x1;
 static const oid_t bitmap_ino = 0x2;
-static const oid_t cc_ino = 0x3;
 
 static void
 init_fake_inode(struct super_block *super, struct inode *fake,
@@ -235,7 +234,6 @@ int reiser4_init_formatted_fake(struct super_block *super)
 {
 	struct inode *fake;
 	struct inode *bitmap;
-	struct inode *cc;
 	reiser4_super_info_data *sinfo;
 
 	assert("nikita-1703", super != NULL);
@@ -249,21 +247,10 @@ int reiser4_init_formatted_fake(struct super_block *super)
 		bitmap = iget_locked(super, oid_to_ino(bitmap_ino));
 		if (bitmap != NULL) {
 			init_fake_inode(super, bitmap, &sinfo->bitmap);
-
-			cc = iget_locked(super, oid_to_ino(cc_ino));
-			if (cc != NULL) {
-				init_fake_inode(super, cc, &sinfo->cc);
-				return 0;
-			} else {
-				iput(sinfo->fake);
-				iput(sinfo->bitmap);
-				sinfo->fake = NULL;
-				sinfo->bitmap = NULL;
-			}
-		} else {
-			iput(sinfo->fake);
-			sinfo->fake = NULL;
+			return 0;
 		}
+		iput(sinfo->fake);
+		sinfo->fake = NULL;
 	}
 	return RETERR(-ENOMEM);
 }
@@ -290,11 +277,6 @@ void reiser4_done_formatted_fake(struct super_block *super)
 		iput(sinfo->bitmap);
 		sinfo->bitmap = NULL;
 	}
-
-	if (sinfo->cc != NULL) {
-		iput(sinfo->cc);
-		sinfo->cc = NULL;
-	}
 	return;
 }
 
@@ -574,7 +556,6 @@ truncate_jnodes_range(struct inode *inode, pgoff_t from, pgoff_t count)
 {
 	reiser4_inode *info;
 	int truncated_jnodes;
-	reiser4_tree *tree;
 	unsigned long index;
 	unsigned long end;
 
@@ -591,7 +572,6 @@ truncate_jnodes_range(struct inode *inode, pgoff_t from, pgoff_t count)
 	truncated_jnodes = 0;
 
 	info = reiser4_inode_data(inode);
-	tree = reiser4_tree_by_inode(inode);
 
 	index = from;
 	end = from + count;
@@ -604,7 +584,7 @@ truncate_jnodes_range(struct inode *inode, pgoff_t from, pgoff_t count)
 
 		assert("nikita-3466", index <= end);
 
-		read_lock_tree(tree);
+		spin_lock(&info->jnodes_guard);
 		taken =
 		    radix_tree_gang_lookup(jnode_tree_by_reiser4_inode(info),
 					   (void **)gang, index,
@@ -616,7 +596,7 @@ truncate_jnodes_range(struct inode *inode, pgoff_t from, pgoff_t count)
 			else
 				gang[i] = NULL;
 		}
-		read_unlock_tree(tree);
+		spin_unlock(&info->jnodes_guard);
 
 		for (i = 0; i < taken; ++i) {
 			node = gang[i];
@@ -0,0 +1,172 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by
+ * reiser4/README */
+
+/* Block placement policy plugins */
+
+/*
+ * Nodes which have no preceder (new nodes, or relocated ones whose left
+ * neighbor is not known to flush) and blocks allocated with
+ * BA_USE_DEFAULT_SEARCH_START are placed starting from the "default" hint
+ * (see get_blocknr_hint_default()).
+ *
+ * Currently following policies are implemented:
+ *
+ *  "global": one hint per file system (default), which follows the last
+ *  written location. All writers and flushes start their search from the
+ *  same bitmap block and queue on its mutex.
+ *
+ *  "percpu": an allocation cursor per cpu. Cursors are spread evenly over
+ *  the disk at mount, so that parallel flushes running on different cpus
+ *  allocate in different bitmap blocks. Then each cursor follows allocations
+ *  made on its cpu. Writes are not tracked: in-place writes of overwrite set,
+ *  super block and journal control blocks, done by committer or ktxnmgrd,
+ *  would move cursors away from their areas.
+ */
+
+#include "../debug.h"
+#include "../dformat.h"
+#include "../super.h"
+#include "plugin.h"
+
+#include <linux/percpu.h>
+#include <linux/math64.h>
+
+static void get_hint_global(const struct super_block *super,
+			    reiser4_block_nr *blk)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	spin_lock_reiser4_super(sbinfo);
+	*blk = sbinfo->blocknr_hint_default;
+	spin_unlock_reiser4_super(sbinfo);
+}
+
+static void update_hint_global(const struct super_block *super,
+			       const reiser4_block_nr *blk)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	spin_lock_reiser4_super(sbinfo);
+	sbinfo->blocknr_hint_default = *blk;
+	spin_unlock_reiser4_super(sbinfo);
+}
+
+/* the first block of area of the disk @cpu allocates from initially */
+static reiser4_block_nr cursor_start(const struct super_block *super, int cpu)
+{
+	return div_u64(reiser4_block_count(super), nr_cpu_ids) * cpu;
+}
+
+static int init_percpu(struct super_block *super)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+	int cpu;
+
+	sbinfo->alloc_cursors = alloc_percpu(reiser4_block_nr);
+	if (sbinfo->alloc_cursors == NULL)
+		return RETERR(-ENOMEM);
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sbinfo->alloc_cursors, cpu) =
+			cursor_start(super, cpu);
+	return 0;
+}
+
+static void done_percpu(struct super_block *super)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	free_percpu(sbinfo->alloc_cursors);
+	sbinfo->alloc_cursors = NULL;
+}
+
+/*
+ * Cursors are accessed without locking: a thread can migrate to another cpu
+ * or race with another thread of the same cpu, which only makes placement a
+ * bit worse. Torn value on 32-bit architectures is caught by range check,
+ * which also wraps a cursor that reached the end of disk.
+ */
+static void get_hint_percpu(const struct super_block *super,
+			    reiser4_block_nr *blk)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+	reiser4_block_nr *cursor;
+
+	cursor = raw_cpu_ptr(sbinfo->alloc_cursors);
+	*blk = READ_ONCE(*cursor);
+	if (unlikely(*blk >= reiser4_block_count(super)))
+		*blk = cursor_start(super, raw_smp_processor_id());
+}
+
+/* next search on this cpu starts right after the allocated extent */
+static void allocated_percpu(const struct super_block *super,
+			     const reiser4_block_nr *start,
+			     const reiser4_block_nr *len)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	WRITE_ONCE(*raw_cpu_ptr(sbinfo->alloc_cursors), *start + *len);
+}
+
+static int init_noop(struct super_block *super UNUSED_ARG)
+{
+	return 0;
+}
+
+static void done_noop(struct super_block *super UNUSED_ARG)
+{
+}
+
+static void update_hint_noop(const struct super_block *super UNUSED_ARG,
+			     const reiser4_block_nr *blk UNUSED_ARG)
+{
+}
+
+static void allocated_noop(const struct super_block *super UNUSED_ARG,
+			   const reiser4_block_nr *start UNUSED_ARG,
+			   const reiser4_block_nr *len UNUSED_ARG)
+{
+}
+
+/* block placement policy plugins */
+alloc_policy_plugin alloc_policy_plugins[LAST_ALLOC_POLICY_ID] = {
+	[GLOBAL_ALLOC_POLICY_ID] = {
+		.h = {
+			.type_id = REISER4_ALLOC_POLICY_PLUGIN_TYPE,
+			.id = GLOBAL_ALLOC_POLICY_ID,
+			.pops = NULL,
+			.label = "global",
+			.desc = "Single allocation cursor",
+			.linkage = {NULL, NULL}
+		},
+		.init = init_noop,
+		.done = done_noop,
+		.get_hint = get_hint_global,
+		.update_hint = update_hint_global,
+		.allocated = allocated_noop
+	},
+	[PERCPU_ALLOC_POLICY_ID] = {
+		.h = {
+			.type_id = REISER4_ALLOC_POLICY_PLUGIN_TYPE,
+			.id = PERCPU_ALLOC_POLICY_ID,
+			.pops = NULL,
+			.label = "percpu",
+			.desc = "Allocation cursor per cpu",
+			.linkage = {NULL, NULL}
+		},
+		.init = init_percpu,
+		.done = done_percpu,
+		.get_hint = get_hint_percpu,
+		.update_hint = update_hint_noop,
+		.allocated = allocated_percpu
+	}
+};
+
+/*
+ * Local variables:
+ * c-indentation-style: "K&R"
+ * mode-name: "LC"
+ * c-basic-offset: 8
+ * tab-width: 8
+ * fill-column: 79
+ * End:
+ */
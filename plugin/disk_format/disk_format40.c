@@ -155,6 +155,9 @@ static struct buffer_head *find_a_disk_format40_super_block(struct super_block
 	reiser4_set_data_blocks(s, le64_to_cpu(get_unaligned(&disk_sb->block_count)) -
 				le64_to_cpu(get_unaligned(&disk_sb->free_blocks)));
 	reiser4_set_free_blocks(s, le64_to_cpu(get_unaligned(&disk_sb->free_blocks)));
+	/* this has to be known before journal replay */
+	if (get_format40_flags(disk_sb) & (1 << FORMAT40_TX_CSUM))
+		get_super_private(s)->fs_flags |= (1 << REISER4_TX_CSUM);
 
 	return super_bh;
 }
@@ -354,6 +357,17 @@ static int try_init_format40(struct super_block *super,
 
 	/* initialize reiser4_super_info_data */
 	sbinfo = get_super_private(super);
+	if (sbinfo->node_plugin != LAST_NODE_ID &&
+	    sbinfo->node_plugin != nplug->h.id) {
+		/* "node" mount option: nodes of the plugin set by mkfs stay
+		   on disk, so that plugin of each node has to be taken from
+		   its header, see znode_guess_plugin() */
+		nplug = node_plugin_by_id(sbinfo->node_plugin);
+		printk("reiser4: %s: new nodes are of %s layout, volume "
+		       "can not be mounted by kernels without it.\n",
+		       super->s_id, nplug->h.label);
+	} else
+		sbinfo->node_plugin = LAST_NODE_ID;
 	assert("", sbinfo->tree.super == super);
 	/* init reiser4_tree for the filesystem */
 	result = reiser4_init_tree(&sbinfo->tree, &root_block, height, nplug);
@@ -383,10 +397,10 @@ static int try_init_format40(struct super_block *super,
 	sbinfo->fsuid = 0;
 	sbinfo->fs_flags |= (1 << REISER4_ADG);	/* hard links for directories
 						 * are not supported */
-	sbinfo->fs_flags |= (1 << REISER4_ONE_NODE_PLUGIN);	/* all nodes in
-								 * layout 40 are
-								 * of one
-								 * plugin */
+	/* all nodes in layout 40 are of one plugin, unless "node" mount
+	   option was given */
+	if (sbinfo->node_plugin == LAST_NODE_ID)
+		sbinfo->fs_flags |= (1 << REISER4_ONE_NODE_PLUGIN);
 	/* sbinfo->tmgr is initialized already */
 
 	/* recover sb data which were logged separately from sb block */
@@ -513,6 +527,8 @@ jnode *log_super_format40(struct super_block *s)
 
 	sb_jnode = get_super_private(s)->u.format40.sb_jnode;
 
+	/* super block can be in overwrite set of previous atom */
+	reiser4_wait_write_back(sb_jnode);
 	jload(sb_jnode);
 
 	pack_format40_super(s, jdata(sb_jnode));
@@ -21,7 +21,10 @@
 #include <linux/fs.h>		/* for struct super_block  */
 
 typedef enum {
-	FORMAT40_LARGE_KEYS
+	FORMAT40_LARGE_KEYS,
+	/* transaction records carry checksums, so that journal header can be
+	   written together with the log */
+	FORMAT40_TX_CSUM
 } format40_flags;
 
 /* ondisk super block for format 40. It is 512 bytes long */
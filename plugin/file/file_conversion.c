@@ -548,6 +548,9 @@ ssize_t reiser4_write_dispatch(struct file *file, const char __user *buf,
 	ctx = reiser4_init_context(inode->i_sb);
 	if (IS_ERR(ctx))
 		return PTR_ERR(ctx);
+	if ((file->f_flags & O_DSYNC) || IS_SYNC(inode) ||
+	    reiser4_inode_isolated(inode))
+		ctx->isolated = 1;
 	current->backing_dev_info = inode_to_bdi(inode);
 	init_dispatch_context(&cont);
 	inode_lock(inode);
@@ -71,6 +71,12 @@ int reiser4_sync_common(struct file *file, loff_t start,
  * dirtied through mmap. Fortunately sys_fsync() first calls
  * filemap_fdatawrite() that will ultimately call reiser4_writepages_dispatch,
  * insert all missing extents and capture anonymous pages.
+ *
+ * Atom of the file can be fused with atoms of unrelated writers, so that
+ * committing it means writing their dirty data as well. To avoid that next
+ * time, the file is marked REISER4_FSYNC_ISOLATED: its further modifications
+ * go to atoms which other atoms wait for instead of fusing with them, until
+ * the file is not fsync-ed for REISER4_FSYNC_ISOLATED_TIME.
  */
 int reiser4_sync_file_common(struct file *file, loff_t start, loff_t end, int datasync)
 {
@@ -90,6 +96,10 @@ int reiser4_sync_file_common(struct file *file, loff_t start, loff_t end, int da
 
 	inode_lock(inode);
 
+	WRITE_ONCE(reiser4_inode_data(inode)->fsync_time, jiffies);
+	reiser4_inode_set_flag(inode, REISER4_FSYNC_ISOLATED);
+	ctx->isolated = 1;
+
 	reserve = estimate_update_common(dentry->d_inode);
 	if (reiser4_grab_space(reserve, BA_CAN_COMMIT)) {
 		reiser4_exit_context(ctx);
@@ -284,6 +284,70 @@ static int dir_rewind(struct file *dir, loff_t *fpos, struct readdir_pos *pos, t
 	return result;
 }
 
+/* stat-data keys of the objects returned by readdir are collected in batches
+ * of this size. Stat-data of each batch is found by single batched tree
+ * lookup (see reiser4_sd_lookup()) and inodes are loaded into inode cache, so
+ * that lookups of the entries following readdir find them there. This is done
+ * only for directories which readdir was followed by lookups of their entries
+ * last time, so that readdir of callers not interested in stat-data does not
+ * read it synchronously (see readdir_sd_batch_alloc()). */
+#define READDIR_SD_BATCH (64)
+
+struct readdir_sd_batch {
+	int nr;
+	reiser4_key keys[READDIR_SD_BATCH];
+	sd_hint_t hints[READDIR_SD_BATCH];
+};
+
+/* decide whether stat-data of entries of @dir is to be read ahead on this
+   readdir, and allocate batch for that. Directory scan from position @pos */
+static struct readdir_sd_batch *readdir_sd_batch_alloc(struct inode *dir,
+						       loff_t pos)
+{
+	struct readdir_sd_batch *batch;
+
+	if (pos == 0) {
+		/* new scan of directory. If nothing was looked up in it after
+		   the previous one, stop reading stat-data ahead */
+		if (reiser4_inode_get_flag(dir, REISER4_READDIR_PENDING))
+			reiser4_inode_clr_flag(dir, REISER4_READDIR_SD_RA);
+		reiser4_inode_set_flag(dir, REISER4_READDIR_PENDING);
+	}
+	if (!reiser4_inode_get_flag(dir, REISER4_READDIR_SD_RA))
+		return NULL;
+	/* stat-data readahead is optional */
+	batch = kmalloc(sizeof(*batch),
+			reiser4_ctx_gfp_mask_get() | __GFP_NOWARN);
+	if (batch != NULL)
+		batch->nr = 0;
+	return batch;
+}
+
+/* load inodes of stat-data collected in @batch. No locks can be held. */
+static void readdir_sd_load(struct readdir_sd_batch *batch)
+{
+	struct super_block *super;
+	struct inode *inode;
+	int i;
+
+	if (batch == NULL)
+		return;
+	super = reiser4_get_current_sb();
+	reiser4_sd_lookup(current_tree, batch->keys, batch->hints, batch->nr);
+	for (i = 0; i < batch->nr; ++i) {
+		/* this is readahead: do not traverse tree for stat-data which
+		 * was not found by batched lookup, errors are ignored */
+		if (!reiser4_seal_is_set(&batch->hints[i].seal))
+			continue;
+		inode = reiser4_iget_hint(super, &batch->hints[i], 1);
+		if (IS_ERR(inode))
+			continue;
+		reiser4_iget_complete(inode);
+		iput(inode);
+	}
+	batch->nr = 0;
+}
+
 /*
  * Function that is called by common_readdir() on each directory entry while
  * doing readdir. ->filldir callback may block, so we had to release long term
@@ -297,7 +361,8 @@ static int dir_rewind(struct file *dir, loff_t *fpos, struct readdir_pos *pos, t
  * unlocked.
  */
 static int
-feed_entry(tap_t *tap, struct dir_context *context)
+feed_entry(tap_t *tap, struct dir_context *context,
+	   struct readdir_sd_batch *batch)
 {
 	item_plugin *iplug;
 	char *name;
@@ -357,10 +422,16 @@ feed_entry(tap_t *tap, struct dir_context *context)
 		      oid_to_uino(get_key_objectid(&sd_key)), file_type))
 		/* ->filldir() is satisfied. (no space in buffer, IOW) */
 		result = 1;
-	else
+	else {
+		if (batch != NULL) {
+			batch->keys[batch->nr++] = sd_key;
+			if (batch->nr == READDIR_SD_BATCH)
+				readdir_sd_load(batch);
+		}
 		result = reiser4_seal_validate(&seal, coord, &entry_key,
 					       tap->lh, tap->mode,
 					       ZNODE_LOCK_HIPRI);
+	}
 
 	if (local_name != name_buf)
 		kfree(local_name);
@@ -569,6 +640,7 @@ int reiser4_iterate_common(struct file *f /* directory file being read */,
 	lock_handle lh;
 	tap_t tap;
 	struct readdir_pos *pos;
+	struct readdir_sd_batch *batch;
 
 	assert("nikita-1359", f != NULL);
 	inode = file_inode(f);
@@ -581,6 +653,8 @@ int reiser4_iterate_common(struct file *f /* directory file being read */,
 	if (IS_ERR(ctx))
 		return PTR_ERR(ctx);
 
+	batch = readdir_sd_batch_alloc(inode, context->pos);
+
 	coord_init_zero(&coord);
 	init_lh(&lh);
 	reiser4_tap_init(&tap, &coord, &lh, ZNODE_READ_LOCK);
@@ -599,7 +673,7 @@ repeat:
 			assert("nikita-2572", coord_is_existing_unit(coord));
 			assert("nikita-3227", is_valid_dir_coord(inode, coord));
 
-			result = feed_entry(&tap, context);
+			result = feed_entry(&tap, context, batch);
 			if (result > 0) {
 				break;
 			} else if (result == 0) {
@@ -634,6 +708,9 @@ repeat:
 	reiser4_tap_done(&tap);
 	reiser4_detach_fsdata(f);
 
+	readdir_sd_load(batch);
+	kfree(batch);
+
 	/* try to update directory's atime */
 	if (reiser4_grab_space_force(inode_file_plugin(inode)->estimate.update(inode),
 			       BA_CAN_COMMIT) != 0)
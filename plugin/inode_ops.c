@@ -95,6 +95,12 @@ struct dentry *reiser4_lookup_common(struct inode *parent,
 	}
 
 	/* success */
+	if (reiser4_inode_get_flag(parent, REISER4_READDIR_PENDING)) {
+		/* readdir of @parent is followed by lookups (stat of the
+		   entries, most likely) */
+		reiser4_inode_clr_flag(parent, REISER4_READDIR_PENDING);
+		reiser4_inode_set_flag(parent, REISER4_READDIR_SD_RA);
+	}
 	check_light_weight(inode, parent);
 	new = d_splice_alias(inode, dentry);
 	reiser4_iget_complete(inode);
@@ -91,6 +91,7 @@ node_plugin node_plugins[LAST_NODE_ID] = {
 		.item_overhead = item_overhead_node40,
 		.free_space = free_space_node40,
 		.lookup = lookup_node40,
+		.peek_child = peek_child_node40,
 		.num_of_items = num_of_items_node40,
 		.item_by_coord = item_by_coord_node40,
 		.length_by_coord = length_by_coord_node40,
@@ -129,6 +130,7 @@ node_plugin node_plugins[LAST_NODE_ID] = {
 		.item_overhead = item_overhead_node40,
 		.free_space = free_space_node40,
 		.lookup = lookup_node40,
+		.peek_child = peek_child_node40,
 		.num_of_items = num_of_items_node40,
 		.item_by_coord = item_by_coord_node40,
 		.length_by_coord = length_by_coord_node40,
@@ -155,6 +157,46 @@ node_plugin node_plugins[LAST_NODE_ID] = {
 		.prepare_removal = prepare_removal_node40,
 		.set_item_plugin = set_item_plugin_node40,
 		.csum = csum_node41
+	},
+	[NODE42_ID] = {
+		.h = {
+			.type_id = REISER4_NODE_PLUGIN_TYPE,
+			.id = NODE42_ID,
+			.pops = NULL,
+			.label = "node42",
+			.desc = "node41 layout with prefix compressed keys",
+			.linkage = {NULL, NULL}
+		},
+		.item_overhead = item_overhead_node42,
+		.free_space = free_space_node40,
+		.lookup = lookup_node42,
+		.peek_child = peek_child_node42,
+		.num_of_items = num_of_items_node40,
+		.item_by_coord = item_by_coord_node40,
+		.length_by_coord = length_by_coord_node40,
+		.plugin_by_coord = plugin_by_coord_node40,
+		.key_at = key_at_node40,
+		.estimate = estimate_node40,
+		.check = NULL,
+		.parse = parse_node42,
+		.init = init_node42,
+#ifdef GUESS_EXISTS
+		.guess = guess_node42,
+#endif
+		.change_item_size = change_item_size_node40,
+		.create_item = create_item_node40,
+		.update_item_key = update_item_key_node40,
+		.cut_and_kill = kill_node40,
+		.cut = cut_node40,
+		.shift = shift_node42,
+		.shrink_item = shrink_item_node40,
+		.fast_insert = fast_insert_node40,
+		.fast_paste = fast_paste_node40,
+		.fast_cut = fast_cut_node40,
+		.max_item_size = max_item_size_node42,
+		.prepare_removal = prepare_removal_node40,
+		.set_item_plugin = set_item_plugin_node40,
+		.csum = csum_node41
 	}
 };
 
@@ -145,6 +145,15 @@ typedef struct node_plugin {
 	   that item to see if it is in there */
 	 node_search_result(*lookup) (znode * node, const reiser4_key * key,
 				      lookup_bias bias, coord_t * coord);
+	/* find the block number of the child of internal @node that may
+	   contain @key. Unlike ->lookup() this is called on a loaded, but
+	   not locked node, so it has to cope with node content changing
+	   under it: it shouldn't assert anything about the content and
+	   should return error if something looks inconsistent. The caller
+	   validates the result (see search.c:cbk_optimistic_descent()).
+	   Optional. */
+	int (*peek_child) (znode * node, const reiser4_key * key,
+			   reiser4_block_nr * block);
 	/* number of items in node */
 	int (*num_of_items) (const znode * node);
 
@@ -242,6 +251,7 @@ typedef enum {
 	NODE40_ID, /* standard unified node layout used for both,
 		      leaf and internal nodes */
 	NODE41_ID, /* node layout with a checksum */
+	NODE42_ID, /* node41 layout with prefix compressed keys */
 	LAST_NODE_ID
 } reiser4_node_id;
 
@@ -7,6 +7,7 @@
 #include "../item/item.h"
 #include "node.h"
 #include "node40.h"
+#include "node42.h"
 #include "../plugin.h"
 #include "../../jnode.h"
 #include "../../znode.h"
@@ -67,19 +68,112 @@ static inline node40_header *node40_node_header(const znode * node	/* node to
 /* plugin field of node header should be read/set by
    plugin_by_disk_id/save_disk_plugin */
 
-/* array of item headers is at the end of node */
+/* number of leading key elements stored once in the node header rather than
+   in every item header. Always 0 for all layouts but node42 */
+static inline unsigned node40_prefix(const znode * node)
+{
+	if (likely(node->nplug->h.id != NODE42_ID))
+		return 0;
+	return nh42_get_prefix(node42_node_header(node));
+}
+
+/* size of item header when @prefix key elements are not stored in it */
+static inline unsigned node40_ih_size_prefix(unsigned prefix)
+{
+	return sizeof(item_header40) - prefix * sizeof(d64);
+}
+
+/* size of item header in @node */
+static inline unsigned node40_ih_size(const znode * node)
+{
+	return node40_ih_size_prefix(node40_prefix(node));
+}
+
+/* array of item headers is at the end of node. When item headers don't store
+   first @prefix key elements, returned pointer is shifted back by the size of
+   those elements, so that ->offset, ->flags, ->plugin_id and the stored part
+   of ->key are still addressed correctly. The rest of ->key doesn't belong to
+   this item header and should never be accessed. */
+static inline item_header40 *node40_ih_at_prefix(const znode * node,
+						 unsigned pos, unsigned prefix)
+{
+	return (item_header40 *) (zdata(node) + znode_size(node) +
+				  pos * prefix * sizeof(d64)) - pos - 1;
+}
+
 static inline item_header40 *node40_ih_at(const znode * node, unsigned pos)
 {
-	return (item_header40 *) (zdata(node) + znode_size(node)) - pos - 1;
+	return node40_ih_at_prefix(node, pos, node40_prefix(node));
 }
 
 /* ( page_address( node -> pg ) + PAGE_CACHE_SIZE ) - pos - 1
  */
 static inline item_header40 *node40_ih_at_coord(const coord_t * coord)
 {
-	return (item_header40 *) (zdata(coord->node) +
-				  znode_size(coord->node)) - (coord->item_pos) -
-	    1;
+	return node40_ih_at(coord->node, coord->item_pos);
+}
+
+/* first byte of item header @ih actually stored in the node */
+static inline char *node40_ih_start(item_header40 * ih, unsigned prefix)
+{
+	return (char *)ih + prefix * sizeof(d64);
+}
+
+/* copy key of item header @ih of @node into @key */
+static reiser4_key *node40_ih_read_key(const znode * node,
+				       const item_header40 * ih,
+				       reiser4_key * key)
+{
+	unsigned prefix;
+
+	prefix = node40_prefix(node);
+	if (prefix != 0)
+		memcpy(key->el, node42_node_header(node)->common,
+		       prefix * sizeof(d64));
+	memcpy(key->el + prefix, ih->key.el + prefix,
+	       (KEY_LAST_INDEX - prefix) * sizeof(d64));
+	return key;
+}
+
+/* key of item header @ih of @node. Points into item header if key is stored
+   there entirely, otherwise it is assembled in @buf */
+static inline const reiser4_key *node40_ih_key(const znode * node,
+					       const item_header40 * ih,
+					       reiser4_key * buf)
+{
+	if (likely(node40_prefix(node) == 0))
+		return &ih->key;
+	return node40_ih_read_key(node, ih, buf);
+}
+
+/* store @key in item header @ih of @node */
+static void node40_ih_set_key(const znode * node, item_header40 * ih,
+			      const reiser4_key * key)
+{
+	unsigned prefix;
+
+	prefix = node40_prefix(node);
+	assert("edward-2323",
+	       prefix == 0 || !memcmp(key->el, node42_node_header(node)->common,
+				      prefix * sizeof(d64)));
+	memcpy(ih->key.el + prefix, key->el + prefix,
+	       (KEY_LAST_INDEX - prefix) * sizeof(d64));
+}
+
+/* move @count item headers of @node starting from @from-th to @to-th
+   position */
+static void node40_ih_move(znode * node, unsigned to, unsigned from,
+			   unsigned count)
+{
+	unsigned prefix;
+
+	if (count == 0)
+		return;
+	prefix = node40_prefix(node);
+	/* headers are ordered from right to left */
+	memmove(node40_ih_start(node40_ih_at(node, to + count - 1), prefix),
+		node40_ih_start(node40_ih_at(node, from + count - 1), prefix),
+		count * node40_ih_size_prefix(prefix));
 }
 
 /* functions to get/set fields of item_header40 */
@@ -183,7 +277,9 @@ int length_by_coord_node40(const coord_t * coord)
 		    nh40_get_free_space_start(node40_node_header(coord->node)) -
 		    ih40_get_offset(ih);
 	else
-		result = ih40_get_offset(ih - 1) - ih40_get_offset(ih);
+		result = ih40_get_offset(node40_ih_at(coord->node,
+						      coord->item_pos + 1)) -
+		    ih40_get_offset(ih);
 
 	return result;
 }
@@ -204,7 +300,8 @@ node40_item_length(const znode * node, pos_in_node_t item_pos)
 		    nh40_get_free_space_start(node40_node_header(node)) -
 		    ih40_get_offset(ih);
 	else
-		result = ih40_get_offset(ih - 1) - ih40_get_offset(ih);
+		result = ih40_get_offset(node40_ih_at(node, item_pos + 1)) -
+		    ih40_get_offset(ih);
 
 	return result;
 }
@@ -236,8 +333,229 @@ reiser4_key *key_at_node40(const coord_t * coord, reiser4_key * key)
 
 	/* @coord is set to existing item */
 	ih = node40_ih_at_coord(coord);
-	memcpy(key, &ih->key, sizeof(reiser4_key));
-	return key;
+	return node40_ih_read_key(coord->node, ih, key);
+}
+
+/*
+ * Search index.
+ *
+ * Item headers are stored at the end of a node from right to left and keys
+ * in them are in disk byte order. Binary search over them touches log(n)
+ * scattered cache lines and byte-swaps every key it looks at. To make
+ * intra-node lookup cheaper, a small in-memory index is attached to the
+ * znode (znode->sindex). Keys of all items in a node usually share several
+ * leading elements (locality, often objectid). The index stores these common
+ * elements once and, for every item, the first element where keys differ, in
+ * native byte order. Lookup does binary search over this dense array of u64s
+ * and looks into item headers only to resolve ties.
+ *
+ * The index is a pure cache:
+ *
+ *     it is built by the first lookup in a node. Lookups run under long term
+ *     lock, possibly concurrently, so builders race through cmpxchg();
+ *
+ *     node modifications run under write lock and exclude lookups. They
+ *     update index in place (create_item_node40(), update_item_key_node40())
+ *     or refill it from item headers (compact(), shift), or drop it if it
+ *     has no room, in which case next lookup builds new one;
+ *
+ *     lookup checks the range found through the index against item headers
+ *     and falls back to the plain search if index is found to be stale.
+ */
+
+/* number of spare entries allocated in the index for new items */
+#define NODE40_SINDEX_SLACK (16)
+
+/* fill @idx from item headers of @node */
+static void node40_sindex_fill(znode * node, struct node40_sindex *idx)
+{
+	item_header40 *ih;
+	unsigned nr;
+	unsigned el;
+	unsigned i;
+
+	nr = node40_num_of_items_internal(node);
+	assert("edward-2310", nr <= idx->size);
+	assert("edward-2325", node40_prefix(node) == 0);
+
+	el = 0;
+	if (nr > 0) {
+		reiser4_key *first;
+		reiser4_key *last;
+
+		/* keys are sorted, hence elements shared by the first and the
+		 * last key are shared by all keys */
+		first = &node40_ih_at(node, 0)->key;
+		last = &node40_ih_at(node, nr - 1)->key;
+		for (; el < KEY_LAST_INDEX - 1; ++el) {
+			idx->common[el] = get_key_el(first, el);
+			if (idx->common[el] != get_key_el(last, el))
+				break;
+		}
+	}
+	for (i = 0, ih = node40_ih_at(node, 0); i < nr; ++i, --ih)
+		idx->elem[i] = get_key_el(&ih->key, el);
+	idx->el = el;
+	idx->nr = nr;
+}
+
+/* allocate and fill search index for @node */
+static struct node40_sindex *node40_sindex_build(znode * node)
+{
+	struct node40_sindex *idx;
+	unsigned size;
+
+	size = node40_num_of_items_internal(node) + NODE40_SINDEX_SLACK;
+	/* lookup can be called with spin locks held, and index is optional
+	 * anyway */
+	idx = kmalloc(sizeof(*idx) + size * sizeof(idx->elem[0]),
+		      GFP_NOWAIT | __GFP_NOWARN);
+	if (idx != NULL) {
+		idx->size = size;
+		node40_sindex_fill(node, idx);
+	}
+	return idx;
+}
+
+/* return search index of @node, building it if necessary */
+static struct node40_sindex *node40_sindex_get(znode * node)
+{
+	struct node40_sindex *idx;
+
+	idx = READ_ONCE(node->sindex);
+	if (unlikely(idx == NULL)) {
+		struct node40_sindex *old;
+
+		idx = node40_sindex_build(node);
+		if (idx == NULL)
+			return NULL;
+		old = cmpxchg(&node->sindex, NULL, idx);
+		if (old != NULL) {
+			/* somebody was faster */
+			kfree(idx);
+			idx = old;
+		}
+	}
+	return idx;
+}
+
+/* forget search index of @node. Called under write lock */
+static void node40_sindex_drop(znode * node)
+{
+	kfree(node->sindex);
+	node->sindex = NULL;
+}
+
+/* re-read search index of @node from item headers after massive update */
+static void node40_sindex_refill(znode * node)
+{
+	struct node40_sindex *idx;
+
+	idx = node->sindex;
+	if (idx == NULL)
+		return;
+	if (node40_num_of_items_internal(node) <= idx->size)
+		node40_sindex_fill(node, idx);
+	else
+		node40_sindex_drop(node);
+}
+
+/* true if @key shares leading elements with all other keys in the node */
+static int node40_sindex_fits(const struct node40_sindex *idx,
+			      const reiser4_key * key)
+{
+	unsigned i;
+
+	for (i = 0; i < idx->el; ++i) {
+		if (get_key_el(key, i) != idx->common[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* new item with @key was inserted at @pos */
+static void node40_sindex_insert(znode * node, unsigned pos,
+				 const reiser4_key * key)
+{
+	struct node40_sindex *idx;
+
+	idx = node->sindex;
+	if (idx == NULL)
+		return;
+	if (idx->nr < REISER4_SEQ_SEARCH_BREAK || !node40_sindex_fits(idx, key))
+		/* node was nearly empty, or keys got more diverse: shared
+		 * prefix has to be recalculated */
+		node40_sindex_refill(node);
+	else if (idx->nr == idx->size)
+		node40_sindex_drop(node);
+	else {
+		assert("edward-2311", pos <= idx->nr);
+		memmove(idx->elem + pos + 1, idx->elem + pos,
+			(idx->nr - pos) * sizeof(idx->elem[0]));
+		idx->elem[pos] = get_key_el(key, idx->el);
+		++idx->nr;
+	}
+}
+
+/* key of item at @pos was changed to @key */
+static void node40_sindex_update(znode * node, unsigned pos,
+				 const reiser4_key * key)
+{
+	struct node40_sindex *idx;
+
+	idx = node->sindex;
+	if (idx == NULL)
+		return;
+	if (pos < idx->nr && node40_sindex_fits(idx, key))
+		idx->elem[pos] = get_key_el(key, idx->el);
+	else
+		node40_sindex_refill(node);
+}
+
+/*
+ * narrow range of items that can contain @key using the search index. On
+ * return, all keys before *@left are less than @key (unless *@left is 0) and
+ * all keys after *@right are greater than @key.
+ */
+static void node40_sindex_search(const struct node40_sindex *idx,
+				 const reiser4_key * key, int *left, int *right)
+{
+	__u64 e;
+	int lo;
+	int hi;
+	int i;
+
+	for (i = 0; i < idx->el; ++i) {
+		e = get_key_el(key, i);
+		if (e != idx->common[i]) {
+			/* @key is outside of the node key range */
+			*left = *right = (e < idx->common[i]) ? 0 : idx->nr - 1;
+			return;
+		}
+	}
+
+	e = get_key_el(key, idx->el);
+	/* first entry not less than @e */
+	lo = 0;
+	hi = idx->nr;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (idx->elem[i] < e)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	*left = lo > 0 ? lo - 1 : 0;
+	/* first entry greater than @e */
+	hi = idx->nr;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (idx->elem[i] <= e)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	*right = lo > 0 ? lo - 1 : 0;
 }
 
 /* VS-FIXME-HANS: please review whether the below are properly disabled when debugging is disabled */
@@ -248,6 +566,92 @@ reiser4_key *key_at_node40(const coord_t * coord, reiser4_key * key)
 #define NODE_ADDSTAT(n, counter, val)						\
 	reiser4_stat_add_at_level(znode_get_level(n), node.lookup.counter, val)
 
+/* common part of lookup_node40() and lookup_node42(): @left is position of
+   the item which can contain @key, @found is set if its key equals to @key */
+static node_search_result node40_lookup_finish(znode * node,
+					       const reiser4_key * key,
+					       lookup_bias bias,
+					       coord_t * coord, int left,
+					       int found)
+{
+	item_plugin *iplug;
+	item_header40 *bstop;
+	const reiser4_key *bkey;
+	reiser4_key buf;
+	cmp_t order;
+
+	bstop = node40_ih_at(node, (unsigned)left);
+	bkey = node40_ih_key(node, bstop, &buf);
+	assert("nikita-3214", equi(found, keyeq(bkey, key)));
+
+	coord_set_item_pos(coord, left);
+	coord->unit_pos = 0;
+	coord->between = AT_UNIT;
+
+	/* key < leftmost key in a mode or node is corrupted and keys
+	   are not sorted  */
+	order = keycmp(bkey, key);
+	if (unlikely(order == GREATER_THAN)) {
+		if (unlikely(left != 0)) {
+			/* screw up */
+			warning("nikita-587", "Key less than %i key in a node",
+				left);
+			reiser4_print_key("key", key);
+			reiser4_print_key("min", bkey);
+			print_coord_content("coord", coord);
+			return RETERR(-EIO);
+		} else {
+			coord->between = BEFORE_UNIT;
+			return NS_NOT_FOUND;
+		}
+	}
+	/* left <= key, ok */
+	iplug = item_plugin_by_disk_id(znode_get_tree(node), &bstop->plugin_id);
+
+	if (unlikely(iplug == NULL)) {
+		warning("nikita-588", "Unknown plugin %i",
+			le16_to_cpu(get_unaligned(&bstop->plugin_id)));
+		reiser4_print_key("key", key);
+		print_coord_content("coord", coord);
+		return RETERR(-EIO);
+	}
+
+	coord_set_iplug(coord, iplug);
+
+	/* if exact key from item header was found by binary search, no
+	   further checks are necessary. */
+	if (found) {
+		assert("nikita-1259", order == EQUAL_TO);
+		return NS_FOUND;
+	}
+	if (iplug->b.max_key_inside != NULL) {
+		reiser4_key max_item_key;
+
+		/* key > max_item_key --- outside of an item */
+		if (keygt(key, iplug->b.max_key_inside(coord, &max_item_key))) {
+			coord->unit_pos = 0;
+			coord->between = AFTER_ITEM;
+			/* FIXME-VS: key we are looking for does not fit into
+			   found item. Return NS_NOT_FOUND then. Without that
+			   the following case does not work: there is extent of
+			   file 10000, 10001. File 10000, 10002 has been just
+			   created. When writing to position 0 in that file -
+			   traverse_tree will stop here on twig level. When we
+			   want it to go down to leaf level
+			 */
+			return NS_NOT_FOUND;
+		}
+	}
+
+	if (iplug->b.lookup != NULL) {
+		return (node_search_result)iplug->b.lookup(key, bias, coord);
+	} else {
+		assert("nikita-1260", order == LESS_THAN);
+		coord->between = AFTER_UNIT;
+		return (bias == FIND_EXACT) ? NS_NOT_FOUND : NS_FOUND;
+	}
+}
+
 /* plugin->u.node.lookup
    look for description of this method in plugin/node/node.h */
 node_search_result lookup_node40(znode * node /* node to query */ ,
@@ -263,15 +667,15 @@ node_search_result lookup_node40(znode * node /* node to query */ ,
 	item_header40 *lefth;
 	item_header40 *righth;
 
-	item_plugin *iplug;
-	item_header40 *bstop;
 	item_header40 *ih;
-	cmp_t order;
+	struct node40_sindex *idx;
 
 	assert("nikita-583", node != NULL);
 	assert("nikita-584", key != NULL);
 	assert("nikita-585", coord != NULL);
 	assert("nikita-2693", znode_is_any_locked(node));
+	/* item headers are walked by pointer arithmetic below */
+	assert("edward-2324", node40_prefix(node) == 0);
 
 	items = node_num_items(node);
 
@@ -287,6 +691,30 @@ node_search_result lookup_node40(znode * node /* node to query */ ,
 	coord_clear_iplug(coord);
 	found = 0;
 
+	/* narrow the range using search index, and check the result against
+	   item headers. If they disagree (index went stale), fall back to
+	   binary search over all items */
+	idx = node40_sindex_get(node);
+	if (likely(idx != NULL && idx->nr == items)) {
+		int l;
+		int r;
+
+		node40_sindex_search(idx, key, &l, &r);
+		if (likely((r == items - 1 ||
+			    keylt(key, &node40_ih_at(node, r + 1)->key)) &&
+			   (l == 0 ||
+			    keylt(&node40_ih_at(node, l)->key, key)))) {
+			left = l;
+			right = r;
+		} else if (printk_ratelimit())
+			/* index is maintained under long term write lock, it
+			   should never disagree with item headers */
+			warning("edward-2312",
+				"stale search index in node %llu (%d items)",
+				(unsigned long long)*znode_get_block(node),
+				items);
+	}
+
 	lefth = node40_ih_at(node, left);
 	righth = node40_ih_at(node, right);
 
@@ -371,81 +799,155 @@ node_search_result lookup_node40(znode * node /* node to query */ ,
 	}
 
 	assert("nikita-3212", right >= left);
-	assert("nikita-3214",
-	       equi(found, keyeq(&node40_ih_at(node, left)->key, key)));
+	return node40_lookup_finish(node, key, bias, coord, left, found);
+}
 
-	coord_set_item_pos(coord, left);
-	coord->unit_pos = 0;
-	coord->between = AT_UNIT;
+/* compare key of item header @ih with @key, looking only at elements which
+   are stored in item headers of a node with given @prefix */
+static inline cmp_t node42_ih_keycmp(const item_header40 * ih,
+				     const reiser4_key * key, unsigned prefix)
+{
+	unsigned el;
+	__u64 e1;
+	__u64 e2;
 
-	/* key < leftmost key in a mode or node is corrupted and keys
-	   are not sorted  */
-	bstop = node40_ih_at(node, (unsigned)left);
-	order = keycmp(&bstop->key, key);
-	if (unlikely(order == GREATER_THAN)) {
-		if (unlikely(left != 0)) {
-			/* screw up */
-			warning("nikita-587", "Key less than %i key in a node",
-				left);
-			reiser4_print_key("key", key);
-			reiser4_print_key("min", &bstop->key);
-			print_coord_content("coord", coord);
-			return RETERR(-EIO);
-		} else {
-			coord->between = BEFORE_UNIT;
-			return NS_NOT_FOUND;
-		}
+	/* keys are ordered element by element (plan-a key allocation) */
+	for (el = prefix; el < KEY_LAST_INDEX; ++el) {
+		e1 = get_key_el(&ih->key, el);
+		e2 = get_key_el(key, el);
+		if (e1 != e2)
+			return e1 < e2 ? LESS_THAN : GREATER_THAN;
 	}
-	/* left <= key, ok */
-	iplug = item_plugin_by_disk_id(znode_get_tree(node), &bstop->plugin_id);
+	return EQUAL_TO;
+}
 
-	if (unlikely(iplug == NULL)) {
-		warning("nikita-588", "Unknown plugin %i",
-			le16_to_cpu(get_unaligned(&bstop->plugin_id)));
-		reiser4_print_key("key", key);
-		print_coord_content("coord", coord);
-		return RETERR(-EIO);
-	}
+/* plugin->u.node.lookup of node42. Shared leading key elements are compared
+   once, binary search looks only at the rest of every key.
+   look for description of this method in plugin/node/node.h */
+node_search_result lookup_node42(znode * node, const reiser4_key * key,
+				 lookup_bias bias, coord_t * coord)
+{
+	node42_header *nh;
+	unsigned prefix;
+	unsigned el;
+	int items;
+	int left;
+	int right;
+	int found;
 
-	coord_set_iplug(coord, iplug);
+	assert("edward-2326", node != NULL);
+	assert("edward-2327", key != NULL);
+	assert("edward-2328", coord != NULL);
+	assert("edward-2329", znode_is_any_locked(node));
 
-	/* if exact key from item header was found by binary search, no
-	   further checks are necessary. */
-	if (found) {
-		assert("nikita-1259", order == EQUAL_TO);
-		return NS_FOUND;
+	items = node_num_items(node);
+	if (unlikely(items == 0)) {
+		coord_init_first_unit(coord, node);
+		return NS_NOT_FOUND;
 	}
-	if (iplug->b.max_key_inside != NULL) {
-		reiser4_key max_item_key;
+	coord->node = node;
+	coord_clear_iplug(coord);
+	found = 0;
 
-		/* key > max_item_key --- outside of an item */
-		if (keygt(key, iplug->b.max_key_inside(coord, &max_item_key))) {
-			coord->unit_pos = 0;
-			coord->between = AFTER_ITEM;
-			/* FIXME-VS: key we are looking for does not fit into
-			   found item. Return NS_NOT_FOUND then. Without that
-			   the following case does not work: there is extent of
-			   file 10000, 10001. File 10000, 10002 has been just
-			   created. When writing to position 0 in that file -
-			   traverse_tree will stop here on twig level. When we
-			   want it to go down to leaf level
-			 */
-			return NS_NOT_FOUND;
-		}
+	nh = node42_node_header(node);
+	prefix = nh42_get_prefix(nh);
+	for (el = 0; el < prefix; ++el) {
+		__u64 e;
+		__u64 c;
+
+		e = get_key_el(key, el);
+		c = le64_to_cpu(get_unaligned(&nh->common[el]));
+		if (e != c)
+			/* @key is outside of the node key range */
+			return node40_lookup_finish(node, key, bias, coord,
+						    e < c ? 0 : items - 1, 0);
 	}
+	/* first item with key not less than @key */
+	left = 0;
+	right = items;
+	while (left < right) {
+		int median;
 
-	if (iplug->b.lookup != NULL) {
-		return (node_search_result)iplug->b.lookup(key, bias, coord);
-	} else {
-		assert("nikita-1260", order == LESS_THAN);
-		coord->between = AFTER_UNIT;
-		return (bias == FIND_EXACT) ? NS_NOT_FOUND : NS_FOUND;
+		median = (left + right) / 2;
+		if (node42_ih_keycmp(node40_ih_at_prefix(node, median, prefix),
+				     key, prefix) == LESS_THAN)
+			left = median + 1;
+		else
+			right = median;
 	}
+	/* the leftmost item with key equal to @key or the last one with key
+	   less than @key */
+	if (left < items &&
+	    node42_ih_keycmp(node40_ih_at_prefix(node, left, prefix),
+			     key, prefix) == EQUAL_TO)
+		found = 1;
+	else if (left > 0)
+		--left;
+	return node40_lookup_finish(node, key, bias, coord, left, found);
 }
 
 #undef NODE_ADDSTAT
 #undef NODE_INCSTAT
 
+/* plugin->u.node.peek_child
+   look for description of this method in plugin/node/node.h
+
+   Node is not locked, so everything read from it is only a guess: nothing
+   read is trusted to be sorted or within bounds, search index (which is
+   protected by the long-term lock) is not used. Keys are expected to be
+   stored in item headers entirely, see peek_child_node42(). */
+int peek_child_node40(znode * node /* node to query */ ,
+		      const reiser4_key * key /* key to look for */ ,
+		      reiser4_block_nr * block /* resulting child block */ )
+{
+	item_header40 *ih;
+	internal_item_layout *item;
+	unsigned items;
+	unsigned offset;
+	int left;
+	int right;
+
+	assert("edward-2313", node != NULL);
+	assert("edward-2314", key != NULL);
+	assert("edward-2315", block != NULL);
+
+	items = nh40_get_num_items(node40_node_header(node));
+	if (items == 0 || items > (znode_size(node) - sizeof(node40_header)) /
+	    sizeof(item_header40))
+		return RETERR(-E_REPEAT);
+
+	/* first item with key not less than @key */
+	left = 0;
+	right = items;
+	while (left < right) {
+		int median;
+
+		median = (left + right) / 2;
+		if (keylt(&node40_ih_at_prefix(node, median, 0)->key, key))
+			left = median + 1;
+		else
+			right = median;
+	}
+	/* same item as lookup_node40() chooses: the leftmost one with key
+	   equal to @key or the last one with key less than @key */
+	if (left == items || !keyeq(&node40_ih_at_prefix(node, left, 0)->key, key))
+		--left;
+	if (left < 0)
+		return RETERR(-E_REPEAT);
+
+	ih = node40_ih_at_prefix(node, left, 0);
+	if (le16_to_cpu(get_unaligned(&ih->plugin_id)) != NODE_POINTER_ID)
+		/* extent on the twig level */
+		return RETERR(-E_REPEAT);
+	offset = ih40_get_offset(ih);
+	if (offset < sizeof(node40_header) ||
+	    offset + sizeof(*item) > znode_size(node))
+		return RETERR(-E_REPEAT);
+	item = (internal_item_layout *) (zdata(node) + offset);
+	*block = le64_to_cpu(get_unaligned(&item->pointer));
+	return 0;
+}
+
 /* plugin->u.node.estimate
    look for description of this method in plugin/node/node.h */
 size_t estimate_node40(znode * node)
@@ -454,7 +956,7 @@ size_t estimate_node40(znode * node)
 
 	assert("nikita-597", node != NULL);
 
-	result = free_space_node40(node) - sizeof(item_header40);
+	result = free_space_node40(node) - node40_ih_size(node);
 
 	return (result > 0) ? result : 0;
 }
@@ -526,6 +1028,14 @@ int check_node40(const znode * node /* node to check */ ,
 			*error = "Keys are in wrong order";
 			return -1;
 		}
+		if (node->sindex != NULL &&
+		    (node->sindex->nr != nr_items ||
+		     !node40_sindex_fits(node->sindex, &ih->key) ||
+		     node->sindex->elem[i] !=
+		     get_key_el(&ih->key, node->sindex->el))) {
+			*error = "Search index is out of date";
+			return -1;
+		}
 		if (!keyeq(&ih->key, unit_key_by_coord(&coord, &unit_key))) {
 			*error = "Wrong key of first unit";
 			return -1;
@@ -701,6 +1211,7 @@ int init_node40_common(znode *node, node_plugin *nplug,
 
 	header40 = node40_node_header(node);
 	memset(header40, 0, sizeof(node40_header));
+	node40_sindex_drop(node);
 
 	nh40_set_free_space(header40, znode_size(node) - node_header_size);
 	nh40_set_free_space_start(header40, node_header_size);
@@ -784,6 +1295,161 @@ void change_item_size_node40(coord_t * coord, int by)
 	nh40_set_free_space_start(nh, nh40_get_free_space_start(nh) + by);
 }
 
+/*
+ * Re-encoding of item headers of node42 (see comment at the beginning of
+ * node42.c). Only node42 nodes have non-zero prefix, for other layouts
+ * functions below do nothing.
+ */
+
+/* number of leading elements @k1 and @k2 share, but not more than @max */
+static unsigned node40_keys_shared(const reiser4_key * k1,
+				   const reiser4_key * k2, unsigned max)
+{
+	unsigned el;
+
+	for (el = 0; el < max && k1->el[el] == k2->el[el]; ++el)
+		;
+	return el;
+}
+
+#if REISER4_DEBUG
+/* free space of @node is exactly the gap between item bodies and item
+   headers, whatever prefix item headers are encoded for */
+static int node40_free_space_ok(const znode * node)
+{
+	node40_header *nh = node40_node_header(node);
+
+	return nh40_get_free_space(nh) ==
+	    znode_size(node) - nh40_get_free_space_start(nh) -
+	    nh40_get_num_items(nh) * node40_ih_size(node);
+}
+#endif
+
+/* how many bytes of free space re-encoding of item headers of @node for
+   @prefix takes */
+static unsigned node40_prefix_cost(const znode * node, unsigned prefix)
+{
+	unsigned old;
+
+	old = node40_prefix(node);
+	if (prefix >= old)
+		return 0;
+	return node40_num_of_items_internal(node) * (old - prefix) *
+	    sizeof(d64);
+}
+
+/* re-encode item header at @pos stored for @old prefix for @prefix */
+static void node40_ih_reencode(znode * node, unsigned pos, unsigned old,
+			       unsigned prefix)
+{
+	item_header40 ih;
+
+	memcpy(node40_ih_start(&ih, old),
+	       node40_ih_start(node40_ih_at_prefix(node, pos, old), old),
+	       node40_ih_size_prefix(old));
+	if (prefix < old)
+		memcpy(ih.key.el + prefix,
+		       node42_node_header(node)->common + prefix,
+		       (old - prefix) * sizeof(d64));
+	memcpy(node40_ih_start(node40_ih_at_prefix(node, pos, prefix), prefix),
+	       node40_ih_start(&ih, prefix), node40_ih_size_prefix(prefix));
+}
+
+/* store first @prefix key elements of node42 @node in its node header only,
+   re-encoding all item headers. Elements moved to the node header have to be
+   shared by all items. @key supplies them when @node is empty */
+static void node40_set_prefix(znode * node, unsigned prefix,
+			      const reiser4_key * key)
+{
+	node40_header *nh;
+	node42_header *nh42;
+	reiser4_key first;
+	unsigned old;
+	unsigned nr;
+	unsigned i;
+	int delta;
+
+	assert("edward-2330", node->nplug->h.id == NODE42_ID);
+	assert("edward-2331", prefix < KEY_LAST_INDEX);
+
+	nh = node40_node_header(node);
+	nh42 = node42_node_header(node);
+	old = nh42_get_prefix(nh42);
+	nr = nh40_get_num_items(nh);
+	if (nr != 0)
+		key = node40_ih_read_key(node, node40_ih_at(node, 0), &first);
+	assert("edward-2332", key != NULL);
+
+	/* each item header grows by (old - prefix) elements when @prefix is
+	   less than @old and shrinks otherwise */
+	delta = (int)nr * ((int)old - (int)prefix) * (int)sizeof(d64);
+	assert("edward-2333", delta <= 0 || nh40_get_free_space(nh) >= delta);
+
+	/* item headers grow or shrink towards the beginning of the node, walk
+	   them so that not yet re-encoded ones are never overwritten */
+	if (prefix < old) {
+		for (i = nr; i-- > 0;)
+			node40_ih_reencode(node, i, old, prefix);
+	} else {
+		for (i = 0; i < nr; ++i)
+			node40_ih_reencode(node, i, old, prefix);
+	}
+	memcpy(nh42->common, key->el, prefix * sizeof(d64));
+	nh42_set_prefix(nh42, prefix);
+	nh40_set_free_space(nh, nh40_get_free_space(nh) - delta);
+	assert("edward-2391", node40_free_space_ok(node));
+}
+
+/* move as many key elements as possible from item headers of node42 @node
+   to its node header. Called after items were removed or shifted */
+static void node40_pack(znode * node)
+{
+	reiser4_key first;
+	reiser4_key last;
+	unsigned prefix;
+	unsigned nr;
+
+	if (likely(node->nplug->h.id != NODE42_ID))
+		return;
+	nr = node40_num_of_items_internal(node);
+	if (nr == 0) {
+		/* shared elements of an empty node are set by the first item
+		   to come, see node42_prefix_with() */
+		nh42_set_prefix(node42_node_header(node), 0);
+		return;
+	}
+	node40_ih_read_key(node, node40_ih_at(node, 0), &first);
+	node40_ih_read_key(node, node40_ih_at(node, nr - 1), &last);
+	/* keys are sorted, hence elements shared by the first and the last
+	   key are shared by all keys */
+	prefix = min(node42_prefix_limit(node, &first),
+		     node42_prefix_limit(node, &last));
+	prefix = node40_keys_shared(&first, &last, prefix);
+	if (prefix > node40_prefix(node))
+		node40_set_prefix(node, prefix, NULL);
+	assert("edward-2392", node40_free_space_ok(node));
+}
+
+/* number of key elements node42 @target can keep in its node header when
+   items of @source are shifted into it */
+static unsigned node40_shift_prefix(znode * target, znode * source)
+{
+	reiser4_key first;
+	reiser4_key last;
+	unsigned prefix;
+	unsigned nr;
+
+	if (likely(target->nplug->h.id != NODE42_ID))
+		return 0;
+	nr = node40_num_of_items_internal(source);
+	assert("edward-2334", nr > 0);
+	node40_ih_read_key(source, node40_ih_at(source, 0), &first);
+	node40_ih_read_key(source, node40_ih_at(source, nr - 1), &last);
+	prefix = min(node42_prefix_with(target, &first),
+		     node42_prefix_with(target, &last));
+	return node40_keys_shared(&first, &last, prefix);
+}
+
 static int should_notify_parent(const znode * node)
 {
 	/* FIXME_JMACD This looks equivalent to znode_is_root(), right? -josh */
@@ -805,10 +1471,19 @@ create_item_node40(coord_t *target, const reiser4_key *key,
 	nh = node40_node_header(target->node);
 
 	assert("vs-212", coord_is_between_items(target));
+	if (target->node->nplug->h.id == NODE42_ID) {
+		unsigned prefix;
+
+		/* new key may share less elements with the rest of the node.
+		   Space for this was reserved by item_overhead_node42() */
+		prefix = node42_prefix_with(target->node, key);
+		if (prefix != node40_prefix(target->node))
+			node40_set_prefix(target->node, prefix, key);
+	}
 	/* node must have enough free space */
 	assert("vs-254",
 	       free_space_node40(target->node) >=
-	       data->length + sizeof(item_header40));
+	       data->length + node40_ih_size(target->node));
 	assert("vs-1410", data->length >= 0);
 
 	if (coord_set_to_right(target))
@@ -832,10 +1507,10 @@ create_item_node40(coord_t *target, const reiser4_key *key,
 			ih40_set_offset(ih, ih40_get_offset(ih) + data->length);
 		}
 
-		/* @ih is set to item header of the last item, move item headers */
-		memmove(ih - 1, ih,
-			sizeof(item_header40) * (nh40_get_num_items(nh) -
-						 target->item_pos));
+		/* move item headers */
+		node40_ih_move(target->node, target->item_pos + 1,
+			       target->item_pos,
+			       nh40_get_num_items(nh) - target->item_pos);
 	} else {
 		/* new item will start at this offset */
 		offset = nh40_get_free_space_start(nh);
@@ -843,17 +1518,19 @@ create_item_node40(coord_t *target, const reiser4_key *key,
 
 	/* make item header for the new item */
 	ih = node40_ih_at_coord(target);
-	memcpy(&ih->key, key, sizeof(reiser4_key));
+	node40_ih_set_key(target->node, ih, key);
 	ih40_set_offset(ih, offset);
 	save_plugin_id(item_plugin_to_plugin(data->iplug), &ih->plugin_id);
 
 	/* update node header */
 	nh40_set_free_space(nh,
 			    nh40_get_free_space(nh) - data->length -
-			    sizeof(item_header40));
+			    node40_ih_size(target->node));
 	nh40_set_free_space_start(nh,
 				  nh40_get_free_space_start(nh) + data->length);
 	node40_set_num_items(target->node, nh, nh40_get_num_items(nh) + 1);
+	node40_sindex_insert(target->node, target->item_pos, key);
+	assert("edward-2393", node40_free_space_ok(target->node));
 
 	/* FIXME: check how does create_item work when between is set to BEFORE_UNIT */
 	target->unit_pos = 0;
@@ -906,7 +1583,8 @@ update_item_key_node40(coord_t * target, const reiser4_key * key,
 	item_header40 *ih;
 
 	ih = node40_ih_at_coord(target);
-	memcpy(&ih->key, key, sizeof(reiser4_key));
+	node40_ih_set_key(target->node, ih, key);
+	node40_sindex_update(target->node, target->item_pos, key);
 
 	if (target->item_pos == 0) {
 		prepare_for_update(NULL, target->node, info);
@@ -967,17 +1645,16 @@ static void compact(znode * node, struct cut40_info *cinfo)
 
 	/* update item headers of moved items - change their locations */
 	pos = cinfo->first_moved;
-	ih = node40_ih_at(node, pos);
 	if (cinfo->head_removed_location != MAX_POS_IN_NODE) {
 		assert("vs-1580", pos == cinfo->head_removed);
+		ih = node40_ih_at(node, pos);
 		ih40_set_offset(ih, cinfo->head_removed_location);
 		pos++;
-		ih--;
 	}
 
 	freed = cinfo->freed_space_end - cinfo->freed_space_start;
-	for (; pos < nr_items; pos++, ih--) {
-		assert("vs-1581", ih == node40_ih_at(node, pos));
+	for (; pos < nr_items; pos++) {
+		ih = node40_ih_at(node, pos);
 		ih40_set_offset(ih, ih40_get_offset(ih) - freed);
 	}
 
@@ -986,17 +1663,18 @@ static void compact(znode * node, struct cut40_info *cinfo)
 
 	if (cinfo->removed_count != MAX_POS_IN_NODE) {
 		/* number of items changed. Remove item headers of those items */
-		ih = node40_ih_at(node, nr_items - 1);
-		memmove(ih + cinfo->removed_count, ih,
-			sizeof(item_header40) * (nr_items -
-						 cinfo->removed_count -
-						 cinfo->first_removed));
-		freed += sizeof(item_header40) * cinfo->removed_count;
+		node40_ih_move(node, cinfo->first_removed,
+			       cinfo->first_removed + cinfo->removed_count,
+			       nr_items - cinfo->removed_count -
+			       cinfo->first_removed);
+		freed += node40_ih_size(node) * cinfo->removed_count;
 		node40_set_num_items(node, nh, nr_items - cinfo->removed_count);
 	}
 
 	/* total amount of free space increased */
 	nh40_set_free_space(nh, nh40_get_free_space(nh) + freed);
+	node40_sindex_refill(node);
+	node40_pack(node);
 }
 
 int shrink_item_node40(coord_t * coord, int delta)
@@ -1025,10 +1703,8 @@ int shrink_item_node40(coord_t * coord, int delta)
 	memmove(end - delta, end, nh40_get_free_space_start(nh) - off);
 
 	/* update item headers of moved items - change their locations */
-	pos = coord->item_pos + 1;
-	ih = node40_ih_at(node, pos);
-	for (; pos < nr_items; pos++, ih--) {
-		assert("nikita-3490", ih == node40_ih_at(node, pos));
+	for (pos = coord->item_pos + 1; pos < nr_items; pos++) {
+		ih = node40_ih_at(node, pos);
 		ih40_set_offset(ih, ih40_get_offset(ih) - delta);
 	}
 
@@ -1407,13 +2083,13 @@ prepare_for_compact(struct cut40_info *cinfo,
 			ih = node40_ih_at(node, item_pos);
 
 			if (params->smallest_removed)
-				memcpy(params->smallest_removed, &ih->key,
-				       sizeof(reiser4_key));
+				node40_ih_read_key(node, ih,
+						   params->smallest_removed);
 
 			cinfo->freed_space_start = ih40_get_offset(ih);
 
 			item_pos += (cinfo->removed_count - 1);
-			ih -= (cinfo->removed_count - 1);
+			ih = node40_ih_at(node, item_pos);
 			cinfo->freed_space_end =
 			    ih40_get_offset(ih) + node40_item_length(node,
 								     item_pos);
@@ -1476,7 +2152,7 @@ prepare_for_compact(struct cut40_info *cinfo,
 						cinfo->removed_count, data);
 
 			item_pos += cinfo->removed_count;
-			ih -= cinfo->removed_count;
+			ih = node40_ih_at(node, item_pos);
 			cinfo->freed_space_end =
 			    ih40_get_offset(ih) + node40_item_length(node,
 								     item_pos);
@@ -1502,8 +2178,8 @@ prepare_for_compact(struct cut40_info *cinfo,
 			ih = node40_ih_at(node, item_pos);
 
 			if (params->smallest_removed)
-				memcpy(params->smallest_removed, &ih->key,
-				       sizeof(reiser4_key));
+				node40_ih_read_key(node, ih,
+						   params->smallest_removed);
 
 			freed =
 			    kill_head_f(params->to, data, NULL, &new_first_key);
@@ -1621,6 +2297,8 @@ struct shift_params {
 				   is set to unit we want to start shifting
 				   from */
 	znode *target;
+	unsigned prefix;	/* number of key elements not stored in item
+				   headers of @target after shift (node42) */
 	int everything;		/* it is set to 1 if everything we have to shift is
 				   shifted, 0 - otherwise */
 
@@ -1652,9 +2330,10 @@ struct shift_params {
 
 };
 
-static int item_creation_overhead(coord_t *item)
+/* size of item header of an item created in @shift->target */
+static int item_creation_overhead(const struct shift_params *shift)
 {
-	return node_plugin_by_coord(item)->item_overhead(item->node, NULL);
+	return node40_ih_size_prefix(shift->prefix);
 }
 
 /* how many units are there in @source starting from source->unit_pos
@@ -1701,8 +2380,12 @@ estimate_shift(struct shift_params *shift, const reiser4_context * ctx)
 	}
 	shift->real_stop = source;
 
-	/* free space in target node and number of items in source */
+	/* free space in target node and number of items in source. Item
+	   headers of target may have to be re-encoded first */
 	target_free_space = znode_free_space(shift->target);
+	size = node40_prefix_cost(shift->target, shift->prefix);
+	target_free_space = target_free_space > size ?
+	    target_free_space - size : 0;
 
 	shift->everything = 0;
 	if (!node_is_empty(shift->target)) {
@@ -1791,14 +2474,14 @@ estimate_shift(struct shift_params *shift, const reiser4_context * ctx)
 			/* we want this item to be copied entirely */
 			size =
 			    item_length_by_coord(&source) +
-			    item_creation_overhead(&source);
+			    item_creation_overhead(shift);
 			if (size <= target_free_space) {
 				/* item fits into target node as whole */
 				target_free_space -= size;
 				shift->shift_bytes +=
-				    size - item_creation_overhead(&source);
+				    size - item_creation_overhead(shift);
 				shift->entire_bytes +=
-				    size - item_creation_overhead(&source);
+				    size - item_creation_overhead(shift);
 				shift->entire++;
 
 				/* update shift->real_stop coord to be set to
@@ -1822,8 +2505,8 @@ estimate_shift(struct shift_params *shift, const reiser4_context * ctx)
 		   space by an item creation overhead. We can reach here also
 		   if stop coord is in this item */
 		if (target_free_space >=
-		    (unsigned)item_creation_overhead(&source)) {
-			target_free_space -= item_creation_overhead(&source);
+		    (unsigned)item_creation_overhead(shift)) {
+			target_free_space -= item_creation_overhead(shift);
 			iplug = item_plugin_by_coord(&source);
 			if (iplug->b.can_shift) {
 				shift->part_units = iplug->b.can_shift(target_free_space,
@@ -1891,6 +2574,59 @@ copy_units(coord_t * target, coord_t * source, unsigned from, unsigned count,
 	}
 }
 
+/* copy @count item headers of @from starting from @from_pos to @to starting
+   from @to_pos. Keys are re-encoded if the nodes store different number of
+   key elements in their node headers */
+static void node40_copy_ih(znode * to, unsigned to_pos, znode * from,
+			   unsigned from_pos, unsigned count)
+{
+	unsigned prefix;
+	unsigned i;
+
+	if (count == 0)
+		return;
+	prefix = node40_prefix(to);
+	if (prefix == node40_prefix(from)) {
+		assert("edward-2335", prefix == 0 ||
+		       !memcmp(node42_node_header(to)->common,
+			       node42_node_header(from)->common,
+			       prefix * sizeof(d64)));
+		memcpy(node40_ih_start(node40_ih_at(to, to_pos + count - 1),
+				       prefix),
+		       node40_ih_start(node40_ih_at(from, from_pos + count - 1),
+				       prefix),
+		       count * node40_ih_size_prefix(prefix));
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		item_header40 *src;
+		item_header40 *dst;
+		reiser4_key key;
+
+		src = node40_ih_at(from, from_pos + i);
+		dst = node40_ih_at(to, to_pos + i);
+		node40_ih_set_key(to, dst, node40_ih_read_key(from, src, &key));
+		/* offset, flags and plugin id */
+		memcpy(&dst->offset, &src->offset,
+		       sizeof(item_header40) - sizeof(reiser4_key));
+	}
+}
+
+/* size of node header of @node. Nodes of different plugins share the tree
+   when "node" mount option is used, so it is taken from target of shift
+   rather than from its source */
+static size_t node40_header_size(const znode * node)
+{
+	switch (node->nplug->h.id) {
+	case NODE41_ID:
+		return sizeof(node41_header);
+	case NODE42_ID:
+		return sizeof(node42_header);
+	default:
+		return sizeof(node40_header);
+	}
+}
+
 /* copy part of @shift->real_stop.node starting either from its beginning or
    from its end and ending at @shift->real_stop to either the end or the
    beginning of @shift->target */
@@ -1899,13 +2635,25 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 	node40_header *nh;
 	coord_t from;
 	coord_t to;
-	item_header40 *from_ih, *to_ih;
+	item_header40 *to_ih;
+	unsigned ih_size;
 	int free_space_start;
 	int new_items;
 	unsigned old_items;
 	int old_offset;
 	unsigned i;
 
+	if (shift->prefix != node40_prefix(shift->target)) {
+		reiser4_key key;
+
+		/* re-encode item headers of target node, see
+		   estimate_shift() */
+		node40_ih_read_key(shift->wish_stop.node,
+				   node40_ih_at(shift->wish_stop.node, 0), &key);
+		node40_set_prefix(shift->target, shift->prefix, &key);
+	}
+	ih_size = node40_ih_size(shift->target);
+
 	nh = node40_node_header(shift->target);
 	free_space_start = nh40_get_free_space_start(nh);
 	old_items = nh40_get_num_items(nh);
@@ -1931,7 +2679,6 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 		/* copying to left */
 
 		coord_set_item_pos(&from, 0);
-		from_ih = node40_ih_at(from.node, 0);
 
 		coord_set_item_pos(&to,
 				   node40_num_of_items_internal(to.node) - 1);
@@ -1950,25 +2697,30 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 				   shift->merging_units, SHIFT_LEFT,
 				   shift->merging_bytes);
 			coord_inc_item_pos(&from);
-			from_ih--;
 			coord_inc_item_pos(&to);
 		}
 
-		to_ih = node40_ih_at(shift->target, old_items);
 		if (shift->entire) {
 			/* copy @entire items entirely */
 
 			/* copy item headers */
-			memcpy(to_ih - shift->entire + 1,
-			       from_ih - shift->entire + 1,
-			       shift->entire * sizeof(item_header40));
+			node40_copy_ih(shift->target, old_items, from.node,
+				       from.item_pos, shift->entire);
 			/* update item header offset */
-			old_offset = ih40_get_offset(from_ih);
+			old_offset =
+			    ih40_get_offset(node40_ih_at(from.node,
+							 from.item_pos));
 			/* AUDIT: Looks like if we calculate old_offset + free_space_start here instead of just old_offset, we can perform one "add" operation less per each iteration */
-			for (i = 0; i < shift->entire; i++, to_ih--, from_ih--)
+			for (i = 0; i < shift->entire; i++) {
+				to_ih = node40_ih_at(shift->target,
+						     old_items + i);
 				ih40_set_offset(to_ih,
-						ih40_get_offset(from_ih) -
+						ih40_get_offset(node40_ih_at
+								(from.node,
+								 from.item_pos +
+								 i)) -
 						old_offset + free_space_start);
+			}
 
 			/* copy item bodies */
 			memcpy(zdata(shift->target) + free_space_start, zdata(from.node) + old_offset,	/*ih40_get_offset (from_ih), */
@@ -1985,7 +2737,7 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 		nh40_set_free_space(nh,
 				    nh40_get_free_space(nh) -
 				    (shift->shift_bytes - shift->merging_bytes +
-				     sizeof(item_header40) * new_items));
+				     ih_size * new_items));
 
 		/* update node header */
 		node40_set_num_items(shift->target, nh, old_items + new_items);
@@ -2000,8 +2752,9 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 			coord_set_item_pos(&to,
 					   node40_num_of_items_internal(to.node)
 					   - 1);
-			memcpy(to_ih, from_ih, sizeof(item_header40));
-			ih40_set_offset(to_ih,
+			node40_copy_ih(shift->target, to.item_pos, from.node,
+				       from.item_pos, 1);
+			ih40_set_offset(node40_ih_at(shift->target, to.item_pos),
 					nh40_get_free_space_start(nh) -
 					shift->part_bytes);
 			if (item_plugin_by_coord(&to)->b.init)
@@ -2016,7 +2769,6 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 
 		coord_set_item_pos(&from,
 				   node40_num_of_items_internal(from.node) - 1);
-		from_ih = node40_ih_at_coord(&from);
 
 		coord_set_item_pos(&to, 0);
 
@@ -2035,16 +2787,15 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 					shift->shift_bytes -
 					shift->merging_bytes);
 
-		for (i = 1; i < old_items; i++)
-			ih40_set_offset(to_ih - i,
-					ih40_get_offset(to_ih - i) +
+		for (i = 1; i < old_items; i++) {
+			to_ih = node40_ih_at(to.node, i);
+			ih40_set_offset(to_ih,
+					ih40_get_offset(to_ih) +
 					shift->shift_bytes);
+		}
 
 		/* move item headers to make space for new items */
-		memmove(to_ih - old_items + 1 - new_items,
-			to_ih - old_items + 1,
-			sizeof(item_header40) * old_items);
-		to_ih -= (new_items - 1);
+		node40_ih_move(to.node, new_items, 0, old_items);
 
 		nh40_set_free_space_start(nh,
 					  free_space_start +
@@ -2052,7 +2803,7 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 		nh40_set_free_space(nh,
 				    nh40_get_free_space(nh) -
 				    (shift->shift_bytes +
-				     sizeof(item_header40) * new_items));
+				     ih_size * new_items));
 
 		/* update node header */
 		node40_set_num_items(shift->target, nh, old_items + new_items);
@@ -2070,26 +2821,35 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 				   shift->merging_units, SHIFT_RIGHT,
 				   shift->merging_bytes);
 			coord_dec_item_pos(&from);
-			from_ih++;
 		}
 
 		if (shift->entire) {
 			/* copy @entire items entirely */
 
 			/* copy item headers */
-			memcpy(to_ih, from_ih,
-			       shift->entire * sizeof(item_header40));
+			node40_copy_ih(to.node, new_items - shift->entire,
+				       from.node,
+				       from.item_pos - shift->entire + 1,
+				       shift->entire);
 
 			/* update item header offset */
 			old_offset =
-			    ih40_get_offset(from_ih + shift->entire - 1);
+			    ih40_get_offset(node40_ih_at(from.node,
+							 from.item_pos -
+							 shift->entire + 1));
 			/* AUDIT: old_offset + sizeof (node40_header) + shift->part_bytes calculation can be taken off the loop. */
-			for (i = 0; i < shift->entire; i++, to_ih++, from_ih++)
+			for (i = 0; i < shift->entire; i++) {
+				to_ih = node40_ih_at(to.node,
+						     new_items - 1 - i);
 				ih40_set_offset(to_ih,
-						ih40_get_offset(from_ih) -
+						ih40_get_offset(node40_ih_at
+								(from.node,
+								 from.item_pos -
+								 i)) -
 						old_offset +
 						node_header_size +
 						shift->part_bytes);
+			}
 			/* copy item bodies */
 			coord_add_item_pos(&from, -(int)(shift->entire - 1));
 			memcpy(zdata(to.node) + node_header_size +
@@ -2106,8 +2866,9 @@ static void copy(struct shift_params *shift, size_t node_header_size)
 			   a new item into @target->node */
 
 			/* copy item header of partially copied item */
-			memcpy(to_ih, from_ih, sizeof(item_header40));
-			ih40_set_offset(to_ih, node_header_size);
+			node40_copy_ih(to.node, 0, from.node, from.item_pos, 1);
+			ih40_set_offset(node40_ih_at(to.node, 0),
+					node_header_size);
 			if (item_plugin_by_coord(&to)->b.init)
 				item_plugin_by_coord(&to)->b.init(&to, &from,
 								  NULL);
@@ -2623,7 +3384,7 @@ void *shift_check_prepare(const znode * left, const znode * right)
 			coord_set_item_pos(&coord, item_pos);
 			ih = node40_ih_at_coord(&coord);
 
-			data[i].key = ih->key;
+			node40_ih_read_key(coord.node, ih, &data[i].key);
 			data[i].plugin_id = le16_to_cpu(get_unaligned(&ih->plugin_id));
 			switch (data[i].plugin_id) {
 			case CTAIL_ID:
@@ -2683,7 +3444,7 @@ void *shift_check_prepare(const znode * left, const znode * right)
 			coord_set_item_pos(&coord, item_pos);
 			ih = node40_ih_at_coord(&coord);
 
-			data[i].key = ih->key;
+			node40_ih_read_key(coord.node, ih, &data[i].key);
 			data[i].plugin_id = le16_to_cpu(get_unaligned(&ih->plugin_id));
 			switch (data[i].plugin_id) {
 			case CTAIL_ID:
@@ -2716,6 +3477,7 @@ void shift_check(void *vp, const znode * left, const znode * right)
 	__u64 last_bytes;
 	int mergeable;
 	item_header40 *ih;
+	reiser4_key key;
 	pos_in_node_t item_pos;
 	struct shift_check *data;
 
@@ -2750,7 +3512,8 @@ void shift_check(void *vp, const znode * left, const znode * right)
 		ih = node40_ih_at_coord(&coord);
 
 		assert("vs-1611", i == item_pos);
-		assert("vs-1590", keyeq(&ih->key, &data[i].key));
+		assert("vs-1590",
+		       keyeq(node40_ih_key(coord.node, ih, &key), &data[i].key));
 		assert("vs-1591",
 		       le16_to_cpu(get_unaligned(&ih->plugin_id)) == data[i].plugin_id);
 		if ((i < (node40_num_of_items_internal(left) - 1))
@@ -2842,7 +3605,8 @@ void shift_check(void *vp, const znode * left, const znode * right)
 		coord_set_item_pos(&coord, item_pos);
 		ih = node40_ih_at_coord(&coord);
 
-		assert("vs-1612", keyeq(&ih->key, &data[i].key));
+		assert("vs-1612",
+		       keyeq(node40_ih_key(coord.node, ih, &key), &data[i].key));
 		assert("vs-1613",
 		       le16_to_cpu(get_unaligned(&ih->plugin_id)) == data[i].plugin_id);
 		switch (data[i].plugin_id) {
@@ -2885,8 +3649,7 @@ int shift_node40_common(coord_t *from, znode *to,
 					   * it will be deleted from the
 					   * tree if this is set to 1 */
 			int including_stop_coord,
-			carry_plugin_info *info,
-			size_t node_header_size)
+			carry_plugin_info *info)
 {
 	struct shift_params shift;
 	int result;
@@ -2946,6 +3709,8 @@ int shift_node40_common(coord_t *from, znode *to,
 	/* when first node plugin with item body compression is implemented,
 	   this must be changed to call node specific plugin */
 
+	shift.prefix = node40_shift_prefix(to, source);
+
 	/* shift->stop_coord is updated to last unit which really will be
 	   shifted */
 	estimate_shift(&shift, get_current_context());
@@ -2955,7 +3720,9 @@ int shift_node40_common(coord_t *from, znode *to,
 		return 0;
 	}
 
-	copy(&shift, node_header_size);
+	copy(&shift, node40_header_size(shift.target));
+	node40_sindex_refill(shift.target);
+	node40_pack(shift.target);
 
 	/* result value of this is important. It is used by adjust_coord below */
 	result = delete_copied(&shift);
@@ -3016,8 +3783,7 @@ int shift_node40(coord_t *from, znode *to,
 		 carry_plugin_info *info)
 {
 	return shift_node40_common(from, to, pend, delete_child,
-				   including_stop_coord, info,
-				   sizeof(node40_header));
+				   including_stop_coord, info);
 }
 
 /* plugin->u.node.fast_insert()
@@ -67,10 +67,28 @@ typedef struct item_header40 {
 	/* 28 */ d16 plugin_id;
 } PACKED item_header40;
 
+/* in-memory search index attached to znode of node40 layout. See comment
+   before lookup_node40() */
+struct node40_sindex {
+	/* number of items index describes */
+	__u16 nr;
+	/* number of entries ->elem[] has room for */
+	__u16 size;
+	/* number of leading key elements shared by all keys in the node, also
+	   index of key element stored in ->elem[] */
+	__u16 el;
+	/* those shared leading elements, in native byte order */
+	__u64 common[KEY_LAST_INDEX];
+	/* @el-th element of the key of every item, in native byte order */
+	__u64 elem[0];
+};
+
 size_t item_overhead_node40(const znode * node, flow_t * aflow);
 size_t free_space_node40(znode * node);
 node_search_result lookup_node40(znode * node, const reiser4_key * key,
 				 lookup_bias bias, coord_t * coord);
+int peek_child_node40(znode * node, const reiser4_key * key,
+		      reiser4_block_nr * block);
 int num_of_items_node40(const znode * node);
 char *item_by_coord_node40(const coord_t * coord);
 int length_by_coord_node40(const coord_t * coord);
@@ -99,7 +117,7 @@ int kill_node40(struct carry_kill_data *, carry_plugin_info *);
 int cut_node40(struct carry_cut_data *, carry_plugin_info *);
 int shift_node40_common(coord_t *from, znode *to, shift_direction pend,
 			int delete_child, int including_stop_coord,
-			carry_plugin_info *info, size_t nh_size);
+			carry_plugin_info *info);
 int shift_node40(coord_t *from, znode *to, shift_direction pend,
 		 int delete_child, int including_stop_coord,
 		 carry_plugin_info *info);
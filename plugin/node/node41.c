@@ -104,8 +104,7 @@ int shift_node41(coord_t *from, znode *to,
 		 carry_plugin_info *info)
 {
 	return shift_node40_common(from, to, pend, delete_child,
-				   including_stop_coord, info,
-				   sizeof(node41_header));
+				   including_stop_coord, info);
 }
 
 #ifdef GUESS_EXISTS
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by reiser4/README
+ */
+
+#include "../../debug.h"
+#include "../../key.h"
+#include "../../coord.h"
+#include "../plugin_header.h"
+#include "../item/item.h"
+#include "node.h"
+#include "node42.h"
+#include "../plugin.h"
+#include "../../jnode.h"
+#include "../../znode.h"
+#include "../../pool.h"
+#include "../../carry.h"
+#include "../../tap.h"
+#include "../../tree.h"
+#include "../../super.h"
+#include "../../checksum.h"
+#include "../../reiser4.h"
+
+#include <linux/types.h>
+#include <linux/prefetch.h>
+
+/*
+ * node42 layout is node41 layout with prefix compressed item keys.
+ *
+ * Keys of items of a leaf node usually share several leading elements: all
+ * items of a file body share everything but offset, all entries of a
+ * directory share locality. node42_header stores the number of leading
+ * key elements shared by all items of the node (prefix) and the elements
+ * themselves, item headers keep only the rest of the key:
+ *
+ * [node42 header | item 0, .., item N-1 | free space | item_head N-1, .., item_head 0 ]
+ *  node41 header                                         key elements prefix..
+ *  prefix (8)                                            offset (16)
+ *  shared key elements                                   flags (16)
+ *                                                        plugin_id (16)
+ *
+ * With prefix 0 item headers are identical to the ones of node40. Item
+ * headers are handled by the code in node40.c.
+ *
+ * Prefix is relative to the keys stored in the node itself rather than to
+ * its left delimiting key: delimiting keys are kept in memory only and can
+ * change without the node being modified.
+ *
+ * Prefix never exceeds node42_prefix_limit() of keys in the node. This is 0
+ * for internal nodes, because keys of internal items are replaced by
+ * delimiting key updates, and depends on key type in leaves. Hence pasting
+ * into an item, cutting its head or updating its key never changes the
+ * elements stored in the node header. Only creation of an item or shifting
+ * of items into a node can make prefix shorter. This re-encodes all item
+ * headers and takes free space, which is accounted by item_overhead_node42()
+ * and by estimate of shift. When items are removed from or shifted into the
+ * node, item headers are packed again.
+ */
+
+static const __u32 REISER4_NODE42_MAGIC = 0x52344e32;	/* "R4N2" */
+
+/* how many leading elements of @key can be stored in the header of @node */
+unsigned node42_prefix_limit(const znode *node, const reiser4_key *key)
+{
+	if (znode_get_level(node) != LEAF_LEVEL)
+		return 0;
+
+	switch (get_key_type(key)) {
+	case KEY_SD_MINOR:
+	case KEY_BODY_MINOR:
+		/* keys of all units of an item differ in offset only */
+		return KEY_OFFSET_INDEX;
+	case KEY_FILE_NAME_MINOR:
+	case KEY_ATTR_NAME_MINOR:
+	case KEY_ATTR_BODY_MINOR:
+		/* units of an item share locality only */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* number of leading key elements @node can keep in its header when an item
+   with @key is added to it */
+unsigned node42_prefix_with(const znode *node, const reiser4_key *key)
+{
+	node42_header *nh;
+	unsigned prefix;
+	unsigned el;
+
+	prefix = node42_prefix_limit(node, key);
+	if (node_num_items(node) == 0)
+		return prefix;
+
+	nh = node42_node_header(node);
+	prefix = min(prefix, (unsigned)nh42_get_prefix(nh));
+	for (el = 0; el < prefix; ++el)
+		if (get_unaligned(&nh->common[el]) != key->el[el])
+			break;
+	return el;
+}
+
+/*
+ * plugin->u.node.item_overhead
+ * look for description of this method in plugin/node/node.h
+ *
+ * Only key of @f is used. It tells whether headers of existing items have to
+ * be re-encoded
+ */
+size_t item_overhead_node42(const znode *node, flow_t *f)
+{
+	unsigned old;
+	unsigned prefix;
+	size_t result;
+
+	old = nh42_get_prefix(node42_node_header(node));
+	if (f == NULL)
+		return sizeof(item_header40) - old * sizeof(d64);
+
+	prefix = node42_prefix_with(node, &f->key);
+	result = sizeof(item_header40) - prefix * sizeof(d64);
+	if (prefix < old)
+		result += node_num_items(node) * (old - prefix) * sizeof(d64);
+	return result;
+}
+
+/*
+ * plugin->u.node.peek_child
+ * look for description of this method in plugin/node/node.h
+ */
+int peek_child_node42(znode *node, const reiser4_key *key,
+		      reiser4_block_nr *block)
+{
+	/* internal nodes are never prefix compressed. Node is not locked
+	   though, and can be anything */
+	if (nh42_get_prefix(node42_node_header(node)) != 0)
+		return RETERR(-E_REPEAT);
+	return peek_child_node40(node, key, block);
+}
+
+/*
+ * plugin->u.node.parse
+ * look for description of this method in plugin/node/node.h
+ */
+int parse_node42(znode *node /* node to parse */)
+{
+	unsigned prefix;
+	int ret;
+
+	ret = csum_node41(node, 1/* check */);
+	if (!ret) {
+		warning("edward-2336",
+			"block %llu: bad checksum. FSCK?",
+			*jnode_get_block(ZJNODE(node)));
+		reiser4_handle_error();
+		return RETERR(-EIO);
+	}
+	ret = parse_node40_common(node, REISER4_NODE42_MAGIC);
+	if (ret)
+		return ret;
+	prefix = nh42_get_prefix(node42_node_header(node));
+	if (prefix >= KEY_LAST_INDEX ||
+	    (prefix != 0 && znode_get_level(node) != LEAF_LEVEL)) {
+		warning("edward-2337",
+			"block %llu: wrong key prefix %u. FSCK?",
+			*jnode_get_block(ZJNODE(node)), prefix);
+		reiser4_handle_error();
+		return RETERR(-EIO);
+	}
+	return 0;
+}
+
+/*
+ * plugin->u.node.init
+ * look for description of this method in plugin/node/node.h
+ */
+int init_node42(znode *node /* node to initialise */)
+{
+	node42_header *nh;
+	int ret;
+
+	ret = init_node40_common(node, node_plugin_by_id(NODE42_ID),
+				 sizeof(node42_header), REISER4_NODE42_MAGIC);
+	nh = node42_node_header(node);
+	nh42_set_prefix(nh, 0);
+	memset(nh->common, 0, sizeof(nh->common));
+	return ret;
+}
+
+/*
+ * plugin->u.node.shift
+ * look for description of this method in plugin/node/node.h
+ */
+int shift_node42(coord_t *from, znode *to,
+		 shift_direction pend,
+		 int delete_child, /* if @from->node becomes empty,
+				    * it will be deleted from the
+				    * tree if this is set to 1 */
+		 int including_stop_coord,
+		 carry_plugin_info *info)
+{
+	return shift_node40_common(from, to, pend, delete_child,
+				   including_stop_coord, info);
+}
+
+#ifdef GUESS_EXISTS
+int guess_node42(const znode *node /* node to guess plugin of */)
+{
+	return guess_node40_common(node, NODE42_ID, REISER4_NODE42_MAGIC);
+}
+#endif
+
+/*
+ * plugin->u.node.max_item_size
+ */
+int max_item_size_node42(void)
+{
+	return reiser4_get_current_sb()->s_blocksize - sizeof(node42_header) -
+		sizeof(item_header40);
+}
+
+/*
+   Local variables:
+   c-indentation-style: "K&R"
+   mode-name: "LC"
+   c-basic-offset: 8
+   tab-width: 8
+   fill-column: 80
+   scroll-step: 1
+   End:
+*/
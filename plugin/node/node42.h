@@ -0,0 +1,63 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by reiser4/README */
+
+#if !defined( __REISER4_NODE42_H__ )
+#define __REISER4_NODE42_H__
+
+#include "../../forward.h"
+#include "../../dformat.h"
+#include "node41.h"
+#include <linux/types.h>
+
+/*
+ * node42 layout: the same as node41, but item headers carry only those key
+ * elements which are not shared by all items of the node. Shared leading
+ * elements (key prefix) are stored once in the node header. See comment at
+ * the beginning of node42.c
+ */
+
+typedef struct node42_header {
+	node41_header head;
+	/* number of leading key elements shared by all items in the node */
+	d8 prefix;
+	/* those elements */
+	d64 common[KEY_LAST_INDEX - 1];
+} PACKED node42_header;
+
+/*
+ * functions to get/set fields of node42_header
+ */
+#define nh42_get_prefix(nh) get_unaligned(&(nh)->prefix)
+#define nh42_set_prefix(nh, value) put_unaligned(value, &(nh)->prefix)
+
+#define node42_node_header(node) ((node42_header *)zdata(node))
+
+unsigned node42_prefix_limit(const znode *node, const reiser4_key *key);
+unsigned node42_prefix_with(const znode *node, const reiser4_key *key);
+size_t item_overhead_node42(const znode *node, flow_t *f);
+node_search_result lookup_node42(znode *node, const reiser4_key *key,
+				 lookup_bias bias, coord_t *coord);
+int peek_child_node42(znode *node, const reiser4_key *key,
+		      reiser4_block_nr *block);
+int init_node42(znode *node);
+int parse_node42(znode *node);
+int max_item_size_node42(void);
+int shift_node42(coord_t *from, znode *to, shift_direction pend,
+		 int delete_child, int including_stop_coord,
+		 carry_plugin_info *info);
+
+#ifdef GUESS_EXISTS
+int guess_node42(const znode *node);
+#endif
+
+/* __REISER4_NODE42_H__ */
+#endif
+/*
+   Local variables:
+   c-indentation-style: "K&R"
+   mode-name: "LC"
+   c-basic-offset: 8
+   tab-width: 8
+   fill-column: 80
+   scroll-step: 1
+   End:
+*/
@@ -555,6 +555,15 @@ struct reiser4_plugin_type_data plugins[REISER4_PLUGIN_TYPES] = {
 		.builtin = txmod_plugins,
 		.plugins_list = {NULL, NULL},
 		.size = sizeof(txmod_plugin)
+	},
+	[REISER4_ALLOC_POLICY_PLUGIN_TYPE] = {
+		.type_id = REISER4_ALLOC_POLICY_PLUGIN_TYPE,
+		.label = "alloc_policy",
+		.desc = "Defines block placement policy",
+		.builtin_num = sizeof_array(alloc_policy_plugins),
+		.builtin = alloc_policy_plugins,
+		.plugins_list = {NULL, NULL},
+		.size = sizeof(alloc_policy_plugin)
 	}
 };
 
@@ -21,6 +21,7 @@
 #include "item/item.h"
 #include "node/node.h"
 #include "node/node41.h"
+#include "node/node42.h"
 #include "security/perm.h"
 #include "fibration.h"
 
@@ -528,6 +529,29 @@ typedef struct txmod_plugin {
 				reiser4_key *stop_key); // was_squalloc_extent
 } txmod_plugin;
 
+/**
+ * Plugins of this interface decide where to start search of free blocks for
+ * nodes which have no preceder (see get_blocknr_hint_default()), and keep
+ * track of recently written or allocated blocks for that.
+ */
+typedef struct alloc_policy_plugin {
+	/* generic fields */
+	plugin_header h;
+	/* called on mount after block count is known */
+	int (*init)(struct super_block *);
+	/* called on umount */
+	void (*done)(struct super_block *);
+	/* get block to start search of free blocks from */
+	void (*get_hint)(const struct super_block *, reiser4_block_nr *);
+	/* @block was written, next allocations should go near it */
+	void (*update_hint)(const struct super_block *,
+			    const reiser4_block_nr *block);
+	/* @len blocks starting from @start were allocated */
+	void (*allocated)(const struct super_block *,
+			  const reiser4_block_nr *start,
+			  const reiser4_block_nr *len);
+} alloc_policy_plugin;
+
 typedef struct hash_plugin {
 	/* generic fields */
 	plugin_header h;
@@ -723,6 +747,8 @@ union reiser4_plugin {
 	cluster_plugin clust;
 	/* transaction mode plugin */
 	txmod_plugin txmod;
+	/* block placement policy plugin */
+	alloc_policy_plugin alloc_policy;
 	/* place-holder for new plugin types that can be registered
 	   dynamically, and used by other dynamically loaded plugins.  */
 	void *generic;
@@ -821,9 +847,17 @@ typedef enum {
 	HYBRID_TXMOD_ID,
 	JOURNAL_TXMOD_ID,
 	WA_TXMOD_ID,
+	LOG_TXMOD_ID,
 	LAST_TXMOD_ID
 } reiser4_txmod_id;
 
+/* builtin block placement policies */
+typedef enum {
+	GLOBAL_ALLOC_POLICY_ID,
+	PERCPU_ALLOC_POLICY_ID,
+	LAST_ALLOC_POLICY_ID
+} reiser4_alloc_policy_id;
+
 
 /* data type used to pack parameters that we pass to vfs object creation
    function create_object() */
@@ -922,6 +956,8 @@ PLUGIN_BY_ID(compression_mode_plugin, REISER4_COMPRESSION_MODE_PLUGIN_TYPE,
 	     compression_mode);
 PLUGIN_BY_ID(cluster_plugin, REISER4_CLUSTER_PLUGIN_TYPE, clust);
 PLUGIN_BY_ID(txmod_plugin, REISER4_TXMOD_PLUGIN_TYPE, txmod);
+PLUGIN_BY_ID(alloc_policy_plugin, REISER4_ALLOC_POLICY_PLUGIN_TYPE,
+	     alloc_policy);
 
 extern int save_plugin_id(reiser4_plugin * plugin, d16 * area);
 
@@ -951,6 +987,8 @@ extern hash_plugin hash_plugins[LAST_HASH_ID];
 extern fibration_plugin fibration_plugins[LAST_FIBRATION_ID];
 /* defined in fs/reiser4/plugin/txmod.c */
 extern txmod_plugin txmod_plugins[LAST_TXMOD_ID];
+/* defined in fs/reiser4/plugin/alloc_policy.c */
+extern alloc_policy_plugin alloc_policy_plugins[LAST_ALLOC_POLICY_ID];
 /* defined in fs/reiser4/plugin/crypt.c */
 extern cipher_plugin cipher_plugins[LAST_CIPHER_ID];
 /* defined in fs/reiser4/plugin/digest.c */
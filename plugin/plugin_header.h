@@ -29,6 +29,7 @@ typedef enum {
 	REISER4_COMPRESSION_MODE_PLUGIN_TYPE, /* dispatching policies */
 	REISER4_CLUSTER_PLUGIN_TYPE,          /* manage logical clusters */
 	REISER4_TXMOD_PLUGIN_TYPE,            /* transaction models */
+	REISER4_ALLOC_POLICY_PLUGIN_TYPE,     /* block placement policies */
 	REISER4_PLUGIN_TYPES
 } reiser4_plugin_type;
 
@@ -3,10 +3,12 @@
 #include "../../debug.h"
 #include "../../dformat.h"
 #include "../../txnmgr.h"
+#include "../../wander.h"
 #include "../../jnode.h"
 #include "../../block_alloc.h"
 #include "../../tree.h"
 #include "../../super.h"
+#include "../../context.h"
 #include "../plugin.h"
 #include "space_allocator.h"
 #include "bitmap.h"
@@ -14,42 +16,31 @@
 #include <linux/types.h>
 #include <linux/fs.h>		/* for struct super_block  */
 #include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/log2.h>	/* for roundup_pow_of_two() */
+#include <linux/string.h>	/* for memweight() */
 #include <asm/div64.h>
 
-/* Proposed (but discarded) optimization: dynamic loading/unloading of bitmap
- * blocks
-
-   A useful optimization of reiser4 bitmap handling would be dynamic bitmap
-   blocks loading/unloading which is different from v3.x where all bitmap
-   blocks are loaded at mount time.
-
-   To implement bitmap blocks unloading we need to count bitmap block usage
-   and detect currently unused blocks allowing them to be unloaded. It is not
-   a simple task since we allow several threads to modify one bitmap block
-   simultaneously.
-
-   Briefly speaking, the following schema is proposed: we count in special
-   variable associated with each bitmap block. That is for counting of block
-   alloc/dealloc operations on that bitmap block. With a deferred block
-   deallocation feature of reiser4 all those operation will be represented in
-   atom dirty/deleted lists as jnodes for freshly allocated or deleted
-   nodes.
-
-   So, we increment usage counter for each new node allocated or deleted, and
-   decrement it at atom commit one time for each node from the dirty/deleted
-   atom's list.  Of course, freshly allocated node deletion and node reusing
-   from atom deleted (if we do so) list should decrement bitmap usage counter
-   also.
-
-   This schema seems to be working but that reference counting is
-   not easy to debug. I think we should agree with Hans and do not implement
-   it in v4.0. Current code implements "on-demand" bitmap blocks loading only.
-
-   For simplicity all bitmap nodes (both commit and working bitmap blocks) are
-   loaded into memory on fs mount time or each bitmap nodes are loaded at the
-   first access to it, the "dont_load_bitmap" mount option controls whether
-   bimtap nodes should be loaded at mount time. Dynamic unloading of bitmap
-   nodes currently is not supported. */
+/* Dynamic loading/unloading of bitmap blocks
+
+   Bitmap nodes (both commit and working bitmap blocks) are loaded into memory
+   on fs mount time or at the first access to them, the "dont_load_bitmap"
+   mount option controls whether bitmap nodes should be loaded at mount time.
+
+   On a large volume bitmaps take a lot of memory, so a bitmap node which is
+   not used is released by a shrinker (see bitmap_shrink_scan()) under memory
+   pressure. The node is re-read from disk at the next access.
+
+   To drop a bitmap node we have to know that it is not used. Counting of
+   alloc/dealloc operations not yet applied to the COMMIT bitmap, which was
+   proposed for this, is not needed: the WORKING bitmap is the COMMIT one
+   plus such operations, so a node whose WORKING bitmap equals to its COMMIT
+   bitmap can be re-created from disk as is. In addition, COMMIT bitmap block
+   should not be a part of any atom (that is, not modified by pre-commit hook
+   and not being written), and the node should not be accessed for some time
+   (BITMAP_IDLE_TIME), so that hot bitmaps are not compared over and over.
+   All this is checked under bitmap node mutex, and load_and_lock_bnode()
+   re-checks under the mutex that the node is still loaded. */
 
 #define CHECKSUM_SIZE    4
 
@@ -78,10 +69,23 @@ struct bitmap_node {
 
 	bmap_off_t first_zero_bit;	/* for skip_busy option implementation */
 
+	bmap_off_t nr_busy;	/* number of set bits in WORKING bitmap, this
+				 * is usage of log txmod segment */
+
+	bmap_off_t max_free;	/* length of the longest run of zero bits in
+				 * WORKING bitmap, or larger. Mirrored in the
+				 * free-extent index */
+
 	atomic_t loaded;	/* a flag which shows that bnode is loaded
 				 * already */
+
+	unsigned long last_used;	/* jiffies when bnode was released
+					 * last time */
 };
 
+/* bitmap node not used for this time can be dropped by the shrinker */
+#define BITMAP_IDLE_TIME (5 * HZ)
+
 static inline char *bnode_working_data(struct bitmap_node *bnode)
 {
 	char *data;
@@ -134,10 +138,23 @@ static inline void bnode_set_commit_crc(struct bitmap_node *bnode, __u32 crc)
 struct bitmap_allocator_data {
 	/* an array for bitmap blocks direct access */
 	struct bitmap_node *bitmap;
+	/* free-extent index, see free_index_find() */
+	spinlock_t fi_guard;
+	/* number of leaves of the index, power of 2 */
+	bmap_nr_t fi_size;
+	/* max-tree over ->max_free of bitmap nodes, 2 * @fi_size elements */
+	bmap_off_t *fi_max;
+	/* releases idle bitmap nodes, see bitmap_shrink_scan() */
+	struct shrinker shrinker;
+	/* bitmap node the shrinker starts from */
+	bmap_nr_t shrink_cursor;
+	struct super_block *super;
 };
 
-#define get_barray(super) \
-(((struct bitmap_allocator_data *)(get_super_private(super)->space_allocator.u.generic)) -> bitmap)
+#define get_bdata(super) \
+((struct bitmap_allocator_data *)(get_super_private(super)->space_allocator.u.generic))
+
+#define get_barray(super) (get_bdata(super)->bitmap)
 
 #define get_bnode(super, i) (get_barray(super) + i)
 
@@ -373,6 +390,41 @@ reiser4_find_last_zero_bit(bmap_off_t * result, void *addr, bmap_off_t low_off,
 	return -1;		/* zero bit not found */
 }
 
+/* Search for the first run of at least @len zero bits in the bit array
+ * [@start_offset, @max_offset[. A candidate run is checked from its end
+ * backward: if it has a set bit, the next candidate starts right after the
+ * last set bit, so bits in between are skipped without scanning, and bits
+ * already known to be zero are not scanned again. Return the offset of the
+ * run if it is found, @max_offset otherwise. */
+static bmap_off_t reiser4_find_zero_run(void *addr, bmap_off_t max_offset,
+					bmap_off_t start_offset, bmap_off_t len)
+{
+	bmap_off_t start = start_offset;
+	/* bits [start, clean[ are known to be zero */
+	bmap_off_t clean = start_offset;
+	bmap_off_t last;
+
+	assert("edward-2389", len > 0);
+
+	while (1) {
+		start = reiser4_find_next_zero_bit(addr, max_offset, start);
+		if (start >= max_offset || max_offset - start < len)
+			return max_offset;
+		if (clean <= start)
+			clean = start + 1;
+		/* reiser4_find_last_set_bit() does not clamp its result to
+		   @low_off within the first word: set bit below @clean is
+		   outside of the candidate run */
+		if (clean >= start + len ||
+		    reiser4_find_last_set_bit(&last, addr, clean,
+					      start + len - 1) != 0 ||
+		    last < clean)
+			return start;
+		clean = start + len;
+		start = last + 1;
+	}
+}
+
 /* Audited by: green(2002.06.12) */
 static void reiser4_clear_bits(char *addr, bmap_off_t start, bmap_off_t end)
 {
@@ -474,6 +526,19 @@ __u32 reiser4_adler32(char *data, __u32 len)
 		k = len < ADLER_NMAX ? len : ADLER_NMAX;
 		len -= k;
 
+		/* unrolled as in later zlib versions */
+		while (k >= 8) {
+			s1 += t[0]; s2 += s1;
+			s1 += t[1]; s2 += s1;
+			s1 += t[2]; s2 += s1;
+			s1 += t[3]; s2 += s1;
+			s1 += t[4]; s2 += s1;
+			s1 += t[5]; s2 += s1;
+			s1 += t[6]; s2 += s1;
+			s1 += t[7]; s2 += s1;
+			t += 8;
+			k -= 8;
+		}
 		while (k--) {
 			s1 += *t++;
 			s2 += s1;
@@ -550,6 +615,62 @@ adler32_recalc(__u32 adler, unsigned char old_data, unsigned char data,
 	return (s2 << 16) | s1;
 }
 
+/* Sets (@set != 0) or clears bits [@start, @end) of COMMIT bitmap of @bnode
+   and updates its checksum in one pass over changed bytes only. Change of
+   byte k by delta changes the lower half of adler32 by delta and the upper
+   half by delta * (@size - k), where @size is length of the bitmap data.
+   All deltas have the same sign, so their absolute values are summed */
+static void
+commit_bits_change(struct bitmap_node *bnode, bmap_off_t start,
+		   bmap_off_t end, int set, __u32 size)
+{
+	unsigned char *data = (unsigned char *)bnode_commit_data(bnode);
+	__u32 adler = bnode_commit_crc(bnode);
+	__u32 s1 = adler & 0xffff;
+	__u32 s2 = (adler >> 16) & 0xffff;
+	__u32 d1 = 0;
+	__u32 d2 = 0;
+	__u32 first;
+	__u32 last;
+	__u32 k;
+
+	assert("edward-2386", start < end);
+	assert("edward-2387", ((end - 1) >> 3) < size);
+
+	first = start >> 3;
+	last = (end - 1) >> 3;
+	for (k = first; k <= last; k++) {
+		unsigned char mask = 0xFF;
+		unsigned char old = data[k];
+		__u32 delta;
+
+		if (k == first)
+			mask <<= start & 0x7;
+		if (k == last)
+			mask &= 0xFF >> (7 - ((end - 1) & 0x7));
+		if (set) {
+			data[k] = old | mask;
+			delta = data[k] - old;
+		} else {
+			data[k] = old & ~mask;
+			delta = old - data[k];
+		}
+		if (delta == 0)
+			continue;
+		d1 += delta;
+		d2 = (d2 + delta * (size - k)) % ADLER_BASE;
+	}
+	d1 %= ADLER_BASE;
+	if (set) {
+		s1 = (s1 + d1) % ADLER_BASE;
+		s2 = (s2 + d2) % ADLER_BASE;
+	} else {
+		s1 = (s1 + ADLER_BASE - d1) % ADLER_BASE;
+		s2 = (s2 + ADLER_BASE - d2) % ADLER_BASE;
+	}
+	bnode_set_commit_crc(bnode, (s2 << 16) | s1);
+}
+
 #define LIMIT(val, boundary) ((val) > (boundary) ? (boundary) : (val))
 
 /**
@@ -650,6 +771,118 @@ adjust_first_zero_bit(struct bitmap_node *bnode, bmap_off_t offset)
 		bnode->first_zero_bit = offset;
 }
 
+/* Free-extent index.
+
+   Every bitmap node knows the length of the longest free run of its WORKING
+   bitmap (->max_free). The index is a tree of maximums over those lengths in
+   bitmap order, so that the first bitmap at or after a given one which may
+   have a free run of given length is found in O(log(number of bitmaps)),
+   without loading and scanning bitmaps which can not satisfy the request.
+
+   ->max_free is an upper bound: allocation does not decrease it, because
+   finding the new longest run would cost a scan of the whole bitmap. It is
+   made exact when a scan of the whole bitmap fails to find a long enough run
+   or when bitmap is loaded. Bitmaps which are not loaded yet are indexed as
+   completely free. */
+
+/* length of the longest run of zero bits in @data */
+static bmap_off_t longest_free_run(void *data, bmap_off_t max_offset)
+{
+	bmap_off_t longest = 0;
+	bmap_off_t start = 0;
+	bmap_off_t end;
+
+	while (start < max_offset) {
+		start = reiser4_find_next_zero_bit(data, max_offset, start);
+		if (start >= max_offset)
+			break;
+		end = reiser4_find_next_set_bit(data, max_offset, start);
+		if (end > max_offset)
+			end = max_offset;
+		if (end - start > longest)
+			longest = end - start;
+		start = end + 1;
+	}
+	return longest;
+}
+
+/* set ->max_free of bitmap node @bmap and update the index */
+static void free_index_set(struct super_block *super, bmap_nr_t bmap,
+			   bmap_off_t max_free)
+{
+	struct bitmap_allocator_data *bdata = get_bdata(super);
+	bmap_nr_t k;
+
+	get_bnode(super, bmap)->max_free = max_free;
+
+	spin_lock(&bdata->fi_guard);
+	k = bdata->fi_size + bmap;
+	bdata->fi_max[k] = max_free;
+	for (k >>= 1; k != 0; k >>= 1) {
+		bmap_off_t m = max(bdata->fi_max[2 * k],
+				   bdata->fi_max[2 * k + 1]);
+
+		if (bdata->fi_max[k] == m)
+			break;
+		bdata->fi_max[k] = m;
+	}
+	spin_unlock(&bdata->fi_guard);
+}
+
+/* find first bitmap in [@from, @to) which may have @len free blocks in a row.
+   Returns @to if there is no such bitmap */
+static bmap_nr_t free_index_find(struct super_block *super, bmap_nr_t from,
+				 bmap_nr_t to, bmap_off_t len)
+{
+	struct bitmap_allocator_data *bdata = get_bdata(super);
+	bmap_nr_t k;
+
+	assert("edward-2383", from < bdata->fi_size);
+
+	spin_lock(&bdata->fi_guard);
+	k = bdata->fi_size + from;
+	if (bdata->fi_max[k] < len) {
+		/* go up until there is a fitting subtree on the right */
+		while (1) {
+			if (k == 1) {
+				spin_unlock(&bdata->fi_guard);
+				return to;
+			}
+			if (!(k & 1) && bdata->fi_max[k + 1] >= len) {
+				k++;
+				break;
+			}
+			k >>= 1;
+		}
+		/* go down to the leftmost fitting leaf */
+		while (k < bdata->fi_size)
+			k = (bdata->fi_max[2 * k] >= len) ? 2 * k : 2 * k + 1;
+	}
+	spin_unlock(&bdata->fi_guard);
+	k -= bdata->fi_size;
+	return min(k, to);
+}
+
+static int free_index_init(struct bitmap_allocator_data *bdata,
+			   bmap_nr_t nr, bmap_off_t bits)
+{
+	bmap_nr_t k;
+
+	spin_lock_init(&bdata->fi_guard);
+	bdata->fi_size = roundup_pow_of_two(nr);
+	bdata->fi_max = reiser4_vmalloc(2 * bdata->fi_size *
+					sizeof(bmap_off_t));
+	if (bdata->fi_max == NULL)
+		return RETERR(-ENOMEM);
+	/* bitmaps are not loaded yet */
+	for (k = 0; k < bdata->fi_size; k++)
+		bdata->fi_max[bdata->fi_size + k] = (k < nr) ? bits : 0;
+	for (k = bdata->fi_size - 1; k != 0; k--)
+		bdata->fi_max[k] = max(bdata->fi_max[2 * k],
+				       bdata->fi_max[2 * k + 1]);
+	return 0;
+}
+
 /* return a physical disk address for logical bitmap number @bmap */
 /* FIXME-VS: this is somehow related to disk layout? */
 /* ZAM-FIXME-HANS: your answer is? Use not more than one function dereference
@@ -697,12 +930,13 @@ static void get_working_bitmap_blocknr(bmap_nr_t bmap, reiser4_block_nr * bnr)
 /* bnode structure initialization */
 static void
 init_bnode(struct bitmap_node *bnode,
-	   struct super_block *super UNUSED_ARG, bmap_nr_t bmap UNUSED_ARG)
+	   struct super_block *super, bmap_nr_t bmap UNUSED_ARG)
 {
 	memset(bnode, 0, sizeof(struct bitmap_node));
 
 	mutex_init(&bnode->mutex);
 	atomic_set(&bnode->loaded, 0);
+	bnode->max_free = bmap_bit_count(super->s_blocksize);
 }
 
 static void release(jnode * node)
@@ -714,9 +948,11 @@ static void release(jnode * node)
 
 /* This function is for internal bitmap.c use because it assumes that jnode is
    in under full control of this thread */
-static void done_bnode(struct bitmap_node *bnode)
+static void done_bnode(struct super_block *super, struct bitmap_node *bnode)
 {
 	if (bnode) {
+		if (atomic_read(&bnode->loaded))
+			atomic_dec(&get_super_private(super)->bitmaps_loaded);
 		atomic_set(&bnode->loaded, 0);
 		if (bnode->wjnode != NULL)
 			release(bnode->wjnode);
@@ -809,8 +1045,31 @@ static int check_struct_bnode(struct bitmap_node *bnode, __u32 blksize)
 }
 
 /* load bitmap blocks "on-demand" */
+/* blocks [@offset, @end) of bitmap @bmap were freed, the free run they
+   joined may be the longest one now. Bitmap node should be locked */
+static void update_max_free(struct super_block *super, bmap_nr_t bmap,
+			    bmap_off_t offset, bmap_off_t end)
+{
+	struct bitmap_node *bnode = get_bnode(super, bmap);
+	const bmap_off_t max_offset = bmap_bit_count(super->s_blocksize);
+	char *data = bnode_working_data(bnode);
+	bmap_off_t left;
+
+	if (offset == 0 ||
+	    reiser4_find_last_set_bit(&left, data, 0, offset - 1) != 0)
+		left = 0;
+	else
+		left++;
+	end = reiser4_find_next_set_bit(data, max_offset, end);
+	if (end > max_offset)
+		end = max_offset;
+	if (end - left > bnode->max_free)
+		free_index_set(super, bmap, end - left);
+}
+
 static int load_and_lock_bnode(struct bitmap_node *bnode)
 {
+	struct super_block *super = reiser4_get_current_sb();
 	int ret;
 
 	jnode *cjnode;
@@ -818,15 +1077,15 @@ static int load_and_lock_bnode(struct bitmap_node *bnode)
 
 	assert("nikita-3040", reiser4_schedulable());
 
-/* ZAM-FIXME-HANS: since bitmaps are never unloaded, this does not
- * need to be atomic, right? Just leave a comment that if bitmaps were
- * unloadable, this would need to be atomic.  */
 	if (atomic_read(&bnode->loaded)) {
-		/* bitmap is already loaded, nothing to do */
-		check_bnode_loaded(bnode);
 		mutex_lock(&bnode->mutex);
-		assert("nikita-2827", atomic_read(&bnode->loaded));
-		return 0;
+		if (likely(atomic_read(&bnode->loaded))) {
+			/* bitmap is already loaded, nothing to do */
+			check_bnode_loaded(bnode);
+			return 0;
+		}
+		/* bitmap was unloaded by the shrinker meanwhile */
+		mutex_unlock(&bnode->mutex);
 	}
 
 	ret = prepare_bnode(bnode, &cjnode, &wjnode);
@@ -849,12 +1108,20 @@ static int load_and_lock_bnode(struct bitmap_node *bnode)
 			goto error;
 
 		atomic_set(&bnode->loaded, 1);
+		atomic_inc(&get_super_private(super)->bitmaps_loaded);
+		reiser4_stat_inc(super, REISER4_STAT_BITMAP_LOADS);
+		bnode->last_used = jiffies;
 		/* working bitmap is initialized by on-disk
 		 * commit bitmap. This should be performed
 		 * under mutex. */
 		memcpy(bnode_working_data(bnode),
 		       bnode_commit_data(bnode),
 		       bmap_size(current_blocksize));
+		bnode->nr_busy = memweight(bnode_working_data(bnode),
+					   bmap_size(current_blocksize));
+		free_index_set(super, bnode - get_bnode(super, 0),
+			       longest_free_run(bnode_working_data(bnode),
+						bmap_bit_count(current_blocksize)));
 	} else
 		/* race: someone already loaded bitmap
 		 * while we were busy initializing data. */
@@ -873,6 +1140,7 @@ static int load_and_lock_bnode(struct bitmap_node *bnode)
 static void release_and_unlock_bnode(struct bitmap_node *bnode)
 {
 	check_bnode_loaded(bnode);
+	bnode->last_used = jiffies;
 	mutex_unlock(&bnode->mutex);
 }
 
@@ -896,6 +1164,7 @@ search_one_bitmap_forward(bmap_nr_t bmap, bmap_off_t * offset,
 	bmap_off_t end;
 
 	int set_first_zero_bit = 0;
+	int whole;
 
 	int ret;
 
@@ -916,41 +1185,44 @@ search_one_bitmap_forward(bmap_nr_t bmap, bmap_off_t * offset,
 		start = bnode->first_zero_bit;
 		set_first_zero_bit = 1;
 	}
+	whole = set_first_zero_bit &&
+		max_offset == bmap_bit_count(super->s_blocksize);
 
-	while (start + min_len < max_offset) {
+	if (set_first_zero_bit && start < max_offset) {
+		start = reiser4_find_next_zero_bit((long *)data, max_offset,
+						   start);
+		bnode->first_zero_bit = start;
+	}
 
-		start =
-		    reiser4_find_next_zero_bit((long *)data, max_offset, start);
-		if (set_first_zero_bit) {
-			bnode->first_zero_bit = start;
-			set_first_zero_bit = 0;
-		}
-		if (start >= max_offset)
-			break;
+	if (start < max_offset && max_offset - start >= min_len)
+		start = reiser4_find_zero_run(data, max_offset, start, min_len);
+	else
+		start = max_offset;
 
+	if (start < max_offset) {
+		/* [start, start + min_len) is free, find where the run ends */
 		search_end = LIMIT(start + max_len, max_offset);
-		end =
-		    reiser4_find_next_set_bit((long *)data, search_end, start);
-		if (end >= start + min_len) {
-			/* we can't trust find_next_set_bit result if set bit
-			   was not fount, result may be bigger than
-			   max_offset */
-			if (end > search_end)
-				end = search_end;
-
-			ret = end - start;
-			*offset = start;
+		end = reiser4_find_next_set_bit((long *)data, search_end,
+						start + min_len);
+		/* we can't trust find_next_set_bit result if set bit
+		   was not fount, result may be bigger than
+		   max_offset */
+		if (end > search_end)
+			end = search_end;
 
-			reiser4_set_bits(data, start, end);
+		ret = end - start;
+		*offset = start;
 
-			/* FIXME: we may advance first_zero_bit if [start,
-			   end] region overlaps the first_zero_bit point */
+		reiser4_set_bits(data, start, end);
+		bnode->nr_busy += end - start;
 
-			break;
-		}
-
-		start = end + 1;
-	}
+		/* FIXME: we may advance first_zero_bit if [start,
+		   end] region overlaps the first_zero_bit point */
+	} else if (whole)
+		/* there is no run of @min_len free blocks, make the index
+		   exact */
+		free_index_set(super, bmap,
+			       longest_free_run(data, max_offset));
 
 	release_and_unlock_bnode(bnode);
 
@@ -1010,6 +1282,7 @@ search_one_bitmap_backward(bmap_nr_t bmap, bmap_off_t * start_offset,
 			       reiser4_find_next_set_bit(data, start + 1,
 							 end) >= start + 1);
 			reiser4_set_bits(data, end, start + 1);
+			bnode->nr_busy += start + 1 - end;
 			break;
 		}
 
@@ -1047,6 +1320,15 @@ static int bitmap_alloc_forward(reiser4_block_nr * start,
 	assert("zam-359", ergo(end_bmap == bmap, end_offset >= offset));
 
 	for (; bmap < end_bmap; bmap++, offset = 0) {
+		/* skip bitmaps which do not have @min_len free blocks in a
+		   row without loading them */
+		tmp = free_index_find(super, bmap, end_bmap, min_len);
+		if (tmp != bmap) {
+			bmap = tmp;
+			offset = 0;
+			if (bmap == end_bmap)
+				break;
+		}
 		len =
 		    search_one_bitmap_forward(bmap, &offset, max_offset,
 					      min_len, max_len);
@@ -1121,6 +1403,19 @@ static int alloc_blocks_forward(reiser4_blocknr_hint *hint, int needed,
 	   of the disk or in given region if @hint -> max_dist is not zero */
 	search_start = hint->blk;
 
+	if (needed > 1 && search_start < search_end) {
+		/* look for the whole extent first, the free-extent index
+		   skips bitmaps which do not have it */
+		int whole = min_t(int, needed,
+				  bmap_bit_count(super->s_blocksize));
+
+		actual_len = bitmap_alloc_forward(&search_start, &search_end,
+						  whole, needed);
+		if (actual_len != 0)
+			goto out;
+		search_start = hint->blk;
+	}
+
 	actual_len =
 	    bitmap_alloc_forward(&search_start, &search_end, 1, needed);
 
@@ -1134,6 +1429,7 @@ static int alloc_blocks_forward(reiser4_blocknr_hint *hint, int needed,
 		actual_len =
 		    bitmap_alloc_forward(&search_start, &search_end, 1, needed);
 	}
+ out:
 	if (actual_len == 0)
 		return RETERR(-ENOSPC);
 	if (actual_len < 0)
@@ -1196,6 +1492,7 @@ void reiser4_dealloc_blocks_bitmap(reiser4_space_allocator * allocator,
 
 	bmap_nr_t bmap;
 	bmap_off_t offset;
+	bmap_off_t end;
 
 	struct bitmap_node *bnode;
 	int ret;
@@ -1205,21 +1502,27 @@ void reiser4_dealloc_blocks_bitmap(reiser4_space_allocator * allocator,
 
 	parse_blocknr(&start, &bmap, &offset);
 
-	assert("zam-469", offset + len <= bmap_bit_count(super->s_blocksize));
+	/* extents of delete set are joined, so they can span bitmap blocks */
+	for (; len != 0; bmap++, offset = 0) {
+		end = min_t(reiser4_block_nr, offset + len,
+			    bmap_bit_count(super->s_blocksize));
 
-	bnode = get_bnode(super, bmap);
+		bnode = get_bnode(super, bmap);
 
-	assert("zam-470", bnode != NULL);
+		assert("zam-470", bnode != NULL);
 
-	ret = load_and_lock_bnode(bnode);
-	assert("zam-481", ret == 0);
+		ret = load_and_lock_bnode(bnode);
+		assert("zam-481", ret == 0);
 
-	reiser4_clear_bits(bnode_working_data(bnode), offset,
-			   (bmap_off_t) (offset + len));
+		reiser4_clear_bits(bnode_working_data(bnode), offset, end);
+		bnode->nr_busy -= end - offset;
 
-	adjust_first_zero_bit(bnode, offset);
+		adjust_first_zero_bit(bnode, offset);
+		update_max_free(super, bmap, offset, end);
 
-	release_and_unlock_bnode(bnode);
+		release_and_unlock_bnode(bnode);
+		len -= end - offset;
+	}
 }
 
 static int check_blocks_one_bitmap(bmap_nr_t bmap, bmap_off_t start_offset,
@@ -1295,9 +1598,14 @@ int reiser4_check_blocks_bitmap(const reiser4_block_nr * start,
 	return check_blocks_one_bitmap(bmap, offset, end_offset, desired);
 }
 
-/* conditional insertion of @node into atom's overwrite set  if it was not there */
-static void cond_add_to_overwrite_set(txn_atom * atom, jnode * node)
+/* conditional insertion of @node into atom's overwrite set  if it was not there.
+   Returns 0 if @node is still in overwrite set of a previous atom, which is
+   not written back yet. Caller has to release it with
+   reiser4_wait_write_back() before COMMIT BITMAP gets modified */
+static int cond_add_to_overwrite_set(txn_atom * atom, jnode * node)
 {
+	int ret = 1;
+
 	assert("zam-546", atom != NULL);
 	assert("zam-547", atom->stage == ASTAGE_PRE_COMMIT);
 	assert("zam-548", node != NULL);
@@ -1308,39 +1616,26 @@ static void cond_add_to_overwrite_set(txn_atom * atom, jnode * node)
 	if (node->atom == NULL) {
 		JF_SET(node, JNODE_OVRWR);
 		insert_into_atom_ovrwr_list(atom, node);
-	} else {
-		assert("zam-549", node->atom == atom);
+	} else if (node->atom != atom) {
+		assert("edward-2350", node->atom->stage >= ASTAGE_POST_COMMIT);
+		ret = 0;
 	}
 
 	spin_unlock_jnode(node);
 	spin_unlock_atom(atom);
+	return ret;
 }
 
-/* an actor which applies delete set to COMMIT bitmap pages and link modified
-   pages in a single-linked list */
-static int
-apply_dset_to_commit_bmap(txn_atom * atom, const reiser4_block_nr * start,
-			  const reiser4_block_nr * len, void *data)
+/* clear bits [@offset, @end) of COMMIT bitmap block @bmap */
+static int apply_dset_to_one_commit_bmap(txn_atom *atom, bmap_nr_t bmap,
+					 bmap_off_t offset, bmap_off_t end)
 {
-
-	bmap_nr_t bmap;
-	bmap_off_t offset;
 	int ret;
 
-	long long *blocks_freed_p = data;
-
 	struct bitmap_node *bnode;
 
 	struct super_block *sb = reiser4_get_current_sb();
 
-	check_block_range(start, len);
-
-	parse_blocknr(start, &bmap, &offset);
-
-	/* FIXME-ZAM: we assume that all block ranges are allocated by this
-	   bitmap-based allocator and each block range can't go over a zone of
-	   responsibility of one bitmap block; same assumption is used in
-	   other journal hooks in bitmap code. */
 	bnode = get_bnode(sb, bmap);
 	assert("zam-448", bnode != NULL);
 
@@ -1351,30 +1646,59 @@ apply_dset_to_commit_bmap(txn_atom * atom, const reiser4_block_nr * start,
 		return ret;
 
 	/* put bnode into atom's overwrite set */
-	cond_add_to_overwrite_set(atom, bnode->cjnode);
-
-	data = bnode_commit_data(bnode);
+	while (!cond_add_to_overwrite_set(atom, bnode->cjnode)) {
+		/* write-back takes bnode locks */
+		release_and_unlock_bnode(bnode);
+		reiser4_wait_write_back(bnode->cjnode);
+		ret = load_and_lock_bnode(bnode);
+		if (ret)
+			return ret;
+	}
 
 	ret = bnode_check_crc(bnode);
 	if (ret != 0)
 		return ret;
 
-	if (len != NULL) {
-		/* FIXME-ZAM: a check that all bits are set should be there */
-		assert("zam-443",
-		       offset + *len <= bmap_bit_count(sb->s_blocksize));
-		reiser4_clear_bits(data, offset, (bmap_off_t) (offset + *len));
+	/* FIXME-ZAM: a check that all bits are set should be there */
+	assert("zam-443", end <= bmap_bit_count(sb->s_blocksize));
+	commit_bits_change(bnode, offset, end, 0, bmap_size(sb->s_blocksize));
+	assert("edward-2388", bnode_check_adler32(bnode, sb->s_blocksize) == 0);
 
-		(*blocks_freed_p) += *len;
-	} else {
-		reiser4_clear_bit(offset, data);
-		(*blocks_freed_p)++;
-	}
+	release_and_unlock_bnode(bnode);
 
-	bnode_set_commit_crc(bnode, bnode_calc_crc(bnode, sb->s_blocksize));
+	return 0;
+}
 
-	release_and_unlock_bnode(bnode);
+/* an actor which applies delete set to COMMIT bitmap pages. Extents of delete
+   set are joined, so one extent can span several bitmap blocks */
+static int
+apply_dset_to_commit_bmap(txn_atom * atom, const reiser4_block_nr * start,
+			  const reiser4_block_nr * len, void *data)
+{
+	bmap_nr_t bmap;
+	bmap_off_t offset;
+	bmap_off_t end;
+	reiser4_block_nr left;
+	int ret;
 
+	long long *blocks_freed_p = data;
+
+	struct super_block *sb = reiser4_get_current_sb();
+
+	check_block_range(start, len);
+
+	parse_blocknr(start, &bmap, &offset);
+
+	left = (len != NULL) ? *len : 1;
+	(*blocks_freed_p) += left;
+	for (; left != 0; bmap++, offset = 0) {
+		end = min_t(reiser4_block_nr, offset + left,
+			    bmap_bit_count(sb->s_blocksize));
+		ret = apply_dset_to_one_commit_bmap(atom, bmap, offset, end);
+		if (ret)
+			return ret;
+		left -= end - offset;
+	}
 	return 0;
 }
 
@@ -1384,7 +1708,8 @@ apply_dset_to_commit_bmap(txn_atom * atom, const reiser4_block_nr * start,
    BITMAP blocks, copy COMMIT BITMAP blocks data). */
 /* Only one instance of this function can be running at one given time, because
    only one transaction can be committed a time, therefore it is safe to access
-   some global variables without any locking */
+   some global variables without any locking. Previous atoms can still be
+   not written back though, see cond_add_to_overwrite_set() */
 
 int reiser4_pre_commit_hook_bitmap(void)
 {
@@ -1429,8 +1754,21 @@ int reiser4_pre_commit_hook_bitmap(void)
 				if (ret != 0)
 					return ret;
 
-				check_bnode_loaded(bn);
 				load_and_lock_bnode(bn);
+				check_bnode_loaded(bn);
+
+				/* bitmap block has to be in overwrite set
+				   before its COMMIT BITMAP is modified. It is
+				   OK to insert it while scanning clean list,
+				   overwrite list is a different one */
+				if (!cond_add_to_overwrite_set(atom,
+							       bn->cjnode)) {
+					/* write-back takes bnode locks */
+					release_and_unlock_bnode(bn);
+					reiser4_wait_write_back(bn->cjnode);
+					/* process this node again */
+					continue;
+				}
 
 				byte = *(bnode_commit_data(bn) + index);
 				reiser4_set_bit(offset, bnode_commit_data(bn));
@@ -1446,12 +1784,6 @@ int reiser4_pre_commit_hook_bitmap(void)
 				ret = bnode_check_crc(bn);
 				if (ret != 0)
 					return ret;
-
-				/* working of this depends on how it inserts
-				   new j-node into clean list, because we are
-				   scanning the same list now. It is OK, if
-				   insertion is done to the list front */
-				cond_add_to_overwrite_set(atom, bn->cjnode);
 			}
 
 			node = list_entry(node->capture_link.next, jnode, capture_link);
@@ -1475,6 +1807,90 @@ int reiser4_pre_commit_hook_bitmap(void)
 	return 0;
 }
 
+/* true if bitmap node can be dropped and read from disk again later, see
+   comment at the beginning of this file. Bitmap node should be locked */
+static int bnode_is_unloadable(struct bitmap_node *bnode,
+			       unsigned long blocksize)
+{
+	jnode *cj = bnode->cjnode;
+	int busy;
+
+	if (time_before(jiffies, bnode->last_used + BITMAP_IDLE_TIME))
+		return 0;
+
+	spin_lock_jnode(cj);
+	busy = cj->atom != NULL || JF_ISSET(cj, JNODE_DIRTY) ||
+		JF_ISSET(cj, JNODE_WRITEBACK);
+	spin_unlock_jnode(cj);
+	if (busy)
+		return 0;
+
+	return memcmp(bnode_working_data(bnode), bnode_commit_data(bnode),
+		      bmap_size(blocksize)) == 0;
+}
+
+static unsigned long bitmap_shrink_count(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct bitmap_allocator_data *bdata;
+
+	bdata = container_of(shrink, struct bitmap_allocator_data, shrinker);
+	return atomic_read(&get_super_private(bdata->super)->bitmaps_loaded);
+}
+
+/*
+ * drop idle bitmap nodes which do not differ from their on-disk state. Free
+ * space index and ->first_zero_bit, ->nr_busy of dropped nodes stay valid,
+ * because bitmap content does not change while it is not in memory.
+ */
+static unsigned long bitmap_shrink_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct bitmap_allocator_data *bdata;
+	struct super_block *super;
+	reiser4_context ctx;
+	bmap_nr_t nr;
+	bmap_nr_t cur;
+	bmap_nr_t i;
+	unsigned long freed = 0;
+
+	/* bitmap nodes are locked by allocation itself, do not wait for them
+	   from inside of reiser4 */
+	if (!(sc->gfp_mask & __GFP_FS) || is_in_reiser4_context())
+		return SHRINK_STOP;
+
+	bdata = container_of(shrink, struct bitmap_allocator_data, shrinker);
+	super = bdata->super;
+	init_stack_context(&ctx, super);
+
+	nr = get_nr_bmap(super);
+	cur = READ_ONCE(bdata->shrink_cursor);
+	for (i = 0; i < nr && sc->nr_to_scan > 0; i++) {
+		struct bitmap_node *bnode;
+
+		if (cur >= nr)
+			cur = 0;
+		bnode = get_bnode(super, cur++);
+		if (!atomic_read(&bnode->loaded))
+			continue;
+		sc->nr_to_scan--;
+		if (!mutex_trylock(&bnode->mutex))
+			continue;
+		if (atomic_read(&bnode->loaded) &&
+		    bnode_is_unloadable(bnode, super->s_blocksize)) {
+			done_bnode(super, bnode);
+			reiser4_stat_inc(super, REISER4_STAT_BITMAP_UNLOADS);
+			freed++;
+		}
+		mutex_unlock(&bnode->mutex);
+	}
+	/* concurrent scans may overwrite each other's cursor, it is a hint */
+	WRITE_ONCE(bdata->shrink_cursor, cur);
+
+	reiser4_exit_context(&ctx);
+	return freed;
+}
+
 /* plugin->u.space_allocator.init_allocator
     constructor of reiser4_space_allocator object. It is called on fs mount */
 int reiser4_init_allocator_bitmap(reiser4_space_allocator * allocator,
@@ -1488,7 +1904,7 @@ int reiser4_init_allocator_bitmap(reiser4_space_allocator * allocator,
 
 	/* getting memory for bitmap allocator private data holder */
 	data =
-		kmalloc(sizeof(struct bitmap_allocator_data),
+		kzalloc(sizeof(struct bitmap_allocator_data),
 			reiser4_ctx_gfp_mask_get());
 
 	if (data == NULL)
@@ -1514,6 +1930,17 @@ int reiser4_init_allocator_bitmap(reiser4_space_allocator * allocator,
 	for (i = 0; i < bitmap_blocks_nr; i++)
 		init_bnode(data->bitmap + i, super, i);
 
+	if (free_index_init(data, bitmap_blocks_nr,
+			    bmap_bit_count(super->s_blocksize)) != 0) {
+		vfree(data->bitmap);
+		kfree(data);
+		return RETERR(-ENOMEM);
+	}
+
+	data->super = super;
+	data->shrinker.count_objects = bitmap_shrink_count;
+	data->shrinker.scan_objects = bitmap_shrink_scan;
+	data->shrinker.seeks = DEFAULT_SEEKS;
 	allocator->u.generic = data;
 
 #if REISER4_DEBUG
@@ -1548,6 +1975,65 @@ int reiser4_init_allocator_bitmap(reiser4_space_allocator * allocator,
 			       (unsigned long long)elapsed_time);
 	}
 
+	register_shrinker(&data->shrinker);
+	return 0;
+}
+
+/* Log transaction model (see logseg.c) uses areas covered by bitmap blocks as
+   segments, and bitmap nodes count busy blocks of them */
+
+/* number of log segments of @super */
+__u64 reiser4_bitmap_nr_segments(const struct super_block *super)
+{
+	return get_nr_bmap(super);
+}
+
+/* first block and length of log segment @seg */
+void reiser4_bitmap_segment(const struct super_block *super, __u64 seg,
+			    reiser4_block_nr *start, reiser4_block_nr *len)
+{
+	assert("edward-2372", seg < get_nr_bmap(super));
+
+	*start = seg * bmap_bit_count(super->s_blocksize);
+	*len = min_t(reiser4_block_nr, bmap_bit_count(super->s_blocksize),
+		     reiser4_block_count(super) - *start);
+}
+
+/* log segment block @blk belongs to */
+__u64 reiser4_bitmap_segment_of(const reiser4_block_nr *blk)
+{
+	bmap_nr_t bmap;
+	bmap_off_t offset;
+
+	parse_blocknr(blk, &bmap, &offset);
+	return bmap;
+}
+
+/**
+ * reiser4_bitmap_segment_busy - count busy blocks of log segment
+ * @super: super block
+ * @seg: log segment
+ * @load: if not set, bitmap block is not read from disk
+ * @busy: where to store the number of busy blocks
+ *
+ * Returns -ENOENT if bitmap block of @seg is not loaded and @load is not set.
+ */
+int reiser4_bitmap_segment_busy(struct super_block *super, __u64 seg, int load,
+				__u64 *busy)
+{
+	struct bitmap_node *bnode;
+	int ret;
+
+	assert("edward-2373", seg < get_nr_bmap(super));
+
+	bnode = get_bnode(super, seg);
+	if (!load && !atomic_read(&bnode->loaded))
+		return -ENOENT;
+	ret = load_and_lock_bnode(bnode);
+	if (ret)
+		return ret;
+	*busy = bnode->nr_busy;
+	release_and_unlock_bnode(bnode);
 	return 0;
 }
 
@@ -1564,6 +2050,8 @@ int reiser4_destroy_allocator_bitmap(reiser4_space_allocator * allocator,
 	assert("zam-414", data != NULL);
 	assert("zam-376", data->bitmap != NULL);
 
+	unregister_shrinker(&data->shrinker);
+
 	bitmap_blocks_nr = get_nr_bmap(super);
 
 	for (i = 0; i < bitmap_blocks_nr; i++) {
@@ -1585,10 +2073,11 @@ int reiser4_destroy_allocator_bitmap(reiser4_space_allocator * allocator,
 
 		}
 #endif
-		done_bnode(bnode);
+		done_bnode(super, bnode);
 		mutex_unlock(&bnode->mutex);
 	}
 
+	vfree(data->fi_max);
 	vfree(data->bitmap);
 	kfree(data);
 
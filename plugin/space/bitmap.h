@@ -26,6 +26,14 @@ extern void reiser4_dealloc_blocks_bitmap(reiser4_space_allocator *,
 					  reiser4_block_nr);
 extern int reiser4_pre_commit_hook_bitmap(void);
 
+extern __u64 reiser4_bitmap_nr_segments(const struct super_block *);
+extern void reiser4_bitmap_segment(const struct super_block *, __u64 seg,
+				   reiser4_block_nr *start,
+				   reiser4_block_nr *len);
+extern __u64 reiser4_bitmap_segment_of(const reiser4_block_nr *);
+extern int reiser4_bitmap_segment_busy(struct super_block *, __u64 seg,
+				       int load, __u64 *busy);
+
 #define reiser4_post_commit_hook_bitmap() do{}while(0)
 #define reiser4_post_write_back_hook_bitmap() do{}while(0)
 #define reiser4_print_info_bitmap(pref, al) do{}while(0)
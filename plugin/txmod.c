@@ -7,6 +7,8 @@
 #include "../block_alloc.h"
 #include "../reiser4.h"
 #include "../flush.h"
+#include "../super.h"
+#include "../logseg.h"
 
 /*
  * This file contains implementation of different transaction models.
@@ -123,6 +125,8 @@ void jnode_make_wander_nolock(jnode * node)
 	assert("zam-894", atom_is_protected(atom));
 
 	JF_SET(node, JNODE_OVRWR);
+	reiser4_stat_inc(jnode_get_tree(node)->super,
+			 REISER4_STAT_FLUSH_OVERWRITTEN);
 	/* move node to atom's overwrite list */
 	list_move_tail(&node->capture_link, ATOM_OVRWR_LIST(atom));
 	ON_DEBUG(count_jnode(atom, node, DIRTY_LIST, OVRWR_LIST, 1));
@@ -155,7 +159,11 @@ static void jnode_make_reloc_nolock(flush_queue_t * fq, jnode * node)
 	assert("zam-918", !JF_ISSET(node, JNODE_OVRWR));
 	assert("zam-920", !JF_ISSET(node, JNODE_FLUSH_QUEUED));
 	assert("nikita-3367", !reiser4_blocknr_is_fake(jnode_get_block(node)));
+	assert_spin_locked(&(node->atom->alock));
 	jnode_set_reloc(node);
+	node->atom->nr_relocated++;
+	reiser4_stat_inc(jnode_get_tree(node)->super,
+			 REISER4_STAT_FLUSH_RELOCATED);
 }
 
 /*
@@ -266,9 +274,10 @@ static int forward_relocate_unformatted(flush_pos_t *flush_pos,
 	}
 	/*
 	 * look at previous unit if possible. If it is allocated, make
-	 * preceder more precise
+	 * preceder more precise. Log txmod writes at the log head only
 	 */
 	if (coord->unit_pos &&
+	    get_current_super_private()->txmod != LOG_TXMOD_ID &&
 	    (state_of_extent(ext - 1) == ALLOCATED_EXTENT))
 		reiser4_pos_hint(flush_pos)->blk =
 			extent_get_start(ext - 1) +
@@ -363,9 +372,10 @@ static squeeze_result squeeze_relocate_unformatted(znode *left,
 	}
 	/*
 	 * look at previous unit if possible. If it is allocated, make
-	 * preceder more precise
+	 * preceder more precise. Log txmod writes at the log head only
 	 */
 	if (coord->unit_pos &&
+	    get_current_super_private()->txmod != LOG_TXMOD_ID &&
 	    (state_of_extent(ext - 1) == ALLOCATED_EXTENT))
 		reiser4_pos_hint(flush_pos)->blk =
 			extent_get_start(ext - 1) +
@@ -1180,6 +1190,74 @@ static squeeze_result squeeze_alloc_unformatted_wa(znode *left,
 	return ret;
 }
 
+/**********************  LOG (Log-Structured) TRANSACTION MODEL  **************/
+
+/*
+ * Like WA, log txmod relocates every dirty node, but the search of free blocks
+ * starts at the log head rather than near the preceder. See logseg.c.
+ */
+static int forward_alloc_formatted_log(znode * node,
+				       const coord_t *parent_coord,
+				       flush_pos_t *pos)
+{
+	int ret;
+
+	assert("edward-2377", znode_is_loaded(node));
+	assert("edward-2378", !jnode_check_flushprepped(ZJNODE(node)));
+	assert("edward-2379", znode_is_write_locked(node));
+	assert("edward-2380", coord_is_invalid(parent_coord)
+	       || znode_is_write_locked(parent_coord->node));
+
+	reiser4_log_hint(&pos->preceder);
+	ret = forward_try_defragment_locality(node, parent_coord, pos);
+	if (ret) {
+		warning("edward-2381", "forward defrag failed (%d)", ret);
+		return ret;
+	}
+	/* set JNODE_RELOC bit _after_ node gets allocated */
+	znode_make_reloc(node, pos->fq);
+
+	pos->preceder.blk = *znode_get_block(node);
+	check_preceder(pos->preceder.blk);
+	pos->alloc_cnt += 1;
+	reiser4_log_advance(&pos->preceder.blk);
+
+	assert("edward-2382", !reiser4_blocknr_is_fake(&pos->preceder.blk));
+	return 0;
+}
+
+static int forward_alloc_unformatted_log(flush_pos_t *flush_pos)
+{
+	reiser4_block_nr head;
+	int ret;
+
+	reiser4_log_hint(reiser4_pos_hint(flush_pos));
+	head = reiser4_pos_hint(flush_pos)->blk;
+
+	ret = forward_alloc_unformatted_wa(flush_pos);
+	/* the hint is set to the last allocated block, if any */
+	if (ret == 0 && reiser4_pos_hint(flush_pos)->blk != head)
+		reiser4_log_advance(&reiser4_pos_hint(flush_pos)->blk);
+	return ret;
+}
+
+static squeeze_result squeeze_alloc_unformatted_log(znode *left,
+						    const coord_t *coord,
+						    flush_pos_t *flush_pos,
+						    reiser4_key *stop_key)
+{
+	reiser4_block_nr head;
+	squeeze_result ret;
+
+	reiser4_log_hint(reiser4_pos_hint(flush_pos));
+	head = reiser4_pos_hint(flush_pos)->blk;
+
+	ret = squeeze_alloc_unformatted_wa(left, coord, flush_pos, stop_key);
+	if (ret == SQUEEZE_CONTINUE && reiser4_pos_hint(flush_pos)->blk != head)
+		reiser4_log_advance(&reiser4_pos_hint(flush_pos)->blk);
+	return ret;
+}
+
 /******************************************************************************/
 
 txmod_plugin txmod_plugins[LAST_TXMOD_ID] = {
@@ -1224,6 +1302,20 @@ txmod_plugin txmod_plugins[LAST_TXMOD_ID] = {
 		.reverse_alloc_formatted = NULL,
 		.forward_alloc_unformatted = forward_alloc_unformatted_wa,
 		.squeeze_alloc_unformatted = squeeze_alloc_unformatted_wa
+	},
+	[LOG_TXMOD_ID] = {
+		.h = {
+			.type_id = REISER4_TXMOD_PLUGIN_TYPE,
+			.id = LOG_TXMOD_ID,
+			.pops = NULL,
+			.label = "log",
+			.desc =	"Log-Structured Transaction Model",
+			.linkage = {NULL, NULL}
+		},
+		.forward_alloc_formatted = forward_alloc_formatted_log,
+		.reverse_alloc_formatted = NULL,
+		.forward_alloc_unformatted = forward_alloc_unformatted_log,
+		.squeeze_alloc_unformatted = squeeze_alloc_unformatted_log
 	}
 };
 
@@ -10,6 +10,7 @@
 #include "znode.h"
 
 #include <linux/swap.h>		/* for totalram_pages */
+#include <linux/sort.h>
 
 void reiser4_init_ra_info(ra_info_t *rai)
 {
@@ -129,6 +130,66 @@ void reiser4_readdir_readahead_init(struct inode *dir, tap_t *tap)
 	set_key_offset(stop_key, get_key_offset(reiser4_max_key()));
 }
 
+static int sd_key_cmp(const void *k1, const void *k2)
+{
+	return keycmp(k1, k2);
+}
+
+struct sd_lookup_args {
+	const reiser4_key *keys;
+	sd_hint_t *hints;
+};
+
+/* coord_by_keys() actor for reiser4_sd_lookup(): seal stat-data found for
+ * @key, so that it can be accessed without tree traversal later. Inode cannot
+ * be loaded right here: reiser4_iget() may wait for other thread loading the
+ * same inode, and that thread may wait for the lock on this node. */
+static int sd_lookup_actor(reiser4_tree *tree UNUSED_ARG,
+			   const reiser4_key *key, lookup_result result,
+			   coord_t *coord, lock_handle *lh UNUSED_ARG,
+			   void *arg)
+{
+	struct sd_lookup_args *args = arg;
+	sd_hint_t *hint;
+
+	hint = &args->hints[key - args->keys];
+	if (result == CBK_COORD_FOUND) {
+		reiser4_seal_init(&hint->seal, coord, key);
+		hint->coord = *coord;
+	}
+	return 0;
+}
+
+/* locate stat-data of @nr objects with stat-data keys @keys by single batched
+ * tree lookup, that only descends from the root when next key is not in the
+ * leaf where previous one was found, or in its right neighbor. @keys are
+ * sorted in place, and @hints[i] is filled for @keys[i]: pass it to
+ * reiser4_iget_hint() to load inode without another tree traversal. */
+void reiser4_sd_lookup(reiser4_tree *tree, reiser4_key *keys,
+		       sd_hint_t *hints, int nr)
+{
+	struct sd_lookup_args args;
+	int i;
+
+	assert("edward-2321", tree != NULL);
+	assert("edward-2322", keys != NULL);
+	assert("edward-2395", hints != NULL);
+
+	sort(keys, nr, sizeof keys[0], sd_key_cmp, NULL);
+	for (i = 0; i < nr; ++i) {
+		hints[i].key = keys[i];
+		reiser4_seal_done(&hints[i].seal);
+	}
+	if (nr == 0 || low_on_memory())
+		return;
+	args.keys = keys;
+	args.hints = hints;
+	/* hints are optional, errors are ignored: reiser4_iget_hint() looks
+	 * up stat-data whose seal is not set */
+	coord_by_keys(tree, keys, nr, ZNODE_READ_LOCK, FIND_EXACT, LEAF_LEVEL,
+		      CBK_UNIQUE, sd_lookup_actor, &args);
+}
+
 /*
    Local variables:
    c-indentation-style: "K&R"
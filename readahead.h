@@ -27,6 +27,8 @@ void formatted_readahead(znode * , ra_info_t *);
 void reiser4_init_ra_info(ra_info_t *rai);
 
 extern void reiser4_readdir_readahead_init(struct inode *dir, tap_t *tap);
+extern void reiser4_sd_lookup(reiser4_tree *tree, reiser4_key *keys,
+			      struct sd_hint *hints, int nr);
 
 /* __READAHEAD_H__ */
 #endif
@@ -93,8 +93,11 @@ extern const int REISER4_MAGIC_OFFSET;	/* offset to magic string from the
 /* key allocation follows good old 3.x scheme */
 #define REISER4_3_5_KEY_ALLOCATION (0)
 
-/* size of hash-table for znodes */
-#define REISER4_ZNODE_HASH_TABLE_SIZE (1 << 13)
+/* initial (and minimal) size of hash-tables for znodes and jnodes. Tables
+ * grow with population up to the maximal size. */
+#define REISER4_ZNODE_HASH_TABLE_SIZE (1 << 10)
+#define REISER4_JNODE_HASH_TABLE_SIZE (1 << 10)
+#define REISER4_HASH_TABLE_MAX_SIZE (1 << 24)
 
 /* number of buckets in lnode hash-table */
 #define LNODE_HTABLE_BUCKETS (1024)
@@ -134,6 +137,18 @@ static_assert(REISER4_SEQ_SEARCH_BREAK > 2);
    be overwritten by tmgr.atom_max_age mount option. */
 #define REISER4_ATOM_MAX_AGE          (600 * HZ)
 
+/* With adaptive_atom_limits mount option, maximal atom size is chosen so
+   that commit of atom of that size takes about this many milliseconds. */
+#define REISER4_ATOM_COMMIT_TARGET_MS (1000)
+
+/* Lower bound of maximal atom age (in jiffies) chosen by ktxnmgrd when dirty
+   memory approaches the dirty limit. */
+#define REISER4_ATOM_MIN_AGE          (5 * HZ)
+
+/* modifications of a file go to isolated atoms for this long (in jiffies)
+   after it was fsync-ed last time (see REISER4_FSYNC_ISOLATED) */
+#define REISER4_FSYNC_ISOLATED_TIME   (30 * HZ)
+
 /* sleeping period for ktxnmrgd */
 #define REISER4_TXNMGR_TIMEOUT  (5 * HZ)
 
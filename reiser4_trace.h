@@ -0,0 +1,177 @@
+/* Copyright 2001, 2002, 2003 by Hans Reiser, licensing governed by
+ * reiser4/README */
+
+/* Tracepoints of reiser4. Defined in lock.c, used also by txnmgr.c and
+   wander.c. */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM reiser4
+
+#if !defined(__REISER4_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __REISER4_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+/* long-term lock request had to sleep. @ret is the result of the request */
+TRACE_EVENT(reiser4_lock_wait,
+
+	TP_PROTO(const struct super_block *super, __u64 block, int level,
+		 int mode, int hipri, int ret, __u64 wait_ns),
+
+	TP_ARGS(super, block, level, mode, hipri, ret, wait_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(__u64, block)
+		__field(int, level)
+		__field(int, mode)
+		__field(int, hipri)
+		__field(int, ret)
+		__field(__u64, wait_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = super->s_dev;
+		__entry->block = block;
+		__entry->level = level;
+		__entry->mode = mode;
+		__entry->hipri = hipri;
+		__entry->ret = ret;
+		__entry->wait_ns = wait_ns;
+	),
+
+	TP_printk("dev %d,%d block %llu level %d mode %s%s ret %d wait %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->block, __entry->level,
+		  __entry->mode == 2 ? "write" : "read",
+		  __entry->hipri ? " hipri" : "", __entry->ret,
+		  (unsigned long long)__entry->wait_ns)
+);
+
+/* long-term lock released */
+TRACE_EVENT(reiser4_lock_hold,
+
+	TP_PROTO(const struct super_block *super, __u64 block, int level,
+		 __u64 hold_ns),
+
+	TP_ARGS(super, block, level, hold_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(__u64, block)
+		__field(int, level)
+		__field(__u64, hold_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = super->s_dev;
+		__entry->block = block;
+		__entry->level = level;
+		__entry->hold_ns = hold_ns;
+	),
+
+	TP_printk("dev %d,%d block %llu level %d hold %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->block, __entry->level,
+		  (unsigned long long)__entry->hold_ns)
+);
+
+/* low priority owners of a lock were asked to release it (priority
+   inversion) */
+TRACE_EVENT(reiser4_lopri_wakeup,
+
+	TP_PROTO(const struct super_block *super, __u64 block, int level,
+		 int nr),
+
+	TP_ARGS(super, block, level, nr),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(__u64, block)
+		__field(int, level)
+		__field(int, nr)
+	),
+
+	TP_fast_assign(
+		__entry->dev = super->s_dev;
+		__entry->block = block;
+		__entry->level = level;
+		__entry->nr = nr;
+	),
+
+	TP_printk("dev %d,%d block %llu level %d signalled %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->block, __entry->level,
+		  __entry->nr)
+);
+
+/* stage @stage (see reiser4_commit_stage) of commit of atom @atom_id is
+   finished */
+TRACE_EVENT(reiser4_commit_stage,
+
+	TP_PROTO(const struct super_block *super, __u32 atom_id, int stage,
+		 __u64 ns),
+
+	TP_ARGS(super, atom_id, stage, ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(__u32, atom_id)
+		__field(int, stage)
+		__field(__u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = super->s_dev;
+		__entry->atom_id = atom_id;
+		__entry->stage = stage;
+		__entry->ns = ns;
+	),
+
+	TP_printk("dev %d,%d atom %u stage %d took %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->atom_id, __entry->stage,
+		  (unsigned long long)__entry->ns)
+);
+
+/* atom is committed */
+TRACE_EVENT(reiser4_commit,
+
+	TP_PROTO(const struct super_block *super, __u32 atom_id,
+		 __u32 captured, __u32 overwrite, __u32 relocated, __u64 ns),
+
+	TP_ARGS(super, atom_id, captured, overwrite, relocated, ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(__u32, atom_id)
+		__field(__u32, captured)
+		__field(__u32, overwrite)
+		__field(__u32, relocated)
+		__field(__u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = super->s_dev;
+		__entry->atom_id = atom_id;
+		__entry->captured = captured;
+		__entry->overwrite = overwrite;
+		__entry->relocated = relocated;
+		__entry->ns = ns;
+	),
+
+	TP_printk("dev %d,%d atom %u captured %u overwrite %u relocate %u "
+		  "commit %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->atom_id, __entry->captured, __entry->overwrite,
+		  __entry->relocated, (unsigned long long)__entry->ns)
+);
+
+#endif /* __REISER4_TRACE_H__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE reiser4_trace
+#include <trace/define_trace.h>
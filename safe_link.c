@@ -53,6 +53,7 @@
 #include "plugin/item/blackbox.h"
 
 #include <linux/fs.h>
+#include <linux/sort.h>
 
 /*
  * On-disk format of safe-link.
@@ -243,6 +244,22 @@ static int safe_link_iter_finished(struct safe_link_context *ctx)
 	return get_key_locality(&ctx->key) != safe_link_locality(ctx->tree);
 }
 
+/*
+ * move iterator past the current safe-link, without removing it from the
+ * tree. Safe-links are scanned in descending key order.
+ */
+static void safe_link_iter_skip(struct safe_link_context *ctx)
+{
+	if (ctx->link > 0)
+		build_link_key(ctx->tree, ctx->oid, ctx->link - 1, &ctx->key);
+	else if (ctx->oid > 0) {
+		build_link_key(ctx->tree, ctx->oid - 1, 0, &ctx->key);
+		set_key_offset(&ctx->key, get_key_offset(reiser4_max_key()));
+	} else
+		/* the very first possible safe-link: finish */
+		set_key_locality(&ctx->key, safe_link_locality(ctx->tree) - 1);
+}
+
 /*
  * finish safe-link iteration.
  */
@@ -255,7 +272,7 @@ static void safe_link_iter_end(struct safe_link_context *ctx)
  * process single safe-link.
  */
 static int process_safelink(struct super_block *super, reiser4_safe_link_t link,
-			    reiser4_key * sdkey, oid_t oid, __u64 size)
+			    sd_hint_t *hint, oid_t oid, __u64 size)
 {
 	struct inode *inode;
 	int result;
@@ -265,7 +282,7 @@ static int process_safelink(struct super_block *super, reiser4_safe_link_t link,
 	 * ->safelink() method to do actual work, then delete safe-link on
 	 * success.
 	 */
-	inode = reiser4_iget(super, sdkey, 1);
+	inode = reiser4_iget_hint(super, hint, 1);
 	if (!IS_ERR(inode)) {
 		file_plugin *fplug;
 
@@ -283,7 +300,7 @@ static int process_safelink(struct super_block *super, reiser4_safe_link_t link,
 			warning("nikita-3430",
 				"Cannot handle safelink for %lli",
 				(unsigned long long)oid);
-			reiser4_print_key("key", sdkey);
+			reiser4_print_key("key", &hint->key);
 			result = 0;
 		}
 		if (result != 0) {
@@ -314,31 +331,106 @@ static int process_safelink(struct super_block *super, reiser4_safe_link_t link,
 	return result;
 }
 
+/*
+ * number of safe-links collected before processing. Stat-data of objects in a
+ * batch is found by single batched tree lookup.
+ */
+#define SAFE_LINK_BATCH (32)
+
+static int safe_link_sdkey_cmp(const void *c1, const void *c2)
+{
+	return keycmp(&((const struct safe_link_context *)c1)->sdkey,
+		      &((const struct safe_link_context *)c2)->sdkey);
+}
+
 /*
  * iterate over all safe-links in the file-system processing them one by one.
  */
 int process_safelinks(struct super_block *super)
 {
 	struct safe_link_context ctx;
+	struct safe_link_context *batch;
+	reiser4_key *sdkeys;
+	sd_hint_t *hints;
+	sd_hint_t hint;
+	int nr_max;
+	int done;
 	int result;
 
 	if (sb_rdonly(super))
 		/* do nothing on the read-only file system */
 		return 0;
+
+	nr_max = SAFE_LINK_BATCH;
+	batch = kmalloc_array(nr_max, sizeof(*batch) + sizeof(*sdkeys) +
+			      sizeof(*hints),
+			      reiser4_ctx_gfp_mask_get() | __GFP_NOWARN);
+	if (batch == NULL) {
+		/* fall back to processing safe-links one by one */
+		nr_max = 1;
+		batch = &ctx;
+		sdkeys = NULL;
+		hints = &hint;
+	} else {
+		sdkeys = (reiser4_key *)(batch + nr_max);
+		hints = (sd_hint_t *)(sdkeys + nr_max);
+	}
+
 	safe_link_iter_begin(&get_super_private(super)->tree, &ctx);
 	result = 0;
+	done = 0;
 	do {
-		result = safe_link_iter_next(&ctx);
-		if (safe_link_iter_finished(&ctx) || result == -ENOENT) {
-			result = 0;
-			break;
+		int nr;
+		int i;
+
+		/* collect next batch of safe-links */
+		for (nr = 0; nr < nr_max; ) {
+			result = safe_link_iter_next(&ctx);
+			if (safe_link_iter_finished(&ctx) ||
+			    result == -ENOENT) {
+				result = 0;
+				done = 1;
+				break;
+			}
+			if (result != 0)
+				break;
+			if (batch != &ctx)
+				batch[nr] = ctx;
+			++nr;
+			safe_link_iter_skip(&ctx);
+		}
+		if (sdkeys != NULL) {
+			/*
+			 * order of processing does not matter. Sort safe-links
+			 * by stat-data key, so that @hints[i] found for
+			 * @sdkeys[i] is the one of @batch[i].
+			 */
+			sort(batch, nr, sizeof(*batch), safe_link_sdkey_cmp,
+			     NULL);
+			for (i = 0; i < nr; ++i)
+				sdkeys[i] = batch[i].sdkey;
+			reiser4_sd_lookup(ctx.tree, sdkeys, hints, nr);
+		} else if (nr != 0) {
+			/* no hint, reiser4_iget_hint() traverses the tree */
+			hint.key = ctx.sdkey;
+			reiser4_seal_done(&hint.seal);
+		}
+
+		/* process safe-links collected before an error, if any */
+		for (i = 0; i < nr; ++i) {
+			int ret;
+
+			ret = process_safelink(super, batch[i].link, &hints[i],
+					       batch[i].oid, batch[i].size);
+			if (ret != 0) {
+				result = ret;
+				break;
+			}
 		}
-		if (result == 0)
-			result = process_safelink(super, ctx.link,
-						  &ctx.sdkey, ctx.oid,
-						  ctx.size);
-	} while (result == 0);
+	} while (result == 0 && !done);
 	safe_link_iter_end(&ctx);
+	if (batch != &ctx)
+		kfree(batch);
 	return result;
 }
 
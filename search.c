@@ -36,94 +36,149 @@ static const char *bias_name(lookup_bias bias);
  * The efficiency of coord cache depends heavily on locality of reference for
  * tree accesses. Our user level simulations show reasonably good hit ratios
  * for coord cache under most loads so far.
+ *
+ * To avoid bouncing of a single lock and LRU list between cpus, the cache is
+ * split into per-cpu shards. Thread uses the shard of the cpu it runs on
+ * (migration in the middle of a lookup is harmless: it only affects which
+ * shard gets updated). Readers don't take locks at all. LRU order is
+ * approximated by a per-shard logical clock stamped into a slot on each
+ * access, so that a hit costs one store into the slot found.
  */
 
-/* Initialise coord cache slot */
-static void cbk_cache_init_slot(cbk_cache_slot *slot)
-{
-	assert("nikita-345", slot != NULL);
-
-	INIT_LIST_HEAD(&slot->lru);
-	slot->node = NULL;
-}
-
 /* Initialize coord cache */
 int cbk_cache_init(cbk_cache * cache/* cache to init */)
 {
+	cbk_cache_slot *slots;
 	int i;
 
 	assert("nikita-346", cache != NULL);
 
-	cache->slot =
-		kmalloc(sizeof(cbk_cache_slot) * cache->nr_slots,
-			reiser4_ctx_gfp_mask_get());
-	if (cache->slot == NULL)
+	cache->nr_shards = nr_cpu_ids;
+	cache->shard = kcalloc(cache->nr_shards, sizeof(cbk_cache_shard),
+			       reiser4_ctx_gfp_mask_get());
+	if (cache->shard == NULL)
 		return RETERR(-ENOMEM);
 
-	INIT_LIST_HEAD(&cache->lru);
-	for (i = 0; i < cache->nr_slots; ++i) {
-		cbk_cache_init_slot(cache->slot + i);
-		list_add_tail(&((cache->slot + i)->lru), &cache->lru);
+	slots = NULL;
+	if (cache->nr_slots != 0) {
+		slots = kcalloc(cache->nr_shards * cache->nr_slots,
+				sizeof(cbk_cache_slot),
+				reiser4_ctx_gfp_mask_get());
+		if (slots == NULL)
+			goto nomem;
+	}
+	cache->stats = alloc_percpu(struct cbk_cache_stats);
+	if (cache->stats == NULL)
+		goto nomem;
+
+	for (i = 0; i < cache->nr_shards; ++i) {
+		spin_lock_init(&cache->shard[i].guard);
+		cache->shard[i].clock = 0;
+		cache->shard[i].slot =
+			slots != NULL ? slots + i * cache->nr_slots : NULL;
 	}
-	rwlock_init(&cache->guard);
 	return 0;
+ nomem:
+	kfree(slots);
+	kfree(cache->shard);
+	cache->shard = NULL;
+	return RETERR(-ENOMEM);
 }
 
 /* free cbk cache data */
 void cbk_cache_done(cbk_cache * cache/* cache to release */)
 {
 	assert("nikita-2493", cache != NULL);
-	if (cache->slot != NULL) {
-		kfree(cache->slot);
-		cache->slot = NULL;
+	if (cache->shard != NULL) {
+		/* slots of all shards were allocated as a single array */
+		kfree(cache->shard[0].slot);
+		kfree(cache->shard);
+		cache->shard = NULL;
+	}
+	if (cache->stats != NULL) {
+		free_percpu(cache->stats);
+		cache->stats = NULL;
+	}
+}
+
+/* return shard of @cache to be used by the current thread */
+static inline cbk_cache_shard *cbk_cache_local_shard(const cbk_cache * cache)
+{
+	return &cache->shard[raw_smp_processor_id()];
+}
+
+/* mark @slot of @shard as most recently used */
+static inline void cbk_cache_touch(cbk_cache_shard * shard,
+				   cbk_cache_slot * slot)
+{
+	unsigned long clock;
+
+	/* racy increment is fine: clock is only a hint for eviction */
+	clock = READ_ONCE(shard->clock) + 1;
+	WRITE_ONCE(shard->clock, clock);
+	WRITE_ONCE(slot->stamp, clock);
+}
+
+/* sum per-cpu hit/miss counters of @cache into @stats */
+void cbk_cache_get_stats(const cbk_cache * cache,
+			 struct cbk_cache_stats *stats)
+{
+	int cpu;
+
+	stats->hits = 0;
+	stats->misses = 0;
+	if (cache->stats == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct cbk_cache_stats *s;
+
+		s = per_cpu_ptr(cache->stats, cpu);
+		stats->hits += READ_ONCE(s->hits);
+		stats->misses += READ_ONCE(s->misses);
 	}
 }
 
-/* macro to iterate over all cbk cache slots */
-#define for_all_slots(cache, slot)					  \
-	for ((slot) = list_entry((cache)->lru.next, cbk_cache_slot, lru); \
-	     &(cache)->lru != &(slot)->lru;				  \
-	     (slot) = list_entry(slot->lru.next, cbk_cache_slot, lru))
+/* zero hit/miss counters of @cache */
+void cbk_cache_reset_stats(cbk_cache * cache)
+{
+	int cpu;
+
+	if (cache->stats == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(cache->stats, cpu), 0,
+		       sizeof(struct cbk_cache_stats));
+}
 
 #if REISER4_DEBUG
 /* this function assures that [cbk-cache-invariant] invariant holds */
 static int cbk_cache_invariant(const cbk_cache * cache)
 {
-	cbk_cache_slot *slot;
+	cbk_cache_shard *shard;
 	int result;
-	int unused;
+	int i;
+	int j;
+
+	assert("nikita-2469", cache != NULL);
 
 	if (cache->nr_slots == 0)
 		return 1;
 
-	assert("nikita-2469", cache != NULL);
-	unused = 0;
+	/* all nodes cached within one shard are different */
+	shard = cbk_cache_local_shard(cache);
 	result = 1;
-	read_lock(&((cbk_cache *)cache)->guard);
-	for_all_slots(cache, slot) {
-		/* in LRU first go all `used' slots followed by `unused' */
-		if (unused && (slot->node != NULL))
-			result = 0;
-		if (slot->node == NULL)
-			unused = 1;
-		else {
-			cbk_cache_slot *scan;
-
-			/* all cached nodes are different */
-			scan = slot;
-			while (result) {
-				scan = list_entry(scan->lru.next,
-						  cbk_cache_slot, lru);
-				if (&cache->lru == &scan->lru)
-					break;
-				if (slot->node == scan->node)
-					result = 0;
+	spin_lock(&shard->guard);
+	for (i = 0; i < cache->nr_slots && result; ++i) {
+		if (shard->slot[i].node == NULL)
+			continue;
+		for (j = i + 1; j < cache->nr_slots; ++j) {
+			if (shard->slot[i].node == shard->slot[j].node) {
+				result = 0;
+				break;
 			}
 		}
-		if (!result)
-			break;
 	}
-	read_unlock(&((cbk_cache *)cache)->guard);
+	spin_unlock(&shard->guard);
 	return result;
 }
 
@@ -133,9 +188,10 @@ static int cbk_cache_invariant(const cbk_cache * cache)
 void cbk_cache_invalidate(const znode * node /* node to remove from cache */ ,
 			  reiser4_tree * tree/* tree to remove node from */)
 {
-	cbk_cache_slot *slot;
+	cbk_cache_shard *shard;
 	cbk_cache *cache;
 	int i;
+	int j;
 
 	assert("nikita-350", node != NULL);
 	assert("nikita-1479", LOCK_CNT_GTZ(rw_locked_tree));
@@ -143,15 +199,29 @@ void cbk_cache_invalidate(const znode * node /* node to remove from cache */ ,
 	cache = &tree->cbk_cache;
 	assert("nikita-2470", cbk_cache_invariant(cache));
 
-	write_lock(&(cache->guard));
-	for (i = 0, slot = cache->slot; i < cache->nr_slots; ++i, ++slot) {
-		if (slot->node == node) {
-			list_move_tail(&slot->lru, &cache->lru);
-			slot->node = NULL;
+	/*
+	 * @node is unreferenced and tree lock is held, hence nobody can add
+	 * it to the cache concurrently. It is enough to scan shards without
+	 * locks and to take shard lock only to clear matching slot.
+	 */
+	for (i = 0; i < cache->nr_shards; ++i) {
+		shard = &cache->shard[i];
+		for (j = 0; j < cache->nr_slots; ++j) {
+			cbk_cache_slot *slot;
+
+			slot = &shard->slot[j];
+			if (READ_ONCE(slot->node) != node)
+				continue;
+			spin_lock(&shard->guard);
+			if (slot->node == node) {
+				WRITE_ONCE(slot->node, NULL);
+				slot->stamp = 0;
+			}
+			spin_unlock(&shard->guard);
+			/* node is cached at most once per shard */
 			break;
 		}
 	}
-	write_unlock(&(cache->guard));
 	assert("nikita-2471", cbk_cache_invariant(cache));
 }
 
@@ -160,8 +230,9 @@ void cbk_cache_invalidate(const znode * node /* node to remove from cache */ ,
 static void cbk_cache_add(const znode * node/* node to add to the cache */)
 {
 	cbk_cache *cache;
-
+	cbk_cache_shard *shard;
 	cbk_cache_slot *slot;
+	cbk_cache_slot *victim;
 	int i;
 
 	assert("nikita-352", node != NULL);
@@ -172,20 +243,28 @@ static void cbk_cache_add(const znode * node/* node to add to the cache */)
 	if (cache->nr_slots == 0)
 		return;
 
-	write_lock(&(cache->guard));
+	shard = cbk_cache_local_shard(cache);
+	victim = NULL;
+	spin_lock(&shard->guard);
 	/* find slot to update/add */
-	for (i = 0, slot = cache->slot; i < cache->nr_slots; ++i, ++slot) {
+	for (i = 0, slot = shard->slot; i < cache->nr_slots; ++i, ++slot) {
 		/* oops, this node is already in a cache */
-		if (slot->node == node)
+		if (slot->node == node) {
+			victim = slot;
 			break;
+		}
+		/* otherwise, reuse free or least recently used slot */
+		if (victim == NULL)
+			victim = slot;
+		else if (victim->node != NULL &&
+			 (slot->node == NULL ||
+			  time_before(slot->stamp, victim->stamp)))
+			victim = slot;
 	}
-	/* if all slots are used, reuse least recently used one */
-	if (i == cache->nr_slots) {
-		slot = list_entry(cache->lru.prev, cbk_cache_slot, lru);
-		slot->node = (znode *) node;
-	}
-	list_move(&slot->lru, &cache->lru);
-	write_unlock(&(cache->guard));
+	if (victim->node != node)
+		WRITE_ONCE(victim->node, (znode *) node);
+	cbk_cache_touch(shard, victim);
+	spin_unlock(&shard->guard);
 	assert("nikita-2473", cbk_cache_invariant(cache));
 }
 
@@ -200,6 +279,8 @@ static level_lookup_result cbk_node_lookup(cbk_handle * h);
 /* helper functions */
 
 static void update_stale_dk(reiser4_tree * tree, znode * node);
+static int znode_contains_key_strict(znode * node, const reiser4_key * key,
+				     int isunique);
 
 /* release parent node during traversal */
 static void put_parent(cbk_handle * h);
@@ -382,6 +463,135 @@ static lookup_result coord_by_handle(cbk_handle * handle)
 		return traverse_tree(handle);
 }
 
+/*
+ * helper function for coord_by_keys(): look for @key in the node, where
+ * previous key of the batch was found (it is still locked by @lh), or in its
+ * right neighbor. Returns -E_REPEAT if full lookup has to be done.
+ */
+static lookup_result cbk_batch_next(reiser4_tree * tree,
+				    const reiser4_key * key, coord_t * coord,
+				    lock_handle * lh, znode_lock_mode lock_mode,
+				    lookup_bias bias, tree_level level,
+				    __u32 flags)
+{
+	znode *node;
+	lock_handle next;
+	int isunique;
+	int inside;
+	int beyond;
+	int result;
+
+	node = lh->node;
+	if (node == NULL || znode_get_level(node) != level)
+		/* first key, or extent was found on the twig level */
+		return RETERR(-E_REPEAT);
+
+	isunique = flags & CBK_UNIQUE;
+	read_lock_dk(tree);
+	inside = znode_contains_key_strict(node, key, isunique);
+	beyond = keyge(key, znode_get_rd_key(node));
+	read_unlock_dk(tree);
+
+	if (!inside) {
+		if (!beyond)
+			return RETERR(-E_REPEAT);
+		/* keys are sorted, so next key is likely to be in the right
+		 * neighbor */
+		init_lh(&next);
+		result = reiser4_get_right_neighbor(&next, node, (int)lock_mode,
+						    GN_CAN_USE_UPPER_LEVELS);
+		if (result != 0) {
+			done_lh(&next);
+			return RETERR(-E_REPEAT);
+		}
+		done_lh(lh);
+		move_lh(lh, &next);
+		node = lh->node;
+
+		read_lock_dk(tree);
+		inside = znode_contains_key_strict(node, key, isunique);
+		read_unlock_dk(tree);
+		if (!inside)
+			return RETERR(-E_REPEAT);
+	}
+	if (ZF_ISSET(node, JNODE_HEARD_BANSHEE))
+		return RETERR(-E_REPEAT);
+
+	result = zload(node);
+	if (result != 0)
+		return result;
+	result = node->nplug->lookup(node, key, bias, coord);
+	zrelse(node);
+	if (result == NS_FOUND)
+		return CBK_COORD_FOUND;
+	else if (result == NS_NOT_FOUND)
+		return CBK_COORD_NOTFOUND;
+	return RETERR(-E_REPEAT);
+}
+
+/**
+ * coord_by_keys - look up a batch of keys
+ * @tree: tree to perform search in
+ * @keys: keys to look for, sorted in ascending order
+ * @nr: number of keys in @keys
+ * @lock_mode: lock mode to take on the node where key is found
+ * @bias: what to return if key is not in the tree
+ * @level: level to look on (used as both lock and stop level)
+ * @flags: search flags
+ * @actor: function called for each key
+ * @arg: argument passed to @actor
+ *
+ * Calls @actor for each key with the result of its lookup, as if it were
+ * found by coord_by_key(): @coord is valid and its node is locked by @lh
+ * unless lookup failed. As keys are sorted, subsequent keys are usually
+ * located in the same node or in its right neighbor. So, lookup of a key
+ * starts from the node where previous key was found and only if this fails,
+ * traversal from the root is performed. @actor may release @lh (it has to if
+ * it wants to call coord_by_key() itself), in which case next key is looked
+ * up from the root.
+ *
+ * Returns 0 when @actor was called for all keys. Otherwise stops on the
+ * first error of tree traversal, or on the first non-zero value returned by
+ * @actor, and returns it.
+ */
+int coord_by_keys(reiser4_tree * tree, const reiser4_key * keys, int nr,
+		  znode_lock_mode lock_mode, lookup_bias bias,
+		  tree_level level, __u32 flags,
+		  cbk_batch_actor_t actor, void *arg)
+{
+	coord_t coord;
+	lock_handle lh;
+	int result;
+	int i;
+
+	assert("edward-2316", tree != NULL);
+	assert("edward-2317", keys != NULL);
+	assert("edward-2318", actor != NULL);
+	assert("edward-2319", lock_stack_isclean(get_current_lock_stack()));
+
+	result = 0;
+	init_lh(&lh);
+	for (i = 0; i < nr; ++i) {
+		assert("edward-2320", ergo(i > 0, keyle(&keys[i - 1], &keys[i])));
+
+		result = cbk_batch_next(tree, &keys[i], &coord, &lh,
+					lock_mode, bias, level, flags);
+		if (IS_CBKERR(result)) {
+			done_lh(&lh);
+			result = coord_by_key(tree, &keys[i], &coord, &lh,
+					      lock_mode, bias, level, level,
+					      flags, NULL);
+			if (IS_CBKERR(result))
+				break;
+		}
+		result = actor(tree, &keys[i], result, &coord, &lh, arg);
+		if (result != 0)
+			break;
+	}
+	done_lh(&lh);
+	return result;
+}
+
 /* Execute actor for each item (or unit, depending on @through_units_p),
    starting from @coord, right-ward, until either:
 
@@ -571,25 +781,18 @@ static void handle_vroot(struct inode *object, znode * node)
 }
 
 /*
- * helper function used by traverse tree to start tree traversal not from the
- * tree root, but from @h->object's vroot, if possible.
+ * helper function used by traverse_tree() to start tree traversal not from
+ * the tree root, but from @start node found by other means. @start is
+ * locked, if @h->key is still within its key range, lookup in @start is
+ * performed. Reference to @start acquired by the caller is released.
  */
-static int prepare_object_lookup(cbk_handle * h)
+static int cbk_start_at(cbk_handle * h, znode * start)
 {
-	znode *vroot;
 	int result;
 
-	vroot = inode_get_vroot(h->object);
-	if (vroot == NULL) {
-		/*
-		 * object doesn't have known vroot, start from real tree root.
-		 */
-		return LOOKUP_CONT;
-	}
-
-	h->level = znode_get_level(vroot);
-	/* take a long-term lock on vroot */
-	h->result = longterm_lock_znode(h->active_lh, vroot,
+	h->level = znode_get_level(start);
+	/* take a long-term lock on @start */
+	h->result = longterm_lock_znode(h->active_lh, start,
 					cbk_lock_mode(h->level, h),
 					ZNODE_LOCK_LOPRI);
 	result = LOOKUP_REST;
@@ -598,18 +801,20 @@ static int prepare_object_lookup(cbk_handle * h)
 		int inside;
 
 		isunique = h->flags & CBK_UNIQUE;
-		/* check that key is inside vroot */
+		/* check that key is inside @start */
 		read_lock_dk(h->tree);
-		inside = (znode_contains_key_strict(vroot, h->key, isunique) &&
-			  !ZF_ISSET(vroot, JNODE_HEARD_BANSHEE));
+		inside = (ZF_ISSET(start, JNODE_DKSET) &&
+			  znode_is_connected(start) &&
+			  znode_contains_key_strict(start, h->key, isunique) &&
+			  !ZF_ISSET(start, JNODE_HEARD_BANSHEE));
 		read_unlock_dk(h->tree);
 		if (inside) {
-			h->result = zload(vroot);
+			h->result = zload(start);
 			if (h->result == 0) {
-				/* search for key in vroot. */
+				/* search for key in @start. */
 				result = cbk_node_lookup(h);
-				zrelse(vroot);	/*h->active_lh->node); */
-				if (h->active_lh->node != vroot) {
+				zrelse(start);	/*h->active_lh->node); */
+				if (h->active_lh->node != start) {
 					result = LOOKUP_REST;
 				} else if (result == LOOKUP_CONT) {
 					move_lh(h->parent_lh, h->active_lh);
@@ -619,13 +824,123 @@ static int prepare_object_lookup(cbk_handle * h)
 		}
 	}
 
-	zput(vroot);
+	zput(start);
 
 	if (IS_CBKERR(h->result) || result == LOOKUP_REST)
 		hput(h);
 	return result;
 }
 
+/*
+ * helper function used by traverse tree to start tree traversal not from the
+ * tree root, but from @h->object's vroot, if possible.
+ */
+static int prepare_object_lookup(cbk_handle * h)
+{
+	znode *vroot;
+
+	vroot = inode_get_vroot(h->object);
+	if (vroot == NULL) {
+		/*
+		 * object doesn't have known vroot, start from real tree root.
+		 */
+		return LOOKUP_CONT;
+	}
+	return cbk_start_at(h, vroot);
+}
+
+/*
+ * Optimistic descent.
+ *
+ *     Regular traversal takes long-term lock on every node on the path from
+ *     the root down to the stop level (lock coupling). Upper levels of the
+ *     tree are shared by all lookups and rarely modified, still every lookup
+ *     bounces spin lock and owners list of the root znode and of its
+ *     children between processors.
+ *
+ *     To avoid this, before regular traversal cbk_optimistic_descent() walks
+ *     internal levels without taking long-term locks: in each node child
+ *     pointer is found by ->peek_child() method of node plugin, and the
+ *     result is validated by zlock_read_retry(): node content can only be
+ *     modified under write lock, and zlock->seq changes whenever node is
+ *     write-locked. The child is looked up in znode hash table, so the walk
+ *     stops at the first node that is not in memory, not loaded or write
+ *     locked, or at the level where lock requested by the caller has to be
+ *     taken (h->lock_level), whichever is higher. Only that node is locked,
+ *     and its delimiting keys are checked under dk lock exactly as it is done
+ *     for the vroot and for nodes found in the cbk cache, so a stale guess
+ *     can at worst cost a restart. Restarts always go the regular way.
+ */
+static znode *cbk_optimistic_descent(cbk_handle * h)
+{
+	reiser4_tree *tree;
+	reiser4_block_nr block;
+	tree_level target;
+	tree_level level;
+	znode *node;
+	znode *child;
+
+	tree = h->tree;
+	target = max(h->lock_level, h->stop_level);
+
+	block = READ_ONCE(tree->root_block);
+	node = zlook(tree, &block);
+	if (node == NULL)
+		return NULL;
+	level = znode_get_level(node);
+
+	while (znode_get_level(node) > target) {
+		unsigned seq;
+		int result;
+
+		/* don't start io without lock */
+		if (!JF_ISSET(ZJNODE(node), JNODE_PARSED) || zload(node) != 0)
+			break;
+		result = RETERR(-E_REPEAT);
+		seq = zlock_read_begin(&node->lock);
+		if (node->nplug->peek_child != NULL)
+			result = node->nplug->peek_child(node, h->key, &block);
+		if (zlock_read_retry(&node->lock, seq))
+			result = RETERR(-E_REPEAT);
+		zrelse(node);
+		if (result != 0)
+			break;
+
+		child = zlook(tree, &block);
+		if (child == NULL)
+			break;
+		if (znode_get_level(child) + 1 != znode_get_level(node) ||
+		    !znode_is_connected(child) ||
+		    !ZF_ISSET(child, JNODE_DKSET) ||
+		    ZF_ISSET(child, JNODE_HEARD_BANSHEE)) {
+			zput(child);
+			break;
+		}
+		zput(node);
+		node = child;
+	}
+	if (znode_get_level(node) == level) {
+		/* nothing gained: root is locked by regular traversal */
+		zput(node);
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * helper function used by traverse tree to start tree traversal from the
+ * node found by cbk_optimistic_descent(), if possible.
+ */
+static int prepare_optimistic_lookup(cbk_handle * h)
+{
+	znode *start;
+
+	start = cbk_optimistic_descent(h);
+	if (start == NULL)
+		return LOOKUP_CONT;
+	return cbk_start_at(h, start);
+}
+
 /* main function that handles common parts of tree traversal: starting
     (fake znode handling), restarts, error handling, completion */
 static lookup_result traverse_tree(cbk_handle * h/* search handle */)
@@ -633,6 +948,7 @@ static lookup_result traverse_tree(cbk_handle * h/* search handle */)
 	int done;
 	int iterations;
 	int vroot_used;
+	int optimistic_used;
 
 	assert("nikita-365", h != NULL);
 	assert("nikita-366", h->tree != NULL);
@@ -647,6 +963,7 @@ static lookup_result traverse_tree(cbk_handle * h/* search handle */)
 	done = 0;
 	iterations = 0;
 	vroot_used = 0;
+	optimistic_used = 0;
 
 	/* loop for restarts */
 restart:
@@ -668,6 +985,14 @@ restart:
 		else if (done == LOOKUP_DONE)
 			return h->result;
 	}
+	if (!optimistic_used && h->parent_lh->node == NULL) {
+		optimistic_used = 1;
+		done = prepare_optimistic_lookup(h);
+		if (done == LOOKUP_REST)
+			goto restart;
+		else if (done == LOOKUP_DONE)
+			return h->result;
+	}
 	if (h->parent_lh->node == NULL) {
 		done =
 		    get_uber_znode(h->tree, ZNODE_READ_LOCK, ZNODE_LOCK_LOPRI,
@@ -709,9 +1034,14 @@ restart:
 			break;
 		case LOOKUP_REST:
 			hput(h);
+			reiser4_stat_inc(h->tree->super,
+					 REISER4_STAT_CBK_RESTARTS);
 			/* deadlock avoidance is normal case. */
 			if (h->result != -E_DEADLOCK)
 				++iterations;
+			else
+				reiser4_stat_inc(h->tree->super,
+						 REISER4_STAT_CBK_DEADLOCKS);
 			reiser4_preempt_point();
 			goto restart;
 		}
@@ -1122,11 +1452,13 @@ static int cbk_cache_scan_slots(cbk_handle * h/* cbk handle */)
 	znode *node;
 	reiser4_tree *tree;
 	cbk_cache_slot *slot;
+	cbk_cache_shard *shard;
 	cbk_cache *cache;
 	tree_level level;
 	int isunique;
 	const reiser4_key *key;
 	int result;
+	int i;
 
 	assert("nikita-1317", h != NULL);
 	assert("nikita-1315", h->tree != NULL);
@@ -1140,6 +1472,7 @@ static int cbk_cache_scan_slots(cbk_handle * h/* cbk handle */)
 
 	assert("nikita-2474", cbk_cache_invariant(cache));
 	node = NULL;		/* to keep gcc happy */
+	slot = NULL;
 	level = h->level;
 	key = h->key;
 	isunique = h->flags & CBK_UNIQUE;
@@ -1149,39 +1482,30 @@ static int cbk_cache_scan_slots(cbk_handle * h/* cbk handle */)
 	 * this is time-critical function and dragons had, hence, been settled
 	 * here.
 	 *
-	 * Loop below scans cbk cache slots trying to find matching node with
-	 * suitable range of delimiting keys and located at the h->level.
-	 *
-	 * Scan is done under cbk cache spin lock that protects slot->node
-	 * pointers. If suitable node is found we want to pin it in
-	 * memory. But slot->node can point to the node with x_count 0
-	 * (unreferenced). Such node can be recycled at any moment, or can
-	 * already be in the process of being recycled (within jput()).
+	 * Loop below scans cbk cache slots of the local shard trying to find
+	 * matching node with suitable range of delimiting keys and located at
+	 * the h->level.
 	 *
-	 * As we found node in the cbk cache, it means that jput() hasn't yet
-	 * called cbk_cache_invalidate().
+	 * Scan is done without any locks: slot->node is only read once, and
+	 * the znode it points to cannot be freed before rcu_read_unlock(). If
+	 * suitable node is found we want to pin it in memory. But slot->node
+	 * can point to the node with x_count 0 (unreferenced). Such node can
+	 * be recycled at any moment, or can already be in the process of
+	 * being recycled (within jput()).
 	 *
-	 * We acquire reference to the node without holding tree lock, and
-	 * later, check node's RIP bit. This avoids races with jput().
+	 * We acquire reference to the node by zref_rcu() that checks node's
+	 * RIP bit. This avoids races with jput().
 	 */
 
 	rcu_read_lock();
-	read_lock(&((cbk_cache *)cache)->guard);
-
-	slot = list_entry(cache->lru.next, cbk_cache_slot, lru);
-	slot = list_entry(slot->lru.prev, cbk_cache_slot, lru);
-	BUG_ON(&slot->lru != &cache->lru);/*????*/
-	while (1) {
-
-		slot = list_entry(slot->lru.next, cbk_cache_slot, lru);
 
-		if (&cache->lru != &slot->lru)
-			node = slot->node;
-		else
-			node = NULL;
+	shard = cbk_cache_local_shard(cache);
+	for (i = 0; i < cache->nr_slots; ++i) {
+		slot = &shard->slot[i];
+		node = READ_ONCE(slot->node);
 
-		if (unlikely(node == NULL))
-			break;
+		if (node == NULL)
+			continue;
 
 		/*
 		 * this is (hopefully) the only place in the code where we are
@@ -1192,18 +1516,12 @@ static int cbk_cache_scan_slots(cbk_handle * h/* cbk handle */)
 		if (znode_get_level(node) == level &&
 		    /* reiser4_min_key < key < reiser4_max_key */
 		    znode_contains_key_strict(node, key, isunique)) {
-			zref(node);
-			result = 0;
-			spin_lock_prefetch(&tree->tree_lock);
+			node = zref_rcu(tree, node);
+			if (node != NULL)
+				result = 0;
 			break;
 		}
 	}
-	read_unlock(&((cbk_cache *)cache)->guard);
-
-	assert("nikita-2475", cbk_cache_invariant(cache));
-
-	if (unlikely(result == 0 && ZF_ISSET(node, JNODE_RIP)))
-		result = -ENOENT;
 
 	rcu_read_unlock();
 
@@ -1244,13 +1562,11 @@ static int cbk_cache_scan_slots(cbk_handle * h/* cbk handle */)
 			/* good. Either item found or definitely not found. */
 			result = 0;
 
-			write_lock(&(cache->guard));
-			if (slot->node == h->active_lh->node) {
-				/* if this node is still in cbk cache---move
-				   its slot to the head of the LRU list. */
-				list_move(&slot->lru, &cache->lru);
-			}
-			write_unlock(&(cache->guard));
+			/* if this node is still in cbk cache---mark its slot
+			   as most recently used. Slot could have been reused
+			   meanwhile, so this is only a hint. */
+			if (READ_ONCE(slot->node) == h->active_lh->node)
+				cbk_cache_touch(shard, slot);
 		}
 	} else {
 		/* race. While this thread was waiting for the lock, node was
@@ -1305,6 +1621,12 @@ static int cbk_cache_search(cbk_handle * h/* cbk handle */)
 		}
 	}
 	h->flags &= ~CBK_IN_CACHE;
+	if (h->tree->cbk_cache.nr_slots != 0) {
+		if (result == 0)
+			this_cpu_inc(h->tree->cbk_cache.stats->hits);
+		else
+			this_cpu_inc(h->tree->cbk_cache.stats->misses);
+	}
 	return result;
 }
 
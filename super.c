@@ -98,9 +98,26 @@ void reiser4_set_data_blocks(const struct super_block *super, __u64 nr)
 __u64 reiser4_free_blocks(const struct super_block *super	/* super block
 								   queried */ )
 {
+	reiser4_super_info_data *sbinfo;
+	__u64 free;
+	int cpu;
+
 	assert("nikita-454", super != NULL);
 	assert("nikita-455", is_reiser4_super(super));
-	return get_super_private(super)->blocks_free;
+
+	sbinfo = get_super_private(super);
+	free = sbinfo->blocks_free;
+	/* add free blocks of per-cpu grab caches. The result is exact only
+	   when nobody grabs or releases space concurrently */
+	if (sbinfo->grab_cache != NULL)
+		for_each_possible_cpu(cpu) {
+			struct reiser4_grab_cache *cache;
+
+			cache = per_cpu_ptr(sbinfo->grab_cache, cpu);
+			free += READ_ONCE(cache->reserved) -
+				READ_ONCE(cache->grabbed);
+		}
+	return free;
 }
 
 /* set number of blocks free in filesystem */
@@ -152,10 +169,20 @@ long reiser4_reserved_blocks(const struct super_block *super	/* super block
 /* get/set value of/to grabbed blocks counter */
 __u64 reiser4_grabbed_blocks(const struct super_block * super)
 {
+	reiser4_super_info_data *sbinfo;
+	__u64 grabbed;
+	int cpu;
+
 	assert("zam-512", super != NULL);
 	assert("zam-513", is_reiser4_super(super));
 
-	return get_super_private(super)->blocks_grabbed;
+	sbinfo = get_super_private(super);
+	grabbed = sbinfo->blocks_grabbed;
+	if (sbinfo->grab_cache != NULL)
+		for_each_possible_cpu(cpu)
+			grabbed += READ_ONCE(per_cpu_ptr(sbinfo->grab_cache,
+							 cpu)->grabbed);
+	return grabbed;
 }
 
 __u64 reiser4_flush_reserved(const struct super_block *super)
@@ -209,13 +236,6 @@ struct inode *reiser4_get_super_fake(const struct super_block *super)
 	return get_super_private(super)->fake;
 }
 
-/* return fake inode used to bind copied on capture nodes in the page cache */
-struct inode *reiser4_get_cc_fake(const struct super_block *super)
-{
-	assert("nikita-1757", super != NULL);
-	return get_super_private(super)->cc;
-}
-
 /* return fake inode used to bind bitmaps and journlal heads */
 struct inode *reiser4_get_bitmap_fake(const struct super_block *super)
 {
@@ -246,6 +266,121 @@ int reiser4_is_set(const struct super_block *super, reiser4_fs_flag f)
 	return test_bit((int)f, &get_super_private(super)->fs_flags);
 }
 
+/* sum per-cpu event counters of @super into @sum */
+void reiser4_stats_get(const struct super_block *super,
+		       struct reiser4_stats *sum)
+{
+	struct reiser4_stats __percpu *stats;
+	int cpu;
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	stats = get_super_private(super)->stats;
+	if (stats == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct reiser4_stats *s;
+
+		s = per_cpu_ptr(stats, cpu);
+		for (i = 0; i < REISER4_STAT_LAST; i++)
+			sum->count[i] += READ_ONCE(s->count[i]);
+	}
+}
+
+/* zero event counters of @super. Racing increments may survive, which is
+   fine for statistics. */
+void reiser4_stats_reset(const struct super_block *super)
+{
+	struct reiser4_stats __percpu *stats;
+	int cpu;
+
+	stats = get_super_private(super)->stats;
+	if (stats == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct reiser4_stats));
+}
+
+/* sum up per-cpu lock latency histograms of @super into @sum */
+void reiser4_lock_hist_get(const struct super_block *super,
+			   struct reiser4_lock_hist *sum)
+{
+	struct reiser4_lock_hist __percpu *hist;
+	int cpu;
+	int i;
+	int j;
+
+	memset(sum, 0, sizeof(*sum));
+	hist = get_super_private(super)->lock_hist;
+	if (hist == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct reiser4_lock_hist *h;
+
+		h = per_cpu_ptr(hist, cpu);
+		for (i = 0; i <= REISER4_MAX_ZTREE_HEIGHT; i++) {
+			for (j = 0; j < REISER4_LOCK_HIST_BUCKETS; j++) {
+				sum->wait[i][j] += READ_ONCE(h->wait[i][j]);
+				sum->hold[i][j] += READ_ONCE(h->hold[i][j]);
+			}
+		}
+	}
+}
+
+/* zero lock latency histograms of @super */
+void reiser4_lock_hist_reset(const struct super_block *super)
+{
+	struct reiser4_lock_hist __percpu *hist;
+	int cpu;
+
+	hist = get_super_private(super)->lock_hist;
+	if (hist == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0,
+		       sizeof(struct reiser4_lock_hist));
+}
+
+/* sum per-cpu commit histograms of @super into @sum */
+void reiser4_commit_hist_get(const struct super_block *super,
+			     struct reiser4_commit_hist *sum)
+{
+	struct reiser4_commit_hist __percpu *hist;
+	int cpu;
+	int i;
+	int j;
+
+	memset(sum, 0, sizeof(*sum));
+	hist = get_super_private(super)->commit_hist;
+	if (hist == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct reiser4_commit_hist *h;
+
+		h = per_cpu_ptr(hist, cpu);
+		for (j = 0; j < REISER4_LOCK_HIST_BUCKETS; j++) {
+			for (i = 0; i < REISER4_COMMIT_STAGES; i++)
+				sum->time[i][j] += READ_ONCE(h->time[i][j]);
+			for (i = 0; i < REISER4_ATOM_SIZES; i++)
+				sum->size[i][j] += READ_ONCE(h->size[i][j]);
+		}
+	}
+}
+
+/* zero commit histograms of @super */
+void reiser4_commit_hist_reset(const struct super_block *super)
+{
+	struct reiser4_commit_hist __percpu *hist;
+	int cpu;
+
+	hist = get_super_private(super)->commit_hist;
+	if (hist == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0,
+		       sizeof(struct reiser4_commit_hist));
+}
+
 /* amount of blocks reserved for given group in file system */
 static __u64 reserved_for_gid(const struct super_block *super UNUSED_ARG,
 			      gid_t gid UNUSED_ARG/* group id */)
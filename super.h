@@ -7,6 +7,7 @@
 #define __REISER4_SUPER_H__
 
 #include <linux/exportfs.h>
+#include <linux/percpu.h>
 
 #include "tree.h"
 #include "entd.h"
@@ -15,6 +16,133 @@
 #include "plugin/object.h"
 #include "plugin/space/space_allocator.h"
 
+/*
+ * Hot path event counters. They are kept per-cpu in
+ * reiser4_super_info_data, summed up and reset through "stats" file in the
+ * debugfs directory of the file system (see super_ops.c).
+ */
+typedef enum {
+	/* reiser4 contexts created, roughly a number of syscalls */
+	REISER4_STAT_CONTEXTS,
+	/* tree traversals restarted from the root */
+	REISER4_STAT_CBK_RESTARTS,
+	/* ... of them because of deadlock avoidance */
+	REISER4_STAT_CBK_DEADLOCKS,
+	/* long-term lock requests that had to sleep */
+	REISER4_STAT_LOCK_WAITS,
+	/* carry operations performed */
+	REISER4_STAT_CARRY_OPS,
+	/* nodes flush added to relocate set */
+	REISER4_STAT_FLUSH_RELOCATED,
+	/* nodes flush added to overwrite set */
+	REISER4_STAT_FLUSH_OVERWRITTEN,
+	/* blocks submitted for write from flush queues */
+	REISER4_STAT_FLUSH_WRITTEN,
+	/* atoms committed */
+	REISER4_STAT_COMMITS,
+	/* nodes captured by committed atoms */
+	REISER4_STAT_COMMIT_NODES,
+	/* long-term lock requests failed with -E_DEADLOCK */
+	REISER4_STAT_LOCK_DEADLOCKS,
+	/* low priority lock owners asked to release their locks */
+	REISER4_STAT_LOPRI_WAKEUPS,
+	/* batches of atoms written back by reiser4_checkpoint() */
+	REISER4_STAT_CHECKPOINTS,
+	/* atoms which write-back was deferred */
+	REISER4_STAT_DEFERRED_ATOMS,
+	/* nodes of committed atoms copied on capture */
+	REISER4_STAT_COPIED_ON_CAPTURE,
+	/* head of log txmod passed the end of disk */
+	REISER4_STAT_LOG_WRAPS,
+	/* segments chosen by log cleaner */
+	REISER4_STAT_LOG_CLEANED,
+	/* formatted nodes moved out of segments by log cleaner */
+	REISER4_STAT_LOG_MOVED,
+	/* bitmap nodes read from disk */
+	REISER4_STAT_BITMAP_LOADS,
+	/* idle bitmap nodes dropped by the shrinker */
+	REISER4_STAT_BITMAP_UNLOADS,
+	REISER4_STAT_LAST
+} reiser4_stat_id;
+
+struct reiser4_stats {
+	unsigned long count[REISER4_STAT_LAST];
+};
+
+/*
+ * Long-term znode lock latency histograms, per tree level. Latencies are
+ * counted in units of 1024 nanoseconds: bucket 0 counts latencies below 1024
+ * ns, bucket i > 0 counts latencies in [2^(i+9), 2^(i+10)) ns, the last
+ * bucket absorbs everything above. Level 0 is the uber znode. Exported
+ * through "lock_hist" debugfs file.
+ */
+#define REISER4_LOCK_HIST_BUCKETS (24)
+
+struct reiser4_lock_hist {
+	/* time spent sleeping in longterm_lock_znode() */
+	unsigned long wait[REISER4_MAX_ZTREE_HEIGHT + 1][REISER4_LOCK_HIST_BUCKETS];
+	/* time between acquiring and releasing a long-term lock */
+	unsigned long hold[REISER4_MAX_ZTREE_HEIGHT + 1][REISER4_LOCK_HIST_BUCKETS];
+};
+
+/*
+ * Commit latency histograms, per stage of commit_current_atom() and
+ * reiser4_write_logs(), and atom size histograms. Latency buckets are the
+ * same as in struct reiser4_lock_hist. Size bucket 0 counts empty sets,
+ * bucket i > 0 counts sets of [2^(i-1), 2^i) nodes. Exported through
+ * "commit_hist" debugfs file.
+ */
+typedef enum {
+	/* jnode_flush() loop of the committer */
+	REISER4_COMMIT_FLUSH,
+	/* current_atom_complete_writes() */
+	REISER4_COMMIT_COMPLETE_WRITES,
+	/* waiting for tmgr.commit_mutex */
+	REISER4_COMMIT_MUTEX_WAIT,
+	/* pre-commit hooks and get_overwrite_set() */
+	REISER4_COMMIT_PREPARE,
+	/* allocation and formatting of wandered blocks and log records */
+	REISER4_COMMIT_ALLOC_TX,
+	/* log i/o and journal header update */
+	REISER4_COMMIT_WRITE_LOG,
+	/* waiting for tmgr.wb_mutex */
+	REISER4_COMMIT_WB_MUTEX_WAIT,
+	/* write_tx_back() */
+	REISER4_COMMIT_WRITE_BACK,
+	/* write-back of a batch of atoms with deferred checkpoint */
+	REISER4_COMMIT_CHECKPOINT,
+	/* the whole commit_current_atom() */
+	REISER4_COMMIT_TOTAL,
+	REISER4_COMMIT_STAGES
+} reiser4_commit_stage;
+
+typedef enum {
+	REISER4_ATOM_CAPTURED,
+	REISER4_ATOM_OVERWRITE,
+	REISER4_ATOM_RELOCATE,
+	REISER4_ATOM_SIZES
+} reiser4_atom_size_id;
+
+struct reiser4_commit_hist {
+	unsigned long time[REISER4_COMMIT_STAGES][REISER4_LOCK_HIST_BUCKETS];
+	unsigned long size[REISER4_ATOM_SIZES][REISER4_LOCK_HIST_BUCKETS];
+};
+
+/*
+ * Per-cpu cache of space reservations. @reserved blocks were taken from
+ * sbinfo->blocks_free, @grabbed of them are counted as grabbed, the rest
+ * (@reserved - @grabbed, never negative) are free blocks which reiser4_grab()
+ * and grabbed2free() trade without taking sbinfo->guard. @reserved is changed
+ * under both sbinfo->guard and @lock, @grabbed under @lock only. Either
+ * field may be negative: blocks grabbed on one cpu may be released or
+ * converted on another one. See block_alloc.c for details.
+ */
+struct reiser4_grab_cache {
+	spinlock_t lock;
+	__s64 reserved;
+	__s64 grabbed;
+};
+
 /*
  * Flush algorithms parameters.
  */
@@ -53,7 +181,13 @@ typedef enum {
 	/* enable issuing of discard requests */
 	REISER4_DISCARD = 8,
 	/* disable hole punching at flush time */
-	REISER4_DONT_PUNCH_HOLES = 9
+	REISER4_DONT_PUNCH_HOLES = 9,
+	/* write back overwrite sets of committed atoms in background */
+	REISER4_DEFERRED_CHECKPOINT = 10,
+	/* transactions are checksummed, set from on-disk format flags */
+	REISER4_TX_CSUM = 11,
+	/* atom size and age limits are adjusted by ktxnmgrd */
+	REISER4_ADAPTIVE_ATOM_LIMITS = 12
 } reiser4_fs_flag;
 
 /*
@@ -100,6 +234,7 @@ struct object_ops {
     ->blocks_free
     ->blocks_free_committed
     ->blocks_grabbed
+    ->blocks_cached
     ->blocks_fake_allocated_unformatted
     ->blocks_fake_allocated
     ->blocks_flush_reserved
@@ -136,6 +271,13 @@ struct reiser4_super_info_data {
 	/* transaction model */
 	reiser4_txmod_id txmod;
 
+	/* block placement policy */
+	reiser4_alloc_policy_id alloc_policy;
+
+	/* plugin of new formatted nodes set by "node" mount option,
+	   LAST_NODE_ID if it was not given */
+	reiser4_node_id node_plugin;
+
 	/* reiser4 internal tree */
 	reiser4_tree tree;
 
@@ -192,6 +334,17 @@ struct reiser4_super_info_data {
 	/* number of blocks reserved for cluster operations. */
 	__u64 blocks_clustered;
 
+	/*
+	 * sum of ->reserved of per-cpu grab caches. Blocks of the caches are
+	 * not counted by ->blocks_free and ->blocks_grabbed
+	 */
+	__s64 blocks_cached;
+	/* per-cpu caches of space reservations */
+	struct reiser4_grab_cache __percpu *grab_cache;
+	/* grab caches are in use. Cleared when free space gets low, see
+	   block_alloc.c */
+	int grab_cache_enabled;
+
 	/* unique file-system identifier */
 	__u32 fsuid;
 
@@ -209,12 +362,14 @@ struct reiser4_super_info_data {
 	/* ent thread */
 	entd_context entd;
 
+	/* segments and cleaner of log transaction model, NULL for other
+	   transaction models */
+	struct log_segments *logseg;
+
 	/* fake inode used to bind formatted nodes */
 	struct inode *fake;
 	/* inode used to bind bitmaps (and journal heads) */
 	struct inode *bitmap;
-	/* inode used to bind copied on capture nodes */
-	struct inode *cc;
 
 	/* disk layout plugin */
 	disk_format_plugin *df_plug;
@@ -244,6 +399,8 @@ struct reiser4_super_info_data {
 	 * allocation
 	 */
 	__u64 blocknr_hint_default;
+	/* allocation cursors of "percpu" block placement policy */
+	reiser4_block_nr __percpu *alloc_cursors;
 
 	/* committed number of files (oid allocator state variable ) */
 	__u64 nr_files_committed;
@@ -302,6 +459,14 @@ struct reiser4_super_info_data {
 	struct list_head all_jnodes;
 #endif
 	struct dentry *debugfs_root;
+	/* number of bitmap nodes in memory, see plugin/space/bitmap.c */
+	atomic_t bitmaps_loaded;
+	/* hot path event counters */
+	struct reiser4_stats __percpu *stats;
+	/* long-term lock latency histograms */
+	struct reiser4_lock_hist __percpu *lock_hist;
+	/* commit stage latency and atom size histograms */
+	struct reiser4_commit_hist __percpu *commit_hist;
 };
 
 extern reiser4_super_info_data *get_super_private_nocheck(const struct
@@ -316,6 +481,36 @@ static inline reiser4_super_info_data *get_super_private(const struct
 	return (reiser4_super_info_data *) super->s_fs_info;
 }
 
+/* add @val to the event counter @id of @super */
+static inline void reiser4_stat_add(const struct super_block *super,
+				    reiser4_stat_id id, unsigned long val)
+{
+	reiser4_super_info_data *sbinfo;
+
+	sbinfo = get_super_private(super);
+	/* counters are not allocated yet early during mount */
+	if (sbinfo != NULL && sbinfo->stats != NULL)
+		this_cpu_add(sbinfo->stats->count[id], val);
+}
+
+static inline void reiser4_stat_inc(const struct super_block *super,
+				    reiser4_stat_id id)
+{
+	reiser4_stat_add(super, id, 1);
+}
+
+extern void reiser4_stats_get(const struct super_block *super,
+			      struct reiser4_stats *sum);
+extern void reiser4_stats_reset(const struct super_block *super);
+extern void reiser4_lock_hist_get(const struct super_block *super,
+				  struct reiser4_lock_hist *sum);
+extern void reiser4_lock_hist_reset(const struct super_block *super);
+extern void reiser4_commit_hist_get(const struct super_block *super,
+				    struct reiser4_commit_hist *sum);
+extern void reiser4_commit_hist_reset(const struct super_block *super);
+extern u64 reiser4_commit_stage_done(txn_atom *atom,
+				     reiser4_commit_stage stage, u64 start);
+
 /* get ent context for the @super */
 static inline entd_context *get_entd_context(struct super_block *super)
 {
@@ -401,7 +596,6 @@ reiser4_get_space_allocator(const struct super_block *super);
 extern reiser4_oid_allocator *
 reiser4_get_oid_allocator(const struct super_block *super);
 extern struct inode *reiser4_get_super_fake(const struct super_block *super);
-extern struct inode *reiser4_get_cc_fake(const struct super_block *super);
 extern struct inode *reiser4_get_bitmap_fake(const struct super_block *super);
 extern reiser4_tree *reiser4_get_tree(const struct super_block *super);
 extern int is_reiser4_super(const struct super_block *super);
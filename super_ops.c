@@ -7,6 +7,7 @@
 #include "flush.h"
 #include "safe_link.h"
 #include "checksum.h"
+#include "logseg.h"
 
 #include <linux/vfs.h>
 #include <linux/writeback.h>
@@ -49,6 +50,7 @@ static void init_once(void *obj)
 	loading_init_once(&info->p);
 	INIT_RADIX_TREE(jnode_tree_by_reiser4_inode(&info->p),
 			GFP_ATOMIC);
+	spin_lock_init(&info->p.jnodes_guard);
 #if REISER4_DEBUG
 	info->p.nr_jnodes = 0;
 #endif
@@ -252,6 +254,9 @@ static void reiser4_put_super(struct super_block *super)
 		return;
 	}
 
+	/* stop log cleaner before space allocator goes away */
+	reiser4_done_log_cleaner(super);
+
 	/* have disk format plugin to free its resources */
 	if (get_super_private(super)->df_plug->release)
 		get_super_private(super)->df_plug->release(super);
@@ -264,6 +269,9 @@ static void reiser4_put_super(struct super_block *super)
 	reiser4_done_ktxnmgrd(super);
 	reiser4_done_txnmgr(&sbinfo->tmgr);
 
+	/* nothing is written anymore */
+	alloc_policy_plugin_by_id(sbinfo->alloc_policy)->done(super);
+
 	assert("edward-1890", list_empty(&get_super_private(super)->all_jnodes));
 	assert("edward-1891", get_current_context()->trans->atom == NULL);
 	reiser4_check_block_counters(super);
@@ -484,6 +492,10 @@ static int reiser4_show_options(struct seq_file *m, struct dentry *dentry)
 	seq_printf(m, ",atom_min_size=0x%x", sbinfo->tmgr.atom_min_size);
 	seq_printf(m, ",atom_max_flushers=0x%x",
 		   sbinfo->tmgr.atom_max_flushers);
+	seq_printf(m, ",checkpoint_max_size=0x%x",
+		   sbinfo->tmgr.checkpoint_max_size);
+	seq_printf(m, ",isolated_max_size=0x%x",
+		   sbinfo->tmgr.isolated_max_size);
 	seq_printf(m, ",cbk_cache_slots=0x%x",
 		   sbinfo->tree.cbk_cache.nr_slots);
 
@@ -503,6 +515,283 @@ struct super_operations reiser4_super_operations = {
 	.show_options = reiser4_show_options
 };
 
+/*
+ * cbk_cache_show - show coord cache statistics in debugfs
+ *
+ * Prints geometry of coord cache and cumulative hit/miss counters of all its
+ * shards.
+ */
+static int cbk_cache_show(struct seq_file *m, void *unused)
+{
+	reiser4_super_info_data *sbinfo = m->private;
+	cbk_cache *cache = &sbinfo->tree.cbk_cache;
+	struct cbk_cache_stats stats;
+
+	cbk_cache_get_stats(cache, &stats);
+	seq_printf(m, "shards: %i\nslots: %i\nhits: %lu\nmisses: %lu\n",
+		   cache->nr_shards, cache->nr_slots, stats.hits, stats.misses);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cbk_cache);
+
+static void hash_table_show(struct seq_file *m, const char *name,
+			    const struct tsh_stats *st)
+{
+	int i;
+
+	seq_printf(m, "%s: buckets: %u items: %lu used: %lu max chain: %lu "
+		   "resizes: %lu\n  chains:", name, st->buckets, st->items,
+		   st->used, st->max_chain, st->resizes);
+	for (i = 0; i < TYPE_SAFE_HASH_CHAIN_HIST; i++)
+		seq_printf(m, " %lu", st->chains[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * hash_tables_show - show znode and jnode hash tables statistics in debugfs
+ *
+ * For each table prints its current size, population and histogram of chain
+ * lengths (the last column counts chains of that length or longer).
+ */
+static int hash_tables_show(struct seq_file *m, void *unused)
+{
+	reiser4_super_info_data *sbinfo = m->private;
+	struct tsh_stats hashed;
+	struct tsh_stats fake;
+
+	znodes_tree_stats(&sbinfo->tree, &hashed, &fake);
+	hash_table_show(m, "znodes", &hashed);
+	hash_table_show(m, "fake znodes", &fake);
+	jnodes_tree_stats(&sbinfo->tree, &hashed);
+	hash_table_show(m, "jnodes", &hashed);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hash_tables);
+
+static const char *const stat_names[REISER4_STAT_LAST] = {
+	[REISER4_STAT_CONTEXTS] = "contexts",
+	[REISER4_STAT_CBK_RESTARTS] = "cbk_restarts",
+	[REISER4_STAT_CBK_DEADLOCKS] = "cbk_deadlocks",
+	[REISER4_STAT_LOCK_WAITS] = "lock_waits",
+	[REISER4_STAT_CARRY_OPS] = "carry_ops",
+	[REISER4_STAT_FLUSH_RELOCATED] = "flush_relocated",
+	[REISER4_STAT_FLUSH_OVERWRITTEN] = "flush_overwritten",
+	[REISER4_STAT_FLUSH_WRITTEN] = "flush_written",
+	[REISER4_STAT_COMMITS] = "commits",
+	[REISER4_STAT_COMMIT_NODES] = "commit_nodes",
+	[REISER4_STAT_LOCK_DEADLOCKS] = "lock_deadlocks",
+	[REISER4_STAT_LOPRI_WAKEUPS] = "lopri_wakeups",
+	[REISER4_STAT_CHECKPOINTS] = "checkpoints",
+	[REISER4_STAT_DEFERRED_ATOMS] = "deferred_atoms",
+	[REISER4_STAT_COPIED_ON_CAPTURE] = "copied_on_capture",
+	[REISER4_STAT_LOG_WRAPS] = "log_wraps",
+	[REISER4_STAT_LOG_CLEANED] = "log_cleaned",
+	[REISER4_STAT_LOG_MOVED] = "log_moved",
+	[REISER4_STAT_BITMAP_LOADS] = "bitmap_loads",
+	[REISER4_STAT_BITMAP_UNLOADS] = "bitmap_unloads"
+};
+
+/*
+ * stats_show - show hot path event counters in debugfs
+ *
+ * Prints one "name: value" line per counter, coord cache hits and misses
+ * included. Counters are cumulative since mount or last reset.
+ */
+static int stats_show(struct seq_file *m, void *unused)
+{
+	reiser4_super_info_data *sbinfo = m->private;
+	struct reiser4_stats sum;
+	struct cbk_cache_stats cbk;
+	int i;
+
+	reiser4_stats_get(sbinfo->tree.super, &sum);
+	cbk_cache_get_stats(&sbinfo->tree.cbk_cache, &cbk);
+	seq_printf(m, "cbk_cache_hits: %lu\ncbk_cache_misses: %lu\n",
+		   cbk.hits, cbk.misses);
+	for (i = 0; i < REISER4_STAT_LAST; i++)
+		seq_printf(m, "%s: %lu\n", stat_names[i], sum.count[i]);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, inode->i_private);
+}
+
+/* any write to the "stats" file resets the counters */
+static ssize_t stats_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	reiser4_super_info_data *sbinfo = m->private;
+
+	reiser4_stats_reset(sbinfo->tree.super);
+	cbk_cache_reset_stats(&sbinfo->tree.cbk_cache);
+	return count;
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/* print one line of lock latency histogram, if it is not empty */
+static void lock_hist_show_line(struct seq_file *m, const char *kind,
+				int level, const unsigned long *hist)
+{
+	int i;
+
+	for (i = 0; i < REISER4_LOCK_HIST_BUCKETS; i++)
+		if (hist[i] != 0)
+			break;
+	if (i == REISER4_LOCK_HIST_BUCKETS)
+		return;
+	seq_printf(m, "%s level %d:", kind, level);
+	for (i = 0; i < REISER4_LOCK_HIST_BUCKETS; i++)
+		seq_printf(m, " %lu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * lock_hist_show - show long-term lock latency histograms in debugfs
+ *
+ * Prints wait and hold time histograms for each tree level that has seen any
+ * locking. Column 0 counts latencies below 1024 ns, column i > 0 counts
+ * latencies in [2^(i+9), 2^(i+10)) ns (see comment before struct
+ * reiser4_lock_hist).
+ */
+static int lock_hist_show(struct seq_file *m, void *unused)
+{
+	reiser4_super_info_data *sbinfo = m->private;
+	struct reiser4_lock_hist *sum;
+	int level;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL)
+		return RETERR(-ENOMEM);
+	reiser4_lock_hist_get(sbinfo->tree.super, sum);
+	for (level = 0; level <= REISER4_MAX_ZTREE_HEIGHT; level++) {
+		lock_hist_show_line(m, "wait", level, sum->wait[level]);
+		lock_hist_show_line(m, "hold", level, sum->hold[level]);
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int lock_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lock_hist_show, inode->i_private);
+}
+
+/* any write to the "lock_hist" file resets the histograms */
+static ssize_t lock_hist_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	reiser4_super_info_data *sbinfo = m->private;
+
+	reiser4_lock_hist_reset(sbinfo->tree.super);
+	return count;
+}
+
+static const struct file_operations lock_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = lock_hist_open,
+	.read = seq_read,
+	.write = lock_hist_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+static const char *commit_stage_names[REISER4_COMMIT_STAGES] = {
+	[REISER4_COMMIT_FLUSH] = "flush",
+	[REISER4_COMMIT_COMPLETE_WRITES] = "complete_writes",
+	[REISER4_COMMIT_MUTEX_WAIT] = "commit_mutex",
+	[REISER4_COMMIT_PREPARE] = "prepare",
+	[REISER4_COMMIT_ALLOC_TX] = "alloc_tx",
+	[REISER4_COMMIT_WRITE_LOG] = "write_log",
+	[REISER4_COMMIT_WB_MUTEX_WAIT] = "wb_mutex",
+	[REISER4_COMMIT_WRITE_BACK] = "write_back",
+	[REISER4_COMMIT_CHECKPOINT] = "checkpoint",
+	[REISER4_COMMIT_TOTAL] = "total"
+};
+
+static const char *atom_size_names[REISER4_ATOM_SIZES] = {
+	[REISER4_ATOM_CAPTURED] = "captured",
+	[REISER4_ATOM_OVERWRITE] = "overwrite",
+	[REISER4_ATOM_RELOCATE] = "relocate"
+};
+
+/* print one line of commit histogram */
+static void commit_hist_show_line(struct seq_file *m, const char *kind,
+				  const char *name, const unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "%s %s:", kind, name);
+	for (i = 0; i < REISER4_LOCK_HIST_BUCKETS; i++)
+		seq_printf(m, " %lu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * commit_hist_show - show commit latency and atom size histograms in debugfs
+ *
+ * Column 0 of "time" lines counts commit stages which took less than 1024
+ * ns, column i > 0 counts ones which took [2^(i+9), 2^(i+10)) ns. Column 0
+ * of "size" lines counts atoms with no nodes in the given set, column i > 0
+ * counts atoms with [2^(i-1), 2^i) nodes in it (see comment before struct
+ * reiser4_commit_hist).
+ */
+static int commit_hist_show(struct seq_file *m, void *unused)
+{
+	reiser4_super_info_data *sbinfo = m->private;
+	struct reiser4_commit_hist *sum;
+	int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL)
+		return RETERR(-ENOMEM);
+	reiser4_commit_hist_get(sbinfo->tree.super, sum);
+	for (i = 0; i < REISER4_COMMIT_STAGES; i++)
+		commit_hist_show_line(m, "time", commit_stage_names[i],
+				      sum->time[i]);
+	for (i = 0; i < REISER4_ATOM_SIZES; i++)
+		commit_hist_show_line(m, "size", atom_size_names[i],
+				      sum->size[i]);
+	kfree(sum);
+	return 0;
+}
+
+static int commit_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, commit_hist_show, inode->i_private);
+}
+
+/* any write to the "commit_hist" file resets the histograms */
+static ssize_t commit_hist_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	reiser4_super_info_data *sbinfo = m->private;
+
+	reiser4_commit_hist_reset(sbinfo->tree.super);
+	return count;
+}
+
+static const struct file_operations commit_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = commit_hist_open,
+	.read = seq_read,
+	.write = commit_hist_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
 /**
  * fill_super - initialize super block on mount
  * @super: super block to fill
@@ -559,6 +848,11 @@ static int fill_super(struct super_block *super, void *data, int silent)
 								    data)) != 0)
 		goto failed_init_disk_format;
 
+	/* block count is known, initialize block placement policy */
+	result = alloc_policy_plugin_by_id(sbinfo->alloc_policy)->init(super);
+	if (result != 0)
+		goto failed_init_alloc_policy;
+
 	/*
 	 * There are some 'committed' versions of reiser4 super block counters,
 	 * which correspond to reiser4 on-disk state. These counters are
@@ -574,6 +868,10 @@ static int fill_super(struct super_block *super, void *data, int silent)
 	if ((result = get_super_private(super)->df_plug->version_update(super)) != 0)
 		goto failed_update_format_version;
 
+	/* start log cleaner if log transaction model is used */
+	if ((result = reiser4_init_log_cleaner(super)) != 0)
+		goto failed_init_log_cleaner;
+
 	process_safelinks(super);
 	reiser4_exit_context(&ctx);
 
@@ -586,15 +884,50 @@ static int fill_super(struct super_block *super, void *data, int silent)
 		debugfs_create_u32("id_count", S_IFREG|S_IRUSR,
 				   sbinfo->debugfs_root,
 				   &sbinfo->tmgr.id_count);
+		/* current atom limits, adjusted by ktxnmgrd with
+		   adaptive_atom_limits mount option */
+		debugfs_create_u32("atom_max_size", S_IFREG|S_IRUSR,
+				   sbinfo->debugfs_root,
+				   &sbinfo->tmgr.atom_max_size);
+		debugfs_create_u32("atom_max_age", S_IFREG|S_IRUSR,
+				   sbinfo->debugfs_root,
+				   &sbinfo->tmgr.atom_max_age);
+		debugfs_create_u32("atom_min_size", S_IFREG|S_IRUSR,
+				   sbinfo->debugfs_root,
+				   &sbinfo->tmgr.atom_min_size);
+		debugfs_create_u32("commit_bandwidth", S_IFREG|S_IRUSR,
+				   sbinfo->debugfs_root,
+				   &sbinfo->tmgr.tune.bandwidth);
+		debugfs_create_atomic_t("bitmaps_loaded", S_IFREG|S_IRUSR,
+					sbinfo->debugfs_root,
+					&sbinfo->bitmaps_loaded);
+		debugfs_create_file("cbk_cache", S_IFREG|S_IRUSR,
+				    sbinfo->debugfs_root, sbinfo,
+				    &cbk_cache_fops);
+		debugfs_create_file("hash_tables", S_IFREG|S_IRUSR,
+				    sbinfo->debugfs_root, sbinfo,
+				    &hash_tables_fops);
+		debugfs_create_file("stats", S_IFREG|S_IRUSR|S_IWUSR,
+				    sbinfo->debugfs_root, sbinfo,
+				    &stats_fops);
+		debugfs_create_file("lock_hist", S_IFREG|S_IRUSR|S_IWUSR,
+				    sbinfo->debugfs_root, sbinfo,
+				    &lock_hist_fops);
+		debugfs_create_file("commit_hist", S_IFREG|S_IRUSR|S_IWUSR,
+				    sbinfo->debugfs_root, sbinfo,
+				    &commit_hist_fops);
 	}
 	printk("reiser4: %s: using %s.\n", super->s_id,
 	       txmod_plugin_by_id(sbinfo->txmod)->h.desc);
 	return 0;
 
+ failed_init_log_cleaner:
  failed_update_format_version:
  failed_init_root_inode:
+ failed_init_alloc_policy:
 	if (sbinfo->df_plug->release)
 		sbinfo->df_plug->release(super);
+	alloc_policy_plugin_by_id(sbinfo->alloc_policy)->done(super);
  failed_init_disk_format:
 	reiser4_done_formatted_fake(super);
  failed_init_formatted_fake:
@@ -707,17 +1040,17 @@ static int __init init_reiser4(void)
 	if ((result = blocknr_set_init_static()) != 0)
 		goto failed_init_blocknr_set;
 
-	/* initialize cache of blocknr list entries */
-	if ((result = blocknr_list_init_static()) != 0)
-		goto failed_init_blocknr_list;
+	/* initialize cache of blocknr tree entries */
+	if ((result = blocknr_tree_init_static()) != 0)
+		goto failed_init_blocknr_tree;
 
 	if ((result = register_filesystem(&reiser4_fs_type)) == 0) {
 		reiser4_debugfs_root = debugfs_create_dir("reiser4", NULL);
 		return 0;
 	}
 
-	blocknr_list_done_static();
- failed_init_blocknr_list:
+	blocknr_tree_done_static();
+ failed_init_blocknr_tree:
 	blocknr_set_done_static();
  failed_init_blocknr_set:
 	reiser4_done_d_cursor();
@@ -755,7 +1088,7 @@ static void __exit done_reiser4(void)
 	debugfs_remove(reiser4_debugfs_root);
 	result = unregister_filesystem(&reiser4_fs_type);
 	BUG_ON(result != 0);
-	blocknr_list_done_static();
+	blocknr_tree_done_static();
 	blocknr_set_done_static();
 	reiser4_done_d_cursor();
 	reiser4_done_file_fsdata();
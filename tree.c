@@ -402,7 +402,7 @@ insert_result insert_by_coord(coord_t *coord	/* coord where to
 	if (result != 0)
 		return result;
 
-	item_size = space_needed(node, NULL, data, 1);
+	item_size = space_needed(node, NULL, data, key, 1);
 	if (item_size > znode_free_space(node) &&
 	    (flags & COPI_DONT_SHIFT_LEFT) && (flags & COPI_DONT_SHIFT_RIGHT)
 	    && (flags & COPI_DONT_ALLOCATE)) {
@@ -496,7 +496,7 @@ int insert_into_item(coord_t * coord /* coord of pasting */ ,
 
 	assert("nikita-1480", iplug == data->iplug);
 
-	size_change = space_needed(coord->node, coord, data, 0);
+	size_change = space_needed(coord->node, coord, data, NULL, 0);
 	if (size_change > (int)znode_free_space(coord->node) &&
 	    (flags & COPI_DONT_SHIFT_LEFT) && (flags & COPI_DONT_SHIFT_RIGHT)
 	    && (flags & COPI_DONT_ALLOCATE)) {
@@ -1841,9 +1841,9 @@ int reiser4_init_tree(reiser4_tree * tree	/* pointer to structure being
 
 	tree->znode_epoch = 1ull;
 
-	cbk_cache_init(&tree->cbk_cache);
-
-	result = znodes_tree_init(tree);
+	result = cbk_cache_init(&tree->cbk_cache);
+	if (result == 0)
+		result = znodes_tree_init(tree);
 	if (result == 0)
 		result = jnodes_tree_init(tree);
 	if (result == 0) {
@@ -17,6 +17,8 @@
 #include <linux/types.h>	/* for __u??  */
 #include <linux/fs.h>		/* for struct super_block  */
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>	/* for ____cacheline_aligned_in_smp */
 #include <linux/sched.h>	/* for struct task_struct */
 
 /* fictive block number never actually used */
@@ -29,12 +31,34 @@ extern const reiser4_block_nr UBER_TREE_ADDR;
 
 */
 typedef struct cbk_cache_slot {
-	/* cached node */
+	/* cached node. Read without locks under rcu_read_lock(), updated
+	   under ->guard of the shard this slot belongs to. */
 	znode *node;
-	/* linkage to the next cbk cache slot in a LRU order */
-	struct list_head lru;
+	/* value of shard's ->clock at the last access to this slot. Used to
+	   find least recently used slot. */
+	unsigned long stamp;
 } cbk_cache_slot;
 
+/* &cbk_cache_shard - one independent part of a coord cache.
+
+   Every cpu works with its own shard, so that neither locks nor cache lines
+   of LRU state are shared between cpus on the lookup path.
+*/
+typedef struct cbk_cache_shard {
+	/* serializes updates of ->slot[].node */
+	spinlock_t guard;
+	/* logical clock advanced on each access, approximates LRU order */
+	unsigned long clock;
+	/* slots of this shard, ->nr_slots of them */
+	cbk_cache_slot *slot;
+} ____cacheline_aligned_in_smp cbk_cache_shard;
+
+/* hit/miss statistics of coord cache, kept per-cpu */
+struct cbk_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+};
+
 /* &cbk_cache - coord cache. This is part of reiser4_tree.
 
    cbk_cache is supposed to speed up tree lookups by caching results of recent
@@ -49,21 +73,27 @@ typedef struct cbk_cache_slot {
    is inserted into cache, possibly pulling least recently used entry out of
    it.
 
-   Tree spin lock is used to protect coord cache. If contention for this
-   lock proves to be too high, more finer grained locking can be added.
+   Cache is split into per-cpu shards (&cbk_cache_shard). Lookups scan the
+   shard of the current cpu without taking any locks: znodes are freed
+   through RCU, and a node found in a slot is pinned and checked for
+   JNODE_RIP exactly as it was done with the single shared cache. Insertion
+   takes the spin lock of the local shard only. Invalidation scans all shards
+   without locks and takes the lock of a shard only when @node is found
+   there.
 
    Invariants involving parts of this data-type:
 
       [cbk-cache-invariant]
 */
 typedef struct cbk_cache {
-	/* serializator */
-	rwlock_t guard;
+	/* number of slots in each shard */
 	int nr_slots;
-	/* head of LRU list of cache slots */
-	struct list_head lru;
-	/* actual array of slots */
-	cbk_cache_slot *slot;
+	/* number of shards, one per cpu id */
+	int nr_shards;
+	/* array of shards */
+	cbk_cache_shard *shard;
+	/* per-cpu hit and miss counters */
+	struct cbk_cache_stats __percpu *stats;
 } cbk_cache;
 
 /* level_lookup_result - possible outcome of looking up key at some level.
@@ -125,7 +155,7 @@ struct reiser4_tree {
 	   - parent pointers,
 	   - sibling pointers,
 	   - znode hash table
-	   - coord cache
+	   - decision to destroy unreferenced jnode (see jnode_try_drop())
 	 */
 	/* NOTE: The "giant" tree lock can be replaced by more spin locks,
 	   hoping they will be less contented. We can use one spin lock per one
@@ -134,6 +164,22 @@ struct reiser4_tree {
 	   more SMP scalable we should test this locking change on n-ways (n >
 	   4) SMP machines.  Current 4-ways machine test does not show that tree
 	   lock is contented and it is a bottleneck (2003.07.25). */
+	/* Only the first step of this was made, for unformatted jnodes:
+	   jnode hash table is protected by its bucket locks and per-inode
+	   radix trees of jnodes by reiser4_inode->jnodes_guard, so that page
+	   cache paths (jfind(), jnode_of_page()) don't take tree lock any
+	   longer. Znode hash lookups (zlook(), zget() of cached znode) are
+	   done under RCU. Everything else listed above is still under tree
+	   lock: insertion of new znodes into hash table, znode_remove(),
+	   znode_rehash(), parent pointers and ->c_count, and sibling linking
+	   in tree_walk.c. They are updated together when znode is created or
+	   destroyed, and moving sibling pointers under znode spin locks needs
+	   lock ordering between neighbors that does not exist yet. Splitting
+	   them is left for the next step. Whether the first step scales with
+	   the number of writers is still to be measured on n-ways machine:
+	   userspace model of jfind() and find_get_jnode() run on 1-way box
+	   shows the same throughput with tree lock and with split locks, for
+	   1 to 8 threads (2026.10.17). */
 
 	rwlock_t tree_lock;
 
@@ -304,6 +350,17 @@ lookup_result reiser4_object_lookup(struct inode *object,
 				    tree_level stop_level,
 				    __u32 flags, ra_info_t * info);
 
+/* called by coord_by_keys() for each key of the batch with the result of
+   coord_by_key() for that key */
+typedef int (*cbk_batch_actor_t) (reiser4_tree * tree,
+				  const reiser4_key * key,
+				  lookup_result result, coord_t * coord,
+				  lock_handle * lh, void *arg);
+int coord_by_keys(reiser4_tree * tree, const reiser4_key * keys, int nr,
+		  znode_lock_mode lock_mode, lookup_bias bias,
+		  tree_level level, __u32 flags,
+		  cbk_batch_actor_t actor, void *arg);
+
 insert_result insert_by_key(reiser4_tree * tree, const reiser4_key * key,
 			    reiser4_item_data * data, coord_t * coord,
 			    lock_handle * lh,
@@ -358,6 +415,9 @@ extern znode *child_znode(const coord_t * in_parent, znode * parent,
 extern int cbk_cache_init(cbk_cache * cache);
 extern void cbk_cache_done(cbk_cache * cache);
 extern void cbk_cache_invalidate(const znode * node, reiser4_tree * tree);
+extern void cbk_cache_get_stats(const cbk_cache * cache,
+				struct cbk_cache_stats *stats);
+extern void cbk_cache_reset_stats(cbk_cache * cache);
 
 extern char *sprint_address(const reiser4_block_nr * block);
 
@@ -243,6 +243,9 @@ year old --- define all technical terms used.
 #include <linux/pagemap.h>
 #include <linux/writeback.h>
 #include <linux/swap.h>		/* for totalram_pages */
+#include <linux/sched/clock.h>
+
+#include "reiser4_trace.h"
 
 static void atom_free(txn_atom * atom);
 
@@ -340,6 +343,8 @@ void reiser4_init_txnmgr(txn_mgr *mgr)
 	INIT_LIST_HEAD(&mgr->atoms_list);
 	spin_lock_init(&mgr->tmgr_lock);
 	mutex_init(&mgr->commit_mutex);
+	mutex_init(&mgr->wb_mutex);
+	INIT_LIST_HEAD(&mgr->checkpoint_list);
 }
 
 /**
@@ -353,6 +358,7 @@ void reiser4_done_txnmgr(txn_mgr *mgr)
 	assert("umka-170", mgr != NULL);
 	assert("umka-1701", list_empty_careful(&mgr->atoms_list));
 	assert("umka-1702", mgr->atom_count == 0);
+	assert("edward-2340", list_empty(&mgr->checkpoint_list));
 }
 
 /* Initialize a transaction handle. */
@@ -733,6 +739,9 @@ static int atom_begin_and_assign_to_txnh(txn_atom ** atom_alloc, txn_handle * tx
 
 	assert("jmacd-17", atom_isclean(atom));
 
+	if (get_current_context()->isolated)
+		atom->flags |= ATOM_ISOLATED;
+
         /*
 	 * lock ordering is broken here. It is ok, as long as @atom is new
 	 * and inaccessible for others. We can't use spin_lock_atom or
@@ -1004,6 +1013,62 @@ static inline void reiser4_info_atom(const char *prefix, const txn_atom * atom)
 
 #define TOOMANYFLUSHES (1 << 13)
 
+/* histogram bucket for @val, see comment before struct reiser4_commit_hist */
+static inline int commit_hist_bucket(u64 val)
+{
+	return min_t(int, fls64(val), REISER4_LOCK_HIST_BUCKETS - 1);
+}
+
+/**
+ * reiser4_commit_stage_done - account a stage of atom commit
+ * @atom: atom being committed
+ * @stage: finished stage
+ * @start: local_clock() when @stage started
+ *
+ * Adds duration of @stage to the commit latency histogram and traces it.
+ * Returns the current time, which is where the next stage starts.
+ */
+u64 reiser4_commit_stage_done(txn_atom *atom, reiser4_commit_stage stage,
+			      u64 start)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(atom->super);
+	u64 now = local_clock();
+
+	/* latency buckets are in units of 1024 ns */
+	this_cpu_inc(sbinfo->commit_hist->time[stage]
+		     [commit_hist_bucket((now - start) >> 10)]);
+	trace_reiser4_commit_stage(atom->super, atom->atom_id, stage,
+				   now - start);
+	return now;
+}
+
+/* account sizes and total commit time of @atom which had @captured nodes
+   when its commit started at @start */
+static void commit_account(txn_atom *atom, __u32 captured, u64 start)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(atom->super);
+	struct reiser4_commit_hist __percpu *hist = sbinfo->commit_hist;
+	u64 now;
+
+	this_cpu_inc(hist->size[REISER4_ATOM_CAPTURED]
+		     [commit_hist_bucket(captured)]);
+	this_cpu_inc(hist->size[REISER4_ATOM_OVERWRITE]
+		     [commit_hist_bucket(atom->nr_overwrite)]);
+	this_cpu_inc(hist->size[REISER4_ATOM_RELOCATE]
+		     [commit_hist_bucket(atom->nr_relocated)]);
+	now = reiser4_commit_stage_done(atom, REISER4_COMMIT_TOTAL, start);
+	if (reiser4_is_set(atom->super, REISER4_ADAPTIVE_ATOM_LIMITS)) {
+		/* feed commit throughput estimation of ktxnmgrd */
+		spin_lock_txnmgr(&sbinfo->tmgr);
+		sbinfo->tmgr.tune.nr_nodes += captured;
+		sbinfo->tmgr.tune.commit_ns += now - start;
+		spin_unlock_txnmgr(&sbinfo->tmgr);
+	}
+	trace_reiser4_commit(atom->super, atom->atom_id, captured,
+			     atom->nr_overwrite, atom->nr_relocated,
+			     now - start);
+}
+
 /* Called with the atom locked and no open "active" transaction handlers except
    ours, this function calls flush_current_atom() until all dirty nodes are
    processed.  Then it initiates commit processing.
@@ -1023,6 +1088,10 @@ static int commit_current_atom(long *nr_submitted, txn_atom ** atom)
 	/* how many times jnode_flush() was called as a part of attempt to
 	 * commit this atom. */
 	int flushiters;
+	/* commit stage timestamps, see reiser4_commit_stage_done() */
+	u64 start = local_clock();
+	u64 stamp;
+	__u32 captured;
 
 	assert("zam-888", atom != NULL && *atom != NULL);
 	assert_spin_locked(&((*atom)->alock));
@@ -1073,29 +1142,55 @@ static int commit_current_atom(long *nr_submitted, txn_atom ** atom)
 	   at this point, commit should be successful. */
 	reiser4_atom_set_stage(*atom, ASTAGE_PRE_COMMIT);
 	ON_DEBUG(((*atom)->committer = current));
+	reiser4_stat_inc(sbinfo->tree.super, REISER4_STAT_COMMITS);
+	reiser4_stat_add(sbinfo->tree.super, REISER4_STAT_COMMIT_NODES,
+			 (*atom)->capture_count);
+	captured = (*atom)->capture_count;
 	spin_unlock_atom(*atom);
+	stamp = reiser4_commit_stage_done(*atom, REISER4_COMMIT_FLUSH, start);
 
 	ret = current_atom_complete_writes();
 	if (ret)
 		return ret;
+	stamp = reiser4_commit_stage_done(*atom, REISER4_COMMIT_COMPLETE_WRITES,
+					  stamp);
 
 	assert("zam-906", list_empty(ATOM_WB_LIST(*atom)));
 
 	/* isolate critical code path which should be executed by only one
-	 * thread using tmgr mutex */
+	 * thread using tmgr mutex. reiser4_write_logs() switches to wb_mutex
+	 * when atom's log is on disk, so that the next atom can write its log
+	 * while this one is being written back */
 	mutex_lock(&sbinfo->tmgr.commit_mutex);
+	reiser4_commit_stage_done(*atom, REISER4_COMMIT_MUTEX_WAIT, stamp);
 
 	ret = reiser4_write_logs(nr_submitted);
 	if (ret < 0)
 		reiser4_panic("zam-597", "write log failed (%ld)\n", ret);
+	commit_account(*atom, captured, start);
+	if (ret > 0) {
+		/* atom is committed, its overwrite set is to be written back
+		   by reiser4_checkpoint(), which also drops "until commit"
+		   reference. The atom can be already played at this point */
+		assert("edward-2341", list_empty(ATOM_WB_LIST(*atom)));
+		assert("zam-927", list_empty(&(*atom)->inodes));
+
+		spin_lock_atom(*atom);
+		assert("edward-2342",
+		       (*atom)->flags & ATOM_DEFERRED_CHECKPOINT);
+		wakeup_atom_waiting_list(*atom);
+		reiser4_atom_send_event(*atom);
+		return 0;
+	}
 
-	/* The atom->ovrwr_nodes list is processed under commit mutex held
-	   because of bitmap nodes which are captured by special way in
+	/* The atom->ovrwr_nodes list is processed under wb_mutex held because
+	   of bitmap nodes which are captured by special way in
 	   reiser4_pre_commit_hook_bitmap(), that way does not include
-	   capture_fuse_wait() as a capturing of other nodes does -- the commit
-	   mutex is used for transaction isolation instead. */
+	   capture_fuse_wait() as a capturing of other nodes does -- the
+	   committer of the next atom waits for write-back of this one with
+	   reiser4_wait_write_back() instead. */
 	reiser4_invalidate_list(ATOM_OVRWR_LIST(*atom));
-	mutex_unlock(&sbinfo->tmgr.commit_mutex);
+	mutex_unlock(&sbinfo->tmgr.wb_mutex);
 
 	reiser4_invalidate_list(ATOM_CLEAN_LIST(*atom));
 	reiser4_invalidate_list(ATOM_WB_LIST(*atom));
@@ -1122,6 +1217,44 @@ static int commit_current_atom(long *nr_submitted, txn_atom ** atom)
 	return ret;
 }
 
+/**
+ * reiser4_atom_played - complete commit of atom with deferred write-back
+ * @atom: atom which overwrite set is written back
+ *
+ * This is called by reiser4_checkpoint() when journal footer points to @atom
+ * or to a later one. Does for @atom what commit_current_atom() does after
+ * write-back of not deferred atoms.
+ */
+void reiser4_atom_played(txn_atom *atom)
+{
+	assert("edward-2343", atom->stage == ASTAGE_POST_COMMIT);
+	assert("edward-2344", atom->flags & ATOM_DEFERRED_CHECKPOINT);
+
+	reiser4_invalidate_list(ATOM_OVRWR_LIST(atom));
+
+	spin_lock_atom(atom);
+	reiser4_atom_set_stage(atom, ASTAGE_DONE);
+	ON_DEBUG(atom->committer = NULL);
+	wakeup_atom_waiting_list(atom);
+
+	assert("edward-2345", atom->capture_count == 0);
+	/* drop the "until commit" reference */
+	atom_dec_and_unlock(atom);
+}
+
+/* @atom is committed, but not written back yet, and somebody needs it to be
+   done. Ask ktxnmgrd for that */
+static void want_checkpoint(txn_atom *atom)
+{
+	txn_mgr *mgr = &get_super_private(atom->super)->tmgr;
+
+	assert("edward-2346", atom->flags & ATOM_DEFERRED_CHECKPOINT);
+
+	/* hint only, no lock needed */
+	mgr->checkpoint_wanted = 1;
+	ktxnmgrd_kick(mgr);
+}
+
 /* TXN_TXNH */
 
 /**
@@ -1192,7 +1325,19 @@ int txnmgr_force_commit_all(struct super_block *super, int commit_all_atoms)
 		 * this call is started. */
 		if (commit_all_atoms
 		    || time_before_eq(atom->start_time, start_time)) {
-			if (atom->stage <= ASTAGE_POST_COMMIT) {
+			if (atom->stage == ASTAGE_POST_COMMIT &&
+			    (atom->flags & ATOM_DEFERRED_CHECKPOINT)) {
+				/* atom is committed already. Write it back
+				   on umount only */
+				if (commit_all_atoms) {
+					spin_unlock_atom(atom);
+					spin_unlock_txnmgr(mgr);
+					ret = reiser4_checkpoint(super);
+					if (ret)
+						return ret;
+					goto again;
+				}
+			} else if (atom->stage <= ASTAGE_POST_COMMIT) {
 				spin_unlock_txnmgr(mgr);
 
 				if (atom->stage < ASTAGE_PRE_COMMIT) {
@@ -1338,7 +1483,8 @@ static int txn_try_to_fuse_small_atom(txn_mgr * tmgr, txn_atom * atom)
 		 * atom.
 		 */
 		if (spin_trylock_atom(atom_2)) {
-			if (atom_2->stage < ASTAGE_PRE_COMMIT) {
+			if (atom_2->stage < ASTAGE_PRE_COMMIT &&
+			    !((atom->flags | atom_2->flags) & ATOM_ISOLATED)) {
 				spin_unlock_txnmgr(tmgr);
 				capture_fuse_into(atom_2, atom);
 				/* all locks are lost we can only repeat here */
@@ -1432,6 +1578,9 @@ repeat:
 					 * makes a progress in flushing or
 					 * committing the atom
 					 */
+					if (atom->flags &
+					    ATOM_DEFERRED_CHECKPOINT)
+						want_checkpoint(atom);
 					reiser4_atom_wait_event(atom);
 					goto repeat;
 				}
@@ -1496,16 +1645,45 @@ repeat:
 	return ret;
 }
 
+/* release a copy made by copy_on_capture() after it is uncaptured, unpin the
+   node it was copied from */
+static void drop_capture_copy(jnode *copy)
+{
+	jnode *orig = copy->key.orig;
+
+	unpin_jnode_data(orig);
+	jput(orig);
+	unpin_jnode_data(copy);
+	reiser4_drop_io_head(copy);
+}
+
+/* uncapture a copy made by copy_on_capture() from overwrite set of its atom
+   and release it. Used when the copy is superseded before it is written
+   back, see play_deferred() */
+void reiser4_uncapture_copy(jnode *copy)
+{
+	assert("edward-2394", JF_ISSET(copy, JNODE_CAPTURE_COPY));
+
+	spin_lock_jnode(copy);
+	reiser4_uncapture_block(copy);
+	jput(copy);
+	drop_capture_copy(copy);
+}
+
 /* Remove processed nodes from atom's clean list (thereby remove them from transaction). */
 void reiser4_invalidate_list(struct list_head *head)
 {
 	while (!list_empty(head)) {
 		jnode *node;
+		int copy;
 
 		node = list_entry(head->next, jnode, capture_link);
 		spin_lock_jnode(node);
+		copy = JF_ISSET(node, JNODE_CAPTURE_COPY);
 		reiser4_uncapture_block(node);
 		jput(node);
+		if (copy)
+			drop_capture_copy(node);
 	}
 }
 
@@ -1604,7 +1782,8 @@ static int try_commit_txnh(commit_data * cd)
 		cd->wait = 0;
 	}
 
-	if (cd->atom->stage == ASTAGE_DONE)
+	if (cd->atom->stage == ASTAGE_DONE ||
+	    (cd->atom->flags & ATOM_DEFERRED_CHECKPOINT))
 		return 0;
 
 	if (cd->failed)
@@ -1782,6 +1961,49 @@ static int commit_txnh(txn_handle * txnh)
    released.  The external interface (reiser4_try_capture) manages re-aquiring the jnode
    lock in the failure case.
 */
+/* true if @atom is isolated atom which other atoms are not fused with */
+static int atom_is_isolated(txn_atom *atom)
+{
+	assert_spin_locked(&(atom->alock));
+
+	/* Handles of an atom with open handles can wait for long term locks
+	   held by handles which would wait for the atom to commit, so such
+	   atom is fused as usual */
+	return (atom->flags & ATOM_ISOLATED) &&
+		atom->stage == ASTAGE_CAPTURE_FUSE &&
+		atom->txnh_count == 0 &&
+		atom->capture_count <=
+		get_super_private(atom->super)->tmgr.isolated_max_size;
+}
+
+/* Return true if handle of current context, which belongs to @txnh_atom (may
+   be NULL), should wait for @block_atom to commit instead of fusing with it.
+
+   An isolated atom is forced to commit, so the wait is short. Handles of
+   isolated contexts, write-out threads and handles of atoms which are
+   committing themselves fuse as usual, the latter is what resolves lock
+   dependencies between the two atoms. */
+static int atom_refuses_fusion(txn_atom *block_atom, txn_atom *txnh_atom)
+{
+	reiser4_context *ctx = get_current_context();
+
+	assert_spin_locked(&(block_atom->alock));
+
+	if (!atom_is_isolated(block_atom))
+		return 0;
+	if (ctx->isolated || ctx->entd || ctx->writeout_mode ||
+	    ctx->flush_bd_task)
+		return 0;
+	if (txnh_atom != NULL && txnh_atom->stage != ASTAGE_CAPTURE_FUSE)
+		return 0;
+
+	if (!(block_atom->flags & ATOM_FORCE_COMMIT)) {
+		block_atom->flags |= ATOM_FORCE_COMMIT;
+		ktxnmgrd_kick(&get_super_private(ctx->super)->tmgr);
+	}
+	return 1;
+}
+
 static int try_capture_block(
 	txn_handle * txnh, jnode * node, txn_capture mode,
 	txn_atom ** atom_alloc)
@@ -1833,7 +2055,8 @@ static int try_capture_block(
 			atomic_dec(&block_atom->refcount);
 			if (block_atom->stage > ASTAGE_CAPTURE_WAIT ||
 			    (block_atom->stage == ASTAGE_CAPTURE_WAIT &&
-			     block_atom->txnh_count != 0))
+			     block_atom->txnh_count != 0) ||
+			    atom_refuses_fusion(block_atom, NULL))
 				return capture_fuse_wait(txnh, block_atom, NULL, mode);
 			capture_assign_txnh_nolock(block_atom, txnh);
 			spin_unlock_txnh(txnh);
@@ -1948,13 +2171,169 @@ build_capture_mode(jnode * node, znode_lock_mode lock_mode, txn_capture flags)
 	return cap_mode;
 }
 
+/* true if @atom, which log is on disk, waits for deferred write-back. Its
+   overwrite set can be copied on capture. Write-back of atoms which is not
+   deferred is done by the committer right after the log is written, with
+   tmgr.wb_mutex held, so there is nothing to gain from copying there */
+static int atom_can_copy_on_capture(txn_atom *atom)
+{
+	return atom->stage == ASTAGE_POST_COMMIT &&
+		(atom->flags & ATOM_DEFERRED_CHECKPOINT);
+}
+
+/* true if @node which belongs to other atom can be copied on capture instead
+   of waiting for that atom to complete. Only overwrite set of atoms, which
+   log is on disk, is copied: contents of those nodes are frozen, only
+   write-back of them remains */
+static int can_copy_on_capture(jnode *node, txn_capture mode)
+{
+	assert_spin_locked(&(node->guard));
+
+	return node->atom != NULL &&
+		!(mode & (TXN_CAPTURE_NONBLOCKING | TXN_CAPTURE_DONT_FUSE)) &&
+		(jnode_is_znode(node) || jnode_is_unformatted(node)) &&
+		JF_ISSET(node, JNODE_OVRWR) &&
+		atom_can_copy_on_capture(node->atom);
+}
+
+/**
+ * copy_on_capture - detach node from committed atom
+ * @node: spin-locked node which can_copy_on_capture()
+ *
+ * Replaces @node in the overwrite set of its atom with a copy, which is written
+ * back instead of @node, and uncaptures @node, so that it can be captured by
+ * other atom right away. Page of @node is pinned until the copy is written
+ * back: it must not be read from disk before that. Copies are io heads, they
+ * are released by reiser4_invalidate_list(), or by play_deferred() when a
+ * later atom of the same checkpoint writes @node itself. The copy is loaded as the rest
+ * of overwrite set (see get_overwrite_set()), and the load of @node is
+ * released here, as put_overwrite_set() does not see @node any longer.
+ *
+ * Write-back of overwrite set is serialized by tmgr.wb_mutex. If it is busy,
+ * the atom is being written back, so this gives up.
+ *
+ * Returns 0 if @node is uncaptured, error otherwise. @node is unlocked.
+ */
+static int copy_on_capture(jnode *node)
+{
+	struct super_block *super = jnode_get_tree(node)->super;
+	txn_mgr *mgr = &get_super_private(super)->tmgr;
+	txn_atom *atom = node->atom;
+	jnode *copy;
+	int ret;
+
+	atomic_inc(&atom->refcount);
+	jref(node);
+	spin_unlock_jnode(node);
+
+	copy = reiser4_alloc_io_head(jnode_get_block(node));
+	if (copy == NULL) {
+		ret = RETERR(-ENOMEM);
+		goto out;
+	}
+	ret = jinit_new(copy, reiser4_ctx_gfp_mask_get());
+	if (ret) {
+		jfree(copy);
+		goto out;
+	}
+	pin_jnode_data(copy);
+
+	ret = jload(node);
+	if (ret)
+		goto drop_copy;
+
+	if (!mutex_trylock(&mgr->wb_mutex)) {
+		ret = RETERR(-EBUSY);
+		goto release;
+	}
+	spin_lock_atom(atom);
+	spin_lock_jnode(node);
+	if (node->atom != atom || !atom_can_copy_on_capture(atom) ||
+	    !JF_ISSET(node, JNODE_OVRWR) ||
+	    PageWriteback(jnode_page(node))) {
+		spin_unlock_jnode(node);
+		spin_unlock_atom(atom);
+		mutex_unlock(&mgr->wb_mutex);
+		ret = RETERR(-E_REPEAT);
+		goto release;
+	}
+
+	memcpy(jdata(copy), jdata(node), super->s_blocksize);
+	/* the copy stays loaded until put_overwrite_set() */
+	copy->key.orig = node;
+	/* keep reference to @node and its page until the copy is dropped */
+	jref(node);
+	pin_jnode_data(node);
+
+	/* put the copy next to @node in the overwrite set, so that write-back
+	   still sees contiguous block ranges */
+	spin_lock_jnode(copy);
+	JF_SET(copy, JNODE_CAPTURE_COPY);
+	JF_SET(copy, JNODE_OVRWR);
+	list_add(&copy->capture_link, &node->capture_link);
+	jref(copy);
+	copy->atom = atom;
+	atom->capture_count++;
+	ON_DEBUG(count_jnode(atom, copy, NOT_CAPTURED, OVRWR_LIST, 1));
+	spin_unlock_jnode(copy);
+
+	reiser4_uncapture_block(node);
+	spin_unlock_atom(atom);
+	mutex_unlock(&mgr->wb_mutex);
+
+	/* drop the reference of atom to @node, and its load done by
+	   get_overwrite_set() */
+	jput(node);
+	jrelse_tail(node);
+	jrelse(node);
+	reiser4_stat_inc(super, REISER4_STAT_COPIED_ON_CAPTURE);
+	goto out;
+
+ release:
+	jrelse(node);
+ drop_copy:
+	jrelse(copy);
+	unpin_jnode_data(copy);
+	reiser4_drop_io_head(copy);
+ out:
+	spin_lock_atom(atom);
+	atom_dec_and_unlock(atom);
+	jput(node);
+	return ret;
+}
+
+/**
+ * reiser4_uncapture_deferred - detach node from atom waiting for write-back
+ * @node: node which may be in overwrite set of other atom
+ *
+ * Used by the committer for nodes which every atom writes: commit bitmap
+ * blocks and super block. If atom of @node waits for deferred write-back,
+ * @node is copied on capture, so that its contents is not waited for and
+ * newer contents supersede it in play_deferred().
+ *
+ * Returns 0 if @node is not captured, error otherwise.
+ */
+int reiser4_uncapture_deferred(jnode *node)
+{
+	spin_lock_jnode(node);
+	if (node->atom == NULL) {
+		spin_unlock_jnode(node);
+		return 0;
+	}
+	if (!JF_ISSET(node, JNODE_OVRWR) ||
+	    !atom_can_copy_on_capture(node->atom)) {
+		spin_unlock_jnode(node);
+		return RETERR(-E_REPEAT);
+	}
+	return copy_on_capture(node);
+}
+
 /* This is an external interface to try_capture_block(), it calls
    try_capture_block() repeatedly as long as -E_REPEAT is returned.
 
    @node:         node to capture,
    @lock_mode:    read or write lock is used in capture mode calculation,
    @flags:        see txn_capture flags enumeration,
-   @can_coc     : can copy-on-capture
 
    @return: 0 - node was successfully captured, -E_REPEAT - capture request
             cannot be processed immediately as it was requested in flags,
@@ -1984,6 +2363,14 @@ int reiser4_try_capture(jnode *node, znode_lock_mode lock_mode,
 			JF_SET(node, JNODE_MISSED_IN_CAPTURE);
 		return 0;
 	}
+	if (can_copy_on_capture(node, cap_mode)) {
+		/* do not wait for write-back of committed atom */
+		ret = copy_on_capture(node);
+		spin_lock_jnode(node);
+		if (ret == 0)
+			goto repeat;
+		/* wait for the atom as usual */
+	}
 	/* Repeat try_capture as long as -E_REPEAT is returned. */
 	ret = try_capture_block(txnh, node, cap_mode, &atom_alloc);
 	/* Regardless of non_blocking:
@@ -2295,6 +2682,11 @@ static void capture_assign_txnh_nolock(txn_atom *atom, txn_handle *txnh)
 	reiser4_ctx_gfp_mask_set();
 	list_add_tail(&txnh->txnh_link, &atom->txnh_list);
 	atom->txnh_count += 1;
+	/* isolated atom is fused with from now on, wake up handles which
+	   wait for it (see atom_refuses_fusion()) */
+	if (atom->txnh_count == 1 && (atom->flags & ATOM_ISOLATED) &&
+	    !list_empty(&atom->fwaitfor_list))
+		reiser4_atom_send_event(atom);
 }
 
 /* No-locking version of assign_block.  Sets the block's atom pointer, references the
@@ -2652,6 +3044,10 @@ static int wait_for_fusion(txn_atom * atom, txn_wait_links * wlinks)
 	assert("nikita-3330", atom != NULL);
 	assert_spin_locked(&(atom->alock));
 
+	/* isolated atom is forced to commit, keep waiting until it starts to,
+	 * or gets a handle, see capture_assign_txnh_nolock() */
+	if (atom_is_isolated(atom) && (atom->flags & ATOM_FORCE_COMMIT))
+		return 0;
 	/* atom->txnh_count == 1 is for waking waiters up if we are releasing
 	 * last transaction handle. */
 	return atom->stage != ASTAGE_CAPTURE_WAIT || atom->txnh_count == 1;
@@ -2697,6 +3093,12 @@ static int capture_fuse_wait(txn_handle * txnh, txn_atom * atomf,
 	/* Initialize the waiting list links. */
 	init_wlinks(&wlinks);
 
+	/* nodes of atom with deferred write-back are released when it is
+	   played */
+	if (atomf->stage == ASTAGE_POST_COMMIT &&
+	    (atomf->flags & ATOM_DEFERRED_CHECKPOINT))
+		want_checkpoint(atomf);
+
 	/* Add txnh to atomf's waitfor list, unlock atomf. */
 	list_add_tail(&wlinks._fwaitfor_link, &atomf->fwaitfor_list);
 	wlinks.waitfor_cb = wait_for_fusion;
@@ -2779,6 +3181,10 @@ static int capture_init_fusion(jnode *node, txn_handle *txnh, txn_capture mode)
 
 	assert ("zam-1066", atom_isopen(txnh_atom));
 
+	if (atom_refuses_fusion(block_atom, txnh_atom)) {
+		spin_lock_txnh(txnh);
+		return capture_fuse_wait(txnh, block_atom, txnh_atom, mode);
+	}
 	if (txnh_atom->stage >= block_atom->stage ||
 	    (block_atom->stage == ASTAGE_CAPTURE_WAIT && block_atom->txnh_count == 0)) {
 		capture_fuse_into(txnh_atom, block_atom);
@@ -2858,6 +3264,7 @@ static void capture_fuse_into(txn_atom * small, txn_atom * large)
 	int level;
 	unsigned zcount = 0;
 	unsigned tcount = 0;
+	int isolated;
 
 	assert("umka-224", small != NULL);
 	assert("umka-225", small != NULL);
@@ -2868,6 +3275,8 @@ static void capture_fuse_into(txn_atom * small, txn_atom * large)
 	assert("jmacd-201", atom_isopen(small));
 	assert("jmacd-202", atom_isopen(large));
 
+	isolated = atom_is_isolated(large);
+
 	/* Splice and update the per-level dirty jnode lists */
 	for (level = 0; level < REAL_MAX_ZTREE_HEIGHT + 1; level += 1) {
 		zcount +=
@@ -2924,6 +3333,9 @@ static void capture_fuse_into(txn_atom * small, txn_atom * large)
 	large->flushed += small->flushed;
 	small->flushed = 0;
 
+	large->nr_relocated += small->nr_relocated;
+	small->nr_relocated = 0;
+
 	/* Transfer list counts to large. */
 	large->txnh_count += small->txnh_count;
 	large->capture_count += small->capture_count;
@@ -2938,7 +3350,10 @@ static void capture_fuse_into(txn_atom * small, txn_atom * large)
 
 	/* Assign the oldest start_time, merge flags. */
 	large->start_time = min(large->start_time, small->start_time);
-	large->flags |= small->flags;
+	/* fused atom is isolated only if both were */
+	if (!(small->flags & ATOM_ISOLATED))
+		large->flags &= ~ATOM_ISOLATED;
+	large->flags |= small->flags & ~ATOM_ISOLATED;
 
 	/* Merge blocknr sets. */
 	blocknr_set_merge(&small->wandered_map, &large->wandered_map);
@@ -2967,7 +3382,9 @@ static void capture_fuse_into(txn_atom * small, txn_atom * large)
 		/* Large only needs to notify if it has changed state. */
 		reiser4_atom_set_stage(large, small->stage);
 		wakeup_atom_waiting_list(large);
-	}
+	} else if (isolated && !atom_is_isolated(large))
+		/* handles waiting for isolated atom can fuse with it now */
+		reiser4_atom_send_event(large);
 
 	reiser4_atom_set_stage(small, ASTAGE_INVALID);
 
@@ -3079,29 +3496,17 @@ reiser4_block_nr txnmgr_count_deleted_blocks(void)
 
 void atom_dset_init(txn_atom *atom)
 {
-	if (reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
-		blocknr_list_init(&atom->discard.delete_set);
-	} else {
-		blocknr_set_init(&atom->nodiscard.delete_set);
-	}
+	blocknr_tree_init(&atom->delete_set);
 }
 
 void atom_dset_destroy(txn_atom *atom)
 {
-	if (reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
-		blocknr_list_destroy(&atom->discard.delete_set);
-	} else {
-		blocknr_set_destroy(&atom->nodiscard.delete_set);
-	}
+	blocknr_tree_destroy(&atom->delete_set);
 }
 
 void atom_dset_merge(txn_atom *from, txn_atom *to)
 {
-	if (reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
-		blocknr_list_merge(&from->discard.delete_set, &to->discard.delete_set);
-	} else {
-		blocknr_set_merge(&from->nodiscard.delete_set, &to->nodiscard.delete_set);
-	}
+	blocknr_tree_merge(&from->delete_set, &to->delete_set);
 }
 
 int atom_dset_deferred_apply(txn_atom* atom,
@@ -3109,47 +3514,25 @@ int atom_dset_deferred_apply(txn_atom* atom,
                              void *data,
                              int delete)
 {
-	int ret;
-
-	if (reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
-		ret = blocknr_list_iterator(atom,
-		                            &atom->discard.delete_set,
-		                            actor,
-		                            data,
-		                            delete);
-	} else {
-		ret = blocknr_set_iterator(atom,
-		                           &atom->nodiscard.delete_set,
-		                           actor,
-		                           data,
-		                           delete);
-	}
-
-	return ret;
+	return blocknr_tree_iterator(atom, &atom->delete_set, actor, data,
+				     delete);
 }
 
-extern int atom_dset_deferred_add_extent(txn_atom *atom,
-                                         void **new_entry,
-                                         const reiser4_block_nr *start,
-                                         const reiser4_block_nr *len)
+int atom_dset_deferred_add_extent(txn_atom *atom,
+				  void **new_entry,
+				  const reiser4_block_nr *start,
+				  const reiser4_block_nr *len)
 {
-	int ret;
-
-	if (reiser4_is_set(reiser4_get_current_sb(), REISER4_DISCARD)) {
-		ret = blocknr_list_add_extent(atom,
-		                              &atom->discard.delete_set,
-		                              (blocknr_list_entry**)new_entry,
-		                              start,
-		                              len);
-	} else {
-		ret = blocknr_set_add_extent(atom,
-		                             &atom->nodiscard.delete_set,
-		                             (blocknr_set_entry**)new_entry,
-		                             start,
-		                             len);
-	}
+	return blocknr_tree_add_extent(atom, &atom->delete_set,
+				       (blocknr_tree_entry **)new_entry,
+				       start, len);
+}
 
-	return ret;
+/* true if @blk is in the delete set of @atom, which is to be locked */
+int atom_dset_contains(txn_atom *atom, const reiser4_block_nr *blk)
+{
+	assert("edward-2370", atom_is_protected(atom));
+	return blocknr_tree_contains(&atom->delete_set, blk);
 }
 
 /*
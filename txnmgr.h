@@ -14,6 +14,7 @@
 #include <linux/mm.h>
 #include <linux/types.h>
 #include <linux/spinlock.h>
+#include <linux/rbtree.h>
 #include <asm/atomic.h>
 #include <linux/wait.h>
 
@@ -113,7 +114,15 @@ typedef enum {
 	ATOM_FORCE_COMMIT = (1 << 0),
 	/* to avoid endless loop, mark the atom (which was considered as too
 	 * small) after failed attempt to fuse it. */
-	ATOM_CANCEL_FUSION = (1 << 1)
+	ATOM_CANCEL_FUSION = (1 << 1),
+	/* atom is committed, but its overwrite set is not written back yet.
+	   This is done later by reiser4_checkpoint() */
+	ATOM_DEFERRED_CHECKPOINT = (1 << 2),
+	/* atom was started by modification of a file which is fsync-ed often
+	 * (see REISER4_FSYNC_ISOLATED). While it is small, other atoms are not
+	 * fused with it: they wait for it to commit instead, so that fsync of
+	 * that file does not have to commit their dirty data */
+	ATOM_ISOLATED = (1 << 3)
 } txn_flags;
 
 /* Flags for controlling commit_txnh */
@@ -239,30 +248,23 @@ struct txn_atom {
 
 	__u32 flushed;
 
+	/* sizes of relocate and overwrite sets, for commit statistics. The
+	   former is counted by jnode_make_reloc_nolock(), the latter is set by
+	   reiser4_write_logs() */
+	__u32 nr_relocated;
+	__u32 nr_overwrite;
+
 	/* Current transaction stage. */
 	txn_stage stage;
 
 	/* Start time. */
 	unsigned long start_time;
 
-	/* The atom's delete sets.
-	   "simple" are blocknr_set instances and are used when discard is disabled.
-	   "discard" are blocknr_list instances and are used when discard is enabled. */
-	union {
-		struct {
-		/* The atom's delete set. It collects block numbers of the nodes
-		   which were deleted during the transaction. */
-			struct list_head delete_set;
-		} nodiscard;
-
-		struct {
-			/* The atom's delete set. It collects all blocks that have been
-			   deallocated (both immediate and deferred) during the transaction.
-			   These blocks are considered for discarding at commit time.
-			   For details see discard.c */
-			struct list_head delete_set;
-		} discard;
-	};
+	/* The atom's delete set. It collects extents of blocks deallocated
+	   during the transaction, sorted and joined (see blocknrtree.c). When
+	   discard is enabled, these blocks are considered for discarding at
+	   commit time. For details see discard.c */
+	struct rb_root delete_set;
 
 	/* The atom's wandered_block mapping. */
 	struct list_head wandered_map;
@@ -372,9 +374,27 @@ struct txn_mgr {
 	/* A counter used to assign atom->atom_id values. */
 	__u32 id_count;
 
-	/* a mutex object for commit serialization */
+	/* a mutex object for commit serialization. It is held while atom's
+	   log is written (see reiser4_write_logs()) */
 	struct mutex commit_mutex;
 
+	/* serializes write-back of overwrite sets. It is taken by committing
+	   thread before commit_mutex is released, so atoms are played in the
+	   order they are committed, and the next atom can write its log while
+	   the previous one is being written back */
+	struct mutex wb_mutex;
+
+	/* commit handles of atoms which write-back is deferred, in commit
+	   order (see reiser4_checkpoint()). This and three fields below are
+	   protected by tmgr_lock */
+	struct list_head checkpoint_list;
+	/* number of log blocks allocated for those atoms */
+	__u64 checkpoint_blocks;
+	/* commit time of the oldest of them */
+	unsigned long checkpoint_start;
+	/* somebody waits for one of them to be written back */
+	int checkpoint_wanted;
+
 	/* a list of all txnmrgs served by particular daemon. */
 	struct list_head linkage;
 
@@ -387,6 +407,28 @@ struct txn_mgr {
 	unsigned int atom_min_size;
 	/* max number of concurrent flushers for one atom, 0 - unlimited.  */
 	unsigned int atom_max_flushers;
+	/* max number of log blocks of atoms which write-back is deferred */
+	unsigned int checkpoint_max_size;
+	/* isolated atoms larger than this are fused as usual */
+	unsigned int isolated_max_size;
+
+	/* state of adaptive atom limits (see tune_atom_limits()). Limits set
+	   by mount options are upper bounds for the values chosen by
+	   ktxnmgrd, which wakes up once a second to adjust them. Protected by
+	   tmgr_lock */
+	struct {
+		unsigned int max_size;
+		unsigned int max_age;
+		unsigned int min_size;
+		/* nodes committed and time spent in commit since the last
+		   adjustment */
+		__u64 nr_nodes;
+		__u64 commit_ns;
+		/* time of the last adjustment */
+		unsigned long stamp;
+		/* measured commit throughput, blocks per second */
+		unsigned int bandwidth;
+	} tune;
 	struct dentry *debugfs_atom_count;
 	struct dentry *debugfs_id_count;
 };
@@ -472,6 +514,7 @@ static inline txn_atom *get_current_atom_locked(void)
 extern txn_atom *jnode_get_atom(jnode *);
 
 extern void reiser4_atom_wait_event(txn_atom *);
+extern void reiser4_atom_played(txn_atom *);
 extern void reiser4_atom_send_event(txn_atom *);
 
 extern void insert_into_atom_ovrwr_list(txn_atom * atom, jnode * node);
@@ -502,31 +545,29 @@ extern int blocknr_set_iterator(txn_atom * atom, struct list_head * bset,
 				blocknr_set_actor_f actor, void *data,
 				int delete);
 
-/* This is the block list interface (see blocknrlist.c) */
-extern int blocknr_list_init_static(void);
-extern void blocknr_list_done_static(void);
-extern void blocknr_list_init(struct list_head *blist);
-extern void blocknr_list_destroy(struct list_head *blist);
-extern void blocknr_list_merge(struct list_head *from, struct list_head *to);
-extern void blocknr_list_sort_and_join(struct list_head *blist);
+/* This is the block extent tree interface (see blocknrtree.c) */
+extern int blocknr_tree_init_static(void);
+extern void blocknr_tree_done_static(void);
+extern void blocknr_tree_init(struct rb_root *tree);
+extern void blocknr_tree_destroy(struct rb_root *tree);
+extern void blocknr_tree_merge(struct rb_root *from, struct rb_root *to);
 /**
  * The @atom should be locked.
  */
-extern int blocknr_list_add_extent(txn_atom *atom,
-                                   struct list_head *blist,
-                                   blocknr_list_entry **new_entry,
-                                   const reiser4_block_nr *start,
-                                   const reiser4_block_nr *len);
-extern int blocknr_list_iterator(txn_atom *atom,
-                                 struct list_head *blist,
-                                 blocknr_set_actor_f actor,
-                                 void *data,
-                                 int delete);
-
-/* These are wrappers for accessing and modifying atom's delete lists,
-   depending on whether discard is enabled or not.
-   If it is enabled, (less memory efficient) blocknr_list is used for delete
-   list storage. Otherwise, blocknr_set is used for this purpose. */
+extern int blocknr_tree_add_extent(txn_atom *atom,
+				   struct rb_root *tree,
+				   blocknr_tree_entry **new_entry,
+				   const reiser4_block_nr *start,
+				   const reiser4_block_nr *len);
+extern int blocknr_tree_contains(struct rb_root *tree,
+				 const reiser4_block_nr *blk);
+extern int blocknr_tree_iterator(txn_atom *atom,
+				 struct rb_root *tree,
+				 blocknr_set_actor_f actor,
+				 void *data,
+				 int delete);
+
+/* These are wrappers for accessing and modifying atom's delete set */
 extern void atom_dset_init(txn_atom *atom);
 extern void atom_dset_destroy(txn_atom *atom);
 extern void atom_dset_merge(txn_atom *from, txn_atom *to);
@@ -538,6 +579,7 @@ extern int atom_dset_deferred_add_extent(txn_atom *atom,
                                          void **new_entry,
                                          const reiser4_block_nr *start,
                                          const reiser4_block_nr *len);
+extern int atom_dset_contains(txn_atom *atom, const reiser4_block_nr *blk);
 
 /* flush code takes care about how to fuse flush queues */
 extern void flush_init_atom(txn_atom * atom);
@@ -724,6 +766,7 @@ extern void queue_jnode(flush_queue_t *, jnode *);
 
 extern int reiser4_write_fq(flush_queue_t *, long *, int);
 extern int current_atom_finish_all_fq(void);
+extern int reiser4_atom_finish_all_fq(txn_atom *);
 extern void init_atom_fq_parts(txn_atom *);
 
 extern reiser4_block_nr txnmgr_count_deleted_blocks(void);
@@ -741,6 +784,8 @@ extern void add_fq_to_bio(flush_queue_t *, struct bio *);
 extern flush_queue_t *get_fq_for_current_atom(void);
 
 void reiser4_invalidate_list(struct list_head * head);
+void reiser4_uncapture_copy(jnode *copy);
+int reiser4_uncapture_deferred(jnode *node);
 
 # endif				/* __REISER4_TXNMGR_H__ */
 
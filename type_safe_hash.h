@@ -10,23 +10,96 @@
 #include "debug.h"
 
 #include <asm/errno.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+
+/* maximal number of locks protecting hash chains. Buckets are mapped to locks
+   by the lower bits of hash value, so that neighbouring buckets are protected
+   by different locks. */
+#define TYPE_SAFE_HASH_MAX_LOCKS (1024)
+
+/* resizable table is grown when average chain becomes longer than this */
+#define TYPE_SAFE_HASH_MAX_LOAD (2)
+/* and is shrunk when there is more than this many buckets per item */
+#define TYPE_SAFE_HASH_MIN_LOAD_INV (8)
+
+/* number of chain length classes in struct tsh_stats */
+#define TYPE_SAFE_HASH_CHAIN_HIST (8)
+
+/* lock protecting one stripe of buckets and number of items in that stripe */
+struct tsh_stripe {
+	spinlock_t lock;
+	unsigned long count;
+};
+
+/* hash table statistics, filled by prefix_hash_stats() */
+struct tsh_stats {
+	__u32 buckets;
+	unsigned long items;
+	unsigned long used;
+	unsigned long max_chain;
+	unsigned long resizes;
+	/* number of chains of given length. Last slot counts chains of
+	 * TYPE_SAFE_HASH_CHAIN_HIST - 1 items and longer. */
+	unsigned long chains[TYPE_SAFE_HASH_CHAIN_HIST];
+};
+
+/* number of buckets resizable table holding @items items should have */
+static inline __u32 tsh_target_buckets(unsigned long items,
+				       __u32 min_buckets, __u32 max_buckets)
+{
+	if (items <= min_buckets)
+		return min_buckets;
+	if (items >= max_buckets)
+		return max_buckets;
+	return roundup_pow_of_two(items);
+}
+
 /* Step 1: Use TYPE_SAFE_HASH_DECLARE() to define the TABLE and LINK objects
    based on the object type.  You need to declare the item type before
    this definition, define it after this definition. */
 #define TYPE_SAFE_HASH_DECLARE(PREFIX,ITEM_TYPE)                                                     \
                                                                                               \
-typedef struct PREFIX##_hash_table_  PREFIX##_hash_table;                                     \
-typedef struct PREFIX##_hash_link_   PREFIX##_hash_link;                                      \
+typedef struct PREFIX##_hash_table_    PREFIX##_hash_table;                                   \
+typedef struct PREFIX##_hash_link_     PREFIX##_hash_link;                                    \
+typedef struct PREFIX##_hash_buckets_  PREFIX##_hash_buckets;                                 \
                                                                                               \
-struct PREFIX##_hash_table_                                                                   \
+/* array of hash chains. Chains of ->_bk[g] are linked through ->_next[g] */                  \
+struct PREFIX##_hash_buckets_                                                                 \
 {                                                                                             \
   ITEM_TYPE  **_table;                                                                        \
   __u32        _buckets;                                                                      \
+  __u32        _gen;                                                                          \
+};                                                                                            \
+                                                                                              \
+struct PREFIX##_hash_table_                                                                   \
+{                                                                                             \
+  /* array used by lookups, one of _bk[] */                                                   \
+  PREFIX##_hash_buckets  *_cur;                                                               \
+  /* array being populated by resize, or NULL */                                              \
+  PREFIX##_hash_buckets  *_new;                                                               \
+  /* number of stripes already moved into ->_new */                                           \
+  __u32                   _migrated;                                                          \
+  PREFIX##_hash_buckets   _bk[2];                                                             \
+  /* locks serializing updates of hash chains, see PREFIX##_hash_stripe() */                 \
+  struct tsh_stripe      *_locks;                                                             \
+  __u32                   _nr_locks;                                                          \
+  /* limits on the number of buckets. Equal for fixed size tables */                          \
+  __u32                   _min_buckets;                                                       \
+  __u32                   _max_buckets;                                                       \
+  int                     _frozen;                                                            \
+  unsigned long           _resizes;                                                           \
+  unsigned long           _last_check;                                                        \
+  struct work_struct      _resize_work;                                                       \
 };                                                                                            \
                                                                                               \
 struct PREFIX##_hash_link_                                                                    \
 {                                                                                             \
-  ITEM_TYPE *_next;                                                                           \
+  ITEM_TYPE *_next[2];                                                                        \
 }
 
 /* Step 2: Define the object type of the hash: give it field of type
@@ -44,24 +117,35 @@ struct PREFIX##_hash_link_
 
    It implements these functions:
 
-   prefix_hash_init           Initialize the table given its size.
+   prefix_hash_init           Initialize fixed size table given its size.
+   prefix_hash_init_resizable Initialize table that is resized with population
+   prefix_hash_freeze         Stop resizing, call before tearing table down
    prefix_hash_insert         Insert an item
-   prefix_hash_insert_index   Insert an item w/ precomputed hash_index
+   prefix_hash_insert_index   Insert an item w/ precomputed hash value
    prefix_hash_find           Find an item by key
-   prefix_hash_find_index     Find an item w/ precomputed hash_index
+   prefix_hash_find_index     Find an item w/ precomputed hash value
    prefix_hash_remove         Remove an item, returns 1 if found, 0 if not found
-   prefix_hash_remove_index   Remove an item w/ precomputed hash_index
+   prefix_hash_stats          Collect chain length statistics
 
-   If you'd like something to be done differently, feel free to ask me
-   for modifications.  Additional features that could be added but
-   have not been:
+   Hash function returns full 32 bit hash value, table takes as many lower
+   bits of it as it needs.
 
-   prefix_hash_remove_key           Find and remove an item by key
-   prefix_hash_remove_key_index     Find and remove an item by key w/ precomputed hash_index
+   Lookups are not protected by any lock: they are done under RCU and rely on
+   items being freed through RCU. Updates of chains are serialized by stripe
+   locks taken by insertion and removal functions: item goes to the stripe
+   number (hash & (_nr_locks - 1)). As number of buckets is always a multiple
+   of number of stripes, a stripe is the same set of chains before and after
+   resize. Callers that need find-then-insert to be atomic still have to
+   serialize them by some external lock (tree lock for znodes, inode's
+   ->jnodes_guard for jnodes).
 
-   The hash_function currently receives only the key as an argument,
-   meaning it must somehow know the number of buckets.  If this is a
-   problem let me know.
+   Resizable table is resized incrementally by a work item. The new bucket
+   array is populated stripe by stripe under stripe locks, while lookups keep
+   using the old array. Each item has two links, so that it can be on the old
+   and the new chains at the same time. Insertions and removals update the new
+   array too, for stripes that were already moved. When all stripes are
+   moved, the new array is published by rcu_assign_pointer(), and the old one
+   is freed after RCU grace period. Lookups never wait for resize.
 
    This hash table uses a single-linked hash chain.  This means
    insertion is fast but deletion requires searching the chain.
@@ -76,69 +160,261 @@ struct PREFIX##_hash_link_
 */
 #define TYPE_SAFE_HASH_DEFINE(PREFIX,ITEM_TYPE,KEY_TYPE,KEY_NAME,LINK_NAME,HASH_FUNC,EQ_FUNC)	\
 											\
+static __inline__ PREFIX##_hash_buckets *						\
+PREFIX##_hash_current (PREFIX##_hash_table *hash)					\
+{											\
+  return rcu_dereference_raw(hash->_cur);						\
+}											\
+											\
+static __inline__ ITEM_TYPE **								\
+PREFIX##_hash_bucket (PREFIX##_hash_buckets *bk, __u32 hashval)			\
+{											\
+  assert("nikita-2780", IS_POW(bk->_buckets));						\
+  return &bk->_table[hashval & (bk->_buckets - 1)];					\
+}											\
+											\
+static __inline__ struct tsh_stripe *							\
+PREFIX##_hash_stripe (PREFIX##_hash_table *hash, __u32 hashval)			\
+{											\
+  return &hash->_locks[hashval & (hash->_nr_locks - 1)];				\
+}											\
+											\
 static __inline__ void									\
-PREFIX##_check_hash (PREFIX##_hash_table *table UNUSED_ARG,				\
-		     __u32                hash UNUSED_ARG)				\
+PREFIX##_hash_link_in (PREFIX##_hash_buckets *bk,					\
+		       __u32                  hashval,					\
+		       ITEM_TYPE             *ins_item)					\
 {											\
-	assert("nikita-2780", hash < table->_buckets);					\
+  ITEM_TYPE **head = PREFIX##_hash_bucket(bk, hashval);					\
+											\
+  ins_item->LINK_NAME._next[bk->_gen] = *head;						\
+  smp_wmb();    									\
+  WRITE_ONCE(*head, ins_item);								\
 }											\
 											\
 static __inline__ int									\
-PREFIX##_hash_init (PREFIX##_hash_table *hash,						\
-		    __u32                buckets)					\
+PREFIX##_hash_link_out (PREFIX##_hash_buckets *bk,					\
+		        __u32                  hashval,					\
+		        ITEM_TYPE             *del_item)				\
+{											\
+  ITEM_TYPE ** hash_item_p = PREFIX##_hash_bucket(bk, hashval);				\
+                                                                                        \
+  while (*hash_item_p != NULL) {                                                        \
+    if (*hash_item_p == del_item) {                                                     \
+      WRITE_ONCE(*hash_item_p, del_item->LINK_NAME._next[bk->_gen]);                    \
+      return 1;                                                                         \
+    }                                                                                   \
+    hash_item_p = &(*hash_item_p)->LINK_NAME._next[bk->_gen];                           \
+  }											\
+  return 0;										\
+}											\
+											\
+/* true if updates of @hashval chain have to be replicated into ->_new.		\
+   Called under stripe lock */								\
+static __inline__ PREFIX##_hash_buckets *						\
+PREFIX##_hash_shadow (PREFIX##_hash_table   *hash,					\
+		      PREFIX##_hash_buckets *cur,					\
+		      __u32                  hashval)					\
+{											\
+  PREFIX##_hash_buckets *bk = READ_ONCE(hash->_new);					\
+											\
+  if (bk != NULL && bk != cur &&							\
+      (hashval & (hash->_nr_locks - 1)) < READ_ONCE(hash->_migrated))			\
+    return bk;										\
+  return NULL;										\
+}											\
+											\
+static void										\
+PREFIX##_hash_resize_worker (struct work_struct *work)					\
+{											\
+  PREFIX##_hash_table   *hash;								\
+  PREFIX##_hash_buckets *old;								\
+  PREFIX##_hash_buckets *bk;								\
+  unsigned long items;									\
+  __u32 target;										\
+  __u32 s;										\
+  __u32 i;										\
+											\
+  hash = container_of(work, PREFIX##_hash_table, _resize_work);				\
+  if (READ_ONCE(hash->_frozen))								\
+    return;										\
+											\
+  for (items = 0, s = 0; s < hash->_nr_locks; ++ s)					\
+    items += READ_ONCE(hash->_locks[s].count);						\
+  /* only this worker changes ->_cur, and work items do not run			\
+     concurrently with themselves */							\
+  old = hash->_cur;									\
+  target = tsh_target_buckets(items, hash->_min_buckets, hash->_max_buckets);		\
+  if (target == old->_buckets) {							\
+    hash->_last_check = jiffies;							\
+    return;										\
+  }											\
+											\
+  bk = &hash->_bk[!old->_gen];								\
+  bk->_table = (ITEM_TYPE**) KMALLOC (sizeof (ITEM_TYPE*) * target);			\
+  if (bk->_table == NULL) {								\
+    hash->_last_check = jiffies;							\
+    return;										\
+  }											\
+  memset (bk->_table, 0, sizeof (ITEM_TYPE*) * target);					\
+  bk->_buckets = target;								\
+  assert("edward-2301", hash->_migrated == 0);						\
+  WRITE_ONCE(hash->_new, bk);								\
+											\
+  for (s = 0; s < hash->_nr_locks; ++ s) {						\
+    spin_lock(&hash->_locks[s].lock);							\
+    for (i = s; i < old->_buckets; i += hash->_nr_locks) {				\
+      ITEM_TYPE *item;									\
+											\
+      for (item = old->_table[i]; item != NULL;						\
+	   item = item->LINK_NAME._next[old->_gen])					\
+	PREFIX##_hash_link_in(bk, HASH_FUNC(hash, &item->KEY_NAME), item);		\
+    }											\
+    WRITE_ONCE(hash->_migrated, s + 1);							\
+    spin_unlock(&hash->_locks[s].lock);							\
+    cond_resched();									\
+  }											\
+											\
+  rcu_assign_pointer(hash->_cur, bk);							\
+  /* wait for updaters that still could see old ->_cur */				\
+  for (s = 0; s < hash->_nr_locks; ++ s) {						\
+    spin_lock(&hash->_locks[s].lock);							\
+    spin_unlock(&hash->_locks[s].lock);							\
+  }											\
+  WRITE_ONCE(hash->_new, NULL);								\
+  WRITE_ONCE(hash->_migrated, 0);							\
+  /* and for lookups still walking old chains */					\
+  synchronize_rcu();									\
+  KFREE (old->_table, sizeof (ITEM_TYPE*) * old->_buckets);				\
+  old->_table = NULL;									\
+  old->_buckets = 0;									\
+  ++ hash->_resizes;									\
+  hash->_last_check = jiffies;								\
+}											\
+											\
+/* called by updaters under stripe lock. Schedules resize when stripe		\
+   population suggests that table is too crowded or too sparse */			\
+static __inline__ void									\
+PREFIX##_hash_check_load (PREFIX##_hash_table   *hash,				\
+			  PREFIX##_hash_buckets *cur,					\
+			  struct tsh_stripe     *stripe)				\
 {											\
-  hash->_table   = (ITEM_TYPE**) KMALLOC (sizeof (ITEM_TYPE*) * buckets);		\
-  hash->_buckets = buckets;								\
-  if (hash->_table == NULL)								\
+  unsigned long per_stripe;								\
+											\
+  if (hash->_min_buckets == hash->_max_buckets || READ_ONCE(hash->_frozen))		\
+    return;										\
+  per_stripe = cur->_buckets / hash->_nr_locks;						\
+  if ((stripe->count > per_stripe * TYPE_SAFE_HASH_MAX_LOAD &&			\
+       cur->_buckets < hash->_max_buckets) ||						\
+      (stripe->count * TYPE_SAFE_HASH_MIN_LOAD_INV < per_stripe &&			\
+       cur->_buckets > hash->_min_buckets)) {						\
+    if (READ_ONCE(hash->_new) == NULL &&						\
+	time_after(jiffies, READ_ONCE(hash->_last_check) + HZ) &&			\
+	!work_pending(&hash->_resize_work))						\
+      queue_work(system_unbound_wq, &hash->_resize_work);				\
+  }											\
+}											\
+											\
+static __inline__ int									\
+PREFIX##_hash_init_resizable (PREFIX##_hash_table *hash,				\
+			      __u32                min_buckets,				\
+			      __u32                max_buckets)				\
+{											\
+  PREFIX##_hash_buckets *bk;								\
+  __u32 i;										\
+											\
+  assert("", IS_POW(min_buckets));							\
+  assert("", IS_POW(max_buckets));							\
+  assert("", min_buckets <= max_buckets);						\
+  memset (hash, 0, sizeof *hash);							\
+  bk = &hash->_bk[0];									\
+  bk->_table   = (ITEM_TYPE**) KMALLOC (sizeof (ITEM_TYPE*) * min_buckets);		\
+  bk->_buckets = min_buckets;								\
+  bk->_gen     = 0;									\
+  hash->_bk[1]._gen = 1;								\
+  if (bk->_table == NULL)								\
     {											\
       return RETERR(-ENOMEM);								\
     }											\
-  memset (hash->_table, 0, sizeof (ITEM_TYPE*) * buckets);				\
-  ON_DEBUG(printk(#PREFIX "_hash_table: %i buckets\n", buckets));			\
+  memset (bk->_table, 0, sizeof (ITEM_TYPE*) * min_buckets);				\
+  hash->_nr_locks = min_t(__u32, min_buckets, TYPE_SAFE_HASH_MAX_LOCKS);		\
+  hash->_locks = (struct tsh_stripe *)							\
+    KMALLOC (sizeof (struct tsh_stripe) * hash->_nr_locks);				\
+  if (hash->_locks == NULL)								\
+    {											\
+      KFREE (bk->_table, sizeof (ITEM_TYPE*) * min_buckets);				\
+      bk->_table = NULL;								\
+      return RETERR(-ENOMEM);								\
+    }											\
+  for (i = 0; i < hash->_nr_locks; ++ i) {						\
+    spin_lock_init(&hash->_locks[i].lock);						\
+    hash->_locks[i].count = 0;								\
+  }											\
+  hash->_min_buckets = min_buckets;							\
+  hash->_max_buckets = max_buckets;							\
+  hash->_last_check = jiffies;								\
+  INIT_WORK(&hash->_resize_work, PREFIX##_hash_resize_worker);				\
+  rcu_assign_pointer(hash->_cur, bk);							\
+  ON_DEBUG(printk(#PREFIX "_hash_table: %i buckets\n", min_buckets));			\
   return 0;										\
 }											\
 											\
+static __inline__ int									\
+PREFIX##_hash_init (PREFIX##_hash_table *hash,						\
+		    __u32                buckets)					\
+{											\
+  return PREFIX##_hash_init_resizable(hash, buckets, buckets);				\
+}											\
+											\
 static __inline__ void									\
-PREFIX##_hash_done (PREFIX##_hash_table *hash)						\
+PREFIX##_hash_freeze (PREFIX##_hash_table *hash)					\
 {											\
-  if (REISER4_DEBUG && hash->_table != NULL) {                                          \
-	    __u32 i;                                                                    \
-	    for (i = 0 ; i < hash->_buckets ; ++ i)                                     \
-		    assert("nikita-2905", hash->_table[i] == NULL);                     \
-  }                                                                                     \
-  if (hash->_table != NULL)								\
-    KFREE (hash->_table, sizeof (ITEM_TYPE*) * hash->_buckets);				\
-  hash->_table = NULL;									\
+  WRITE_ONCE(hash->_frozen, 1);								\
+  if (hash->_cur != NULL)								\
+    cancel_work_sync(&hash->_resize_work);						\
 }											\
 											\
 static __inline__ void									\
-PREFIX##_hash_prefetch_next (ITEM_TYPE *item)						\
+PREFIX##_hash_done (PREFIX##_hash_table *hash)						\
 {											\
-	prefetch(item->LINK_NAME._next);						\
+  PREFIX##_hash_buckets *bk;								\
+											\
+  PREFIX##_hash_freeze(hash);								\
+  bk = hash->_cur;									\
+  if (REISER4_DEBUG && bk != NULL) {                                                    \
+	    __u32 i;                                                                    \
+	    for (i = 0 ; i < bk->_buckets ; ++ i)                                       \
+		    assert("nikita-2905", bk->_table[i] == NULL);                       \
+  }                                                                                     \
+  if (bk != NULL)									\
+    KFREE (bk->_table, sizeof (ITEM_TYPE*) * bk->_buckets);				\
+  hash->_cur = NULL;									\
+  if (hash->_locks != NULL)								\
+    KFREE (hash->_locks, sizeof (struct tsh_stripe) * hash->_nr_locks);		\
+  hash->_locks = NULL;									\
 }											\
 											\
 static __inline__ void									\
 PREFIX##_hash_prefetch_bucket (PREFIX##_hash_table *hash,				\
-			       __u32                index)				\
+			       __u32                hashval)				\
 {											\
-	prefetch(hash->_table[index]);  						\
+	prefetch(*PREFIX##_hash_bucket(PREFIX##_hash_current(hash), hashval));		\
 }											\
 											\
+/* lookup. Has to be called under rcu_read_lock() or with some lock that	\
+   prevents items from being freed */							\
 static __inline__ ITEM_TYPE*								\
 PREFIX##_hash_find_index (PREFIX##_hash_table *hash,					\
-			  __u32                hash_index,				\
+			  __u32                hashval,					\
 			  KEY_TYPE const      *find_key)				\
 {											\
+  PREFIX##_hash_buckets *bk;								\
   ITEM_TYPE *item;									\
 											\
-  PREFIX##_check_hash(hash, hash_index);						\
-											\
-  for (item  = hash->_table[hash_index];						\
+  bk = PREFIX##_hash_current(hash);							\
+  for (item  = READ_ONCE(*PREFIX##_hash_bucket(bk, hashval));				\
        item != NULL;									\
-       item  = item->LINK_NAME._next)							\
+       item  = READ_ONCE(item->LINK_NAME._next[bk->_gen]))				\
     {											\
-      prefetch(item->LINK_NAME._next);							\
-      prefetch(item->LINK_NAME._next + offsetof(ITEM_TYPE, KEY_NAME));			\
       if (EQ_FUNC (& item->KEY_NAME, find_key))						\
         {										\
           return item;									\
@@ -148,72 +424,59 @@ PREFIX##_hash_find_index (PREFIX##_hash_table *hash,					\
   return NULL;										\
 }											\
 											\
-static __inline__ ITEM_TYPE*								\
-PREFIX##_hash_find_index_lru (PREFIX##_hash_table *hash,				\
-			      __u32                hash_index,				\
-			      KEY_TYPE const      *find_key)				\
-{											\
-  ITEM_TYPE ** item = &hash->_table[hash_index];                                        \
-											\
-  PREFIX##_check_hash(hash, hash_index);						\
-                                                                                        \
-  while (*item != NULL) {                                                               \
-    prefetch(&(*item)->LINK_NAME._next);						\
-    if (EQ_FUNC (&(*item)->KEY_NAME, find_key)) {                                       \
-      ITEM_TYPE *found; 								\
-											\
-      found = *item;    								\
-      *item = found->LINK_NAME._next;                                                   \
-      found->LINK_NAME._next = hash->_table[hash_index];				\
-      hash->_table[hash_index] = found;							\
-      return found;                                                                     \
-    }                                                                                   \
-    item = &(*item)->LINK_NAME._next;                                                   \
-  }											\
-  return NULL;										\
-}											\
-											\
 static __inline__ int									\
 PREFIX##_hash_remove_index (PREFIX##_hash_table *hash,					\
-			    __u32                hash_index,				\
+			    __u32                hashval,				\
 			    ITEM_TYPE           *del_item)				\
 {											\
-  ITEM_TYPE ** hash_item_p = &hash->_table[hash_index];                                 \
+  PREFIX##_hash_buckets *cur;								\
+  PREFIX##_hash_buckets *shadow;							\
+  struct tsh_stripe *stripe;								\
+  int found;										\
 											\
-  PREFIX##_check_hash(hash, hash_index);						\
-                                                                                        \
-  while (*hash_item_p != NULL) {                                                        \
-    prefetch(&(*hash_item_p)->LINK_NAME._next);						\
-    if (*hash_item_p == del_item) {                                                     \
-      *hash_item_p = (*hash_item_p)->LINK_NAME._next;                                   \
-      return 1;                                                                         \
-    }                                                                                   \
-    hash_item_p = &(*hash_item_p)->LINK_NAME._next;                                     \
+  stripe = PREFIX##_hash_stripe(hash, hashval);						\
+  spin_lock(&stripe->lock);								\
+  cur = PREFIX##_hash_current(hash);							\
+  found = PREFIX##_hash_link_out(cur, hashval, del_item);				\
+  shadow = PREFIX##_hash_shadow(hash, cur, hashval);					\
+  if (shadow != NULL)									\
+    PREFIX##_hash_link_out(shadow, hashval, del_item);					\
+  if (found) {										\
+    -- stripe->count;									\
+    PREFIX##_hash_check_load(hash, cur, stripe);					\
   }											\
-  return 0;										\
+  spin_unlock(&stripe->lock);								\
+  return found;										\
 }											\
 											\
 static __inline__ void									\
 PREFIX##_hash_insert_index (PREFIX##_hash_table *hash,					\
-			    __u32                hash_index,				\
+			    __u32                hashval,				\
 			    ITEM_TYPE           *ins_item)				\
 {											\
-  PREFIX##_check_hash(hash, hash_index);						\
+  PREFIX##_hash_buckets *cur;								\
+  PREFIX##_hash_buckets *shadow;							\
+  struct tsh_stripe *stripe;								\
 											\
-  ins_item->LINK_NAME._next = hash->_table[hash_index];					\
-  hash->_table[hash_index]  = ins_item;							\
+  stripe = PREFIX##_hash_stripe(hash, hashval);						\
+  spin_lock(&stripe->lock);								\
+  cur = PREFIX##_hash_current(hash);							\
+  PREFIX##_hash_link_in(cur, hashval, ins_item);					\
+  shadow = PREFIX##_hash_shadow(hash, cur, hashval);					\
+  if (shadow != NULL)									\
+    PREFIX##_hash_link_in(shadow, hashval, ins_item);					\
+  ++ stripe->count;									\
+  PREFIX##_hash_check_load(hash, cur, stripe);						\
+  spin_unlock(&stripe->lock);								\
 }											\
 											\
+/* insertion always publishes item safely for lockless lookups */			\
 static __inline__ void									\
 PREFIX##_hash_insert_index_rcu (PREFIX##_hash_table *hash,				\
-			        __u32                hash_index,			\
+			        __u32                hashval,				\
 			        ITEM_TYPE           *ins_item)				\
 {											\
-  PREFIX##_check_hash(hash, hash_index);						\
-											\
-  ins_item->LINK_NAME._next = hash->_table[hash_index];					\
-  smp_wmb();    									\
-  hash->_table[hash_index]  = ins_item;							\
+  PREFIX##_hash_insert_index(hash, hashval, ins_item);					\
 }											\
 											\
 static __inline__ ITEM_TYPE*								\
@@ -223,13 +486,6 @@ PREFIX##_hash_find (PREFIX##_hash_table *hash,						\
   return PREFIX##_hash_find_index (hash, HASH_FUNC(hash, find_key), find_key);		\
 }											\
 											\
-static __inline__ ITEM_TYPE*								\
-PREFIX##_hash_find_lru (PREFIX##_hash_table *hash,					\
-	                KEY_TYPE const      *find_key)					\
-{											\
-  return PREFIX##_hash_find_index_lru (hash, HASH_FUNC(hash, find_key), find_key);	\
-}											\
-											\
 static __inline__ int									\
 PREFIX##_hash_remove (PREFIX##_hash_table *hash,					\
 		      ITEM_TYPE           *del_item)					\
@@ -261,13 +517,17 @@ PREFIX##_hash_insert_rcu (PREFIX##_hash_table *hash,					\
                                          ins_item);     				\
 }											\
 											\
+/* iteration. Caller has to exclude concurrent updates other than removal of	\
+   the current item */									\
 static __inline__ ITEM_TYPE *								\
 PREFIX##_hash_first (PREFIX##_hash_table *hash, __u32 ind)				\
 {											\
+  PREFIX##_hash_buckets *bk;								\
   ITEM_TYPE *first;									\
 											\
-  for (first = NULL; ind < hash->_buckets; ++ ind) {					\
-    first = hash->_table[ind];  							\
+  bk = PREFIX##_hash_current(hash);							\
+  for (first = NULL; ind < bk->_buckets; ++ ind) {					\
+    first = bk->_table[ind];  								\
     if (first != NULL)									\
       break;										\
   }											\
@@ -278,27 +538,62 @@ static __inline__ ITEM_TYPE *								\
 PREFIX##_hash_next (PREFIX##_hash_table *hash,						\
 		    ITEM_TYPE           *item)						\
 {											\
+  PREFIX##_hash_buckets *bk;								\
   ITEM_TYPE  *next;									\
 											\
   if (item == NULL)									\
     return NULL;									\
-  next = item->LINK_NAME._next;								\
+  bk = PREFIX##_hash_current(hash);							\
+  next = item->LINK_NAME._next[bk->_gen];						\
   if (next == NULL)									\
-    next = PREFIX##_hash_first (hash, HASH_FUNC(hash, &item->KEY_NAME) + 1);		\
+    next = PREFIX##_hash_first (hash, (HASH_FUNC(hash, &item->KEY_NAME) &		\
+				       (bk->_buckets - 1)) + 1);			\
   return next;										\
 }											\
 											\
+/* collect chain length statistics. Chains are walked under RCU, with		\
+   rescheduling between stripes, so result is approximate. */				\
+static __inline__ void									\
+PREFIX##_hash_stats (PREFIX##_hash_table *hash, struct tsh_stats *st)			\
+{											\
+  PREFIX##_hash_buckets *bk;								\
+  __u32 i;										\
+											\
+ again:											\
+  memset(st, 0, sizeof *st);								\
+  rcu_read_lock();									\
+  bk = rcu_dereference(hash->_cur);							\
+  st->buckets = bk->_buckets;								\
+  for (i = 0; i < bk->_buckets; ++ i) {							\
+    ITEM_TYPE *item;									\
+    unsigned long len;									\
+											\
+    if ((i & (TYPE_SAFE_HASH_MAX_LOCKS - 1)) == TYPE_SAFE_HASH_MAX_LOCKS - 1) {		\
+      rcu_read_unlock();								\
+      cond_resched();									\
+      rcu_read_lock();									\
+      if (rcu_dereference(hash->_cur) != bk) {						\
+	rcu_read_unlock();								\
+	goto again;									\
+      }											\
+    }											\
+    len = 0;										\
+    for (item = READ_ONCE(bk->_table[i]); item != NULL;					\
+	 item = READ_ONCE(item->LINK_NAME._next[bk->_gen]))				\
+      ++ len;										\
+    st->items += len;									\
+    if (len != 0)									\
+      ++ st->used;									\
+    if (len > st->max_chain)								\
+      st->max_chain = len;								\
+    ++ st->chains[min_t(unsigned long, len, TYPE_SAFE_HASH_CHAIN_HIST - 1)];		\
+  }											\
+  rcu_read_unlock();									\
+  st->resizes = READ_ONCE(hash->_resizes);						\
+}											\
+											\
 typedef struct {} PREFIX##_hash_dummy
 
-#define for_all_ht_buckets(table, head)					\
-for ((head) = &(table) -> _table[ 0 ] ;					\
-     (head) != &(table) -> _table[ (table) -> _buckets ] ; ++ (head))
-
-#define for_all_in_bucket(bucket, item, next, field)				\
-for ((item) = *(bucket), (next) = (item) ? (item) -> field._next : NULL ;	\
-     (item) != NULL ;								\
-     (item) = (next), (next) = (item) ? (item) -> field._next : NULL )
-
 #define for_all_in_htable(table, prefix, item, next)	\
 for ((item) = prefix ## _hash_first ((table), 0), 	\
      (next) = prefix ## _hash_next ((table), (item)) ;	\
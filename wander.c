@@ -81,6 +81,13 @@
    written tx head, submit an i/o for modified journal header block and wait
    for i/o completion.
 
+   Steps above are done under the per-fs commit mutex, the atom playing
+   process described below is done under the write-back mutex. The latter is
+   taken before the former is released, so the next atom can be committed
+   while the current one is being played, and atoms are played in commit
+   order. Journal footer lags behind journal header by one or two atoms, and
+   recovery replays all transactions between them.
+
    NOTE: The special logging for bitmap blocks and some reiser4 super block
    fields makes processes of atom commit, flush and recovering a bit more
    complex (see comments in the source code for details).
@@ -176,6 +183,7 @@
 #include "writeout.h"
 #include "inode.h"
 #include "entd.h"
+#include "checksum.h"
 
 #include <linux/types.h>
 #include <linux/fs.h>		/* for struct super_block  */
@@ -183,6 +191,7 @@
 #include <linux/pagemap.h>
 #include <linux/bio.h>		/* for struct bio */
 #include <linux/blkdev.h>
+#include <linux/sched/clock.h>
 
 static int write_jnodes_to_disk_extent(
 	jnode *, int, const reiser4_block_nr *, flush_queue_t *, int);
@@ -208,6 +217,12 @@ struct commit_handle {
 	struct super_block *super;
 	/* The counter of modified bitmaps */
 	reiser4_block_nr nr_bitmap;
+	/* link in tmgr.checkpoint_list, when write-back is deferred */
+	struct list_head link;
+	/* checksums of logged blocks xor-ed together, see tx_csum() */
+	__u32 csum;
+	/* end of the last accounted commit stage, see commit_stage_done() */
+	u64 stamp;
 };
 
 static void init_commit_handle(struct commit_handle *ch, txn_atom *atom)
@@ -224,6 +239,13 @@ static void done_commit_handle(struct commit_handle *ch)
 	assert("zam-690", list_empty(&ch->tx_list));
 }
 
+/* account commit stage which started at ch->stamp and ends now */
+static void commit_stage_done(struct commit_handle *ch,
+			      reiser4_commit_stage stage)
+{
+	ch->stamp = reiser4_commit_stage_done(ch->atom, stage, ch->stamp);
+}
+
 /* fill journal header block data  */
 static void format_journal_header(struct commit_handle *ch)
 {
@@ -244,6 +266,8 @@ static void format_journal_header(struct commit_handle *ch)
 
 	put_unaligned(cpu_to_le64(*jnode_get_block(txhead)),
 		      &header->last_committed_tx);
+	put_unaligned(cpu_to_le64(sbinfo->last_committed_tx),
+		      &header->prev_committed_tx);
 
 	jrelse(sbinfo->journal_header);
 }
@@ -361,6 +385,74 @@ store_entry(jnode * node, int index, const reiser4_block_nr * a,
 	put_unaligned(cpu_to_le64(*b), &pairs[index].wandered);
 }
 
+/* Transaction checksum.
+
+   With FORMAT40_TX_CSUM the tx head stores crc32c of the whole transaction:
+   wander records (taken in the order of the on-disk list starting from tx
+   head, with the checksum field of tx head taken as zero) are checksummed as
+   one stream, and the result is xor-ed with checksums of all logged blocks.
+   Logged blocks are combined by xor because wandered map order is not the
+   order in which blocks are written. Checksum of a logged block is seeded by
+   its original location, so that a block which wandered to a wrong place does
+   not pass the check.
+
+   This allows to submit journal header together with the log instead of
+   waiting for the log before: replay verifies the last transaction and drops
+   it if it turns out to be torn. */
+static __u32 logged_block_csum(const struct super_block *s,
+			       const reiser4_block_nr *original,
+			       const char *data)
+{
+	struct crypto_shash *tfm = get_super_private(s)->csum_tfm;
+	d64 loc;
+	__u32 crc;
+
+	put_unaligned(cpu_to_le64(*original), &loc);
+	crc = reiser4_crc32c(tfm, ~0, &loc, sizeof(loc));
+	return reiser4_crc32c(tfm, crc, data, s->s_blocksize);
+}
+
+static __u32 wander_record_csum(const struct super_block *s, __u32 crc,
+				const char *data, int tx_head)
+{
+	struct crypto_shash *tfm = get_super_private(s)->csum_tfm;
+	const d32 zero = 0;
+	size_t off;
+
+	if (!tx_head)
+		return reiser4_crc32c(tfm, crc, data, s->s_blocksize);
+
+	off = offsetof(struct tx_header, csum);
+	crc = reiser4_crc32c(tfm, crc, data, off);
+	crc = reiser4_crc32c(tfm, crc, &zero, sizeof(zero));
+	off += sizeof(zero);
+	return reiser4_crc32c(tfm, crc, data + off, s->s_blocksize - off);
+}
+
+/* calculate transaction checksum and store it in tx head */
+static void tx_csum(struct commit_handle *ch)
+{
+	struct tx_header *header;
+	jnode *txhead;
+	jnode *cur;
+	__u32 crc = ~0;
+
+	txhead = list_entry(ch->tx_list.next, jnode, capture_link);
+	list_for_each_entry(cur, &ch->tx_list, capture_link)
+		crc = wander_record_csum(ch->super, crc, jdata(cur),
+					 cur == txhead);
+
+	header = (struct tx_header *)jdata(txhead);
+	put_unaligned(cpu_to_le32(crc ^ ch->csum), &header->csum);
+}
+
+/* flags for writing the log: with checksummed transactions log blocks are
+   written with FUA, as nothing flushes disk cache after them */
+static int log_write_flags(const struct commit_handle *ch)
+{
+	return reiser4_is_set(ch->super, REISER4_TX_CSUM) ? WRITEOUT_FUA : 0;
+}
+
 /* currently, wander records contains contain only wandered map, which depend on
    overwrite set size */
 static void get_tx_size(struct commit_handle *ch)
@@ -470,15 +562,49 @@ static int update_journal_footer(struct commit_handle *ch)
 	return 0;
 }
 
+/* put log block of already written in place transaction to delete set of
+   @atom. Unlike reiser4_dealloc_block() this does not need @atom to be the
+   current one, see reiser4_checkpoint() */
+static int dealloc_log_block(txn_atom *atom, const reiser4_block_nr *block)
+{
+	reiser4_block_nr len = 1;
+	void *new_entry = NULL;
+	int ret;
+
+	do {
+		spin_lock_atom(atom);
+		ret = atom_dset_deferred_add_extent(atom, &new_entry,
+						    block, &len);
+	} while (ret == -E_REPEAT);
+
+	if (ret == 0)
+		spin_unlock_atom(atom);
+	return ret;
+}
+
+/* delete set entry for log block could not be allocated. Log blocks are
+   allocated after pre-commit hook, so they never get to commit bitmap, and
+   transaction is already written in place, so the block is freed in working
+   bitmap right away, as apply_dset() would do a bit later */
+static void dealloc_log_block_now(const reiser4_block_nr *block, int error)
+{
+	warning("edward-2390", "log block %llu freed synchronously (%d)",
+		(unsigned long long)*block, error);
+	reiser4_dealloc_block(block, BLOCK_NOT_COUNTED, BA_FORMATTED);
+}
+
 /* free block numbers of wander records of already written in place transaction */
 static void dealloc_tx_list(struct commit_handle *ch)
 {
+	int ret;
+
 	while (!list_empty(&ch->tx_list)) {
 		jnode *cur = list_entry(ch->tx_list.next, jnode, capture_link);
 		list_del(&cur->capture_link);
 		ON_DEBUG(INIT_LIST_HEAD(&cur->capture_link));
-		reiser4_dealloc_block(jnode_get_block(cur), 0,
-				      BA_DEFER | BA_FORMATTED);
+		ret = dealloc_log_block(ch->atom, jnode_get_block(cur));
+		if (ret)
+			dealloc_log_block_now(jnode_get_block(cur), ret);
 
 		unpin_jnode_data(cur);
 		reiser4_drop_io_head(cur);
@@ -488,16 +614,19 @@ static void dealloc_tx_list(struct commit_handle *ch)
 /* An actor for use in block_nr_iterator() routine which frees wandered blocks
    from atom's overwrite set. */
 static int
-dealloc_wmap_actor(txn_atom * atom UNUSED_ARG,
+dealloc_wmap_actor(txn_atom * atom,
 		   const reiser4_block_nr * a UNUSED_ARG,
 		   const reiser4_block_nr * b, void *data UNUSED_ARG)
 {
+	int ret;
 
 	assert("zam-499", b != NULL);
 	assert("zam-500", *b != 0);
 	assert("zam-501", !reiser4_blocknr_is_fake(b));
 
-	reiser4_dealloc_block(b, 0, BA_DEFER | BA_FORMATTED);
+	ret = dealloc_log_block(atom, b);
+	if (ret)
+		dealloc_log_block_now(b, ret);
 	return 0;
 }
 
@@ -610,7 +739,9 @@ static int get_overwrite_set(struct commit_handle *ch)
 			    get_current_super_private();
 
 			if (sbinfo->df_plug->log_super) {
-				jnode *sj = sbinfo->df_plug->log_super(s);
+				jnode *sj;
+
+				sj = sbinfo->df_plug->log_super(s);
 
 				assert("zam-593", sj != NULL);
 
@@ -709,7 +840,7 @@ static int write_jnodes_to_disk_extent(
 	flush_queue_t *fq, int flags)
 {
 	struct super_block *super = reiser4_get_current_sb();
-	int op_flags = (flags & WRITEOUT_FLUSH_FUA) ? REQ_PREFLUSH | REQ_FUA : 0;
+	int op_flags = 0;
 	jnode *cur = first;
 	reiser4_block_nr block;
 
@@ -717,6 +848,11 @@ static int write_jnodes_to_disk_extent(
 	assert("zam-572", block_p != NULL);
 	assert("zam-570", nr > 0);
 
+	if (flags & WRITEOUT_FLUSH_FUA)
+		op_flags = REQ_PREFLUSH | REQ_FUA;
+	else if (flags & WRITEOUT_FUA)
+		op_flags = REQ_FUA;
+
 	block = *block_p;
 
 	while (nr > 0) {
@@ -966,13 +1102,20 @@ static int alloc_wandered_blocks(struct commit_handle *ch, flush_queue_t *fq)
 		if (ret)
 			return ret;
 
-		ret = write_jnodes_to_disk_extent(cur, len, &block, fq, 0);
+		ret = write_jnodes_to_disk_extent(cur, len, &block, fq,
+						  log_write_flags(ch));
 		if (ret)
 			return ret;
 
 		while ((len--) > 0) {
 			assert("zam-604",
 			       ch->overwrite_set != &cur->capture_link);
+			/* node checksum is updated on submit, so the data is
+			   final here */
+			if (reiser4_is_set(ch->super, REISER4_TX_CSUM))
+				ch->csum ^= logged_block_csum(ch->super,
+							      jnode_get_block(cur),
+							      jdata(cur));
 			cur = list_entry(cur->capture_link.next, jnode, capture_link);
 		}
 	}
@@ -1074,6 +1217,9 @@ static int alloc_tx(struct commit_handle *ch, flush_queue_t * fq)
 		spin_unlock_atom(atom);
 	}
 
+	if (reiser4_is_set(ch->super, REISER4_TX_CSUM))
+		tx_csum(ch);
+
 	{ /* relse all jnodes from tx_list */
 		cur = list_entry(ch->tx_list.next, jnode, capture_link);
 		while (&ch->tx_list != &cur->capture_link) {
@@ -1082,7 +1228,7 @@ static int alloc_tx(struct commit_handle *ch, flush_queue_t * fq)
 		}
 	}
 
-	ret = write_jnode_list(&ch->tx_list, fq, NULL, 0);
+	ret = write_jnode_list(&ch->tx_list, fq, NULL, log_write_flags(ch));
 
 	return ret;
 
@@ -1121,35 +1267,304 @@ static int commit_tx(struct commit_handle *ch)
 	reiser4_fq_put(fq);
 	if (ret)
 		return ret;
-	ret = current_atom_finish_all_fq();
-	if (ret)
-		return ret;
-	return update_journal_header(ch);
+	commit_stage_done(ch, REISER4_COMMIT_ALLOC_TX);
+
+	if (reiser4_is_set(ch->super, REISER4_TX_CSUM)) {
+		/* Do not wait for the log: replay drops the transaction if
+		   journal header reaches disk before the whole log does. Log
+		   blocks are written with FUA, and preflush of journal header
+		   makes the relocate set (which is already written) durable,
+		   so one cache flush per commit is enough */
+		ret = update_journal_header(ch);
+		if (ret == 0)
+			ret = current_atom_finish_all_fq();
+	} else {
+		ret = current_atom_finish_all_fq();
+		if (ret == 0)
+			ret = update_journal_header(ch);
+	}
+	if (ret == 0)
+		commit_stage_done(ch, REISER4_COMMIT_WRITE_LOG);
+	return ret;
 }
 
-static int write_tx_back(struct commit_handle * ch)
+/* submit overwrite set of committed atom for write in place */
+static int submit_tx_back(struct commit_handle *ch)
 {
-	flush_queue_t *fq;
+	flush_queue_t *fq = NULL;
 	int ret;
 
-	fq = get_fq_for_current_atom();
-	if (IS_ERR(fq))
-		return  PTR_ERR(fq);
-	spin_unlock_atom(fq->atom);
+	do {
+		spin_lock_atom(ch->atom);
+		ret = reiser4_fq_by_atom(ch->atom, &fq);
+	} while (ret == -E_REPEAT);
+	if (ret)
+		return ret;
+	spin_unlock_atom(ch->atom);
 	ret = write_jnode_list(
 		ch->overwrite_set, fq, NULL, WRITEOUT_FOR_PAGE_RECLAIM);
 	reiser4_fq_put(fq);
+	return ret;
+}
+
+static int write_tx_back(struct commit_handle * ch)
+{
+	int ret;
+
+	ret = submit_tx_back(ch);
 	if (ret)
 		return ret;
-	ret = current_atom_finish_all_fq();
+	ret = reiser4_atom_finish_all_fq(ch->atom);
 	if (ret)
 		return ret;
 	return update_journal_footer(ch);
 }
 
+/* free log of written back transaction, release its overwrite set */
+static void done_write_back(struct commit_handle *ch)
+{
+	/* free blocks of flushed transaction */
+	dealloc_tx_list(ch);
+	dealloc_wmap(ch);
+
+	reiser4_post_write_back_hook(ch->atom);
+
+	put_overwrite_set(ch);
+
+	done_commit_handle(ch);
+}
+
+/* true if @atom is one of atoms following @ch on @batch */
+static int played_after(struct commit_handle *ch, struct list_head *batch,
+			txn_atom *atom)
+{
+	list_for_each_entry_continue(ch, batch, link)
+		if (ch->atom == atom)
+			return 1;
+	return 0;
+}
+
+/* Drop copies made by copy_on_capture() from overwrite set of @ch, if the
+   node they were copied from is in overwrite set of an atom following @ch on
+   @batch: newer contents of the block is written back by that atom. Nodes
+   can not be copied or uncaptured from atoms on @batch meanwhile, because
+   tmgr.wb_mutex is held. Returns true if copies remain in the overwrite set
+   of @ch */
+static int drop_superseded_copies(struct commit_handle *ch,
+				  struct list_head *batch)
+{
+	jnode *cur;
+	jnode *tmp;
+	int copies = 0;
+
+	list_for_each_entry_safe(cur, tmp, ch->overwrite_set, capture_link) {
+		jnode *orig;
+		txn_atom *atom;
+
+		if (!JF_ISSET(cur, JNODE_CAPTURE_COPY))
+			continue;
+		orig = cur->key.orig;
+		spin_lock_jnode(orig);
+		atom = JF_ISSET(orig, JNODE_OVRWR) ? orig->atom : NULL;
+		spin_unlock_jnode(orig);
+		if (atom == NULL || !played_after(ch, batch, atom)) {
+			copies = 1;
+			continue;
+		}
+		/* the load done by get_overwrite_set() */
+		jrelse_tail(cur);
+		reiser4_uncapture_copy(cur);
+	}
+	return copies;
+}
+
+/* Write back all atoms on tmgr.checkpoint_list. Overwrite sets of all of them
+   are submitted first, and journal footer is updated once, to point to the
+   last one. Called with tmgr.wb_mutex held in write-out mode.
+
+   Several atoms of the batch can write the same block, when it was copied on
+   capture: a copy in overwrite set of earlier atom, and either the node
+   itself or another copy of it in overwrite set of later one. Copies of nodes
+   which are written by later atom are dropped. If copies still remain, the
+   atom is waited for before overwrite set of the next one is submitted, so
+   that writes of one block are not in flight at once and complete in commit
+   order */
+static void play_deferred(reiser4_super_info_data *sbinfo)
+{
+	txn_mgr *mgr = &sbinfo->tmgr;
+	struct commit_handle *ch;
+	struct commit_handle *tmp;
+	LIST_HEAD(batch);
+	int ret = 0;
+	u64 start;
+
+	assert("edward-2347", mutex_is_locked(&mgr->wb_mutex));
+
+	spin_lock_txnmgr(mgr);
+	list_splice_init(&mgr->checkpoint_list, &batch);
+	mgr->checkpoint_blocks = 0;
+	mgr->checkpoint_wanted = 0;
+	spin_unlock_txnmgr(mgr);
+
+	if (list_empty(&batch))
+		return;
+
+	start = local_clock();
+	list_for_each_entry(ch, &batch, link) {
+		int copies;
+
+		copies = drop_superseded_copies(ch, &batch);
+		ret = submit_tx_back(ch);
+		if (ret)
+			break;
+		if (copies && !list_is_last(&ch->link, &batch)) {
+			ret = reiser4_atom_finish_all_fq(ch->atom);
+			if (ret)
+				break;
+		}
+	}
+	list_for_each_entry(ch, &batch, link) {
+		int wait_ret;
+
+		wait_ret = reiser4_atom_finish_all_fq(ch->atom);
+		if (ret == 0)
+			ret = wait_ret;
+	}
+	if (ret == 0)
+		ret = update_journal_footer(list_entry(batch.prev,
+						       struct commit_handle,
+						       link));
+	if (ret)
+		reiser4_panic("edward-2348", "write back failed (%d)\n", ret);
+
+	reiser4_stat_inc(sbinfo->tree.super, REISER4_STAT_CHECKPOINTS);
+	reiser4_commit_stage_done(list_entry(batch.prev, struct commit_handle,
+					     link)->atom,
+				  REISER4_COMMIT_CHECKPOINT, start);
+	list_for_each_entry_safe(ch, tmp, &batch, link) {
+		txn_atom *atom = ch->atom;
+
+		list_del(&ch->link);
+		done_write_back(ch);
+		kfree(ch);
+		reiser4_atom_played(atom);
+	}
+}
+
+/* Atom's log is on disk. Its write-back is done later by reiser4_checkpoint().
+   Returns true if too many log blocks are kept by atoms not written back */
+static int defer_write_back(struct commit_handle *ch)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(ch->super);
+	txn_mgr *mgr = &sbinfo->tmgr;
+	struct commit_handle *deferred;
+	__u64 log_blocks;
+	__u64 free_blocks;
+	int over;
+
+	deferred = kmalloc(sizeof(*deferred), reiser4_ctx_gfp_mask_get());
+	if (deferred == NULL)
+		return RETERR(-ENOMEM);
+
+	*deferred = *ch;
+	INIT_LIST_HEAD(&deferred->tx_list);
+	list_splice_init(&ch->tx_list, &deferred->tx_list);
+
+	/* relocate set of atom is released here rather than in
+	   commit_current_atom(), because atom can be played as soon as it is
+	   put to checkpoint list */
+	reiser4_invalidate_list(ATOM_CLEAN_LIST(ch->atom));
+
+	spin_lock_atom(ch->atom);
+	ch->atom->flags |= ATOM_DEFERRED_CHECKPOINT;
+	spin_unlock_atom(ch->atom);
+	reiser4_stat_inc(ch->super, REISER4_STAT_DEFERRED_ATOMS);
+
+	log_blocks = ch->overwrite_set_size + ch->tx_size;
+	free_blocks = reiser4_free_blocks(ch->super);
+
+	spin_lock_txnmgr(mgr);
+	if (list_empty(&mgr->checkpoint_list))
+		mgr->checkpoint_start = jiffies;
+	list_add_tail(&deferred->link, &mgr->checkpoint_list);
+	mgr->checkpoint_blocks += log_blocks;
+	/* do not let log of not played atoms take more than a half of free
+	   space */
+	over = mgr->checkpoint_blocks > mgr->checkpoint_max_size ||
+		mgr->checkpoint_blocks > free_blocks / 2;
+	spin_unlock_txnmgr(mgr);
+
+	return over;
+}
+
+/**
+ * reiser4_checkpoint - write back atoms which write-back was deferred
+ * @super: super block
+ *
+ * In deferred checkpoint mode committed atoms are kept on
+ * tmgr.checkpoint_list until ktxnmgrd, somebody who needs space or nodes
+ * occupied by them, or umount writes them back with this.
+ */
+int reiser4_checkpoint(struct super_block *super)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(super);
+
+	mutex_lock(&sbinfo->tmgr.wb_mutex);
+	writeout_mode_enable();
+	play_deferred(sbinfo);
+	writeout_mode_disable();
+	mutex_unlock(&sbinfo->tmgr.wb_mutex);
+	return 0;
+}
+
+/**
+ * reiser4_wait_write_back - release node from previous atoms
+ * @node: commit bitmap block or super block
+ *
+ * Called by the committer holding commit_mutex, before it captures @node
+ * which may still be in the overwrite set of an atom being written back or
+ * waiting for deferred write-back. In the latter case @node is copied on
+ * capture, and the atom keeps its contents to be written back, unless the
+ * atom being committed is written back in the same checkpoint (see
+ * drop_superseded_copies()). Otherwise previous atoms are written back.
+ * When this returns @node is uncaptured.
+ */
+void reiser4_wait_write_back(jnode *node)
+{
+	reiser4_super_info_data *sbinfo = get_current_super_private();
+
+	assert("edward-2338", mutex_is_locked(&sbinfo->tmgr.commit_mutex));
+
+	if (reiser4_uncapture_deferred(node) == 0)
+		return;
+
+	mutex_lock(&sbinfo->tmgr.wb_mutex);
+	play_deferred(sbinfo);
+	mutex_unlock(&sbinfo->tmgr.wb_mutex);
+}
+
+/* Atom's log is on disk. Let the next atom write its log while this one is
+   written back. Write-back stages of atoms are ordered the same way as their
+   log stages, because wb_mutex is taken with commit_mutex held. Atoms which
+   write-back was deferred are played first */
+static void start_write_back(reiser4_super_info_data *sbinfo)
+{
+	mutex_lock(&sbinfo->tmgr.wb_mutex);
+	mutex_unlock(&sbinfo->tmgr.commit_mutex);
+	play_deferred(sbinfo);
+}
+
 /* We assume that at this moment all captured blocks are marked as RELOC or
    WANDER (belong to Relocate o Overwrite set), all nodes from Relocate set
    are submitted to write.
+
+   This is called with tmgr.commit_mutex held and returns with tmgr.wb_mutex
+   held instead. Journal header is updated under the former, write-back of
+   the overwrite set and journal footer update are done under the latter.
+
+   When file system is mounted with deferred_checkpoint option, write-back
+   is left to reiser4_checkpoint(), and 1 is returned with none of the
+   mutexes held.
 */
 
 int reiser4_write_logs(long *nr_submitted)
@@ -1158,14 +1573,21 @@ int reiser4_write_logs(long *nr_submitted)
 	struct super_block *super = reiser4_get_current_sb();
 	reiser4_super_info_data *sbinfo = get_super_private(super);
 	struct commit_handle ch;
+	int write_back = 0;
+	u64 start = local_clock();
 	int ret;
 
+	assert("edward-2339", mutex_is_locked(&sbinfo->tmgr.commit_mutex));
+
 	writeout_mode_enable();
 
 	/* block allocator may add j-nodes to the clean_list */
 	ret = reiser4_pre_commit_hook();
-	if (ret)
+	if (ret) {
+		start_write_back(sbinfo);
+		writeout_mode_disable();
 		return ret;
+	}
 
 	/* No locks are required if we take atom which stage >=
 	 * ASTAGE_PRE_COMMIT */
@@ -1199,6 +1621,7 @@ int reiser4_write_logs(long *nr_submitted)
 	sbinfo->nr_files_committed -= (unsigned)atom->nr_objects_deleted;
 
 	init_commit_handle(&ch, atom);
+	ch.stamp = start;
 
 	ch.free_blocks = sbinfo->blocks_free_committed;
 	ch.nr_files = sbinfo->nr_files_committed;
@@ -1208,6 +1631,8 @@ int reiser4_write_logs(long *nr_submitted)
 
 	/* count overwrite set and place it in a separate list */
 	ret = get_overwrite_set(&ch);
+	atom->nr_overwrite = ch.overwrite_set_size;
+	commit_stage_done(&ch, REISER4_COMMIT_PREPARE);
 
 	if (ret <= 0) {
 		/* It is possible that overwrite set is empty here, it means
@@ -1231,24 +1656,40 @@ int reiser4_write_logs(long *nr_submitted)
 	spin_unlock_atom(atom);
 	reiser4_post_commit_hook();
 
+	if (reiser4_is_set(super, REISER4_DEFERRED_CHECKPOINT)) {
+		ret = defer_write_back(&ch);
+		if (ret >= 0) {
+			mutex_unlock(&sbinfo->tmgr.commit_mutex);
+			if (ret > 0) {
+				/* throttle committers */
+				mutex_lock(&sbinfo->tmgr.wb_mutex);
+				play_deferred(sbinfo);
+				mutex_unlock(&sbinfo->tmgr.wb_mutex);
+			}
+			writeout_mode_disable();
+			return 1;
+		}
+		/* no memory to keep commit handle, write back now */
+	}
+
+	start_write_back(sbinfo);
+	write_back = 1;
+	commit_stage_done(&ch, REISER4_COMMIT_WB_MUTEX_WAIT);
+
 	ret = write_tx_back(&ch);
+	if (ret == 0)
+		commit_stage_done(&ch, REISER4_COMMIT_WRITE_BACK);
 
       up_and_ret:
+	if (!write_back)
+		start_write_back(sbinfo);
 	if (ret) {
 		/* there could be fq attached to current atom; the only way to
 		   remove them is: */
 		current_atom_finish_all_fq();
 	}
 
-	/* free blocks of flushed transaction */
-	dealloc_tx_list(&ch);
-	dealloc_wmap(&ch);
-
-	reiser4_post_write_back_hook();
-
-	put_overwrite_set(&ch);
-
-	done_commit_handle(&ch);
+	done_write_back(&ch);
 
 	writeout_mode_disable();
 
@@ -1342,24 +1783,70 @@ static int restore_commit_handle(struct commit_handle *ch, jnode *tx_head)
 	return 0;
 }
 
-/* replay one transaction: restore and write overwrite set in place */
+/* Wait for reads started by jstartio() for all jnodes of @head and load them.
+   Jnodes which fail to load are removed from the list and dropped, so that
+   all jnodes left on the list are loaded. Returns first error. */
+static int load_jnode_list(struct list_head *head)
+{
+	jnode *cur, *tmp;
+	int result = 0;
+
+	list_for_each_entry_safe(cur, tmp, head, capture_link) {
+		int ret;
+
+		ret = jload(cur);
+		if (ret < 0) {
+			list_del_init(&cur->capture_link);
+			reiser4_drop_io_head(cur);
+			if (result == 0)
+				result = ret;
+		}
+	}
+	return result;
+}
+
+/* release and drop loaded io heads of @head */
+static void drop_jnode_list(struct list_head *head)
+{
+	while (!list_empty(head)) {
+		jnode *cur = list_entry(head->next, jnode, capture_link);
+		list_del_init(&cur->capture_link);
+		jrelse(cur);
+		reiser4_drop_io_head(cur);
+	}
+}
+
+/* replay one transaction: restore and write overwrite set in place.
+
+   Reads of all wandered blocks are started as soon as wander record which
+   maps them is parsed, the next wander record is read ahead while the current
+   one is parsed. Only then the reads are waited for, and the overwrite set is
+   written in place under one block plug. Writes are waited for once, before
+   the next transaction is replayed: it may overwrite the same blocks. Journal
+   footer is updated after the @last transaction only. */
 static int replay_transaction(const struct super_block *s,
 			      jnode * tx_head,
 			      const reiser4_block_nr * log_rec_block_p,
 			      const reiser4_block_nr * end_block,
-			      unsigned int nr_wander_records)
+			      unsigned int nr_wander_records,
+			      int last, __u64 *nr_replayed)
 {
 	reiser4_block_nr log_rec_block = *log_rec_block_p;
 	struct commit_handle ch;
 	LIST_HEAD(overwrite_set);
+	LIST_HEAD(records);
+	struct blk_plug plug;
+	jnode *next = NULL;
 	jnode *log;
-	int ret;
+	jnode *node;
+	int ret = 0;
 
 	init_commit_handle(&ch, NULL);
 	ch.overwrite_set = &overwrite_set;
 
 	restore_commit_handle(&ch, tx_head);
 
+	blk_start_plug(&plug);
 	while (log_rec_block != *end_block) {
 		struct wander_record_header *header;
 		struct wander_entry *entry;
@@ -1371,35 +1858,49 @@ static int replay_transaction(const struct super_block *s,
 				"number of wander records in the linked list"
 				" greater than number stored in tx head.\n");
 			ret = RETERR(-EIO);
-			goto free_ow_set;
+			break;
 		}
 
-		log = reiser4_alloc_io_head(&log_rec_block);
-		if (log == NULL)
-			return RETERR(-ENOMEM);
+		if (next != NULL) {
+			assert("edward-2354",
+			       *jnode_get_block(next) == log_rec_block);
+			log = next;
+			next = NULL;
+		} else {
+			log = reiser4_alloc_io_head(&log_rec_block);
+			if (log == NULL) {
+				ret = RETERR(-ENOMEM);
+				break;
+			}
+		}
 
 		ret = jload(log);
 		if (ret < 0) {
 			reiser4_drop_io_head(log);
-			return ret;
+			break;
 		}
+		list_add_tail(&log->capture_link, &records);
 
 		ret = check_wander_record(log);
-		if (ret) {
-			jrelse(log);
-			reiser4_drop_io_head(log);
-			return ret;
-		}
+		if (ret)
+			break;
 
 		header = (struct wander_record_header *)jdata(log);
 		log_rec_block = le64_to_cpu(get_unaligned(&header->next_block));
 
+		/* start reading the next record while reads of blocks mapped
+		   by this one are being submitted */
+		if (log_rec_block != *end_block) {
+			next = reiser4_alloc_io_head(&log_rec_block);
+			if (next != NULL)
+				jstartio(next);
+		}
+
 		entry = (struct wander_entry *)(header + 1);
 
 		/* restore overwrite set from wander record content */
 		for (i = 0; i < wander_record_capacity(s); i++) {
 			reiser4_block_nr block;
-			jnode *node;
 
 			block = le64_to_cpu(get_unaligned(&entry->wandered));
 			if (block == 0)
@@ -1408,52 +1909,68 @@ static int replay_transaction(const struct super_block *s,
 			node = reiser4_alloc_io_head(&block);
 			if (node == NULL) {
 				ret = RETERR(-ENOMEM);
-				/*
-				 * FIXME-VS:???
-				 */
-				jrelse(log);
-				reiser4_drop_io_head(log);
-				goto free_ow_set;
-			}
-
-			ret = jload(node);
-
-			if (ret < 0) {
-				reiser4_drop_io_head(node);
-				/*
-				 * FIXME-VS:???
-				 */
-				jrelse(log);
-				reiser4_drop_io_head(log);
-				goto free_ow_set;
+				break;
 			}
-
-			block = le64_to_cpu(get_unaligned(&entry->original));
-
-			assert("zam-603", block != 0);
-
-			jnode_set_block(node, &block);
-
+			jstartio(node);
 			list_add_tail(&node->capture_link, ch.overwrite_set);
 
 			++entry;
 		}
-
-		jrelse(log);
-		reiser4_drop_io_head(log);
+		if (ret)
+			break;
 
 		--nr_wander_records;
 	}
+	blk_finish_plug(&plug);
+
+	/* read ahead record which turned out to be not needed is loaded and
+	   dropped together with the overwrite set */
+	if (next != NULL)
+		list_add_tail(&next->capture_link, ch.overwrite_set);
 
-	if (nr_wander_records != 0) {
+	if (ret == 0 && nr_wander_records != 0) {
 		warning("zam-632", "number of wander records in the linked list"
 			" less than number stored in tx head.\n");
 		ret = RETERR(-EIO);
+	}
+
+	if (load_jnode_list(ch.overwrite_set) != 0 && ret == 0)
+		ret = RETERR(-EIO);
+	if (ret)
 		goto free_ow_set;
+
+	/* set in-place locations of the overwrite set, the order is the same
+	   as in wander records */
+	node = list_entry(ch.overwrite_set->next, jnode, capture_link);
+	list_for_each_entry(log, &records, capture_link) {
+		struct wander_entry *entry;
+		int i;
+
+		entry = (struct wander_entry *)
+			((struct wander_record_header *)jdata(log) + 1);
+		for (i = 0; i < wander_record_capacity(s); i++, entry++) {
+			reiser4_block_nr block;
+
+			if (get_unaligned(&entry->wandered) == 0)
+				break;
+			assert("edward-2352",
+			       ch.overwrite_set != &node->capture_link);
+
+			block = le64_to_cpu(get_unaligned(&entry->original));
+			assert("zam-603", block != 0);
+
+			jnode_set_block(node, &block);
+			node = list_entry(node->capture_link.next, jnode,
+					  capture_link);
+			++*nr_replayed;
+		}
 	}
+	assert("edward-2353", ch.overwrite_set == &node->capture_link);
 
 	{			/* write wandered set in place */
+		blk_start_plug(&plug);
 		write_jnode_list(ch.overwrite_set, NULL, NULL, 0);
+		blk_finish_plug(&plug);
 		ret = wait_on_jnode_list(ch.overwrite_set);
 
 		if (ret) {
@@ -1462,16 +1979,12 @@ static int replay_transaction(const struct super_block *s,
 		}
 	}
 
-	ret = update_journal_footer(&ch);
+	if (last)
+		ret = update_journal_footer(&ch);
 
       free_ow_set:
-
-	while (!list_empty(ch.overwrite_set)) {
-		jnode *cur = list_entry(ch.overwrite_set->next, jnode, capture_link);
-		list_del_init(&cur->capture_link);
-		jrelse(cur);
-		reiser4_drop_io_head(cur);
-	}
+	drop_jnode_list(ch.overwrite_set);
+	drop_jnode_list(&records);
 
 	list_del_init(&tx_head->capture_link);
 
@@ -1480,23 +1993,29 @@ static int replay_transaction(const struct super_block *s,
 	return ret;
 }
 
-/* find oldest committed and not played transaction and play it. The transaction
- * was committed and journal header block was updated but the blocks from the
- * process of writing the atom's overwrite set in-place and updating of journal
- * footer block were not completed. This function completes the process by
- * recovering the atom's overwrite set from their wandered locations and writes
- * them in-place and updating the journal footer. */
-static int replay_oldest_transaction(struct super_block *s)
+/* Find committed and not played transactions and play them, oldest first.
+ * The transactions were committed and journal header block was updated but
+ * writing of their overwrite sets in place and updating of journal footer
+ * block were not completed. This function completes the process by recovering
+ * the overwrite sets from their wandered locations and writing them in place.
+ *
+ * The on-disk list of transactions goes from the newest one, so it is scanned
+ * once to collect transaction heads. Journal footer is updated once, after the
+ * last transaction is played: replay is idempotent, an interrupted one is
+ * just repeated on the next mount. */
+static int replay_transactions(struct super_block *s, int *nr_tx,
+			       __u64 *nr_blocks)
 {
 	reiser4_super_info_data *sbinfo = get_super_private(s);
 	jnode *jf = sbinfo->journal_footer;
-	unsigned int total;
 	struct journal_footer *F;
 	struct tx_header *T;
 
-	reiser4_block_nr prev_tx;
+	reiser4_block_nr *heads = NULL;
 	reiser4_block_nr last_flushed_tx;
-	reiser4_block_nr log_rec_block = 0;
+	reiser4_block_nr tx;
+	int nr_heads = 0;
+	int size = 0;
 
 	jnode *tx_head;
 
@@ -1511,59 +2030,239 @@ static int replay_oldest_transaction(struct super_block *s)
 
 	jrelse(jf);
 
-	if (sbinfo->last_committed_tx == last_flushed_tx) {
-		/* all transactions are replayed */
-		return 0;
-	}
+	/* collect heads of not flushed transactions, the newest first */
+	for (tx = sbinfo->last_committed_tx; tx != last_flushed_tx;) {
+		if (nr_heads == size) {
+			reiser4_block_nr *bigger;
 
-	prev_tx = sbinfo->last_committed_tx;
+			size = size ? size * 2 : 16;
+			bigger = kmalloc_array(size, sizeof(*heads),
+					       reiser4_ctx_gfp_mask_get());
+			if (bigger == NULL) {
+				ret = RETERR(-ENOMEM);
+				goto out;
+			}
+			if (heads != NULL)
+				memcpy(bigger, heads, nr_heads * sizeof(*heads));
+			kfree(heads);
+			heads = bigger;
+		}
+		heads[nr_heads++] = tx;
 
-	/* searching for oldest not flushed transaction */
-	while (1) {
-		tx_head = reiser4_alloc_io_head(&prev_tx);
-		if (!tx_head)
-			return RETERR(-ENOMEM);
+		tx_head = reiser4_alloc_io_head(&tx);
+		if (!tx_head) {
+			ret = RETERR(-ENOMEM);
+			goto out;
+		}
 
 		ret = jload(tx_head);
 		if (ret < 0) {
 			reiser4_drop_io_head(tx_head);
-			return ret;
+			goto out;
 		}
 
 		ret = check_tx_head(tx_head);
-		if (ret) {
-			jrelse(tx_head);
-			reiser4_drop_io_head(tx_head);
-			return ret;
+		if (ret == 0) {
+			T = (struct tx_header *)jdata(tx_head);
+			tx = le64_to_cpu(get_unaligned(&T->prev_tx));
 		}
+		jrelse(tx_head);
+		reiser4_drop_io_head(tx_head);
+		if (ret)
+			goto out;
+	}
 
-		T = (struct tx_header *)jdata(tx_head);
+	while (nr_heads > 0) {
+		reiser4_block_nr log_rec_block;
+		unsigned int total;
 
-		prev_tx = le64_to_cpu(get_unaligned(&T->prev_tx));
+		tx = heads[--nr_heads];
 
-		if (prev_tx == last_flushed_tx)
+		tx_head = reiser4_alloc_io_head(&tx);
+		if (!tx_head) {
+			ret = RETERR(-ENOMEM);
 			break;
+		}
 
+		ret = jload(tx_head);
+		if (ret < 0) {
+			reiser4_drop_io_head(tx_head);
+			break;
+		}
+
+		T = (struct tx_header *)jdata(tx_head);
+		total = le32_to_cpu(get_unaligned(&T->total));
+		log_rec_block = le64_to_cpu(get_unaligned(&T->next_block));
+
+		pin_jnode_data(tx_head);
 		jrelse(tx_head);
+
+		ret = replay_transaction(s, tx_head, &log_rec_block,
+					 jnode_get_block(tx_head), total - 1,
+					 nr_heads == 0, nr_blocks);
+
+		unpin_jnode_data(tx_head);
 		reiser4_drop_io_head(tx_head);
+
+		if (ret)
+			break;
+		++*nr_tx;
 	}
+ out:
+	kfree(heads);
+	return ret;
+}
 
-	total = le32_to_cpu(get_unaligned(&T->total));
-	log_rec_block = le64_to_cpu(get_unaligned(&T->next_block));
+/* Verify checksum of the transaction with head at @tx_block. Returns 0 if it
+   matches, 1 if the transaction is torn, negative error code otherwise */
+static int check_tx_csum(struct super_block *s,
+			 const reiser4_block_nr *tx_block)
+{
+	reiser4_block_nr block = *tx_block;
+	struct tx_header *T;
+	unsigned int nr_wander_records;
+	__u32 stored;
+	__u32 blocks_crc = 0;
+	__u32 crc;
+	jnode *log;
+	int ret;
 
-	pin_jnode_data(tx_head);
-	jrelse(tx_head);
+	log = reiser4_alloc_io_head(&block);
+	if (log == NULL)
+		return RETERR(-ENOMEM);
+	ret = jload(log);
+	if (ret < 0) {
+		reiser4_drop_io_head(log);
+		return ret;
+	}
+	T = (struct tx_header *)jdata(log);
+	if (memcmp(&T->magic, TX_HEADER_MAGIC, TX_HEADER_MAGIC_SIZE) != 0) {
+		jrelse(log);
+		reiser4_drop_io_head(log);
+		return 1;
+	}
+	stored = le32_to_cpu(get_unaligned(&T->csum));
+	nr_wander_records = le32_to_cpu(get_unaligned(&T->total)) - 1;
+	block = le64_to_cpu(get_unaligned(&T->next_block));
+	crc = wander_record_csum(s, ~0, jdata(log), 1);
+	jrelse(log);
+	reiser4_drop_io_head(log);
+
+	while (block != *tx_block) {
+		struct wander_record_header *header;
+		struct wander_entry *entry;
+		int i;
 
-	ret =
-	    replay_transaction(s, tx_head, &log_rec_block,
-			       jnode_get_block(tx_head), total - 1);
+		if (nr_wander_records == 0)
+			return 1;
 
-	unpin_jnode_data(tx_head);
-	reiser4_drop_io_head(tx_head);
+		log = reiser4_alloc_io_head(&block);
+		if (log == NULL)
+			return RETERR(-ENOMEM);
+		ret = jload(log);
+		if (ret < 0) {
+			reiser4_drop_io_head(log);
+			return ret;
+		}
+		header = (struct wander_record_header *)jdata(log);
+		if (memcmp(&header->magic, WANDER_RECORD_MAGIC,
+			   WANDER_RECORD_MAGIC_SIZE) != 0) {
+			jrelse(log);
+			reiser4_drop_io_head(log);
+			return 1;
+		}
+		crc = wander_record_csum(s, crc, jdata(log), 0);
+		block = le64_to_cpu(get_unaligned(&header->next_block));
+
+		entry = (struct wander_entry *)(header + 1);
+		for (i = 0; i < wander_record_capacity(s); i++, entry++) {
+			reiser4_block_nr wandered;
+			reiser4_block_nr original;
+			jnode *node;
 
+			wandered = le64_to_cpu(get_unaligned(&entry->wandered));
+			if (wandered == 0)
+				break;
+			original = le64_to_cpu(get_unaligned(&entry->original));
+
+			node = reiser4_alloc_io_head(&wandered);
+			if (node == NULL) {
+				ret = RETERR(-ENOMEM);
+				break;
+			}
+			ret = jload(node);
+			if (ret < 0) {
+				reiser4_drop_io_head(node);
+				break;
+			}
+			blocks_crc ^= logged_block_csum(s, &original,
+							jdata(node));
+			jrelse(node);
+			reiser4_drop_io_head(node);
+		}
+		jrelse(log);
+		reiser4_drop_io_head(log);
+		if (ret < 0)
+			return ret;
+
+		--nr_wander_records;
+	}
+	if (nr_wander_records != 0)
+		return 1;
+
+	return (crc ^ blocks_crc) == stored ? 0 : 1;
+}
+
+/* Journal header is written together with the log when transactions are
+   checksummed (see commit_tx()), so the last committed transaction may be
+   incomplete. Verify it and, if it is torn, make journal header point to the
+   previous one. Transactions before the last one are complete, because
+   journal header is updated only after the log of the previous transaction
+   is on disk. */
+static int drop_torn_tx(struct super_block *s,
+			reiser4_block_nr prev_committed_tx)
+{
+	reiser4_super_info_data *sbinfo = get_super_private(s);
+	jnode *jh = sbinfo->journal_header;
+	jnode *jf = sbinfo->journal_footer;
+	struct journal_header *header;
+	struct journal_footer *F;
+	reiser4_block_nr last_flushed_tx;
+	int ret;
+
+	ret = jload(jf);
+	if (ret < 0)
+		return ret;
+	F = (struct journal_footer *)jdata(jf);
+	last_flushed_tx = le64_to_cpu(get_unaligned(&F->last_flushed_tx));
+	jrelse(jf);
+
+	if (sbinfo->last_committed_tx == last_flushed_tx)
+		return 0;
+
+	ret = check_tx_csum(s, &sbinfo->last_committed_tx);
+	if (ret <= 0)
+		return ret;
+
+	warning("edward-2351", "transaction at block %s is torn, dropped",
+		sprint_address(&sbinfo->last_committed_tx));
+	sbinfo->last_committed_tx = prev_committed_tx;
+
+	/* the torn transaction occupies free blocks, so journal header must
+	   not point to it when those blocks are reused */
+	ret = jload(jh);
+	if (ret < 0)
+		return ret;
+	header = (struct journal_header *)jdata(jh);
+	put_unaligned(cpu_to_le64(prev_committed_tx),
+		      &header->last_committed_tx);
+	jrelse(jh);
+
+	ret = write_jnodes_to_disk_extent(jh, 1, jnode_get_block(jh), NULL,
+					  WRITEOUT_FLUSH_FUA);
 	if (ret)
 		return ret;
-	return -E_REPEAT;
+	return jwait_io(jh, WRITE);
 }
 
 /* The reiser4 journal current implementation was optimized to not to capture
@@ -1618,7 +2317,10 @@ int reiser4_journal_replay(struct super_block *s)
 	reiser4_super_info_data *sbinfo = get_super_private(s);
 	jnode *jh, *jf;
 	struct journal_header *header;
+	reiser4_block_nr prev_committed_tx;
 	int nr_tx_replayed = 0;
+	__u64 nr_blocks_replayed = 0;
+	unsigned long start;
 	int ret;
 
 	assert("zam-582", sbinfo != NULL);
@@ -1663,12 +2365,24 @@ int reiser4_journal_replay(struct super_block *s)
 
 	header = (struct journal_header *)jdata(jh);
 	sbinfo->last_committed_tx = le64_to_cpu(get_unaligned(&header->last_committed_tx));
+	prev_committed_tx = le64_to_cpu(get_unaligned(&header->prev_committed_tx));
 
 	jrelse(jh);
 
+	if (reiser4_is_set(s, REISER4_TX_CSUM)) {
+		ret = drop_torn_tx(s, prev_committed_tx);
+		if (ret)
+			return ret;
+	}
+
 	/* replay committed transactions */
-	while ((ret = replay_oldest_transaction(s)) == -E_REPEAT)
-		nr_tx_replayed++;
+	start = jiffies;
+	ret = replay_transactions(s, &nr_tx_replayed, &nr_blocks_replayed);
+	if (nr_tx_replayed != 0)
+		printk(KERN_INFO "reiser4: %s: replayed %d transactions "
+		       "(%llu blocks) in %u ms.\n", s->s_id, nr_tx_replayed,
+		       (unsigned long long)nr_blocks_replayed,
+		       jiffies_to_msecs(jiffies - start));
 
 	return ret;
 }
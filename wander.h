@@ -19,6 +19,10 @@
 struct journal_header {
 	/* last written transaction head location */
 	d64 last_committed_tx;
+	/* transaction head location which was the last written one before
+	   @last_committed_tx. Journal replay falls back to it when the
+	   transaction at @last_committed_tx fails checksum verification */
+	d64 prev_committed_tx;
 };
 
 typedef struct journal_location {
@@ -82,8 +86,9 @@ struct tx_header {
 	   transaction */
 	d32 total;
 
-	/* align next field to 8-byte boundary; this field always is zero */
-	d32 padding;
+	/* crc32c of the transaction (see tx_csum() in wander.c) if disk
+	   format has FORMAT40_TX_CSUM flag set, otherwise zero */
+	d32 csum;
 
 	/* block number of previous transaction head */
 	d64 prev_tx;
@@ -113,6 +118,8 @@ struct wander_entry {
 /* REISER4 JOURNAL WRITER FUNCTIONS   */
 
 extern int reiser4_write_logs(long *);
+extern int reiser4_checkpoint(struct super_block *);
+extern void reiser4_wait_write_back(jnode *);
 extern int reiser4_journal_replay(struct super_block *);
 extern int reiser4_journal_recover_sb_data(struct super_block *);
 
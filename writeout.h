@@ -5,6 +5,7 @@
 #define WRITEOUT_SINGLE_STREAM (0x1)
 #define WRITEOUT_FOR_PAGE_RECLAIM  (0x2)
 #define WRITEOUT_FLUSH_FUA (0x4)
+#define WRITEOUT_FUA (0x8)
 
 extern int reiser4_get_writeout_flags(void);
 
@@ -184,7 +184,7 @@ blknrhashfn(z_hash_table * table, const reiser4_block_nr * b)
 {
 	assert("nikita-536", b != NULL);
 
-	return *b & (REISER4_ZNODE_HASH_TABLE_SIZE - 1);
+	return (__u32)(*b ^ (*b >> 32));
 }
 
 /* The hash table definition */
@@ -237,13 +237,25 @@ int znodes_tree_init(reiser4_tree * tree /* tree to initialise znodes for */ )
 
 	rwlock_init(&tree->dk_lock);
 
-	result = z_hash_init(&tree->zhash_table, REISER4_ZNODE_HASH_TABLE_SIZE);
+	result = z_hash_init_resizable(&tree->zhash_table,
+				       REISER4_ZNODE_HASH_TABLE_SIZE,
+				       REISER4_HASH_TABLE_MAX_SIZE);
 	if (result != 0)
 		return result;
-	result = z_hash_init(&tree->zfake_table, REISER4_ZNODE_HASH_TABLE_SIZE);
+	result = z_hash_init_resizable(&tree->zfake_table,
+				       REISER4_ZNODE_HASH_TABLE_SIZE,
+				       REISER4_HASH_TABLE_MAX_SIZE);
 	return result;
 }
 
+/* collect statistics of znode hash tables, see type_safe_hash.h */
+void znodes_tree_stats(reiser4_tree * tree, struct tsh_stats *hashed,
+		       struct tsh_stats *fake)
+{
+	z_hash_stats(&tree->zhash_table, hashed);
+	z_hash_stats(&tree->zfake_table, fake);
+}
+
 /* free this znode */
 void zfree(znode * node /* znode to free */ )
 {
@@ -261,6 +273,7 @@ void zfree(znode * node /* znode to free */ )
 
 	/* not yet phash_jnode_destroy(ZJNODE(node)); */
 
+	kfree(node->sindex);
 	kmem_cache_free(znode_cache, node);
 }
 
@@ -278,7 +291,8 @@ void znodes_tree_done(reiser4_tree * tree /* tree to finish with znodes of */ )
 
 	ztable = &tree->zhash_table;
 
-	if (ztable->_table != NULL) {
+	if (ztable->_cur != NULL) {
+		z_hash_freeze(ztable);
 		for_all_in_htable(ztable, z, node, next) {
 			node->c_count = 0;
 			node->in_parent.node = NULL;
@@ -291,7 +305,8 @@ void znodes_tree_done(reiser4_tree * tree /* tree to finish with znodes of */ )
 
 	ztable = &tree->zfake_table;
 
-	if (ztable->_table != NULL) {
+	if (ztable->_cur != NULL) {
+		z_hash_freeze(ztable);
 		for_all_in_htable(ztable, z, node, next) {
 			node->c_count = 0;
 			node->in_parent.node = NULL;
@@ -424,10 +439,8 @@ znode *zlook(reiser4_tree * tree, const reiser4_block_nr * const blocknr)
 	rcu_read_lock();
 	result = z_hash_find_index(htable, hash, blocknr);
 
-	if (result != NULL) {
-		add_x_ref(ZJNODE(result));
-		result = znode_rip_check(tree, result);
-	}
+	if (result != NULL)
+		result = zref_rcu(tree, result);
 	rcu_read_unlock();
 
 	return result;
@@ -480,9 +493,8 @@ znode *zget(reiser4_tree * tree,
 	/* NOTE-NIKITA address-as-unallocated-blocknr still is not
 	   implemented. */
 
-	z_hash_prefetch_bucket(zth, hashi);
-
 	rcu_read_lock();
+	z_hash_prefetch_bucket(zth, hashi);
 	/* Find a matching BLOCKNR in the hash table.  If the znode is found,
 	   we obtain an reference (x_count) but the znode remains unlocked.
 	   Have to worry about race conditions later. */
@@ -490,14 +502,13 @@ znode *zget(reiser4_tree * tree,
 	/* According to the current design, the hash table lock protects new
 	   znode references. */
 	if (result != NULL) {
-		add_x_ref(ZJNODE(result));
 		/* NOTE-NIKITA it should be so, but special case during
 		   creation of new root makes such assertion highly
 		   complicated.  */
 		assert("nikita-2131", 1 || znode_parent(result) == parent ||
 		       (ZF_ISSET(result, JNODE_ORPHAN)
 			&& (znode_parent(result) == NULL)));
-		result = znode_rip_check(tree, result);
+		result = zref_rcu(tree, result);
 	}
 
 	rcu_read_unlock();
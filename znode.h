@@ -138,6 +138,10 @@ struct znode {
 	 * plugin. */
 	__u16 nr_items;
 
+	/* in-memory search index, built and maintained by node plugin. See
+	 * plugin/node/node40.c:lookup_node40() */
+	struct node40_sindex *sindex;
+
 #if REISER4_DEBUG
 	void *creator;
 	reiser4_key first_key;
@@ -223,6 +227,8 @@ extern int init_znodes(void);
 extern void done_znodes(void);
 extern int znodes_tree_init(reiser4_tree * ztree);
 extern void znodes_tree_done(reiser4_tree * ztree);
+extern void znodes_tree_stats(reiser4_tree * ztree, struct tsh_stats *hashed,
+			      struct tsh_stats *fake);
 extern int znode_contains_key(znode * node, const reiser4_key * key);
 extern int znode_contains_key_lock(znode * node, const reiser4_key * key);
 extern unsigned znode_save_free_space(znode * node);
@@ -328,6 +334,14 @@ static inline znode *znode_rip_check(reiser4_tree * tree, znode * node)
 	return node;
 }
 
+/* znode version of jref_rcu() */
+static inline znode *zref_rcu(reiser4_tree * tree, znode * node)
+{
+	if (likely(jref_rcu(tree, ZJNODE(node)) != NULL))
+		return node;
+	return NULL;
+}
+
 #if defined(REISER4_DEBUG)
 int znode_is_loaded(const znode * node /* znode to query */ );
 #endif